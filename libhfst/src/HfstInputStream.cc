@@ -1090,6 +1090,12 @@ namespace hfst
       }
   }
   
+  void HfstInputStream::set_memory_mapping(bool value)
+  {
+    if (type == HFST_OL_TYPE || type == HFST_OLW_TYPE)
+      { implementation.hfst_ol->set_memory_mapped(value); }
+  }
+
   HfstInputStream::HfstInputStream(std::istream &is):
     bytes_to_skip(0), filename(std::string()), has_hfst_header(false),
     hfst_version_2_weighted_transducer(false)
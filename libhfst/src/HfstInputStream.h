@@ -281,6 +281,16 @@ For documentation on the HFST binary transducer format, see
 
     HFSTDLL bool is_hfst_header_included(void) const;
 
+    /** \brief Access the tables of optimized-lookup transducers in place
+        in a memory-mapped file instead of copying them into memory.
+
+        Only has an effect on streams that were opened with a filename and
+        that contain transducers of type HFST_OL_TYPE or HFST_OLW_TYPE.
+        Startup is then nearly instant and processes reading the same file
+        share its pages. The file must not be modified while transducers
+        read from it are in use. */
+    HFSTDLL void set_memory_mapping(bool value);
+
     friend class HfstTransducer;
   };
 
@@ -95,7 +95,37 @@ namespace hfst
 
   typedef std::pair<float, StringPairVector> HfstTwoLevelPath;
   typedef std::set<HfstTwoLevelPath> HfstTwoLevelPaths;
-  
+
+  /** \brief A handle to an interned symbol.
+
+      Every symbol used in an HfstBasicTransducer is mapped to a number
+      that stays the same for the lifetime of the program. Passing these
+      numbers instead of strings spares hashing and copying the symbol
+      in each operation. Epsilon, unknown and identity always have the ids
+      #EPSILON_SYMBOL_ID, #UNKNOWN_SYMBOL_ID and #IDENTITY_SYMBOL_ID.
+
+      @see HfstTropicalTransducerTransitionData::get_symbol_id
+      HfstTropicalTransducerTransitionData::get_symbol_string */
+  typedef unsigned int SymbolId;
+  typedef std::pair<SymbolId, SymbolId> SymbolIdPair;
+  typedef std::vector<SymbolId> SymbolIdVector;
+  typedef std::set<SymbolId> SymbolIdSet;
+  typedef std::vector<SymbolIdPair> SymbolIdPairVector;
+  typedef std::set<SymbolIdPair> SymbolIdPairSet;
+  /** \brief Symbol-to-symbol substitutions given as symbol ids. */
+  typedef std::map<SymbolId, SymbolId> SymbolIdSubstitutions;
+  /** \brief Symbol pair-to-symbol pair substitutions given as symbol ids. */
+  typedef std::map<SymbolIdPair, SymbolIdPair> SymbolIdPairSubstitutions;
+  typedef std::pair<float, SymbolIdPairVector> HfstTwoLevelIdPath;
+  typedef std::set<HfstTwoLevelIdPath> HfstTwoLevelIdPaths;
+
+  /** \brief The id of the epsilon symbol. */
+  const SymbolId EPSILON_SYMBOL_ID = 0;
+  /** \brief The id of the unknown symbol. */
+  const SymbolId UNKNOWN_SYMBOL_ID = 1;
+  /** \brief The id of the identity symbol. */
+  const SymbolId IDENTITY_SYMBOL_ID = 2;
+
 /* The internal representations */
   const std::string internal_epsilon("@_EPSILON_SYMBOL_@");
   const std::string internal_unknown("@_UNKNOWN_SYMBOL_@");
@@ -663,6 +663,25 @@ HfstOneLevelPaths * HfstTransducer::lookup_fd(const StringVector& s,
     }
 }
 
+HfstOneLevelPaths * HfstTransducer::lookup_fd(const StringVector& s,
+                                              hfst_ol::LookupContext & c,
+                                              ssize_t limit,
+                                              double time_cutoff) const
+{
+    switch(this->type) {
+
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+        return this->implementation.hfst_ol->lookup_fd(s, c, limit, time_cutoff);
+
+    case (ERROR_TYPE):
+      HFST_THROW(TransducerHasWrongTypeException);
+    default:
+      (void)c;
+      HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
 HfstOneLevelPaths * HfstTransducer::lookup_fd(const std::string & s,
                          ssize_t limit, double time_cutoff) const
 {
@@ -680,6 +699,75 @@ HfstOneLevelPaths * HfstTransducer::lookup_fd(const std::string & s,
     }
 }
 
+void HfstTransducer::lookup_fd(const std::string & s,
+                               hfst_ol::LookupContext & c,
+                               hfst_ol::LookupVisitor & visitor,
+                               ssize_t limit, double time_cutoff) const
+{
+    switch(this->type) {
+
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+        this->implementation.hfst_ol->lookup_fd(s, c, visitor, limit,
+                                                time_cutoff);
+        break;
+
+    case (ERROR_TYPE):
+      HFST_THROW(TransducerHasWrongTypeException);
+    default:
+      (void)c;
+      (void)visitor;
+      HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
+void HfstTransducer::set_lookup_cache_size(size_t size)
+{
+    switch(this->type) {
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+        this->implementation.hfst_ol->set_lookup_cache_size(size);
+        break;
+    default:
+      (void)size;
+      HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
+size_t HfstTransducer::get_lookup_cache_hits() const
+{
+    switch(this->type) {
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+        return this->implementation.hfst_ol->get_lookup_cache_hits();
+    default:
+      HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
+size_t HfstTransducer::get_lookup_cache_misses() const
+{
+    switch(this->type) {
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+        return this->implementation.hfst_ol->get_lookup_cache_misses();
+    default:
+      HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
+void HfstTransducer::build_input_lookahead()
+{
+    switch(this->type) {
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+        this->implementation.hfst_ol->build_input_lookahead();
+        break;
+    default:
+      HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
 HfstOneLevelPaths * HfstTransducer::lookup(const HfstTokenizer& tok,
                        const std::string &s,
                        ssize_t limit, double time_cutoff) const
@@ -745,6 +833,20 @@ bool HfstTransducer::is_lookup_infinitely_ambiguous(const std::string & s)
     }
 }
 
+bool HfstTransducer::is_lookup_infinitely_ambiguous
+(const StringVector& s, hfst_ol::LookupContext & c) const {
+    switch(this->type) {
+    case (HFST_OL_TYPE):
+    case (HFST_OLW_TYPE):
+    return this->implementation.hfst_ol->
+        is_lookup_infinitely_ambiguous(s, c);
+    default:
+    (void)s;
+    (void)c;
+    HFST_THROW(FunctionNotImplementedException);
+    }
+}
+
 bool HfstTransducer::is_lookdown_infinitely_ambiguous
 (const StringVector& s) const {
     (void)s;
@@ -794,6 +794,14 @@ in \a ifile.
         #HFST_OL_TYPE or #HFST_OLW_TYPE transducer, but an #HFST_OL_TYPE
         or #HFST_OLW_TYPE transducer cannot be converted to any other type.
 
+        When converting to #HFST_OL_TYPE or #HFST_OLW_TYPE, \a options is a
+        comma-separated list of packing options for the index table:
+        "quick" packs faster into a larger table, "density-sort" places
+        states with many input symbols first, and "packing-aggression=F"
+        and "floor-jump-threshold=N" tune the packer directly.
+        "threads=N" gathers the states and writes the tables in N threads,
+        0 meaning one per core; the result is byte-identical for any N.
+
         @note For conversion between implementations::HfstTransitionGraph and HfstTransducer,
         see HfstTransducer(const hfst::implementations::HfstBasicTransducer&, ImplementationType) and #hfst::implementations::HfstTransitionGraph::HfstTransitionGraph(const hfst::HfstTransducer&).
     */
@@ -1130,6 +1138,71 @@ ccc : ddd
                                           ssize_t limit = -1,
                                           double time_cutoff = 0.0) const;
 
+    //! @brief Lookup a single string \a s minding flag diacritics using
+    //! the lookup state in \a c.
+    //!
+    //! The same as #lookup_fd(const StringVector&, ssize_t, double) const
+    //! but reentrant: several threads may look up strings in the same
+    //! transducer at once as long as each uses its own \a c.
+    //!
+    //! @pre The transducer must be of type #HFST_OL_TYPE or #HFST_OLW_TYPE.
+    HFSTDLL HfstOneLevelPaths * lookup_fd(const StringVector& s,
+                                          hfst_ol::LookupContext & c,
+                                          ssize_t limit = -1,
+                                          double time_cutoff = 0.0) const;
+
+    //! @brief Look up a single string \a s minding flag diacritics using
+    //! the lookup state in \a c, passing each result to \a visitor as it
+    //! is found.
+    //!
+    //! Unlike the overloads that return HfstOneLevelPaths, this allocates
+    //! nothing per result: \a visitor receives each result as a span of
+    //! input and output symbol numbers with its weight, and can turn the
+    //! symbols into strings with hfst_ol::Transducer::symbol_string if it
+    //! needs them. Results are not deduplicated; a visitor that does so
+    //! tells which results count towards \a limit through its return
+    //! value. The lookup cache is not used.
+    //!
+    //! @pre The transducer must be of type #HFST_OL_TYPE or #HFST_OLW_TYPE.
+    HFSTDLL void lookup_fd(const std::string& s,
+                           hfst_ol::LookupContext & c,
+                           hfst_ol::LookupVisitor & visitor,
+                           ssize_t limit = -1,
+                           double time_cutoff = 0.0) const;
+
+    //! @brief Cache the results of lookup_fd for the \a size most recently
+    //! looked up strings.
+    //!
+    //! Natural language input repeats a small number of frequent words, so
+    //! a cache of a few thousand entries usually answers most lookups
+    //! without traversing the transducer. A \a size of zero, the default,
+    //! disables the cache. The cache is not used by the lookup_fd overloads
+    //! that take a hfst_ol::LookupContext; those use the cache of the
+    //! context instead.
+    //!
+    //! @pre The transducer must be of type #HFST_OL_TYPE or #HFST_OLW_TYPE.
+    HFSTDLL void set_lookup_cache_size(size_t size);
+
+    //! @brief The number of lookups answered from the lookup cache.
+    //! @see set_lookup_cache_size
+    HFSTDLL size_t get_lookup_cache_hits() const;
+
+    //! @brief The number of lookups not found in the lookup cache.
+    //! @see set_lookup_cache_size
+    HFSTDLL size_t get_lookup_cache_misses() const;
+
+    //! @brief Find once which input symbols each state can consume next,
+    //! so that lookup_fd stops following paths that can't match the rest
+    //! of the input.
+    //!
+    //! The results are the same either way; this takes some memory and
+    //! time when called, and makes lookups in large transducers faster.
+    //! It is not safe to call while other threads look up in the
+    //! transducer, and copies of the transducer don't keep the lookahead.
+    //!
+    //! @pre The transducer must be of type #HFST_OL_TYPE or #HFST_OLW_TYPE.
+    HFSTDLL void build_input_lookahead();
+
     //! @brief Lookup or apply a single string \a s and store a maximum of
     //! \a limit results to \a results. \a tok defined how \a s is tokenized.
     //!
@@ -1199,6 +1272,11 @@ ccc : ddd
     //! @see lookup(HfstOneLevelPaths&, const StringVector&, ssize_t) const
     HFSTDLL bool is_lookup_infinitely_ambiguous(const StringVector & s) const;
     HFSTDLL bool is_lookup_infinitely_ambiguous(const std::string & s) const;
+    //! @brief Reentrant version of
+    //! #is_lookup_infinitely_ambiguous(const StringVector&) const
+    //! that uses the lookup state in \a c.
+    HFSTDLL bool is_lookup_infinitely_ambiguous
+      (const StringVector & s, hfst_ol::LookupContext & c) const;
 
     //! @brief (Not implemented) Whether lookdown of path \a s will have
     //! infinite results.
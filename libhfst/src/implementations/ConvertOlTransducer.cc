@@ -12,6 +12,7 @@
 #endif
 
 #include <algorithm>
+#include <iterator>
 
 #include "ConvertTransducerFormat.h"
 #include "optimized-lookup/convert.h"
@@ -139,13 +140,111 @@ typedef std::set<std::string> StringSet;
 using hfst_ol::SymbolNumber;
 using hfst_ol::NO_SYMBOL_NUMBER;
 
+/* Gathers the states of a range into placeholders with their finality,
+   and the symbols of their transitions into sets of the range's own. */
+struct StateGatherer: public hfst_ol::StateRangeTask
+{
+    const HfstBasicTransducer * t;
+    std::vector<hfst_ol::StatePlaceholder> & state_placeholders;
+    bool collect_symbols;
+    std::vector<StringSet> input_symbols;
+    std::vector<StringSet> flag_diacritics;
+    std::vector<StringSet> other_symbols;
+
+    StateGatherer(const HfstBasicTransducer * transducer,
+                  std::vector<hfst_ol::StatePlaceholder> & states,
+                  bool collect, unsigned int chunks):
+    t(transducer), state_placeholders(states), collect_symbols(collect),
+    input_symbols(chunks), flag_diacritics(chunks), other_symbols(chunks) {}
+
+    void run(unsigned int chunk, unsigned int begin, unsigned int end)
+        {
+            for (unsigned int state_number = begin; state_number < end;
+                 ++state_number) {
+                hfst_ol::Weight final_w = 0.0;
+                bool final = t->is_final_state(state_number);
+                if (final) {
+                    final_w = t->get_final_weight(state_number);
+                }
+                // The first transition is filled in once all the states
+                // before this one have been counted
+                state_placeholders[state_number] = hfst_ol::StatePlaceholder(
+                    state_number, final, 0, final_w);
+                if (!collect_symbols) {
+                    continue;
+                }
+                const HfstBasicTransitions & transitions =
+                    t->transitions(state_number);
+                for (HfstBasicTransitions::const_iterator tr_it
+                         = transitions.begin();
+                     tr_it != transitions.end(); ++tr_it) {
+                    if (FdOperation::is_diacritic(tr_it->get_input_symbol()) ||
+                        hfst_ol::PmatchAlphabet::is_insertion(
+                            tr_it->get_input_symbol())) {
+                        flag_diacritics[chunk].insert(tr_it->get_input_symbol());
+                    } else {
+                        input_symbols[chunk].insert(tr_it->get_input_symbol());
+                    }
+                    other_symbols[chunk].insert(tr_it->get_output_symbol());
+                }
+            }
+        }
+};
+
+/* Adds the inputs and transitions of a range of states to their
+   placeholders. */
+struct TransitionGatherer: public hfst_ol::StateRangeTask
+{
+    const HfstBasicTransducer * t;
+    std::vector<hfst_ol::StatePlaceholder> & state_placeholders;
+    const std::map<std::string, SymbolNumber> & string_symbol_map;
+    const std::set<SymbolNumber> & flag_symbols;
+
+    TransitionGatherer(const HfstBasicTransducer * transducer,
+                       std::vector<hfst_ol::StatePlaceholder> & states,
+                       const std::map<std::string, SymbolNumber> & symbol_map,
+                       const std::set<SymbolNumber> & flags):
+    t(transducer), state_placeholders(states), string_symbol_map(symbol_map),
+    flag_symbols(flags) {}
+
+    SymbolNumber symbol_number(const std::string & symbol) const
+        {
+            std::map<std::string, SymbolNumber>::const_iterator it =
+                string_symbol_map.find(symbol);
+            return it == string_symbol_map.end() ? 0 : it->second;
+        }
+
+    void run(unsigned int, unsigned int begin, unsigned int end)
+        {
+            for (unsigned int state_number = begin; state_number < end;
+                 ++state_number) {
+                const HfstBasicTransitions & transitions =
+                    t->transitions(state_number);
+                for (HfstBasicTransitions::const_iterator tr_it
+                         = transitions.begin();
+                     tr_it != transitions.end(); ++tr_it) {
+                    SymbolNumber input = symbol_number(tr_it->get_input_symbol());
+                    // add input in case we're seeing it the first time
+                    state_placeholders[state_number].add_input(input, flag_symbols);
+                    hfst_ol::TransitionPlaceholder trans(
+                        tr_it->get_target_state(),
+                        input,
+                        symbol_number(tr_it->get_output_symbol()),
+                        tr_it->get_weight());
+                    state_placeholders[state_number].add_transition(trans);
+                }
+            }
+        }
+};
+
 void get_states_and_symbols(
     const HfstBasicTransducer * t,
     std::vector<hfst_ol::StatePlaceholder> & state_placeholders,
     hfst_ol::SymbolTable & symbol_table,
     SymbolNumber & seen_input_symbols,
     std::set<SymbolNumber> & flag_symbols,
-    hfst_ol::Transducer * harmonizer)
+    hfst_ol::Transducer * harmonizer,
+    unsigned int threads)
 {
     // Symbols must be in the following order in an optimized-lookup
     // transducer:
@@ -166,41 +265,33 @@ void get_states_and_symbols(
 
     // If we have been told to use a certain symbol table,
     // there's no need to keep track of symbols here.
-    StringSet * input_symbols = new StringSet();
-    StringSet * flag_diacritics = new StringSet();
-    StringSet * other_symbols = new StringSet();
-    
+    // Each range of states collects symbols into sets of its own, which
+    // are merged afterwards, so the result doesn't depend on the ranges.
+    unsigned int state_count =
+        hfst::size_t_to_uint(std::distance(t->begin(), t->end()));
+    state_placeholders.resize(state_count);
+    StateGatherer gatherer(t, state_placeholders, harmonizer == NULL, threads);
+    hfst_ol::run_state_ranges(gatherer, state_count, threads);
+
     unsigned int first_transition = 0;
-    unsigned int state_number = 0;
-    for (HfstBasicTransducer::const_iterator it = t->begin();
-         it != t->end(); ++it) {
-        hfst_ol::Weight final_w = 0.0;
-        if (t->is_final_state(state_number)) {
-            final_w = t->get_final_weight(state_number);
-        }
-        state_placeholders.push_back(hfst_ol::StatePlaceholder(
-                                         state_number,
-                                         t->is_final_state(state_number),
-                                         first_transition,
-                                         final_w));
-        ++first_transition; // there's a padding entry between states
-        for (HfstBasicTransitions::const_iterator tr_it
-                 = it->begin();
-             tr_it != it->end(); ++tr_it) {
-            ++first_transition;
-            // If we don't already have a symbol table, collect symbols
-            if (harmonizer == NULL) {
-                if (FdOperation::is_diacritic(tr_it->get_input_symbol()) ||
-                    hfst_ol::PmatchAlphabet::is_insertion(
-                        tr_it->get_input_symbol())) {
-                    flag_diacritics->insert(tr_it->get_input_symbol());
-                } else {
-                    input_symbols->insert(tr_it->get_input_symbol());
-                }
-                other_symbols->insert(tr_it->get_output_symbol());
-            }
-        }
-        ++state_number;
+    for (unsigned int state_number = 0; state_number < state_count;
+         ++state_number) {
+        state_placeholders[state_number].first_transition = first_transition;
+        // there's a padding entry between states
+        first_transition += 1 + hfst::size_t_to_uint(
+            t->transitions(state_number).size());
+    }
+
+    StringSet input_symbols;
+    StringSet flag_diacritics;
+    StringSet other_symbols;
+    for (unsigned int chunk = 0; chunk < threads; ++chunk) {
+        input_symbols.insert(gatherer.input_symbols[chunk].begin(),
+                             gatherer.input_symbols[chunk].end());
+        flag_diacritics.insert(gatherer.flag_diacritics[chunk].begin(),
+                               gatherer.flag_diacritics[chunk].end());
+        other_symbols.insert(gatherer.other_symbols[chunk].begin(),
+                             gatherer.other_symbols[chunk].end());
     }
 
     std::map<std::string, SymbolNumber> string_symbol_map;
@@ -213,8 +304,8 @@ void get_states_and_symbols(
         symbol_table.push_back(internal_epsilon);
         
         // 2) input symbols
-        for (std::set<std::string>::iterator it = input_symbols->begin();
-             it != input_symbols->end(); ++it) {
+        for (std::set<std::string>::iterator it = input_symbols.begin();
+             it != input_symbols.end(); ++it) {
             if (!is_epsilon(*it)) {
                 string_symbol_map[*it] = hfst::size_t_to_ushort(symbol_table.size());
                 symbol_table.push_back(*it);
@@ -223,8 +314,8 @@ void get_states_and_symbols(
         }
         
         // 3) Flag diacritics
-        for (std::set<std::string>::iterator it = flag_diacritics->begin();
-             it != flag_diacritics->end(); ++it) {
+        for (std::set<std::string>::iterator it = flag_diacritics.begin();
+             it != flag_diacritics.end(); ++it) {
             if (!is_epsilon(*it)) {
                 string_symbol_map[*it] = hfst::size_t_to_ushort(symbol_table.size());
                 // TODO: cl.exe: conversion from 'size_t' to 'char16_t'
@@ -236,10 +327,10 @@ void get_states_and_symbols(
         }
         
         // 4) non-input symbols
-        for (std::set<std::string>::iterator it = other_symbols->begin();
-             it != other_symbols->end(); ++it) {
-            if (!is_epsilon(*it) && input_symbols->count(*it) == 0 &&
-              flag_diacritics->count(*it) == 0) {
+        for (std::set<std::string>::iterator it = other_symbols.begin();
+             it != other_symbols.end(); ++it) {
+            if (!is_epsilon(*it) && input_symbols.count(*it) == 0 &&
+              flag_diacritics.count(*it) == 0) {
                 string_symbol_map[*it] = hfst::size_t_to_ushort(symbol_table.size());
                 symbol_table.push_back(*it);
             }
@@ -256,35 +347,66 @@ void get_states_and_symbols(
             }
         }
     }
-    delete input_symbols;
-    delete flag_diacritics;
-    delete other_symbols;
 
     // Do a second pass over the transitions, figuring out everything
     // about the states except starting indices
+    TransitionGatherer transition_gatherer(t, state_placeholders,
+                                           string_symbol_map, flag_symbols);
+    hfst_ol::run_state_ranges(transition_gatherer, state_count, threads);
+}
 
-    state_number = 0;
-    for (HfstBasicTransducer::const_iterator it = t->begin();
-         it != t->end(); ++it) {
-        for (HfstBasicTransitions::const_iterator tr_it
-               = it->begin();
-             tr_it != it->end(); ++tr_it) {
-            // add input in case we're seeing it the first time
-            state_placeholders[state_number].add_input(
-                string_symbol_map[tr_it->get_input_symbol()],
-                flag_symbols);
-            unsigned int target = tr_it->get_target_state();
-            hfst_ol::TransitionPlaceholder trans(
-                target,
-                string_symbol_map[tr_it->get_input_symbol()],
-                string_symbol_map[tr_it->get_output_symbol()],
-                tr_it->get_weight());
-            //SymbolNumber input_sym = string_symbol_map[tr_it->get_input_symbol()];
-            state_placeholders[state_number].add_transition(trans);
+/* Writes the index table entries of a range of indices. */
+struct IndexWriter: public hfst_ol::StateRangeTask
+{
+    hfst_ol::TransducerTable<hfst_ol::TransitionWIndex> & windex_table;
+    const hfst_ol::IndexPlaceholders & used_indices;
+    const std::vector<hfst_ol::StatePlaceholder> & state_placeholders;
+    unsigned int ta_offset;
+
+    IndexWriter(hfst_ol::TransducerTable<hfst_ol::TransitionWIndex> & table,
+                const hfst_ol::IndexPlaceholders & indices,
+                const std::vector<hfst_ol::StatePlaceholder> & states,
+                unsigned int offset):
+    windex_table(table), used_indices(indices), state_placeholders(states),
+    ta_offset(offset) {}
+
+    void run(unsigned int, unsigned int begin, unsigned int end)
+        {
+            for (unsigned int i = begin; i < end; ++i) {
+                if (!used_indices.used(i)) { // blank entries
+                    continue;
+                }
+                unsigned int idx = used_indices.get_target(i).first;
+                SymbolNumber sym = used_indices.get_target(i).second;
+                if (sym == NO_SYMBOL_NUMBER) { // finality markers
+                    if (state_placeholders[idx].final) {
+                        windex_table.set(
+                            i, hfst_ol::TransitionWIndex::create_final(
+                                state_placeholders[idx].final_weight));
+                    }
+                } else { // actual entries
+                    windex_table.set(
+                        i, hfst_ol::TransitionWIndex(
+                            sym,
+                            state_placeholders[idx].first_transition +
+                            used_indices.get_transition_offset(i) + ta_offset));
+                }
+            }
         }
-        ++state_number;
-    }
-}
+};
+
+/* Orders state numbers descending by the number of input symbols of the
+   states, for packing the index table. */
+struct compare_state_numbers_by_input_size
+{
+    const std::vector<hfst_ol::StatePlaceholder> & states;
+    compare_state_numbers_by_input_size(
+        const std::vector<hfst_ol::StatePlaceholder> & s): states(s) {}
+    bool operator()(unsigned int lhs, unsigned int rhs) const
+        {
+            return hfst_ol::compare_states_by_input_size(states[lhs], states[rhs]);
+        }
+};
 
   /* Create an hfst_ol::Transducer equivalent to HfstBasicTransducer \a t.
      \a weighted defined whether the created transducer is weighted. */
@@ -293,9 +415,8 @@ void get_states_and_symbols(
   (const HfstBasicTransducer * t, bool weighted, std::string options,
    HfstTransducer * harmonizer)
   {
-      const float packing_aggression = (float)0.85; // double -> const float
-      const int floor_jump_threshold = 4; // a packing aggression parameter
-      //bool quick = options == "quick";
+      const hfst_ol::PackingParameters packing =
+          hfst_ol::PackingParameters::from_options(options);
       // The transition array is indexed starting from this constant
       const unsigned int TA_OFFSET = 2147483648u;
 
@@ -310,128 +431,54 @@ void get_states_and_symbols(
       hfst_ol::SymbolTable symbol_table;
       SymbolNumber seen_input_symbols = 1; // We always have epsilon
       std::set<SymbolNumber> flag_symbols;
+      unsigned int threads = hfst_ol::resolve_thread_count(packing.threads);
       get_states_and_symbols(t,
                              state_placeholders,
                              symbol_table,
                              seen_input_symbols,
                              flag_symbols,
-                             harmonizer_ol);
-
-      // For determining the index table we first sort the states (excepting
-    // the starting state) by number of different input symbols.
-    // if (state_placeholders.begin() != state_placeholders.end()) {
-    // std::sort(state_placeholders.begin() + 1, state_placeholders.end(),
-    //       hfst_ol::compare_states_by_input_size);
-    // }
+                             harmonizer_ol,
+                             threads);
+
+    // For determining the index table we collect the nonsimple states and,
+    // if so requested, order them (excepting the starting state) by number
+    // of different input symbols, densest first. The placeholders
+    // themselves stay in state number order.
+    std::vector<unsigned int> packing_order;
+    for (unsigned int i = 0; i < state_placeholders.size(); ++i) {
+        if (!state_placeholders[i].is_simple()) {
+            packing_order.push_back(i);
+        }
+    }
+    if (packing.sort_by_density && packing_order.size() > 1) {
+        std::stable_sort(packing_order.begin() + 1, packing_order.end(),
+                         compare_state_numbers_by_input_size(state_placeholders));
+    }
 
     hfst_ol::IndexPlaceholders * used_indices =
         new hfst_ol::IndexPlaceholders();
 
-    // Now we assign starting indices (or alternatively determine a state
-    // doesn't need an entry in the TIA ("is simple"). The starting state has
-    // index 0. Used indices are stored in a map (at the beginning, every
-    // index below or equal to the alphabet size is available except index 0).
-    // For every state (in the TIA) thereafter, we check each available
-    // starting index to see if it fits.
-
-    // The starting state is special because it will have a TIA entry even if
-    // it's simple, so we deal with it every time.
-
-    unsigned int first_available_index = 0;
-    unsigned int previous_first_index = 0;
-    unsigned int previous_successful_index = 0;
-    int floor_stuck_counter = 0;
-    for (std::vector<hfst_ol::StatePlaceholder>::iterator it =
-             state_placeholders.begin();
-         it != state_placeholders.end(); ++it) {
-        if (it->is_simple()) {
-            continue;
-        }
-        unsigned int i = first_available_index;
-
-        // While this index is not suitable for a starting index, keep looking
-        while (!used_indices->fits(*it, flag_symbols, i)) {
-            ++i;
-        }
-        it->start_index = i;
-        previous_successful_index = i;
-        // Once we've found a starting index, insert a finality marker and
-        // mark all the used indices
-        used_indices->assign(i, it->state_number, NO_SYMBOL_NUMBER);
-        for (std::vector<std::vector<hfst_ol::TransitionPlaceholder> >
-                 ::const_iterator tr_it = it->transition_placeholders.begin();
-             tr_it != it->transition_placeholders.end(); ++tr_it) {
-            SymbolNumber index_offset = tr_it->at(0).input;
-            if (flag_symbols.count(index_offset) != 0) {
-                index_offset = 0;
-            }
-            used_indices->assign(i + index_offset + 1, it->state_number, index_offset);
-        }
-
-        while (used_indices->unsuitable(first_available_index, seen_input_symbols, packing_aggression)) {
-            ++first_available_index;
-        }
-        if (first_available_index == previous_first_index) {
-            if (floor_stuck_counter > floor_jump_threshold) {
-                first_available_index = previous_successful_index + 1;
-                floor_stuck_counter = 0;
-                previous_first_index = first_available_index;
-            } else {
-                ++floor_stuck_counter;
-            }
-        } else {
-            previous_first_index = first_available_index;
-            floor_stuck_counter = 0;
-        }
-    }
-
-    // Now resort by state number for the rest
-    // (this could definitely be neater...)
-   // if (state_placeholders.begin() != state_placeholders.end()) {
-   // std::sort(state_placeholders.begin() + 1, state_placeholders.end(),
-   //       hfst_ol::compare_states_by_state_number);
-   // }
+    // Now we assign starting indices to the states that need an entry in
+    // the TIA
+    hfst_ol::place_states(state_placeholders, packing_order, flag_symbols,
+                          seen_input_symbols, packing, *used_indices);
 
-    // Now for each index entry we write its input symbol and target
+    // Now for each index entry we write its input symbol and target,
+    // followed by padding
 
-    hfst_ol::TransducerTable<hfst_ol::TransitionWIndex> windex_table;
-    
     unsigned int greatest_index = 0;
     if (used_indices->indices.size() != 0) {
         greatest_index = hfst::size_t_to_uint(used_indices->indices.size() - 1);
     }
 
-    for(unsigned int i = 0; i <= greatest_index; ++i) {
-        if (!used_indices->used(i)) { // blank entries
-            windex_table.append(hfst_ol::TransitionWIndex());
-        } else if (used_indices->get_target(i).second ==
-                   NO_SYMBOL_NUMBER) { // finality markers
-            if (state_placeholders[used_indices->get_target(i).first].final) {
-                windex_table.append(
-                    hfst_ol::TransitionWIndex::create_final(
-                        state_placeholders[
-                            used_indices->get_target(i).first].final_weight));
-            } else {
-                windex_table.append(hfst_ol::TransitionWIndex());
-            }
-        } else { // actual entries
-            unsigned int idx = used_indices->get_target(i).first;
-            SymbolNumber sym = used_indices->get_target(i).second;
-            windex_table.append(
-                hfst_ol::TransitionWIndex(
-                    sym,
-                    state_placeholders[idx].first_transition +
-                    state_placeholders[idx].symbol_offset(
-                        sym, flag_symbols) + TA_OFFSET));
-        }
-    }
+    hfst_ol::TransducerTable<hfst_ol::TransitionWIndex> windex_table(
+        greatest_index + 1 + seen_input_symbols, hfst_ol::TransitionWIndex());
+    IndexWriter index_writer(windex_table, *used_indices, state_placeholders,
+                             TA_OFFSET);
+    hfst_ol::run_state_ranges(index_writer, greatest_index + 1, threads);
 
     delete used_indices;
 
-    for (unsigned int i = 0; i < seen_input_symbols; ++i) {
-        windex_table.append(hfst_ol::TransitionWIndex()); // padding
-    }
-
     // Now write the transition table
 
     hfst_ol::TransducerTable<hfst_ol::TransitionW> wtransition_table;
@@ -439,7 +486,8 @@ void get_states_and_symbols(
     hfst_ol::write_transitions_from_state_placeholders(
         wtransition_table,
         state_placeholders,
-        flag_symbols);
+        flag_symbols,
+        threads);
 
     hfst_ol::TransducerAlphabet alphabet(symbol_table);
     hfst_ol::TransducerHeader header(seen_input_symbols,
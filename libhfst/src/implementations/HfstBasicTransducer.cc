@@ -9,6 +9,8 @@
 // information.
 
 #include "HfstBasicTransducer.h"
+#include "HfstCompactBasicTransducer.h"
+#include "HfstTransducerTraversal.h"
 
 #ifndef MAIN_TEST
 
@@ -85,6 +87,11 @@
        assert(alphabet.count(HfstSymbol()) == 0);
      }
 
+     /** @brief Create a mutable copy of the frozen \a transducer. */
+     HfstBasicTransducer::HfstBasicTransducer(const HfstCompactBasicTransducer &transducer) {
+       transducer.to_basic_transducer(*this);
+     }
+
      /** @brief Create an HfstBasicTransducer equivalent to HfstTransducer
          \a transducer. FIXME: move to a separate file */
        HfstBasicTransducer::HfstBasicTransducer(const hfst::HfstTransducer &transducer) {
@@ -356,6 +363,33 @@
            return retval;
          }
 
+         SymbolIdSet HfstBasicTransducer::get_alphabet_ids() const {
+
+           SymbolIdSet retval;
+           for (HfstAlphabet::const_iterator it = alphabet.begin();
+                it != alphabet.end(); it++)
+             {
+               retval.insert(HfstTropicalTransducerTransitionData::get_symbol_id(*it));
+             }
+           return retval;
+         }
+
+         SymbolIdPairSet HfstBasicTransducer::get_transition_id_pairs() const {
+
+           SymbolIdPairSet retval;
+           for (const_iterator it = begin(); it != end(); it++)
+             {
+               for (HfstBasicTransitions::const_iterator tr_it
+                      = it->begin();
+                    tr_it != it->end(); tr_it++)
+                 {
+                   retval.insert(SymbolIdPair(tr_it->get_input_number(),
+                                              tr_it->get_output_number()));
+                 }
+             }
+           return retval;
+         }
+
 
      // ----------------------------------------------------------------
      // --- Adding states and transitions and iterating through them ---
@@ -406,6 +440,27 @@
            state_vector[s].push_back(transition);
      }
 
+     void HfstBasicTransducer::add_transition(HfstState s, HfstState target,
+                                              SymbolId input, SymbolId output,
+                                              HfstTropicalTransducerTransitionData::WeightType weight,
+                                              bool add_symbols_to_alphabet/*=true*/) {
+
+           // Also checks that the ids are mapped to symbols
+           const HfstSymbol &isymbol
+             = HfstTropicalTransducerTransitionData::get_symbol_string(input);
+           const HfstSymbol &osymbol
+             = HfstTropicalTransducerTransitionData::get_symbol_string(output);
+
+           add_state(s);
+           add_state(target);
+           if (add_symbols_to_alphabet) {
+             alphabet.insert(isymbol);
+             alphabet.insert(osymbol);
+           }
+           state_vector[s].push_back
+             (HfstBasicTransition(target, input, output, weight, false));
+     }
+
      /** @brief Remove transition \a transition from state \a s.
                 \a remove_symbols_from_alphabet defines whether
                 symbols in \a transition are removed from the alphabet
@@ -2226,6 +2281,108 @@
              return *this;
            }
 
+         HfstBasicTransducer &
+           HfstBasicTransducer::substitute(SymbolId old_id,
+                                           SymbolId new_id,
+                                           bool input_side/*=true*/,
+                                           bool output_side/*=true*/) {
+
+           const HfstSymbol &old_symbol
+             = HfstTropicalTransducerTransitionData::get_symbol_string(old_id);
+           const HfstSymbol &new_symbol
+             = HfstTropicalTransducerTransitionData::get_symbol_string(new_id);
+
+           // If a symbol is substituted with itself, do nothing.
+           if (old_id == new_id)
+             return *this;
+           // If the old symbol is not known to the graph, do nothing.
+           if (alphabet.find(old_symbol) == alphabet.end())
+             return *this;
+
+           // Remove the symbol to be substituted from the alphabet
+           // if the substitution is made on both sides.
+           if (input_side && output_side) {
+             /* Special symbols are always included in the alphabet */
+             if (! is_epsilon(old_symbol) &&
+                 ! is_unknown(old_symbol) &&
+                 ! is_identity(old_symbol)) {
+               alphabet.erase(old_symbol); }
+           }
+           // Insert the substituting symbol to the alphabet.
+           alphabet.insert(new_symbol);
+
+           for (iterator it = begin(); it != end(); it++)
+             {
+               for (unsigned int i=0; i < it->size(); i++)
+                 {
+                   HfstBasicTransition &tr_it = it->operator[](i);
+                   HfstNumber inumber = tr_it.get_input_number();
+                   HfstNumber onumber = tr_it.get_output_number();
+                   bool substitution_made=false;
+
+                   if (input_side && inumber == old_id) {
+                     inumber = new_id;
+                     substitution_made=true;
+                   }
+                   if (output_side && onumber == old_id) {
+                     onumber = new_id;
+                     substitution_made=true;
+                   }
+                   if (substitution_made) {
+                     tr_it = HfstBasicTransition
+                       (tr_it.get_target_state(), inumber, onumber,
+                        tr_it.get_weight(), false);
+                   }
+                 }
+             }
+
+           return *this;
+         }
+
+         /** @brief Substitute all symbol ids as defined in \a substitutions. */
+         HfstBasicTransducer & HfstBasicTransducer::substitute
+           (const SymbolIdSubstitutions &substitutions)
+           {
+             // marker that means that no substitution is made
+             size_t st = HfstTropicalTransducerTransitionData::get_max_number()+1;
+             unsigned int no_substitution = hfst::size_t_to_uint(st);
+
+             std::vector<unsigned int> substitutions_
+               (HfstTropicalTransducerTransitionData::get_max_number()+1, no_substitution);
+             for (SymbolIdSubstitutions::const_iterator it
+                    = substitutions.begin();
+                  it != substitutions.end(); it++)
+               {
+                 (void)HfstTropicalTransducerTransitionData::get_symbol_string(it->first);
+                 (void)HfstTropicalTransducerTransitionData::get_symbol_string(it->second);
+                 substitutions_.at(it->first) = it->second;
+               }
+
+             substitute_(substitutions_, no_substitution);
+
+             return *this;
+           }
+
+         /** @brief Substitute all transitions as defined in \a substitutions,
+             given as symbol id pairs. */
+         HfstBasicTransducer & HfstBasicTransducer::substitute
+           (const SymbolIdPairSubstitutions &substitutions)
+           {
+             for (SymbolIdPairSubstitutions::const_iterator it
+                    = substitutions.begin();
+                  it != substitutions.end(); it++)
+               {
+                 (void)HfstTropicalTransducerTransitionData::get_symbol_string(it->first.first);
+                 (void)HfstTropicalTransducerTransitionData::get_symbol_string(it->first.second);
+                 (void)HfstTropicalTransducerTransitionData::get_symbol_string(it->second.first);
+                 (void)HfstTropicalTransducerTransitionData::get_symbol_string(it->second.second);
+               }
+
+             substitute_(substitutions);
+
+             return *this;
+           }
+
          HfstBasicTransducer & HfstBasicTransducer::substitute_symbol_pairs
            (const HfstSymbolPairSubstitutions &substitutions)
            { return this->substitute(substitutions); }
@@ -3134,124 +3291,24 @@
          */
      std::vector<std::set<HfstState> > HfstBasicTransducer::topsort(SortDistance dist) const
            {
-             typedef std::set<HfstState>::const_iterator StateIt;
-             unsigned int current_distance = 0; // topological distance
-             TopologicalSort TopSort;
-
-             size_t st = state_vector.size();
-             if (st == 0)
-               {
-                 std::vector<std::set<HfstState> > empty;
-                 return empty;
-               }
-             st = st-1;
-             unsigned int biggest_state_number = hfst::size_t_to_uint(st);
-             TopSort.set_biggest_state_number(biggest_state_number);
-
-             TopSort.set_state_at_distance(0,current_distance,(dist == MaximumDistance));
-             bool new_states_found = false; // end condition for do-while loop
-
-            do
-              {
-                new_states_found = false;
-                // states that are accessible from the current set of states
-                std::set<HfstState> new_states;
-
-                // go through all states at current distance
-                const std::set<HfstState> & states =
-                  TopSort.get_states_at_distance(current_distance);
-                for (StateIt state_it = states.begin();
-                     state_it != states.end(); state_it++)
-                  {
-                    // go through all transitions of each state
-                    const HfstBasicTransitions & transitions
-                      = this->state_vector.at(*state_it);
-                    for (HfstBasicTransitions::const_iterator transition_it
-                           = transitions.begin();
-                         transition_it != transitions.end(); transition_it++)
-                      {
-                        new_states_found = true;
-                        new_states.insert(transition_it->get_target_state());
-                      }
-                    // all transitions gone through
-                  }
-                // all states gone through
-                
-                // set each accessible state at distance one higher than the
-                // current distance
-                for (StateIt it = new_states.begin();
-                     it != new_states.end(); it++)
-                  {
-                    TopSort.set_state_at_distance(*it, current_distance + 1, (dist == MaximumDistance));
-                  }
-                current_distance++;
-              }
-            while (new_states_found);
-
-            return TopSort.states_at_distance;
-          }
+             return traversal::topsort
+               (traversal::BasicTransducerAccessor(*this), dist);
+           }
 
         /** The length of longest string accepted by this graph.
             If no string is accepted, return -1. */
          int HfstBasicTransducer::longest_path_size()
         {
-          // get topological maximum distance sort
-          std::vector<std::set<HfstState> > states_sorted = this->topsort(MaximumDistance);
-          // go through all sets of states in descending order
-          size_t st = states_sorted.size();
-          if (st > 0)
-            {
-              for (int distance = hfst::size_t_to_int(st-1); distance >= 0; distance--)
-                {
-                  const std::set<HfstState> & states
-                    = states_sorted.at((unsigned int)distance);
-                  // go through all states in a set
-                  for (std::set<HfstState>::const_iterator it = states.begin();
-                       it != states.end(); it++)
-                    {
-                      // if a final state is encountered, return the distance
-                      // of that state
-                      if (is_final_state(*it))
-                        {
-                          return distance;
-                        }
-                    }
-                }
-            }
-          // if no final states were encountered, return a negative value
-          return -1;
+          return traversal::longest_path_size
+            (traversal::BasicTransducerAccessor(*this));
         }
 
          /** The lengths of strings accepted by this graph, in descending order.
              If not string is accepted, return an empty vector. */
          std::vector<unsigned int> HfstBasicTransducer::path_sizes()
            {
-             std::vector<unsigned int> result;
-             // get topological maximum distance sort
-             std::vector<std::set<HfstState> > states_sorted = this->topsort(MinimumDistance);
-             // go through all sets of states in descending order
-             size_t st = states_sorted.size();
-             if (st > 0)
-               {
-                 for (int distance = hfst::size_t_to_int(st-1); distance >= 0; distance--)
-                   {
-                     const std::set<HfstState> & states
-                       = states_sorted.at((unsigned int)distance);
-                     // go through all states in a set
-                     for (std::set<HfstState>::const_iterator it = states.begin();
-                          it != states.end(); it++)
-                       {
-                         // if a final state is encountered, add its distance
-                         // to result
-                         if (is_final_state(*it))
-                           {
-                             result.push_back((unsigned int)distance);
-                             break; // go to next set of states
-                           }
-                       }
-                   }
-               }
-             return result;
+             return traversal::path_sizes
+               (traversal::BasicTransducerAccessor(*this));
            }
 
          bool HfstBasicTransducer::has_negative_epsilon_cycles
@@ -3544,6 +3601,84 @@
            path_so_far.first = path_so_far.first - final_weight;
          }
 
+         namespace {
+           /* Numbers the symbols of string lookup paths. Symbols that have
+              no id get numbers past the ids in use, so that they match
+              only identity and unknown symbols and are not added to the
+              symbol table for good. */
+           class LookupSymbolIds
+           {
+             SymbolId first_unnumbered;
+             std::map<std::string, SymbolId> unnumbered_ids;
+             StringVector unnumbered_symbols;
+           public:
+             LookupSymbolIds():
+               first_unnumbered
+               (HfstTropicalTransducerTransitionData::get_max_number() + 1)
+             {}
+
+             SymbolId id(const std::string &symbol)
+             {
+               SymbolId id = 0;
+               if (HfstTropicalTransducerTransitionData::find_symbol_id
+                   (symbol, id))
+                 return id;
+               std::map<std::string, SymbolId>::const_iterator it
+                 = unnumbered_ids.find(symbol);
+               if (it != unnumbered_ids.end())
+                 return it->second;
+               id = first_unnumbered
+                 + (SymbolId)unnumbered_symbols.size();
+               unnumbered_ids[symbol] = id;
+               unnumbered_symbols.push_back(symbol);
+               return id;
+             }
+
+             const std::string &symbol(SymbolId id) const
+             {
+               if (id < first_unnumbered)
+                 return HfstTropicalTransducerTransitionData::get_symbol_string(id);
+               return unnumbered_symbols[id - first_unnumbered];
+             }
+
+             SymbolIdVector ids(const StringVector &symbols)
+             {
+               SymbolIdVector result;
+               for (StringVector::const_iterator it = symbols.begin();
+                    it != symbols.end(); it++)
+                 result.push_back(id(*it));
+               return result;
+             }
+
+             HfstTwoLevelIdPath ids(const HfstTwoLevelPath &path)
+             {
+               HfstTwoLevelIdPath result;
+               result.first = path.first;
+               for (StringPairVector::const_iterator it = path.second.begin();
+                    it != path.second.end(); it++)
+                 result.second.push_back
+                   (SymbolIdPair(id(it->first), id(it->second)));
+               return result;
+             }
+
+             void add_paths(const HfstTwoLevelIdPaths &id_paths,
+                            HfstTwoLevelPaths &paths) const
+             {
+               for (HfstTwoLevelIdPaths::const_iterator it = id_paths.begin();
+                    it != id_paths.end(); it++)
+                 {
+                   StringPairVector spv;
+                   for (SymbolIdPairVector::const_iterator pair_it
+                          = it->second.begin();
+                        pair_it != it->second.end(); pair_it++)
+                     spv.push_back(StringPair(symbol(pair_it->first),
+                                              symbol(pair_it->second)));
+                   paths.insert(HfstTwoLevelPath(it->first, spv));
+                 }
+             }
+           };
+         }
+
          bool HfstBasicTransducer::is_possible_transition
            (const HfstBasicTransition &transition,
             const StringVector &lookup_path,
@@ -3552,58 +3687,24 @@
             bool &input_symbol_consumed,
             StringVector * fds_so_far /*= NULL*/)
          {
-           std::string isymbol = transition.get_input_symbol();
-           
-           // If we are not at the end of lookup_path,
-           if (! (lookup_index == (unsigned int)lookup_path.size()))
-             {
-               // we can go further if the current symbol in lookup_path
-               // matches to the input symbol of the transition, i.e
-               // either the input symbol is the same as the current symbol
-               if ( isymbol.compare(lookup_path.at(lookup_index)) == 0 ||
-                    // or the input symbol is the identity or unknown symbol and
-                    // the current symbol is not found in the alphabet
-                    // of the transducer.
-                    ( (is_identity(isymbol) || is_unknown(isymbol)) &&
-                      (alphabet.find(lookup_path.at(lookup_index))
-                       == alphabet.end()) )
-                    )
-                 {
-                   input_symbol_consumed=true;
-                   return true;
-                 }
-             }
-           // Whether there are more symbols in lookup_path or not,
-           // we can always go further if the input symbol of the transition
-           // is an epsilon or a flag diacritic.
-           if ( is_epsilon(isymbol) )
-             {
-               input_symbol_consumed=false;
-               return true;
-             }
-           if ( FdOperation::is_diacritic(isymbol) )
+           bool at_end = (lookup_index == (unsigned int)lookup_path.size());
+           SymbolId lookup_symbol = 0;
+           bool lookup_symbol_known = false;
+           if (! at_end)
              {
-               if (fds_so_far == NULL)
-                 {
-                   input_symbol_consumed=false;
-                   return true;
-                 }
-               else
-                 {
-                   FlagDiacriticTable FdT;
-                   fds_so_far->push_back(isymbol);
-                   bool valid = FdT.is_valid_string(*fds_so_far);
-                   fds_so_far->pop_back();
-                   if (valid)
-                     {
-                       input_symbol_consumed=false;
-                       return true;
-                     }
-                 }
+               const std::string &symbol = lookup_path.at(lookup_index);
+               // A symbol without an id can't match any transition
+               if (! HfstTropicalTransducerTransitionData::find_symbol_id
+                   (symbol, lookup_symbol))
+                 lookup_symbol =
+                   HfstTropicalTransducerTransitionData::get_max_number() + 1;
+               lookup_symbol_known = (alphabet.find(symbol) != alphabet.end());
              }
-           
-           // No matches.
-           return false;
+           return is_possible_input
+             (transition.get_input_number(),
+              FdOperation::is_diacritic(transition.get_input_symbol()),
+              at_end, lookup_symbol, lookup_symbol_known,
+              input_symbol_consumed, fds_so_far);
          }
          
          void HfstBasicTransducer::lookup
@@ -3618,97 +3719,16 @@
             float * max_weight /*= NULL*/,
             StringVector * flag_diacritic_path /*= NULL*/)
          {
-           // Check whether the number of input epsilon cycles is exceeded
-           if (! Eh.can_continue(state)) {
-             return;
-           }
-           // Check whether the maximum weight is exceeded
-           if (max_weight != NULL && path_so_far.first > *max_weight) {
-             return;
-           }
-           
-           // If we are at the end of lookup_path,
-           if (lookup_index == lookup_path.size())
-             {
-               // and if the current state is final,
-               if (this->is_final_state(state))
-                 {
-                   // path_so_far is a valid result if max_weight is not exceeded
-                   add_to_results
-                     (results, path_so_far, this->get_final_weight(state), max_weight);
-                 }
-             }
-           
-           // Whether there are more symbols in lookup_path or not,
-           // go through all transitions in the current state.
-           const HfstBasicTransitions &transitions
-             = this->operator[](state);
-           for (HfstBasicTransitions::const_iterator it
-                  = transitions.begin();
-                it != transitions.end(); it++)
-             {
-               bool input_symbol_consumed=false;
-               if ( is_possible_transition
-                    (*it, lookup_path, lookup_index, alphabet,
-                     input_symbol_consumed, flag_diacritic_path) )
-                 {
-                   // update path_so_far and lookup_index
-                   std::string istr;
-                   std::string ostr;
-
-                   // identity symbol is replaced with the lookup symbol
-                   if (is_identity(it->get_input_symbol()))
-                     {
-                       istr = lookup_path.at(lookup_index);
-                       ostr = istr;
-                     }
-                   else
-                     {
-                       if (is_unknown(it->get_input_symbol()))
-                         istr = lookup_path.at(lookup_index);
-                       else
-                         istr = it->get_input_symbol();
-
-                       /*if (is_unknown(it->get_output_symbol()))
-                         ostr = std::string("?");
-                         else*/
-                       ostr = it->get_output_symbol();
-                     }
-
-                   push_back_to_two_level_path
-                     (path_so_far,
-                      StringPair(istr, ostr),
-                      it->get_weight(), flag_diacritic_path);
-
-                   HfstEpsilonHandler * Ehp = NULL;
-                   if (input_symbol_consumed) {
-                     lookup_index++;
-                     Ehp = new HfstEpsilonHandler(max_epsilon_cycles);
-                   }
-                   else {
-                     Eh.push_back(state);
-                     Ehp = &Eh;
-                   }
-                   
-                   // call lookup for the target state of the transition
-                   lookup(lookup_path, results, it->get_target_state(),
-                             lookup_index, path_so_far, alphabet, *Ehp, max_epsilon_cycles, max_weight, flag_diacritic_path);
-                   
-                   // return to the original values of path_so_far
-                   // and lookup_index
-                   if (input_symbol_consumed) {
-                     lookup_index--;
-                     delete Ehp;
-                   }
-                   else {
-                     // Eh.pop_back();  not needed because the destructor
-                     // of Eh is automatically called next
-                   }
-                   
-                   pop_back_from_two_level_path(path_so_far, it->get_weight(), flag_diacritic_path);
-                 }
-             }
-           
+           IdLookupTables tables;
+           build_id_lookup_tables(alphabet, tables);
+           LookupSymbolIds ids;
+           SymbolIdVector id_lookup_path = ids.ids(lookup_path);
+           HfstTwoLevelIdPath id_path_so_far = ids.ids(path_so_far);
+           HfstTwoLevelIdPaths id_results;
+           lookup(id_lookup_path, id_results, state, lookup_index,
+                  id_path_so_far, tables, Eh, max_epsilon_cycles, max_weight,
+                  flag_diacritic_path);
+           ids.add_paths(id_results, results);
          }
          
          void HfstBasicTransducer::lookup
@@ -3718,27 +3738,129 @@
             float * max_weight /*= NULL*/,
             bool obey_flags /*= false*/)
          {
-           HfstState state = 0;
-           unsigned int lookup_index = 0;
-           HfstTwoLevelPath path_so_far;
-           StringSet alphabet = this->get_alphabet();
-           StringVector * flag_diacritic_path = (obey_flags)? new StringVector() : NULL;
+           LookupSymbolIds ids;
+           HfstTwoLevelIdPaths id_results;
+           lookup(ids.ids(lookup_path), id_results, max_epsilon_cycles,
+                  max_weight, obey_flags);
+           ids.add_paths(id_results, results);
+         }
 
-           if (max_epsilon_cycles != NULL)
+         void HfstBasicTransducer::build_id_lookup_tables
+           (const HfstAlphabet &alpha, IdLookupTables &tables)
+         {
+           size_t table_size = HfstTropicalTransducerTransitionData::get_max_number()+1;
+           tables.in_alphabet.assign(table_size, false);
+           tables.is_flag.assign(table_size, false);
+           for (HfstAlphabet::const_iterator it = alpha.begin();
+                it != alpha.end(); it++)
              {
-               HfstEpsilonHandler Eh(*max_epsilon_cycles);
-               lookup(lookup_path, results, state, lookup_index, path_so_far,
-                      alphabet, Eh, *max_epsilon_cycles, max_weight, flag_diacritic_path);
+               SymbolId id = 0;
+               if (! HfstTropicalTransducerTransitionData::find_symbol_id(*it, id))
+                 continue;
+               tables.in_alphabet[id] = true;
+               tables.is_flag[id] = FdOperation::is_diacritic(*it);
              }
-           else
+         }
+
+         bool HfstBasicTransducer::is_possible_input
+           (SymbolId isymbol,
+            bool isymbol_is_flag,
+            bool at_end,
+            SymbolId lookup_symbol,
+            bool lookup_symbol_known,
+            bool &input_symbol_consumed,
+            StringVector * fds_so_far /*= NULL*/)
+         {
+           // If we are not at the end of the lookup path, the input symbol
+           // must be the same as the current symbol or an identity or
+           // unknown symbol when the current symbol is not in the alphabet
+           // of the transducer.
+           if (! at_end &&
+               ( isymbol == lookup_symbol ||
+                 ( (isymbol == IDENTITY_SYMBOL_ID ||
+                    isymbol == UNKNOWN_SYMBOL_ID) &&
+                   ! lookup_symbol_known ) ) )
              {
-               HfstEpsilonHandler Eh(100000);
-               lookup(lookup_path, results, state, lookup_index, path_so_far,
-                      alphabet, Eh, 100000, max_weight, flag_diacritic_path);
+               input_symbol_consumed=true;
+               return true;
              }
-           
-           if (flag_diacritic_path != NULL)
-             delete flag_diacritic_path;
+           // Epsilons and flag diacritics can always be followed
+           if (isymbol == EPSILON_SYMBOL_ID)
+             {
+               input_symbol_consumed=false;
+               return true;
+             }
+           if (isymbol_is_flag)
+             {
+               if (fds_so_far != NULL)
+                 {
+                   FlagDiacriticTable FdT;
+                   fds_so_far->push_back
+                     (HfstTropicalTransducerTransitionData::get_symbol_string(isymbol));
+                   bool valid = FdT.is_valid_string(*fds_so_far);
+                   fds_so_far->pop_back();
+                   if (! valid)
+                     return false;
+                 }
+               input_symbol_consumed=false;
+               return true;
+             }
+
+           // No matches.
+           return false;
+         }
+
+         bool HfstBasicTransducer::is_possible_transition
+           (const HfstBasicTransition &transition,
+            const SymbolIdVector &lookup_path,
+            unsigned int lookup_index,
+            const IdLookupTables &tables,
+            bool &input_symbol_consumed,
+            StringVector * fds_so_far /*= NULL*/) const
+         {
+           SymbolId isymbol = transition.get_input_number();
+           bool at_end = (lookup_index == lookup_path.size());
+           SymbolId lookup_symbol = at_end? 0 : lookup_path[lookup_index];
+           return is_possible_input
+             (isymbol, tables.is_flag_id(isymbol), at_end, lookup_symbol,
+              ! at_end && tables.in_alphabet_id(lookup_symbol),
+              input_symbol_consumed, fds_so_far);
+         }
+
+         void HfstBasicTransducer::lookup
+           (const SymbolIdVector &lookup_path,
+            HfstTwoLevelIdPaths &results,
+            HfstState state,
+            unsigned int lookup_index,
+            HfstTwoLevelIdPath &path_so_far,
+            const IdLookupTables &tables,
+            HfstEpsilonHandler Eh,
+            size_t max_epsilon_cycles,
+            float * max_weight /*= NULL*/,
+            StringVector * flag_diacritic_path /*= NULL*/)
+         {
+           traversal::lookup(traversal::BasicTransducerAccessor(*this),
+                             lookup_path, results, state, lookup_index,
+                             path_so_far, tables, Eh, max_epsilon_cycles,
+                             max_weight, flag_diacritic_path);
+         }
+
+         void HfstBasicTransducer::lookup
+           (const SymbolIdVector &lookup_path,
+            HfstTwoLevelIdPaths &results,
+            size_t * max_epsilon_cycles /*= NULL*/,
+            float * max_weight /*= NULL*/,
+            bool obey_flags /*= false*/)
+         {
+           IdLookupTables tables;
+           build_id_lookup_tables(alphabet, tables);
+
+           HfstTwoLevelIdPath path_so_far;
+           StringVector flag_diacritic_path;
+           size_t cycles = (max_epsilon_cycles != NULL)? *max_epsilon_cycles : 100000;
+           HfstEpsilonHandler Eh(cycles);
+           lookup(lookup_path, results, 0, 0, path_so_far, tables, Eh,
+                  cycles, max_weight, obey_flags? &flag_diacritic_path : NULL);
          }
 
 
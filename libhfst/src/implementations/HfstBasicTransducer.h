@@ -54,6 +54,8 @@
      typedef std::vector<HfstReplacement> HfstReplacements;
      typedef std::map<HfstState, HfstReplacements > HfstReplacementsMap;
 
+     class HfstCompactBasicTransducer;
+
      /** @brief Datatype for the states of a transition in a graph. */
      typedef std::vector<hfst::implementations::HfstBasicTransition> HfstBasicTransitions;
      /* Datatype for the states of a graph and their transitions.
@@ -215,6 +217,10 @@
        /** @brief Create an HfstBasicTransducer equivalent to HfstTransducer
            \a transducer. FIXME: move to a separate file */
        HFSTDLL HfstBasicTransducer(const hfst::HfstTransducer &transducer);
+
+       /** @brief Create an HfstBasicTransducer equivalent to the frozen
+           transducer \a transducer. */
+       HFSTDLL HfstBasicTransducer(const HfstCompactBasicTransducer &transducer);
        
        // --------------------------------------------------
        // --- Initialization, optimization and debugging ---
@@ -299,6 +305,14 @@
        HFSTDLL const HfstAlphabet &get_alphabet() const;
        
        HFSTDLL StringPairSet get_transition_pairs() const;
+
+       /** @brief Get the ids of the symbols in the alphabet of the graph.
+
+           @see get_alphabet */
+       HFSTDLL SymbolIdSet get_alphabet_ids() const;
+
+       /** @brief Get the id pairs of all transitions in the graph. */
+       HFSTDLL SymbolIdPairSet get_transition_id_pairs() const;
        
        // ----------------------------------------------------------------
        // --- Adding states and transitions and iterating through them ---
@@ -325,6 +339,17 @@
            If state \a s does not exist, it is created. */
      HFSTDLL void add_transition(HfstState s, const HfstBasicTransition & transition,
                                  bool add_symbols_to_alphabet=true);
+
+     /** @brief Add a transition from state \a s to state \a target with
+         input symbol id \a input, output symbol id \a output and weight
+         \a weight.
+
+         If state \a s or \a target does not exist, it is created.
+         @see HfstTropicalTransducerTransitionData::get_symbol_id */
+     HFSTDLL void add_transition(HfstState s, HfstState target,
+                                 SymbolId input, SymbolId output,
+                                 HfstTropicalTransducerTransitionData::WeightType weight,
+                                 bool add_symbols_to_alphabet=true);
      
      /** @brief Remove transition \a transition from state \a s.
          \a remove_symbols_from_alphabet defines whether
@@ -635,6 +660,28 @@
      */
      HFSTDLL HfstBasicTransducer &substitute
        (const HfstSymbolPairSubstitutions &substitutions);
+
+     /** @brief Substitute symbol id \a old_id with \a new_id in all
+         transitions. \a input_side and \a output_side define whether
+         the substitution is made on input and output sides.
+
+         @see substitute(const HfstSymbol&, const HfstSymbol&, bool, bool) */
+     HFSTDLL HfstBasicTransducer &
+       substitute(SymbolId old_id,
+                  SymbolId new_id,
+                  bool input_side=true,
+                  bool output_side=true);
+
+     /** @brief Substitute all symbol ids as defined in \a substitutions. */
+     HFSTDLL HfstBasicTransducer &substitute
+       (const SymbolIdSubstitutions &substitutions);
+
+     /** @brief Substitute all transitions as defined in \a substitutions,
+         given as symbol id pairs.
+
+         @see substitute(const HfstSymbolPairSubstitutions&) */
+     HFSTDLL HfstBasicTransducer &substitute
+       (const SymbolIdPairSubstitutions &substitutions);
      
      /** @brief Substitute all transitions \a sp with a set of transitions
          \a sps. */
@@ -991,6 +1038,74 @@
         size_t * max_epsilon_cycles = NULL,
         float * max_weight = NULL,
         bool obey_flags = false);
+
+     /* Symbol id versions of the functions above, which number their
+        lookup path once and call these. Transitions are compared by id,
+        and the alphabet and flag diacritics are looked up in tables
+        indexed by id. */
+     struct IdLookupTables
+     {
+       std::vector<bool> in_alphabet;
+       std::vector<bool> is_flag;
+
+       bool in_alphabet_id(SymbolId id) const
+       { return id < in_alphabet.size() && in_alphabet[id]; }
+       bool is_flag_id(SymbolId id) const
+       { return id < is_flag.size() && is_flag[id]; }
+     };
+
+     /* Fill \a tables for the symbols in \a alpha. */
+     static void build_id_lookup_tables
+       (const HfstAlphabet &alpha, IdLookupTables &tables);
+
+     /* Whether a transition with input symbol \a isymbol, a flag
+        diacritic if \a isymbol_is_flag, can be followed when
+        \a lookup_symbol is the next symbol to look up, or when the whole
+        path has been looked up if \a at_end. \a lookup_symbol_known tells
+        whether the symbol is in the alphabet, identity and unknown symbols
+        matching only those that aren't. Both overloads of
+        is_possible_transition are decided here. */
+     static bool is_possible_input
+       (SymbolId isymbol,
+        bool isymbol_is_flag,
+        bool at_end,
+        SymbolId lookup_symbol,
+        bool lookup_symbol_known,
+        bool &input_symbol_consumed,
+        StringVector * fds_so_far = NULL);
+
+     bool is_possible_transition
+       (const HfstBasicTransition &transition,
+        const SymbolIdVector &lookup_path,
+        unsigned int lookup_index,
+        const IdLookupTables &tables,
+        bool &input_symbol_consumed,
+        StringVector * fds_so_far = NULL) const;
+
+     void lookup
+       (const SymbolIdVector &lookup_path,
+        HfstTwoLevelIdPaths &results,
+        HfstState state,
+        unsigned int lookup_index,
+        HfstTwoLevelIdPath &path_so_far,
+        const IdLookupTables &tables,
+        HfstEpsilonHandler Eh,
+        size_t max_epsilon_cycles,
+        float * max_weight = NULL,
+        StringVector * flag_diacritic_path = NULL);
+
+     /** @brief Look up \a lookup_path, given as symbol ids, and store
+         the resulting paths as symbol id pairs to \a results.
+
+         @see lookup(const StringVector&, HfstTwoLevelPaths&, size_t*, float*, bool) */
+     HFSTDLL void lookup
+       (const SymbolIdVector &lookup_path,
+        HfstTwoLevelIdPaths &results,
+        size_t * max_epsilon_cycles = NULL,
+        float * max_weight = NULL,
+        bool obey_flags = false);
+
+     friend class HfstCompactBasicTransducer;
      
      HFSTDLL void check_regexp_state_for_cycle(HfstState s, const std::set<HfstState> & states_visited);
      
@@ -0,0 +1,408 @@
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+#include "HfstCompactBasicTransducer.h"
+#include "HfstTransducerTraversal.h"
+
+#include <limits>
+#include <algorithm>
+
+#ifndef MAIN_TEST
+
+ namespace hfst {
+
+   namespace implementations {
+
+     static const HfstCompactBasicTransducer::WeightType NOT_FINAL
+       = std::numeric_limits<HfstCompactBasicTransducer::WeightType>::infinity();
+
+     HfstCompactBasicTransducer::HfstCompactBasicTransducer(void):
+       transition_offsets(2, 0), final_weights(1, NOT_FINAL)
+     {
+       alphabet.insert(internal_epsilon);
+       alphabet.insert(internal_unknown);
+       alphabet.insert(internal_identity);
+     }
+
+     HfstCompactBasicTransducer::HfstCompactBasicTransducer
+       (const HfstBasicTransducer &graph):
+       alphabet(graph.alphabet), name(graph.name)
+     {
+       const HfstBasicStates &states = graph.state_vector;
+
+       size_t number_of_transitions = 0;
+       for (HfstBasicStates::const_iterator it = states.begin();
+            it != states.end(); it++)
+         {
+           number_of_transitions += it->size();
+         }
+       if (number_of_transitions > std::numeric_limits<unsigned int>::max())
+         HFST_THROW_MESSAGE(HfstFatalException,
+                            "HfstCompactBasicTransducer: too many transitions");
+
+       transition_offsets.reserve(states.size() + 1);
+       transitions.reserve(number_of_transitions);
+       for (HfstBasicStates::const_iterator it = states.begin();
+            it != states.end(); it++)
+         {
+           transition_offsets.push_back((unsigned int)transitions.size());
+           for (HfstBasicTransitions::const_iterator tr_it = it->begin();
+                tr_it != it->end(); tr_it++)
+             {
+               Transition tr;
+               tr.target = tr_it->get_target_state();
+               tr.input = tr_it->get_input_number();
+               tr.output = tr_it->get_output_number();
+               tr.weight = tr_it->get_weight();
+               transitions.push_back(tr);
+             }
+         }
+       transition_offsets.push_back((unsigned int)transitions.size());
+
+       final_weights.assign(states.size(), NOT_FINAL);
+       for (HfstBasicTransducer::FinalWeightMap::const_iterator it
+              = graph.final_weight_map.begin();
+            it != graph.final_weight_map.end(); it++)
+         {
+           final_weights.at(it->first) = it->second;
+         }
+     }
+
+     void HfstCompactBasicTransducer::to_basic_transducer
+       (HfstBasicTransducer &graph) const
+     {
+       unsigned int number_of_states = get_number_of_states();
+       graph.state_vector.clear();
+       graph.state_vector.resize(number_of_states);
+       graph.final_weight_map.clear();
+       for (HfstState s = 0; s < number_of_states; s++)
+         {
+           HfstBasicTransitions &state_transitions = graph.state_vector[s];
+           state_transitions.reserve(transitions_end(s) - transitions_begin(s));
+           for (const Transition * tr = transitions_begin(s);
+                tr != transitions_end(s); tr++)
+             {
+               state_transitions.push_back
+                 (HfstBasicTransition(tr->target, tr->input, tr->output,
+                                      tr->weight, false));
+             }
+           if (is_final_state(s))
+             graph.final_weight_map[s] = final_weights[s];
+         }
+       graph.alphabet = alphabet;
+       graph.name = name;
+     }
+
+     unsigned int HfstCompactBasicTransducer::get_number_of_states() const
+     {
+       return (unsigned int)final_weights.size();
+     }
+
+     unsigned int HfstCompactBasicTransducer::get_number_of_transitions() const
+     {
+       return (unsigned int)transitions.size();
+     }
+
+     const HfstCompactBasicTransducer::Transition *
+     HfstCompactBasicTransducer::transitions_begin(HfstState s) const
+     {
+       return transitions.empty()? NULL : &transitions[0] + transition_offsets[s];
+     }
+
+     const HfstCompactBasicTransducer::Transition *
+     HfstCompactBasicTransducer::transitions_end(HfstState s) const
+     {
+       return transitions.empty()? NULL : &transitions[0] + transition_offsets[s+1];
+     }
+
+     bool HfstCompactBasicTransducer::is_final_state(HfstState s) const
+     {
+       return s < final_weights.size() && final_weights[s] != NOT_FINAL;
+     }
+
+     HfstCompactBasicTransducer::WeightType
+     HfstCompactBasicTransducer::get_final_weight(HfstState s) const
+     {
+       if (s >= final_weights.size())
+         HFST_THROW(StateIndexOutOfBoundsException);
+       if (final_weights[s] == NOT_FINAL)
+         HFST_THROW(StateIsNotFinalException);
+       return final_weights[s];
+     }
+
+     const HfstBasicTransducer::HfstAlphabet &
+     HfstCompactBasicTransducer::get_alphabet() const
+     {
+       return alphabet;
+     }
+
+     namespace {
+       /* An accessor of an HfstCompactBasicTransducer for the algorithms
+          in HfstTransducerTraversal.h. */
+       class CompactTransducerAccessor
+       {
+         const HfstCompactBasicTransducer &fsm;
+       public:
+         typedef const HfstCompactBasicTransducer::Transition *
+           TransitionIterator;
+
+         CompactTransducerAccessor(const HfstCompactBasicTransducer &f):
+           fsm(f) {}
+
+         unsigned int number_of_states() const
+         { return fsm.get_number_of_states(); }
+         TransitionIterator transitions_begin(HfstState s) const
+         { return fsm.transitions_begin(s); }
+         TransitionIterator transitions_end(HfstState s) const
+         { return fsm.transitions_end(s); }
+         static HfstState target(TransitionIterator it)
+         { return it->target; }
+         static SymbolId input(TransitionIterator it)
+         { return it->input; }
+         static SymbolId output(TransitionIterator it)
+         { return it->output; }
+         static float weight(TransitionIterator it)
+         { return it->weight; }
+         bool is_final_state(HfstState s) const
+         { return fsm.is_final_state(s); }
+         float final_weight(HfstState s) const
+         { return fsm.get_final_weight(s); }
+       };
+     }
+
+     std::vector<std::set<HfstState> > HfstCompactBasicTransducer::topsort
+       (HfstBasicTransducer::SortDistance dist) const
+     {
+       return traversal::topsort(CompactTransducerAccessor(*this), dist);
+     }
+
+     int HfstCompactBasicTransducer::longest_path_size() const
+     {
+       return traversal::longest_path_size(CompactTransducerAccessor(*this));
+     }
+
+     std::vector<unsigned int> HfstCompactBasicTransducer::path_sizes() const
+     {
+       return traversal::path_sizes(CompactTransducerAccessor(*this));
+     }
+
+     /* The string of \a id, which may be one of the ids given to the
+        \a unknown strings of a lookup. */
+     static const std::string &symbol_string
+       (SymbolId id, const StringVector &unknown)
+     {
+       SymbolId from_top = std::numeric_limits<SymbolId>::max() - id;
+       if (from_top < unknown.size())
+         return unknown[from_top];
+       return HfstTropicalTransducerTransitionData::get_symbol_string(id);
+     }
+
+     void HfstCompactBasicTransducer::lookup
+       (const StringVector &lookup_path,
+        HfstTwoLevelPaths &results,
+        size_t * max_epsilon_cycles /*= NULL*/,
+        float * max_weight /*= NULL*/,
+        bool obey_flags /*= false*/) const
+     {
+       // Strings missing from the symbol table can't be in the alphabet,
+       // but identity and unknown transitions still match them. They get
+       // ids counted down from the largest one for this lookup only, so
+       // that looking up arbitrary input doesn't grow the symbol table.
+       SymbolIdVector id_path;
+       StringVector unknown_symbols;
+       id_path.reserve(lookup_path.size());
+       for (StringVector::const_iterator it = lookup_path.begin();
+            it != lookup_path.end(); it++)
+         {
+           SymbolId id;
+           if (! HfstTropicalTransducerTransitionData::find_symbol_id(*it, id))
+             {
+               StringVector::const_iterator u = std::find
+                 (unknown_symbols.begin(), unknown_symbols.end(), *it);
+               id = std::numeric_limits<SymbolId>::max() -
+                 (SymbolId)(u - unknown_symbols.begin());
+               if (u == unknown_symbols.end())
+                 unknown_symbols.push_back(*it);
+             }
+           id_path.push_back(id);
+         }
+
+       HfstTwoLevelIdPaths id_results;
+       lookup(id_path, id_results, max_epsilon_cycles, max_weight, obey_flags);
+
+       for (HfstTwoLevelIdPaths::const_iterator it = id_results.begin();
+            it != id_results.end(); it++)
+         {
+           StringPairVector spv;
+           spv.reserve(it->second.size());
+           for (SymbolIdPairVector::const_iterator id_it = it->second.begin();
+                id_it != it->second.end(); id_it++)
+             {
+               spv.push_back(StringPair
+                 (symbol_string(id_it->first, unknown_symbols),
+                  symbol_string(id_it->second, unknown_symbols)));
+             }
+           results.insert(HfstTwoLevelPath(it->first, spv));
+         }
+     }
+
+     void HfstCompactBasicTransducer::lookup
+       (const SymbolIdVector &lookup_path,
+        HfstTwoLevelIdPaths &results,
+        size_t * max_epsilon_cycles /*= NULL*/,
+        float * max_weight /*= NULL*/,
+        bool obey_flags /*= false*/) const
+     {
+       HfstBasicTransducer::IdLookupTables tables;
+       HfstBasicTransducer::build_id_lookup_tables(alphabet, tables);
+
+       HfstTwoLevelIdPath path_so_far;
+       StringVector flag_diacritic_path;
+       size_t cycles = (max_epsilon_cycles != NULL)? *max_epsilon_cycles : 100000;
+       HfstEpsilonHandler Eh(cycles);
+       traversal::lookup(CompactTransducerAccessor(*this), lookup_path,
+                         results, 0, 0, path_so_far, tables, Eh, cycles,
+                         max_weight,
+                         obey_flags? &flag_diacritic_path : NULL);
+     }
+
+     void HfstCompactBasicTransducer::extract_paths
+       (ExtractStringsCb &callback, int cycles /*=-1*/) const
+     {
+       traversal::extract_paths(CompactTransducerAccessor(*this), callback,
+                                cycles);
+     }
+
+   }
+
+ }
+
+#else // MAIN_TEST was defined
+
+#include <cstdlib>
+#include <cassert>
+#include <iostream>
+using namespace hfst;
+using namespace hfst::implementations;
+
+static StringVector split(const std::string &str)
+{
+  StringVector symbols;
+  for (std::string::const_iterator it = str.begin(); it != str.end(); it++)
+    symbols.push_back(std::string(1, *it));
+  return symbols;
+}
+
+int main(int argc, char * argv[])
+{
+    std::cout << "Unit tests for " __FILE__ ":";
+
+    // a b* (c:d | ?) with a loop, a weighted epsilon and a final weight
+    // on two states
+    HfstBasicTransducer basic;
+    basic.add_state(3);
+    basic.add_transition(0, HfstBasicTransition(1, "a", "a", 0.5));
+    basic.add_transition(1, HfstBasicTransition(1, "b", "b", 0.25));
+    basic.add_transition(1, HfstBasicTransition(2, "c", "d", 1));
+    basic.add_transition
+      (1, HfstBasicTransition(2, "@_IDENTITY_SYMBOL_@",
+                              "@_IDENTITY_SYMBOL_@", 2));
+    basic.add_transition(2, HfstBasicTransition(3, "@_EPSILON_SYMBOL_@",
+                                                "e", 0.125));
+    basic.set_final_weight(2, 0.5);
+    basic.set_final_weight(3, 0);
+
+    HfstCompactBasicTransducer compact(basic);
+
+    // converting back gives the same transducer
+    HfstBasicTransducer round_trip(compact);
+    HfstBasicTransducer copy;
+    compact.to_basic_transducer(copy);
+    assert(round_trip.get_max_state() == basic.get_max_state());
+    for (HfstState s = 0; s <= basic.get_max_state(); s++)
+      {
+        assert(round_trip.is_final_state(s) == basic.is_final_state(s));
+        if (basic.is_final_state(s))
+          assert(round_trip.get_final_weight(s) == basic.get_final_weight(s));
+        const HfstBasicTransitions &expected = basic[s];
+        const HfstBasicTransitions &got = round_trip[s];
+        assert(got.size() == expected.size());
+        for (unsigned int i = 0; i < got.size(); i++)
+          {
+            assert(got[i].get_target_state() ==
+                   expected[i].get_target_state());
+            assert(got[i].get_input_symbol() ==
+                   expected[i].get_input_symbol());
+            assert(got[i].get_output_symbol() ==
+                   expected[i].get_output_symbol());
+            assert(got[i].get_weight() == expected[i].get_weight());
+          }
+        assert(copy[s].size() == expected.size());
+      }
+
+    // path sizes need a transducer without cycles
+    HfstBasicTransducer acyclic;
+    acyclic.add_state(3);
+    acyclic.add_transition(0, HfstBasicTransition(1, "a", "a", 0));
+    acyclic.add_transition(1, HfstBasicTransition(2, "b", "b", 0));
+    acyclic.add_transition(0, HfstBasicTransition(2, "c", "c", 0));
+    acyclic.add_transition(2, HfstBasicTransition(3, "d", "d", 0));
+    acyclic.set_final_weight(1, 0);
+    acyclic.set_final_weight(3, 0);
+    HfstCompactBasicTransducer compact_acyclic(acyclic);
+    assert(compact_acyclic.longest_path_size() == acyclic.longest_path_size());
+    assert(compact_acyclic.path_sizes() == acyclic.path_sizes());
+    assert(compact_acyclic.longest_path_size() == 3);
+    assert(compact_acyclic.topsort(HfstBasicTransducer::MaximumDistance) ==
+           acyclic.topsort(HfstBasicTransducer::MaximumDistance));
+    assert(compact_acyclic.topsort(HfstBasicTransducer::MinimumDistance) ==
+           acyclic.topsort(HfstBasicTransducer::MinimumDistance));
+
+    // lookup agrees with the mutable transducer, also for symbols that
+    // are matched by identity or not at all
+    const char * inputs[] = { "", "a", "ab", "abbc", "abx", "ax", "abcc",
+                              "x", "abbbbb", "abxyz" };
+    size_t symbols_before =
+      HfstTropicalTransducerTransitionData::number2symbol_map.size();
+    for (unsigned int i = 0; i < sizeof(inputs)/sizeof(inputs[0]); i++)
+      {
+        HfstTwoLevelPaths expected;
+        HfstTwoLevelPaths got;
+        StringVector input = split(inputs[i]);
+        basic.lookup(input, expected);
+        compact.lookup(input, got);
+        assert(got == expected);
+      }
+    assert(HfstTropicalTransducerTransitionData::number2symbol_map.size() ==
+           symbols_before);
+
+    HfstTwoLevelPaths results;
+    compact.lookup(split("abx"), results);
+    assert(results.size() == 2);
+    for (HfstTwoLevelPaths::const_iterator it = results.begin();
+         it != results.end(); it++)
+      {
+        assert(it->second.size() >= 3);
+        assert(it->second[2].first == "x");
+        assert(it->second[2].second == "x");
+      }
+
+    results.clear();
+    compact.lookup(split("ax"), results);
+    assert(results.size() == 2);
+
+    results.clear();
+    compact.lookup(split("x"), results);
+    assert(results.empty());
+
+    std::cout << std::endl << "ok" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+#endif // MAIN_TEST
@@ -0,0 +1,161 @@
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+ #ifndef _HFST_COMPACT_BASIC_TRANSDUCER_H_
+ #define _HFST_COMPACT_BASIC_TRANSDUCER_H_
+
+ /** @file HfstCompactBasicTransducer.h
+     @brief Class HfstCompactBasicTransducer */
+
+ #include <string>
+ #include <set>
+ #include <vector>
+
+ #include "../HfstSymbolDefs.h"
+ #include "../HfstExtractStrings.h"
+ #include "HfstBasicTransducer.h"
+
+ #include "../hfstdll.h"
+
+ namespace hfst {
+
+   namespace implementations {
+
+     /** @brief A frozen, read-only version of HfstBasicTransducer.
+
+         The transitions of all states are stored in one array in
+         compressed sparse row form: the transitions of state s are
+         at indices [first_transition(s), first_transition(s+1)). Final
+         weights are stored in a dense array indexed by state, with
+         infinity for non-final states. This takes one allocation for
+         all transitions instead of one per state.
+
+         Symbols are stored as SymbolIds. The transducer cannot be
+         modified; convert it to an HfstBasicTransducer for that.
+
+ \verbatim
+   HfstBasicTransducer fsm;
+   ...
+   HfstCompactBasicTransducer compact(fsm);
+   HfstTwoLevelPaths results;
+   compact.lookup(input, results);
+   HfstBasicTransducer copy(compact);
+ \endverbatim
+
+         @see HfstBasicTransducer */
+     class HfstCompactBasicTransducer
+     {
+     public:
+       typedef HfstTropicalTransducerTransitionData::WeightType WeightType;
+
+       /** @brief A transition in an HfstCompactBasicTransducer. */
+       struct Transition
+       {
+         HfstState target;
+         SymbolId input;
+         SymbolId output;
+         WeightType weight;
+       };
+
+     protected:
+       /* Index of the first transition of each state, and the number of
+          transitions as the last element. */
+       std::vector<unsigned int> transition_offsets;
+       std::vector<Transition> transitions;
+       std::vector<WeightType> final_weights;
+       HfstBasicTransducer::HfstAlphabet alphabet;
+
+     public:
+       /** @brief The name of the transducer. */
+       std::string name;
+
+       /** @brief Create an empty transducer with one non-final state. */
+       HFSTDLL HfstCompactBasicTransducer(void);
+
+       /** @brief Create a compact copy of \a graph. */
+       HFSTDLL HfstCompactBasicTransducer(const HfstBasicTransducer &graph);
+
+       /** @brief Get the number of states. */
+       HFSTDLL unsigned int get_number_of_states() const;
+
+       /** @brief Get the total number of transitions. */
+       HFSTDLL unsigned int get_number_of_transitions() const;
+
+       /** @brief Get the first transition of state \a s. */
+       HFSTDLL const Transition * transitions_begin(HfstState s) const;
+
+       /** @brief Get the end of the transitions of state \a s. */
+       HFSTDLL const Transition * transitions_end(HfstState s) const;
+
+       /** @brief Whether state \a s is final. */
+       HFSTDLL bool is_final_state(HfstState s) const;
+
+       /** @brief Get the final weight of state \a s.
+           @throws StateIndexOutOfBoundsException StateIsNotFinalException */
+       HFSTDLL WeightType get_final_weight(HfstState s) const;
+
+       /** @brief Get the alphabet of the transducer.
+           @see HfstBasicTransducer::get_alphabet */
+       HFSTDLL const HfstBasicTransducer::HfstAlphabet &get_alphabet() const;
+
+       /** @brief Copy the transducer to \a graph, replacing its
+           previous contents. */
+       HFSTDLL void to_basic_transducer(HfstBasicTransducer &graph) const;
+
+       /* ---------------------------------
+          Read-only algorithms.
+          --------------------------------- */
+
+       /** @brief Get a topological sort of the transducer.
+           @see HfstBasicTransducer::topsort */
+       HFSTDLL std::vector<std::set<HfstState> > topsort
+         (HfstBasicTransducer::SortDistance dist) const;
+
+       /** @brief The length of longest string accepted by the transducer.
+           If no string is accepted, return -1.
+           @see HfstBasicTransducer::longest_path_size */
+       HFSTDLL int longest_path_size() const;
+
+       /** @brief The lengths of strings accepted by the transducer, in
+           descending order.
+           @see HfstBasicTransducer::path_sizes */
+       HFSTDLL std::vector<unsigned int> path_sizes() const;
+
+       /** @brief Look up \a lookup_path and store the results to \a results.
+           @see HfstBasicTransducer::lookup(const StringVector&, HfstTwoLevelPaths&, size_t*, float*, bool) */
+       HFSTDLL void lookup
+         (const StringVector &lookup_path,
+          HfstTwoLevelPaths &results,
+          size_t * max_epsilon_cycles = NULL,
+          float * max_weight = NULL,
+          bool obey_flags = false) const;
+
+       /** @brief Look up \a lookup_path given as symbol ids.
+           @see HfstBasicTransducer::lookup(const SymbolIdVector&, HfstTwoLevelIdPaths&, size_t*, float*, bool) */
+       HFSTDLL void lookup
+         (const SymbolIdVector &lookup_path,
+          HfstTwoLevelIdPaths &results,
+          size_t * max_epsilon_cycles = NULL,
+          float * max_weight = NULL,
+          bool obey_flags = false) const;
+
+       /** @brief Call \a callback for every path of the transducer,
+           following each state at most \a cycles times on a path.
+           A negative \a cycles means no limit.
+           @see HfstTransducer::extract_paths(ExtractStringsCb&, int) const */
+       HFSTDLL void extract_paths(ExtractStringsCb &callback,
+                                  int cycles=-1) const;
+
+     };
+
+   }
+
+ }
+
+#endif // _HFST_COMPACT_BASIC_TRANSDUCER_H_
@@ -14,20 +14,29 @@
 namespace hfst { namespace implementations
 {
   HfstOlInputStream::HfstOlInputStream(bool weighted):
-    i_stream(),input_stream(std::cin), weighted(weighted)
+    i_stream(),input_stream(std::cin), weighted(weighted),
+    memory_mapped(false), mapped_file(NULL)
   {}
   HfstOlInputStream::HfstOlInputStream
   (const std::string &filename, bool weighted):
     filename(std::string(filename)),
     i_stream(filename.c_str(), std::ios::in | std::ios::binary),
-    input_stream(i_stream),weighted(weighted)
+    input_stream(i_stream),weighted(weighted), memory_mapped(false),
+    mapped_file(NULL)
   {}
 
   HfstOlInputStream::HfstOlInputStream
   (std::istream &is, bool weighted):
-    input_stream(is),weighted(weighted)
+    input_stream(is),weighted(weighted), memory_mapped(false),
+    mapped_file(NULL)
   {}
 
+  HfstOlInputStream::~HfstOlInputStream(void)
+  {
+    if (mapped_file != NULL)
+      { mapped_file->release(); }
+  }
+
   /* Skip the identifier string "HFST_OL_TYPE" or "HFST_OLW_TYPE" */
   void HfstOlInputStream::skip_identifier_version_3_0(void)
   { input_stream.ignore((weighted?14:13)); }
@@ -43,6 +52,11 @@ namespace hfst { namespace implementations
   {
     if (filename != string())
       { i_stream.close(); }
+    if (mapped_file != NULL)
+      {
+        mapped_file->release();
+        mapped_file = NULL;
+      }
   }
   bool HfstOlInputStream::is_open(void) const
   {
@@ -156,6 +170,9 @@ void HfstOlInputStream::ignore(unsigned int n)
   bool HfstOlInputStream::operator() (void) const
   { return is_good(); }
 
+  void HfstOlInputStream::set_memory_mapped(bool value)
+  { memory_mapped = value; }
+
   hfst_ol::Transducer * HfstOlInputStream::read_transducer(bool has_header)
   {
     if (is_eof())
@@ -166,13 +183,32 @@ void HfstOlInputStream::ignore(unsigned int n)
       if (has_header)
         skip_hfst_header();
 
+      if (memory_mapped && filename != string())
+        {
+          std::streamoff offset = i_stream.tellg();
+          if (mapped_file == NULL)
+            { mapped_file = new hfst_ol::MappedFile(filename); }
+          hfst_ol::MappedFile * file = mapped_file->share();
+          hfst_ol::Transducer * t = NULL;
+          try
+            { t = new hfst_ol::Transducer(file, (size_t)offset); }
+          catch (...)
+            {
+              file->release();
+              throw;
+            }
+          // continue reading after the mapped transducer
+          i_stream.seekg(t->get_mapped_size());
+          return t;
+        }
+
       hfst_ol::Transducer* t = new hfst_ol::Transducer(input_stream);
       //t->display();
       return t;
     }
     //catch (TransducerHasWrongTypeException e)
-    catch (const HfstException e)
-    { throw e; }
+    catch (const HfstException &)
+    { throw; }
   }
   
   
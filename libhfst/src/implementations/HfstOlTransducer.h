@@ -37,12 +37,16 @@ namespace hfst { namespace implementations
     ifstream i_stream;
     istream &input_stream;
     bool weighted;
+    bool memory_mapped;
+    // The file mapped once for all transducers read from it
+    hfst_ol::MappedFile * mapped_file;
     void skip_identifier_version_3_0(void);
     void skip_hfst_header(void);
   public:
     HfstOlInputStream(bool weighted);
     HfstOlInputStream(const std::string &filename, bool weighted);
     HfstOlInputStream(std::istream &is, bool weighted);
+    ~HfstOlInputStream(void);
     void open(void);
     void close(void);
     bool is_open(void) const;
@@ -57,6 +61,9 @@ namespace hfst { namespace implementations
     void ignore(unsigned int n);
     
     bool operator() (void) const;
+    /* Whether transducers read from a file are memory-mapped instead of
+       copied into memory. Has no effect on streams that are not files. */
+    void set_memory_mapped(bool value);
     hfst_ol::Transducer * read_transducer(bool has_header);
     
     // 1=unweighted, 2=weighted
@@ -0,0 +1,363 @@
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+ #ifndef _HFST_TRANSDUCER_TRAVERSAL_H_
+ #define _HFST_TRANSDUCER_TRAVERSAL_H_
+
+ /** @file HfstTransducerTraversal.h
+     @brief Read-only algorithms shared by HfstBasicTransducer and
+     HfstCompactBasicTransducer. */
+
+ #include <set>
+ #include <vector>
+ #include <algorithm>
+
+ #include "HfstBasicTransducer.h"
+ #include "../HfstExtractStrings.h"
+
+ namespace hfst {
+
+   namespace implementations {
+
+     /* The algorithms below are templated on an accessor that gives the
+        states and transitions of a transducer:
+
+          typedef ... TransitionIterator;
+          unsigned int number_of_states() const;
+          TransitionIterator transitions_begin(HfstState s) const;
+          TransitionIterator transitions_end(HfstState s) const;
+          static HfstState target(TransitionIterator it);
+          static SymbolId input(TransitionIterator it);
+          static SymbolId output(TransitionIterator it);
+          static float weight(TransitionIterator it);
+          bool is_final_state(HfstState s) const;
+          float final_weight(HfstState s) const;
+
+        The start state is 0. */
+     namespace traversal {
+
+       /* An accessor of an HfstBasicTransducer. */
+       class BasicTransducerAccessor
+       {
+         const HfstBasicTransducer &graph;
+       public:
+         typedef HfstBasicTransitions::const_iterator TransitionIterator;
+
+         BasicTransducerAccessor(const HfstBasicTransducer &g): graph(g) {}
+
+         unsigned int number_of_states() const
+         { return graph.get_max_state() + 1; }
+         TransitionIterator transitions_begin(HfstState s) const
+         { return graph[s].begin(); }
+         TransitionIterator transitions_end(HfstState s) const
+         { return graph[s].end(); }
+         static HfstState target(TransitionIterator it)
+         { return it->get_target_state(); }
+         static SymbolId input(TransitionIterator it)
+         { return it->get_input_number(); }
+         static SymbolId output(TransitionIterator it)
+         { return it->get_output_number(); }
+         static float weight(TransitionIterator it)
+         { return it->get_weight(); }
+         bool is_final_state(HfstState s) const
+         { return graph.is_final_state(s); }
+         float final_weight(HfstState s) const
+         { return graph.get_final_weight(s); }
+       };
+
+       /* A topological sort of the transducer, see
+          HfstBasicTransducer::topsort. */
+       template <class Accessor>
+       std::vector<std::set<HfstState> > topsort
+         (const Accessor &fsm, HfstBasicTransducer::SortDistance dist)
+       {
+         typedef std::set<HfstState>::const_iterator StateIt;
+         unsigned int current_distance = 0; // topological distance
+         HfstBasicTransducer::TopologicalSort TopSort;
+
+         if (fsm.number_of_states() == 0)
+           return std::vector<std::set<HfstState> >();
+         TopSort.set_biggest_state_number(fsm.number_of_states() - 1);
+         bool overwrite = (dist == HfstBasicTransducer::MaximumDistance);
+         TopSort.set_state_at_distance(0, current_distance, overwrite);
+
+         bool new_states_found = false; // end condition for do-while loop
+         do
+           {
+             new_states_found = false;
+             // states that are accessible from the current set of states
+             std::set<HfstState> new_states;
+             const std::set<HfstState> & states =
+               TopSort.get_states_at_distance(current_distance);
+             for (StateIt state_it = states.begin();
+                  state_it != states.end(); state_it++)
+               {
+                 for (typename Accessor::TransitionIterator it
+                        = fsm.transitions_begin(*state_it);
+                      it != fsm.transitions_end(*state_it); it++)
+                   {
+                     new_states_found = true;
+                     new_states.insert(Accessor::target(it));
+                   }
+               }
+             // set each accessible state at distance one higher than the
+             // current distance
+             for (StateIt it = new_states.begin(); it != new_states.end(); it++)
+               {
+                 TopSort.set_state_at_distance
+                   (*it, current_distance + 1, overwrite);
+               }
+             current_distance++;
+           }
+         while (new_states_found);
+
+         return TopSort.states_at_distance;
+       }
+
+       /* The length of longest string accepted by the transducer, or -1
+          if no string is accepted. */
+       template <class Accessor>
+       int longest_path_size(const Accessor &fsm)
+       {
+         std::vector<std::set<HfstState> > states_sorted
+           = topsort(fsm, HfstBasicTransducer::MaximumDistance);
+         // go through all sets of states in descending order, returning
+         // the distance of the first final state
+         for (int distance = (int)states_sorted.size() - 1;
+              distance >= 0; distance--)
+           {
+             const std::set<HfstState> & states = states_sorted[distance];
+             for (std::set<HfstState>::const_iterator it = states.begin();
+                  it != states.end(); it++)
+               {
+                 if (fsm.is_final_state(*it))
+                   return distance;
+               }
+           }
+         return -1;
+       }
+
+       /* The lengths of strings accepted by the transducer, in descending
+          order. */
+       template <class Accessor>
+       std::vector<unsigned int> path_sizes(const Accessor &fsm)
+       {
+         std::vector<unsigned int> result;
+         std::vector<std::set<HfstState> > states_sorted
+           = topsort(fsm, HfstBasicTransducer::MinimumDistance);
+         for (int distance = (int)states_sorted.size() - 1;
+              distance >= 0; distance--)
+           {
+             const std::set<HfstState> & states = states_sorted[distance];
+             for (std::set<HfstState>::const_iterator it = states.begin();
+                  it != states.end(); it++)
+               {
+                 if (fsm.is_final_state(*it))
+                   {
+                     result.push_back((unsigned int)distance);
+                     break; // go to next set of states
+                   }
+               }
+           }
+         return result;
+       }
+
+       /* Look up \a lookup_path from \a lookup_index on, starting at
+          \a state, see HfstBasicTransducer::lookup. */
+       template <class Accessor>
+       void lookup
+         (const Accessor &fsm,
+          const SymbolIdVector &lookup_path,
+          HfstTwoLevelIdPaths &results,
+          HfstState state,
+          unsigned int lookup_index,
+          HfstTwoLevelIdPath &path_so_far,
+          const HfstBasicTransducer::IdLookupTables &tables,
+          HfstEpsilonHandler Eh,
+          size_t max_epsilon_cycles,
+          float * max_weight,
+          StringVector * flag_diacritic_path)
+       {
+         if (! Eh.can_continue(state)) {
+           return;
+         }
+         if (max_weight != NULL && path_so_far.first > *max_weight) {
+           return;
+         }
+
+         bool at_end = (lookup_index == lookup_path.size());
+         if (at_end && fsm.is_final_state(state))
+           {
+             float final_weight = fsm.final_weight(state);
+             path_so_far.first += final_weight;
+             if (max_weight == NULL || !(path_so_far.first > *max_weight))
+               results.insert(path_so_far);
+             path_so_far.first -= final_weight;
+           }
+
+         SymbolId lookup_symbol = at_end? 0 : lookup_path[lookup_index];
+         bool lookup_symbol_known = ! at_end && tables.in_alphabet_id(lookup_symbol);
+
+         for (typename Accessor::TransitionIterator it
+                = fsm.transitions_begin(state);
+              it != fsm.transitions_end(state); it++)
+           {
+             SymbolId isymbol = Accessor::input(it);
+             SymbolId osymbol = Accessor::output(it);
+             bool input_symbol_consumed = false;
+             if (! HfstBasicTransducer::is_possible_input
+                 (isymbol, tables.is_flag_id(isymbol), at_end, lookup_symbol,
+                  lookup_symbol_known, input_symbol_consumed,
+                  flag_diacritic_path))
+               continue;
+
+             // identity symbol is replaced with the lookup symbol on both
+             // sides, unknown symbol only on the input side
+             if (isymbol == IDENTITY_SYMBOL_ID)
+               {
+                 isymbol = lookup_symbol;
+                 osymbol = isymbol;
+               }
+             else if (isymbol == UNKNOWN_SYMBOL_ID)
+               {
+                 isymbol = lookup_symbol;
+               }
+
+             bool is_flag = (flag_diacritic_path != NULL &&
+                             tables.is_flag_id(isymbol));
+             if (is_flag)
+               flag_diacritic_path->push_back
+                 (HfstTropicalTransducerTransitionData::get_symbol_string(isymbol));
+             path_so_far.second.push_back(SymbolIdPair(isymbol, osymbol));
+             path_so_far.first += Accessor::weight(it);
+
+             if (input_symbol_consumed) {
+               HfstEpsilonHandler Eh_consumed(max_epsilon_cycles);
+               lookup(fsm, lookup_path, results, Accessor::target(it),
+                      lookup_index + 1, path_so_far, tables, Eh_consumed,
+                      max_epsilon_cycles, max_weight, flag_diacritic_path);
+             }
+             else {
+               Eh.push_back(state);
+               lookup(fsm, lookup_path, results, Accessor::target(it),
+                      lookup_index, path_so_far, tables, Eh,
+                      max_epsilon_cycles, max_weight, flag_diacritic_path);
+             }
+
+             path_so_far.first -= Accessor::weight(it);
+             path_so_far.second.pop_back();
+             if (is_flag)
+               flag_diacritic_path->pop_back();
+           }
+       }
+
+       /* Orders transitions so that targets visited fewer times on the
+          current path come first. */
+       template <class Accessor>
+       struct compare_by_visitations
+       {
+         const std::vector<unsigned int> & visitations;
+         compare_by_visitations(const std::vector<unsigned int> & v):
+           visitations(v) {}
+         bool operator()(typename Accessor::TransitionIterator t1,
+                         typename Accessor::TransitionIterator t2) const
+         {
+           return visitations[Accessor::target(t1)] <
+             visitations[Accessor::target(t2)];
+         }
+       };
+
+       /* Call \a callback for the paths that continue \a spv from \a state,
+          see HfstTransducer::extract_paths. Return whether the search
+          should continue. */
+       template <class Accessor>
+       bool extract_paths
+         (const Accessor &fsm,
+          HfstState state,
+          std::vector<unsigned int> &path_visitations,
+          float weight_sum,
+          ExtractStringsCb &callback,
+          int cycles,
+          StringPairVector &spv)
+       {
+         if (cycles >= 0 && path_visitations[state] > (unsigned int)cycles)
+           return true;
+         path_visitations[state]++;
+
+         if (spv.size() != 0)
+           {
+             bool final = fsm.is_final_state(state);
+             HfstTwoLevelPath path
+               (weight_sum + (final? fsm.final_weight(state) : 0), spv);
+             ExtractStringsCb::RetVal ret = callback(path, final);
+             if (!ret.continueSearch || !ret.continuePath)
+               {
+                 path_visitations[state]--;
+                 return ret.continueSearch;
+               }
+           }
+
+         std::vector<typename Accessor::TransitionIterator> arcs;
+         for (typename Accessor::TransitionIterator it
+                = fsm.transitions_begin(state);
+              it != fsm.transitions_end(state); it++)
+           {
+             arcs.push_back(it);
+           }
+         std::stable_sort(arcs.begin(), arcs.end(),
+                          compare_by_visitations<Accessor>(path_visitations));
+
+         bool res = true;
+         for (size_t i = 0; i < arcs.size() && res; i++)
+           {
+             typename Accessor::TransitionIterator it = arcs[i];
+             spv.push_back(StringPair
+               (HfstTropicalTransducerTransitionData::get_symbol_string
+                  (Accessor::input(it)),
+                HfstTropicalTransducerTransitionData::get_symbol_string
+                  (Accessor::output(it))));
+             res = extract_paths(fsm, Accessor::target(it), path_visitations,
+                                 weight_sum + Accessor::weight(it), callback,
+                                 cycles, spv);
+             spv.pop_back();
+           }
+
+         path_visitations[state]--;
+         return res;
+       }
+
+       /* Call \a callback for every path of the transducer, following each
+          state at most \a cycles times on a path, or without limit if
+          \a cycles is negative. */
+       template <class Accessor>
+       void extract_paths
+         (const Accessor &fsm, ExtractStringsCb &callback, int cycles)
+       {
+         if (fsm.number_of_states() == 0)
+           return;
+
+         std::vector<unsigned int> path_visitations(fsm.number_of_states(), 0);
+         StringPairVector spv;
+         extract_paths(fsm, 0, path_visitations, 0, callback, cycles, spv);
+
+         // add epsilon path, if needed
+         if (fsm.is_final_state(0))
+           {
+             HfstTwoLevelPath epsilon_path(fsm.final_weight(0), StringPairVector());
+             callback(epsilon_path, true /* final */);
+           }
+       }
+
+     }
+
+   }
+
+ }
+
+#endif // _HFST_TRANSDUCER_TRAVERSAL_H_
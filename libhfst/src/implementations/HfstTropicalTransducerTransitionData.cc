@@ -123,6 +123,30 @@ namespace hfst {
         return it->second;
       }
 
+      SymbolId HfstTropicalTransducerTransitionData::get_symbol_id(const SymbolType &symbol)
+      {
+        if (symbol == "")
+          HFST_THROW_MESSAGE
+            (EmptyStringException,
+             "HfstTropicalTransducerTransitionData::get_symbol_id");
+        return get_number(symbol);
+      }
+
+      bool HfstTropicalTransducerTransitionData::find_symbol_id(const SymbolType &symbol, SymbolId &id)
+      {
+        Symbol2NumberMap::const_iterator it = symbol2number_map.find(symbol);
+        if (it == symbol2number_map.end())
+          return false;
+        id = it->second;
+        return true;
+      }
+
+      const HfstTropicalTransducerTransitionData::SymbolType &
+      HfstTropicalTransducerTransitionData::get_symbol_string(SymbolId id)
+      {
+        return get_symbol(id);
+      }
+
 
     void HfstTropicalTransducerTransitionData::print_transition_data()
       {
@@ -258,9 +282,9 @@ namespace hfst {
 
     Symbol2NumberMapInitializer::Symbol2NumberMapInitializer
     (HfstTropicalTransducerTransitionData::Symbol2NumberMap &map) {
-      map["@_EPSILON_SYMBOL_@"] = 0;
-      map["@_UNKNOWN_SYMBOL_@"] = 1;
-      map["@_IDENTITY_SYMBOL_@"] = 2;
+      map["@_EPSILON_SYMBOL_@"] = EPSILON_SYMBOL_ID;
+      map["@_UNKNOWN_SYMBOL_@"] = UNKNOWN_SYMBOL_ID;
+      map["@_IDENTITY_SYMBOL_@"] = IDENTITY_SYMBOL_ID;
     }
 
   } // namespace implementations
@@ -20,6 +20,7 @@
 #include <iosfwd>
 #include <vector>
 #include "../HfstExceptionDefs.h"
+#include "../HfstSymbolDefs.h"
 
 #include "../hfstdll.h"
 
@@ -99,6 +100,21 @@ namespace hfst {
       static std::vector<unsigned int> get_reverse_harmonization_vector
         (const std::map<SymbolType, unsigned int> &symbols);
 
+      /** @brief Get the id of \a symbol, interning \a symbol if it has
+          not been seen before.
+
+          @throws EmptyStringException if \a symbol is the empty string. */
+      HFSTDLL static SymbolId get_symbol_id(const SymbolType &symbol);
+
+      /** @brief Get the id of \a symbol to \a id without interning it.
+          @return Whether \a symbol has an id. */
+      HFSTDLL static bool find_symbol_id(const SymbolType &symbol, SymbolId &id);
+
+      /** @brief Get the symbol whose id is \a id.
+
+          @throws HfstFatalException if \a id is not mapped to any symbol. */
+      HFSTDLL static const SymbolType &get_symbol_string(SymbolId id);
+
     protected:
       /* Get the symbol that is mapped as \a number */
       static const std::string &get_symbol(unsigned int number);
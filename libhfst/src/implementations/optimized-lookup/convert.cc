@@ -7,6 +7,14 @@
 // See the file COPYING included with this distribution for more
 // information.
 
+#include <algorithm>
+#include <cstdlib>
+
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  include <thread>
+#  include <exception>
+#endif
+
 #include "convert.h"
 
 #ifdef _MSC_VER
@@ -29,64 +37,186 @@ namespace fst
 
 namespace hfst_ol {
 
-void write_transitions_from_state_placeholders(
-    TransducerTable<TransitionW> & transition_table,
-    std::vector<hfst_ol::StatePlaceholder>
-    & state_placeholders,
-    std::set<SymbolNumber> & flag_symbols)
+namespace {
+
+TransitionW transition_from_placeholder(
+    SymbolNumber symbol,
+    TransitionPlaceholder const & transition,
+    std::vector<hfst_ol::StatePlaceholder> const & state_placeholders)
 {
-    for (std::vector<StatePlaceholder>::iterator it =
-             state_placeholders.begin(); it!=state_placeholders.end(); ++it) {
+    // before writing each transition, find out whether its
+    // target is simple (ie. should point directly to TA entry)
+    unsigned int target;
+    if (state_placeholders[transition.target].is_simple()) {
+        target = state_placeholders[transition.target].first_transition +
+        TRANSITION_TARGET_TABLE_START - 1;
+    } else {
+        target = state_placeholders[transition.target].start_index;
+    }
+    return TransitionW(symbol, transition.output, target, transition.weight);
+}
 
-        // Insert a finality marker unless this is the first state,
-        // the finality of which is determined by the index table
-        if (it->state_number != 0) {
-            transition_table.append(
-                TransitionW(
-                    it->final, it->final_weight));
-        }
-        
-        // Then we iterate through the symbols each state has.
-    // First we do a pass for epsilon and flags (they have to come
-    // first), then everything else.
-        if (it->input_present(0)) {
-            add_transitions_with(0, it->get_transition_placeholders(0),
-                                 transition_table,
-                                 state_placeholders,
-                                 flag_symbols);
+void set_transitions_with(SymbolNumber symbol,
+                          std::vector<TransitionPlaceholder> const & transitions,
+                          TransducerTable<TransitionW> & transition_table,
+                          size_t & position,
+                          std::vector<hfst_ol::StatePlaceholder> const
+                          & state_placeholders)
+{
+    for (std::vector<TransitionPlaceholder>::const_iterator it =
+             transitions.begin(); it != transitions.end(); ++it) {
+        transition_table.set(position++, transition_from_placeholder(
+                                 symbol, *it, state_placeholders));
     }
-    for (std::set<hfst_ol::SymbolNumber>::iterator flag_it =
-         flag_symbols.begin(); flag_it != flag_symbols.end();
-         ++flag_it) {
-        if (it->input_present(*flag_it)) {
-            hfst_ol::add_transitions_with(
-                *flag_it,
-                it->get_transition_placeholders(*flag_it),
-                transition_table,
-                state_placeholders,
-                flag_symbols);
-            
+}
+
+/* Writes the transitions of a range of states to the positions given
+   for each state in a table that already has room for them. */
+struct TransitionWriter: public StateRangeTask
+{
+    TransducerTable<TransitionW> & transition_table;
+    std::vector<hfst_ol::StatePlaceholder> & state_placeholders;
+    std::set<SymbolNumber> const & flag_symbols;
+    std::vector<size_t> const & positions;
+
+    TransitionWriter(TransducerTable<TransitionW> & table,
+                     std::vector<hfst_ol::StatePlaceholder> & states,
+                     std::set<SymbolNumber> const & flags,
+                     std::vector<size_t> const & state_positions):
+    transition_table(table), state_placeholders(states),
+    flag_symbols(flags), positions(state_positions) {}
+
+    void run(unsigned int, unsigned int begin, unsigned int end)
+        {
+            for (unsigned int s = begin; s < end; ++s) {
+                StatePlaceholder & state = state_placeholders[s];
+                size_t position = positions[s];
+                // Insert a finality marker unless this is the first state,
+                // the finality of which is determined by the index table
+                if (state.state_number != 0) {
+                    transition_table.set(position++, TransitionW(
+                                             state.final, state.final_weight));
+                }
+                // Then we iterate through the symbols each state has.
+                // First we do a pass for epsilon and flags (they have to come
+                // first), then everything else.
+                if (state.input_present(0)) {
+                    set_transitions_with(0, state.get_transition_placeholders(0),
+                                         transition_table, position,
+                                         state_placeholders);
+                }
+                for (std::set<SymbolNumber>::const_iterator flag_it =
+                         flag_symbols.begin(); flag_it != flag_symbols.end();
+                     ++flag_it) {
+                    if (state.input_present(*flag_it)) {
+                        set_transitions_with(
+                            *flag_it, state.get_transition_placeholders(*flag_it),
+                            transition_table, position, state_placeholders);
+                    }
+                }
+                for (unsigned int i = 1;
+                     i < state.symbol_to_transition_placeholder_v.size(); ++i) {
+                    if (!state.input_present(i) || flag_symbols.count(i) != 0) {
+                        continue;
+                    }
+                    set_transitions_with(i, state.get_transition_placeholders(i),
+                                         transition_table, position,
+                                         state_placeholders);
+                }
+            }
         }
+};
+
+}
+
+unsigned int resolve_thread_count(unsigned int threads)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
     }
-    for (unsigned int i = 1; i < it->symbol_to_transition_placeholder_v.size();
-         ++i) {
-        if (!it->input_present(i) ||
-            flag_symbols.count(i) != 0) {
-        continue;
+#endif
+    return threads == 0 ? 1 : threads;
+}
+
+void run_state_ranges(StateRangeTask & task, unsigned int n, unsigned int chunks)
+{
+    // Below this many states per range threads cost more than they save
+    const unsigned int MIN_STATES_PER_CHUNK = 4096;
+    if (chunks > n / MIN_STATES_PER_CHUNK) {
+        chunks = n / MIN_STATES_PER_CHUNK;
+    }
+    if (chunks <= 1) {
+        task.run(0, 0, n);
+        return;
+    }
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(chunks);
+    for (unsigned int c = 0; c < chunks; ++c) {
+        unsigned int begin = hfst::size_t_to_uint((size_t)n * c / chunks);
+        unsigned int end = hfst::size_t_to_uint((size_t)n * (c + 1) / chunks);
+        workers.push_back(std::thread([&task, &errors, c, begin, end]() {
+                    try {
+                        task.run(c, begin, end);
+                    } catch (...) {
+                        errors[c] = std::current_exception();
+                    }
+                }));
+    }
+    for (unsigned int c = 0; c < chunks; ++c) {
+        workers[c].join();
+    }
+    for (unsigned int c = 0; c < chunks; ++c) {
+        if (errors[c]) {
+            std::rethrow_exception(errors[c]);
         }
-        hfst_ol::add_transitions_with(i,
-                                      it->get_transition_placeholders(i),
-                                      transition_table,
-                                      state_placeholders,
-                                      flag_symbols);
     }
+#else
+    for (unsigned int c = 0; c < chunks; ++c) {
+        task.run(c, (unsigned int)((size_t)n * c / chunks),
+                 (unsigned int)((size_t)n * (c + 1) / chunks));
     }
+#endif
+}
+
+void write_transitions_from_state_placeholders(
+    TransducerTable<TransitionW> & transition_table,
+    std::vector<hfst_ol::StatePlaceholder>
+    & state_placeholders,
+    std::set<SymbolNumber> & flag_symbols)
+{
+    write_transitions_from_state_placeholders(
+        transition_table, state_placeholders, flag_symbols, 1);
+}
+
+void write_transitions_from_state_placeholders(
+    TransducerTable<TransitionW> & transition_table,
+    std::vector<hfst_ol::StatePlaceholder>
+    & state_placeholders,
+    std::set<SymbolNumber> & flag_symbols,
+    unsigned int threads)
+{
+    // Every state gets a finality marker except the first one, then
+    // come its transitions
+    std::vector<size_t> positions;
+    positions.reserve(state_placeholders.size());
+    size_t position = transition_table.size();
+    for (std::vector<StatePlaceholder>::const_iterator it =
+             state_placeholders.begin(); it != state_placeholders.end(); ++it) {
+        positions.push_back(position);
+        position += (it->state_number != 0 ? 1 : 0) + it->number_of_transitions();
+    }
+    transition_table.resize(position, TransitionW(false, INFINITE_WEIGHT));
+
+    TransitionWriter writer(transition_table, state_placeholders,
+                            flag_symbols, positions);
+    run_state_ranges(writer, hfst::size_t_to_uint(state_placeholders.size()),
+                     resolve_thread_count(threads));
 
-        
     // one final padding transition
     transition_table.append(hfst_ol::TransitionW(
                 false, hfst_ol::INFINITE_WEIGHT));
-
 }
 
 void add_transitions_with(SymbolNumber symbol,
@@ -96,22 +226,11 @@ void add_transitions_with(SymbolNumber symbol,
               & state_placeholders,
               std::set<SymbolNumber> & flag_symbols)
 {
+    (void)flag_symbols;
     for (std::vector<TransitionPlaceholder>::iterator it = transitions.begin();
      it != transitions.end(); ++it) {
-    // before writing each transition, find out whether its
-    // target is simple (ie. should point directly to TA entry)
-    unsigned int target;
-    if (state_placeholders[it->target].is_simple()) {
-        target = state_placeholders[it->target].first_transition +
-        TRANSITION_TARGET_TABLE_START - 1;
-    } else {
-        target = state_placeholders[it->target].start_index;
-    }
-    transition_table.append(TransitionW(
-                    symbol,
-                    it->output,
-                    target,
-                    it->weight));
+        transition_table.append(transition_from_placeholder(
+                                    symbol, *it, state_placeholders));
     }
 }
 
@@ -129,6 +248,224 @@ bool compare_states_by_state_number(
     return lhs.state_number < rhs.state_number;
 }
 
+namespace {
+
+inline unsigned int count_set_bits(unsigned int word)
+{
+#if defined(__GNUC__)
+    return __builtin_popcount(word);
+#else
+    unsigned int n = 0;
+    for (; word != 0; word &= word - 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// The number of unset bits in \a word below the lowest set one,
+// \a word being nonzero
+inline unsigned int count_trailing_zeros(unsigned int word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(word);
+#else
+    unsigned int n = 0;
+    for (; (word & 1u) == 0; word >>= 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+}
+
+PackingParameters PackingParameters::from_options(std::string const & options)
+{
+    PackingParameters parameters;
+    std::string::size_type start = 0;
+    while (start <= options.size()) {
+        std::string::size_type end = options.find(',', start);
+        if (end == std::string::npos) {
+            end = options.size();
+        }
+        std::string option = options.substr(start, end - start);
+        std::string::size_type eq = option.find('=');
+        std::string name = option.substr(0, eq);
+        std::string value = eq == std::string::npos ?
+            std::string() : option.substr(eq + 1);
+        if (name == "quick") {
+            parameters.packing_aggression = (float)0.5;
+            parameters.floor_jump_threshold = 1;
+        } else if (name == "packing-aggression" && value != "") {
+            parameters.packing_aggression = (float)atof(value.c_str());
+        } else if (name == "floor-jump-threshold" && value != "") {
+            parameters.floor_jump_threshold = atoi(value.c_str());
+        } else if (name == "density-sort") {
+            parameters.sort_by_density = true;
+        } else if (name == "threads" && value != "") {
+            parameters.threads = (unsigned int)atoi(value.c_str());
+        }
+        start = end + 1;
+    }
+    return parameters;
+}
+
+unsigned int IndexPlaceholders::next_unused(unsigned int position) const
+{
+    unsigned int word = position / BITS_PER_WORD;
+    if (word >= used_bits.size()) {
+        return position;
+    }
+    // Pretend the bits below position are used
+    unsigned int bits = used_bits[word] |
+        ((1u << (position % BITS_PER_WORD)) - 1u);
+    while (bits == UINT_MAX) {
+        if (++word == used_bits.size()) {
+            return word * BITS_PER_WORD;
+        }
+        bits = used_bits[word];
+    }
+    return word * BITS_PER_WORD + count_trailing_zeros(~bits);
+}
+
+unsigned int IndexPlaceholders::count_used(unsigned int first,
+                                           unsigned int count) const
+{
+    unsigned int end = first + count;
+    if (end > used_bits.size() * BITS_PER_WORD) {
+        end = hfst::size_t_to_uint(used_bits.size() * BITS_PER_WORD);
+    }
+    unsigned int n = 0;
+    while (first < end) {
+        unsigned int bit = first % BITS_PER_WORD;
+        unsigned int bits = used_bits[first / BITS_PER_WORD] >> bit;
+        unsigned int span = BITS_PER_WORD - bit;
+        if (end - first < span) {
+            span = end - first;
+            bits &= (1u << span) - 1u;
+        }
+        n += count_set_bits(bits);
+        first += span;
+    }
+    return n;
+}
+
+unsigned int IndexPlaceholders::unused_bits(unsigned int position) const
+{
+    unsigned int word = position / BITS_PER_WORD;
+    unsigned int bit = position % BITS_PER_WORD;
+    unsigned int low = word < used_bits.size() ? used_bits[word] : 0u;
+    if (bit == 0) {
+        return ~low;
+    }
+    unsigned int high = word + 1 < used_bits.size() ? used_bits[word + 1] : 0u;
+    return ~((low >> bit) | (high << (BITS_PER_WORD - bit)));
+}
+
+unsigned int IndexPlaceholders::first_fit(
+    std::vector<unsigned int> const & offsets,
+    unsigned int position) const
+{
+    position = next_unused(position);
+    while (true) {
+        unsigned int candidates = ~0u;
+        for (std::vector<unsigned int>::const_iterator it = offsets.begin();
+             it != offsets.end() && candidates != 0; ++it) {
+            candidates &= unused_bits(position + *it);
+        }
+        if (candidates != 0) {
+            return position + count_trailing_zeros(candidates);
+        }
+        position += BITS_PER_WORD;
+    }
+}
+
+std::vector<unsigned int> IndexPlaceholders::state_offsets(
+    StatePlaceholder const & state,
+    std::set<SymbolNumber> const & flag_symbols)
+{
+    std::vector<unsigned int> offsets(1, 0);
+    for (std::vector<std::vector<TransitionPlaceholder> >::const_iterator it =
+             state.transition_placeholders.begin();
+         it != state.transition_placeholders.end(); ++it) {
+        SymbolNumber index_offset = it->at(0).input;
+        if (flag_symbols.count(index_offset) != 0) {
+            index_offset = 0;
+        }
+        offsets.push_back(index_offset + 1u);
+    }
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    return offsets;
+}
+
+void place_states(std::vector<StatePlaceholder> & states,
+                  std::vector<unsigned int> const & order,
+                  std::set<SymbolNumber> const & flag_symbols,
+                  SymbolNumber input_symbols,
+                  PackingParameters const & packing,
+                  IndexPlaceholders & used_indices)
+{
+    // The starting state has index 0. Used indices are kept in a bitmap (at
+    // the beginning, every index below or equal to the alphabet size is
+    // available except index 0). For every state (in the TIA) thereafter, we
+    // check each available starting index to see if it fits, skipping runs of
+    // used indices a word at a time.
+
+    // The starting state is special because it will have a TIA entry even if
+    // it's simple, so we deal with it every time.
+
+    unsigned int first_available_index = 0;
+    unsigned int previous_first_index = 0;
+    unsigned int previous_successful_index = 0;
+    int floor_stuck_counter = 0;
+    std::vector<unsigned int> transition_offsets;
+    for (std::vector<unsigned int>::const_iterator order_it = order.begin();
+         order_it != order.end(); ++order_it) {
+        StatePlaceholder & state = states[*order_it];
+        std::vector<unsigned int> offsets =
+            IndexPlaceholders::state_offsets(state, flag_symbols);
+
+        unsigned int i = used_indices.first_fit(offsets, first_available_index);
+        state.start_index = i;
+        previous_successful_index = i;
+        // Once we've found a starting index, insert a finality marker and
+        // mark all the used indices along with where their transitions are
+        state.symbol_offsets(flag_symbols, transition_offsets);
+        used_indices.assign(i, state.state_number, NO_SYMBOL_NUMBER);
+        for (std::vector<std::vector<TransitionPlaceholder> >::const_iterator
+                 tr_it = state.transition_placeholders.begin();
+             tr_it != state.transition_placeholders.end(); ++tr_it) {
+            SymbolNumber index_offset = tr_it->at(0).input;
+            if (flag_symbols.count(index_offset) != 0) {
+                index_offset = 0;
+            }
+            used_indices.assign(i + index_offset + 1, state.state_number,
+                                index_offset, transition_offsets[index_offset]);
+        }
+
+        first_available_index = used_indices.next_unused(first_available_index);
+        while (used_indices.unsuitable(first_available_index, input_symbols,
+                                       packing.packing_aggression)) {
+            first_available_index =
+                used_indices.next_unused(first_available_index + 1);
+        }
+        if (first_available_index == previous_first_index) {
+            if (floor_stuck_counter > packing.floor_jump_threshold) {
+                first_available_index = previous_successful_index + 1;
+                floor_stuck_counter = 0;
+                previous_first_index = first_available_index;
+            } else {
+                ++floor_stuck_counter;
+            }
+        } else {
+            previous_first_index = first_available_index;
+            floor_stuck_counter = 0;
+        }
+    }
+}
+
 #if HAVE_OPENFST
 
 bool check_finality(TransduceR * tr, StateId s)
@@ -10,6 +10,8 @@
 #ifndef _HFST_OL_CONVERT_H_
 #define _HFST_OL_CONVERT_H_
 
+#include <climits>
+
 #include "transducer.h"
 #include "pmatch.h"
 
@@ -98,8 +100,8 @@ struct StatePlaceholder {
             if (input_present(input)) {
                 return;
             }
-            while (symbol_to_transition_placeholder_v.size() <= input) {
-                symbol_to_transition_placeholder_v.push_back(UINT_MAX);
+            if (symbol_to_transition_placeholder_v.size() <= input) {
+                symbol_to_transition_placeholder_v.resize(input + 1, UINT_MAX);
             }
             symbol_to_transition_placeholder_v[input] = hfst::size_t_to_uint(transition_placeholders.size());
             transition_placeholders.push_back(std::vector<TransitionPlaceholder>());
@@ -190,6 +192,32 @@ struct StatePlaceholder {
             (HfstFatalException,
              message);
     }
+
+    /* symbol_offset for every input symbol of the state at once, indexed
+       by symbol number. */
+    void symbol_offsets(std::set<SymbolNumber> const & flag_symbols,
+                        std::vector<unsigned int> & offsets) const {
+        offsets.assign(symbol_to_transition_placeholder_v.size(), 0);
+        unsigned int offset = 0;
+        if (input_present(0)) {
+            offset = hfst::size_t_to_uint(
+                transition_placeholders[symbol_to_transition_placeholder_v[0]].size());
+        }
+        for(std::set<SymbolNumber>::const_iterator flag_it = flag_symbols.begin();
+            flag_it != flag_symbols.end(); ++flag_it) {
+            if (input_present(*flag_it)) {
+                offset += hfst::size_t_to_uint(
+                    transition_placeholders[symbol_to_transition_placeholder_v[*flag_it]].size());
+            }
+        }
+        for(unsigned int i = 1; i < symbol_to_transition_placeholder_v.size(); ++i) {
+            if (input_present(i) && flag_symbols.count(i) == 0) {
+                offsets[i] = offset;
+                offset += hfst::size_t_to_uint(
+                    transition_placeholders[symbol_to_transition_placeholder_v[i]].size());
+            }
+        }
+    }
 };
 
 bool compare_states_by_input_size(
@@ -197,78 +225,175 @@ bool compare_states_by_input_size(
 bool compare_states_by_state_number(
     const StatePlaceholder & lhs, const StatePlaceholder & rhs);
 
+/** \brief Tunable parameters of the conversion into optimized-lookup
+    format.
+
+    The packer places each nonsimple state at the first index where all of
+    its input symbols fit, scanning from a floor below which the table is
+    considered full. A lower \a packing_aggression moves the floor sooner,
+    which makes packing faster and the index table larger.
+
+    The states are gathered and their transitions written in \a threads
+    threads; the result does not depend on the number of threads.
+*/
+struct PackingParameters
+{
+    // The floor moves past an index when at least this fraction of the
+    // following (number of input symbols) entries are in use
+    float packing_aggression;
+    // After this many placements that failed to move the floor, jump it
+    // past the last placement
+    int floor_jump_threshold;
+    // Place states with many input symbols before sparse ones. This
+    // helps some lexicons and hurts others, so it is off by default.
+    bool sort_by_density;
+    // Threads for the parts of the conversion done per state
+    unsigned int threads;
+
+    PackingParameters():
+    packing_aggression((float)0.85),
+    floor_jump_threshold(4),
+    sort_by_density(false),
+    threads(1)
+    {}
+
+    /* Parameters from a comma-separated option string, as given to
+       HfstTransducer::convert. "quick" trades table size for speed;
+       "packing-aggression=F", "floor-jump-threshold=N" and
+       "density-sort" set single parameters, and "threads=N" the number
+       of threads, 0 meaning one per core. Unknown options are ignored. */
+    static PackingParameters from_options(std::string const & options);
+};
+
 struct IndexPlaceholders
 {
     std::vector<unsigned int> indices;
     std::vector<std::pair<unsigned int, SymbolNumber> > targets;
+    // For each target, the offset of its transitions from the first
+    // transition of the state
+    std::vector<unsigned int> transition_offsets;
+    // One bit per index, set when the index is in use
+    std::vector<unsigned int> used_bits;
+
+    static const unsigned int BITS_PER_WORD = sizeof(unsigned int) * CHAR_BIT;
 
     bool used(unsigned int const position) const
         {
-            return position < indices.size() && indices[position] != NO_TABLE_INDEX;
+            unsigned int word = position / BITS_PER_WORD;
+            return word < used_bits.size() &&
+                ((used_bits[word] >> (position % BITS_PER_WORD)) & 1u);
         }
 
-    void assign(unsigned int const position, unsigned int target, SymbolNumber sym)
+    void assign(unsigned int const position, unsigned int target, SymbolNumber sym,
+                unsigned int transition_offset = 0)
         {
-            while (position >= indices.size()) {
-                indices.push_back(NO_TABLE_INDEX);
+            if (position >= indices.size()) {
+                indices.resize(position + 1, NO_TABLE_INDEX);
+                used_bits.resize(position / BITS_PER_WORD + 1, 0u);
             }
             indices[position] = hfst::size_t_to_uint(targets.size());
+            used_bits[position / BITS_PER_WORD] |=
+                1u << (position % BITS_PER_WORD);
             targets.push_back(std::pair<unsigned int, SymbolNumber>(target, sym));
+            transition_offsets.push_back(transition_offset);
         }
 
-    std::pair<unsigned int, SymbolNumber> get_target(unsigned int index)
+    std::pair<unsigned int, SymbolNumber> get_target(unsigned int index) const
         {
             return targets[indices[index]];
         }
-    
-    bool fits(StatePlaceholder const & state,
-              std::set<SymbolNumber> const & flag_symbols,
+
+    unsigned int get_transition_offset(unsigned int index) const
+        {
+            return transition_offsets[indices[index]];
+        }
+
+    /* The smallest unused index that is not smaller than \a position.
+       Skips a whole word of used indices at a time. */
+    unsigned int next_unused(unsigned int position) const;
+
+    /* The number of used indices in [\a first, \a first + \a count). */
+    unsigned int count_used(unsigned int first, unsigned int count) const;
+
+    /* A word whose bit n is set when \a position + n is unused. */
+    unsigned int unused_bits(unsigned int position) const;
+
+    /* The offsets from a starting index that \a state occupies: 0 for its
+       finality marker and one past each input symbol, flag diacritics
+       counting as epsilon. Sorted, so that the offsets most likely to land
+       on the densely used indices near the floor come first. */
+    static std::vector<unsigned int> state_offsets(
+        StatePlaceholder const & state,
+        std::set<SymbolNumber> const & flag_symbols);
+
+    bool fits(std::vector<unsigned int> const & offsets,
               unsigned int const position) const
         {
-            if (used(position)) {
-                return false;
-            }
-            for (std::vector<std::vector<TransitionPlaceholder> >::const_iterator it = state.transition_placeholders.begin();
-                 it != state.transition_placeholders.end(); ++it) {
-                SymbolNumber index_offset = it->at(0).input;
-                if (flag_symbols.count(index_offset) != 0) {
-                    index_offset = 0;
-                }
-                if (used(index_offset + position + 1)) {
+            for (std::vector<unsigned int>::const_iterator it = offsets.begin();
+                 it != offsets.end(); ++it) {
+                if (used(position + *it)) {
                     return false;
                 }
             }
             return true;
         }
 
+    bool fits(StatePlaceholder const & state,
+              std::set<SymbolNumber> const & flag_symbols,
+              unsigned int const position) const
+        {
+            return fits(state_offsets(state, flag_symbols), position);
+        }
+
+    /* The first index not smaller than \a position where \a offsets fit.
+       Candidates are tried a word at a time: the unused bits under every
+       offset are intersected, and any bit left standing is a fit. */
+    unsigned int first_fit(std::vector<unsigned int> const & offsets,
+                           unsigned int position) const;
+
     bool unsuitable(unsigned int const index,
                     SymbolNumber const symbols,
                     float const packing_aggression) const
     {
-    if (used(index)) {
-        return true;
-    }
-    
-    // "Perfect packing" (under this strategy)
-/*              for (unsigned int i = 0; i < symbols; ++i) {
-        
-        if (count(index + i) == 0) {
-        return true;
-        }
-        return false;
-        }*/
-
-    unsigned int filled = 0;
-    for (unsigned int i = 0; i < symbols; ++i) {
-        filled += used(index + i + 1);
-        if (filled >= (packing_aggression*symbols)) {
-            return true; // too full
+        if (used(index)) {
+            return true;
         }
+        return symbols > 0 &&
+            count_used(index + 1, symbols) >= packing_aggression * symbols;
     }
-    return false;
-    }
 };
 
+/* Give each of \a states listed in \a order, in that order, the first
+   starting index in \a used_indices where its finality marker and input
+   symbols fit, and mark those indices used. \a input_symbols is the
+   number of input symbols of the transducer, which \a packing uses to
+   decide when to move the floor the search starts from. */
+void place_states(std::vector<StatePlaceholder> & states,
+                  std::vector<unsigned int> const & order,
+                  std::set<SymbolNumber> const & flag_symbols,
+                  SymbolNumber input_symbols,
+                  PackingParameters const & packing,
+                  IndexPlaceholders & used_indices);
+
+/** \brief Work on a range of states, to be split between threads by
+    run_state_ranges. */
+struct StateRangeTask
+{
+    virtual ~StateRangeTask() {}
+    /* Process the states in [\a begin, \a end), which is range number
+       \a chunk. Different ranges must not write to the same data. */
+    virtual void run(unsigned int chunk, unsigned int begin, unsigned int end) = 0;
+};
+
+/* Split [0, \a n) into at most \a chunks consecutive ranges and run
+   \a task on each, in threads of their own if threads are available.
+   Returns once every range is done, rethrowing an exception thrown by
+   any of them. */
+void run_state_ranges(StateRangeTask & task, unsigned int n, unsigned int chunks);
+
+/* The number of threads to use when \a threads were asked for,
+   0 meaning one per core. */
+unsigned int resolve_thread_count(unsigned int threads);
 
 void write_transitions_from_state_placeholders(
     TransducerTable<TransitionW> & transition_table,
@@ -276,6 +401,16 @@ void write_transitions_from_state_placeholders(
     & state_placeholders,
     std::set<SymbolNumber> & flag_symbols);
 
+/* As above, but with the states split between \a threads threads. Each
+   state's transitions go to a position computed beforehand, so the
+   table is the same for any number of threads. */
+void write_transitions_from_state_placeholders(
+    TransducerTable<TransitionW> & transition_table,
+    std::vector<hfst_ol::StatePlaceholder>
+    & state_placeholders,
+    std::set<SymbolNumber> & flag_symbols,
+    unsigned int threads);
+
 void add_transitions_with(SymbolNumber symbol,
               std::vector<TransitionPlaceholder> & transitions,
               TransducerTable<TransitionW> & transition_table,
@@ -45,11 +45,11 @@ bool TraversalState::operator<(const TraversalState & rhs) const
     return false;
 }
 
-void Transducer::find_loop_epsilon_transitions(
-    unsigned int input_pos,
-    TransitionTableIndex i)
+void Transducer::find_loop_epsilon_transitions(LookupContext & c,
+                                               unsigned int input_pos,
+                                               TransitionTableIndex i) const
 {
-    FlagDiacriticState flags = flag_state.get_values();
+    FlagDiacriticState flags = c.flag_state.get_values();
     while (true)
     {
         TransitionTableIndex target = tables->get_transition_target(i);
@@ -57,31 +57,31 @@ void Transducer::find_loop_epsilon_transitions(
         if (tables->get_transition_input(i) == 0) // epsilon
         {
             // We try to trap non-progressing loops
-            if (traversal_states.count(epsilon_reachable) == 1) {
+            if (c.traversal_states.count(epsilon_reachable) == 1) {
                 // We've been here before
                 throw true;
             }
-            traversal_states.insert(epsilon_reachable);
-            find_loop(input_pos, target);
-            traversal_states.erase(epsilon_reachable);
-            found_transition = true;
+            c.traversal_states.insert(epsilon_reachable);
+            find_loop(c, input_pos, target);
+            c.traversal_states.erase(epsilon_reachable);
+            c.found_transition = true;
             ++i;
         } else if (alphabet->is_flag_diacritic(
                        tables->get_transition_input(i))) {
             
-            if (flag_state.apply_operation(
+            if (c.flag_state.apply_operation(
                     *(alphabet->get_operation(
                           tables->get_transition_input(i))))) {
                 // flag diacritic allowed
-                if (traversal_states.count(epsilon_reachable) == 1) {
+                if (c.traversal_states.count(epsilon_reachable) == 1) {
                     // We've been here before
                     throw true;
                 }
-                traversal_states.insert(epsilon_reachable);
-                find_loop(input_pos, target);
-                traversal_states.erase(epsilon_reachable);
+                c.traversal_states.insert(epsilon_reachable);
+                find_loop(c, input_pos, target);
+                c.traversal_states.erase(epsilon_reachable);
             }
-            flag_state.assign_values(flags);
+            c.flag_state.assign_values(flags);
             ++i;
         } else { // it's not epsilon and it's not a flag, so nothing to do
             return;
@@ -89,29 +89,31 @@ void Transducer::find_loop_epsilon_transitions(
     }
 }
 
-void Transducer::find_loop_epsilon_indices(unsigned int input_pos,
-                                                TransitionTableIndex i)
+void Transducer::find_loop_epsilon_indices(LookupContext & c,
+                                           unsigned int input_pos,
+                                           TransitionTableIndex i) const
 {
     if (tables->get_index_input(i) == 0)
     {
-        find_loop_epsilon_transitions(
+        find_loop_epsilon_transitions(c, 
             input_pos,
             tables->get_index_target(i) - TRANSITION_TARGET_TABLE_START);
-        found_transition = true;
+        c.found_transition = true;
     }
 }
 
-void Transducer::find_loop_transitions(SymbolNumber input,
-                                            unsigned int input_pos,
-                                            TransitionTableIndex i)
+void Transducer::find_loop_transitions(LookupContext & c,
+                                       SymbolNumber input,
+                                       unsigned int input_pos,
+                                       TransitionTableIndex i) const
 {
 
     while (tables->get_transition_input(i) != NO_SYMBOL_NUMBER) {
         if (tables->get_transition_input(i) == input) {
             // We're not going to find an epsilon / flag loop
-            traversal_states.clear();
-            find_loop(input_pos, tables->get_transition_target(i));
-            found_transition = true;
+            c.traversal_states.clear();
+            find_loop(c, input_pos, tables->get_transition_target(i));
+            c.found_transition = true;
         } else {
             return;
         }
@@ -119,66 +121,68 @@ void Transducer::find_loop_transitions(SymbolNumber input,
     }
 }
 
-void Transducer::find_loop_index(SymbolNumber input,
-                                      unsigned int input_pos,
-                                      TransitionTableIndex i)
+void Transducer::find_loop_index(LookupContext & c,
+                                 SymbolNumber input,
+                                 unsigned int input_pos,
+                                 TransitionTableIndex i) const
 {
     if (tables->get_index_input(i+input) == input)
     {
-        find_loop_transitions(input,
+        find_loop_transitions(c, input,
                               input_pos,
                               tables->get_index_target(i+input) -
                               TRANSITION_TARGET_TABLE_START);
-        found_transition = true;
+        c.found_transition = true;
     }
 }
 
 
 
 
-void Transducer::find_loop(unsigned int input_pos,
-                           TransitionTableIndex i)
+void Transducer::find_loop(LookupContext & c,
+                           unsigned int input_pos,
+                           TransitionTableIndex i) const
 {
-    found_transition = false;
+    c.found_transition = false;
     
     if (indexes_transition_table(i))
     {
         i -= TRANSITION_TARGET_TABLE_START;
-        find_loop_epsilon_transitions(input_pos, i+1);
+        find_loop_epsilon_transitions(c, input_pos, i+1);
         
         // input-string ended.
-        if (input_tape[input_pos] == NO_SYMBOL_NUMBER)
+        if (c.input_tape[input_pos] == NO_SYMBOL_NUMBER)
         {
             return;
         }
       
-        SymbolNumber input = input_tape[input_pos];
+        SymbolNumber input = c.input_tape[input_pos];
         ++input_pos;
 
-        find_loop_transitions(input, input_pos, i+1);
+        find_loop_transitions(c, input, input_pos, i+1);
         if (alphabet->get_default_symbol() != NO_SYMBOL_NUMBER &&
-            !found_transition) {
-            find_loop_transitions(alphabet->get_default_symbol(),
+            !c.found_transition) {
+            find_loop_transitions(c, alphabet->get_default_symbol(),
                                   input_pos, i+1);
         }
     }
     else
     {
-        find_loop_epsilon_indices(input_pos, i+1);
+        find_loop_epsilon_indices(c, input_pos, i+1);
         
-        if (input_tape[input_pos] == NO_SYMBOL_NUMBER)
+        if (c.input_tape[input_pos] == NO_SYMBOL_NUMBER)
         { // input-string ended.
             return;
         }
       
-        SymbolNumber input = input_tape[input_pos];
+        SymbolNumber input = c.input_tape[input_pos];
         ++input_pos;
 
-        find_loop_index(input, input_pos, i+1);
+        find_loop_index(c, input, input_pos, i+1);
         // If we have a default symbol defined and we didn't find an index,
         // check for that
-        if (alphabet->get_default_symbol() != NO_SYMBOL_NUMBER && !found_transition) {
-            find_loop_index(alphabet->get_default_symbol(),
+        if (alphabet->get_default_symbol() != NO_SYMBOL_NUMBER && !c.found_transition) {
+            find_loop_index(c, alphabet->get_default_symbol(),
                             input_pos, i+1);
         }
     }
@@ -0,0 +1,265 @@
+// -*- mode: c++; -*-
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+#ifndef _HFST_OL_TRANSDUCER_LETTER_TRIE_H_
+#define _HFST_OL_TRANSDUCER_LETTER_TRIE_H_
+
+#include <vector>
+#include <climits>
+#include <cstddef>
+
+namespace hfst_ol {
+
+/** \brief A trie from byte strings to symbol numbers, stored as a
+    double array.
+
+    All nodes live in one vector of cells. The child of node s on byte c
+    is the cell at base(s) + c + 1, and it belongs to s if its check
+    field is s. Following a byte is two array reads instead of a pointer
+    dereference into a 256-entry table per node. Strings can be added at
+    any time; when a new child does not fit, the children of its parent
+    are moved to a free range of cells.
+*/
+template <class S>
+class CompactLetterTrie
+{
+public:
+    typedef unsigned int Node;
+
+private:
+    struct Cell
+    {
+        int base;
+        int check;
+        S symbol;
+    };
+
+    static const int FREE = -1;
+    static const unsigned int CODES = UCHAR_MAX + 1;
+
+    std::vector<Cell> cells;
+    S no_symbol;
+    // No cell below this index is free
+    size_t first_free;
+
+    static unsigned int code(unsigned char c) { return c + 1; }
+
+    bool is_free(size_t i) const
+        {
+            return i >= cells.size() || cells[i].check == FREE;
+        }
+
+    void grow(size_t size)
+        {
+            if (size > cells.size()) {
+                Cell free_cell = { 0, FREE, no_symbol };
+                cells.resize(size, free_cell);
+            }
+        }
+
+    void children(Node s, std::vector<unsigned int> & codes) const
+        {
+            codes.clear();
+            for (unsigned int k = 1; k <= CODES; ++k) {
+                size_t i = cells[s].base + k;
+                if (i < cells.size() && cells[i].check == (int)s) {
+                    codes.push_back(k);
+                }
+            }
+        }
+
+    /* The smallest base at which all of \a codes (ascending) are free. */
+    int find_base(const std::vector<unsigned int> & codes) const
+        {
+            size_t f = first_free > codes[0] ? first_free : codes[0];
+            for (;; ++f) {
+                if (!is_free(f)) {
+                    continue;
+                }
+                size_t b = f - codes[0];
+                size_t k = 1;
+                while (k < codes.size() && is_free(b + codes[k])) {
+                    ++k;
+                }
+                if (k == codes.size()) {
+                    return (int)b;
+                }
+            }
+        }
+
+    Node claim(Node parent, size_t i)
+        {
+            grow(i + 1);
+            cells[i].base = 0;
+            cells[i].check = (int)parent;
+            cells[i].symbol = no_symbol;
+            while (!is_free(first_free)) {
+                ++first_free;
+            }
+            return (Node)i;
+        }
+
+    /* Move the children of \a s so that \a new_code fits beside them. */
+    void relocate(Node s, std::vector<unsigned int> & codes,
+                  unsigned int new_code)
+        {
+            std::vector<unsigned int> all_codes(codes);
+            size_t pos = 0;
+            while (pos < all_codes.size() && all_codes[pos] < new_code) {
+                ++pos;
+            }
+            all_codes.insert(all_codes.begin() + pos, new_code);
+            int new_base = find_base(all_codes);
+            grow(new_base + all_codes.back() + 1);
+            int old_base = cells[s].base;
+            for (size_t k = 0; k < codes.size(); ++k) {
+                size_t old_i = old_base + codes[k];
+                size_t new_i = new_base + codes[k];
+                cells[new_i] = cells[old_i];
+                // Grandchildren now have a new parent
+                for (unsigned int g = 1; g <= CODES; ++g) {
+                    size_t child_i = cells[old_i].base + g;
+                    if (child_i < cells.size() &&
+                        cells[child_i].check == (int)old_i) {
+                        cells[child_i].check = (int)new_i;
+                    }
+                }
+                cells[old_i].base = 0;
+                cells[old_i].check = FREE;
+                cells[old_i].symbol = no_symbol;
+                if (old_i < first_free) {
+                    first_free = old_i;
+                }
+            }
+            cells[s].base = new_base;
+            while (!is_free(first_free)) {
+                ++first_free;
+            }
+        }
+
+    Node add_child(Node s, unsigned char c)
+        {
+            unsigned int k = code(c);
+            Node t;
+            if (next(s, c, t)) {
+                return t;
+            }
+            std::vector<unsigned int> codes;
+            children(s, codes);
+            if (codes.empty()) {
+                std::vector<unsigned int> only(1, k);
+                cells[s].base = find_base(only);
+            } else if (!is_free(cells[s].base + k)) {
+                relocate(s, codes, k);
+            }
+            return claim(s, cells[s].base + k);
+        }
+
+public:
+    CompactLetterTrie(S no_symbol_number):
+        cells(), no_symbol(no_symbol_number), first_free(1)
+        {
+            Cell root = { 0, FREE - 1, no_symbol };
+            cells.push_back(root);
+        }
+
+    Node root(void) const { return 0; }
+
+    /* Follow byte \a c from node \a s to \a t. */
+    bool next(Node s, unsigned char c, Node & t) const
+        {
+            size_t i = cells[s].base + code(c);
+            if (i < cells.size() && cells[i].check == (int)s) {
+                t = (Node)i;
+                return true;
+            }
+            return false;
+        }
+
+    /* The symbol that ends at node \a s, or the no-symbol value. */
+    S symbol(Node s) const { return cells[s].symbol; }
+
+    void add_string(const char * p, S symbol_key)
+        {
+            if (*p == '\0') {
+                return;
+            }
+            Node s = root();
+            for (; *p != '\0'; ++p) {
+                s = add_child(s, (unsigned char)*p);
+            }
+            cells[s].symbol = symbol_key;
+        }
+
+    /* Whether some string of two or more bytes starts with \a c. */
+    bool has_key_starting_with(const char c) const
+        {
+            Node t;
+            if (!next(root(), (unsigned char)c, t)) {
+                return false;
+            }
+            for (unsigned int k = 0; k < CODES; ++k) {
+                Node u;
+                if (next(t, (unsigned char)k, u)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    /* Find the longest symbol at the start of *p and move *p past it.
+       If there is none, return the no-symbol value with *p moved by
+       one byte. */
+    S find_key(char ** p) const
+        {
+            const char * s = *p;
+            const char * best_end = s + 1;
+            S best = no_symbol;
+            Node node = root();
+            while (*s != '\0' && next(node, (unsigned char)*s, node)) {
+                ++s;
+                if (cells[node].symbol != no_symbol) {
+                    best = cells[node].symbol;
+                    best_end = s;
+                }
+            }
+            *p = const_cast<char *>(best_end);
+            return best;
+        }
+
+    /* The symbol that is exactly \a str, or the no-symbol value. */
+    S find_symbol(const char * str) const
+        {
+            Node node = root();
+            if (*str == '\0') {
+                return no_symbol;
+            }
+            for (; *str != '\0'; ++str) {
+                if (!next(node, (unsigned char)*str, node)) {
+                    return no_symbol;
+                }
+            }
+            return cells[node].symbol;
+        }
+
+    bool has_symbol(S symbol_key) const
+        {
+            for (size_t i = 1; i < cells.size(); ++i) {
+                if (cells[i].check != FREE && cells[i].symbol == symbol_key) {
+                    return true;
+                }
+            }
+            return false;
+        }
+};
+
+}
+
+#endif // _HFST_OL_TRANSDUCER_LETTER_TRIE_H_
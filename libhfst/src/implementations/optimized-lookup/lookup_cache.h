@@ -0,0 +1,130 @@
+// -*- mode: c++; -*-
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+#ifndef _HFST_OL_TRANSDUCER_LOOKUP_CACHE_H_
+#define _HFST_OL_TRANSDUCER_LOOKUP_CACHE_H_
+
+#include <list>
+#include <string>
+#include <utility>
+#include <cstddef>
+
+#if !defined(NO_CPLUSPLUS_11)
+#  include <unordered_map>
+#else
+#  include <map>
+#endif
+
+namespace hfst_ol {
+
+/** \brief A bounded cache of lookup results that evicts the least recently
+    used entry when full.
+
+    Keys are encoded input strings, built with append_to_cache_key from the
+    symbol numbers of the input, so that a frequent input costs one hash
+    probe instead of a traversal of the transducer. A capacity of zero
+    disables the cache. The cache is not thread-safe; each thread should
+    have a cache of its own.
+*/
+template <class V>
+class LookupCache
+{
+public:
+    typedef std::string Key;
+private:
+    typedef std::list<std::pair<Key, V> > EntryList;
+#if !defined(NO_CPLUSPLUS_11)
+    typedef std::unordered_map<Key, typename EntryList::iterator> EntryIndex;
+#else
+    typedef std::map<Key, typename EntryList::iterator> EntryIndex;
+#endif
+
+    size_t capacity;
+    // Most recently used first
+    EntryList entries;
+    EntryIndex index;
+    size_t hits;
+    size_t misses;
+
+    void evict(size_t max_size)
+        {
+            while (index.size() > max_size) {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+        }
+
+public:
+    LookupCache(size_t max_entries = 0):
+        capacity(max_entries), entries(), index(), hits(0), misses(0) {}
+
+    bool is_enabled(void) const { return capacity > 0; }
+    size_t get_capacity(void) const { return capacity; }
+    size_t size(void) const { return index.size(); }
+    size_t get_hits(void) const { return hits; }
+    size_t get_misses(void) const { return misses; }
+
+    /* Change the maximum number of entries, evicting entries if needed. */
+    void set_capacity(size_t max_entries)
+        {
+            capacity = max_entries;
+            evict(capacity);
+        }
+
+    /* Return the value stored for \a key, or NULL if there is none.
+       A found entry becomes the most recently used one. */
+    const V * find(const Key & key)
+        {
+            typename EntryIndex::iterator it = index.find(key);
+            if (it == index.end()) {
+                ++misses;
+                return NULL;
+            }
+            ++hits;
+            entries.splice(entries.begin(), entries, it->second);
+            return &(it->second->second);
+        }
+
+    /* Store \a value for \a key as the most recently used entry. */
+    void insert(const Key & key, const V & value)
+        {
+            if (capacity == 0) {
+                return;
+            }
+            typename EntryIndex::iterator it = index.find(key);
+            if (it != index.end()) {
+                it->second->second = value;
+                entries.splice(entries.begin(), entries, it->second);
+                return;
+            }
+            evict(capacity - 1);
+            entries.push_front(std::make_pair(key, value));
+            index[key] = entries.begin();
+        }
+
+    void clear(void)
+        {
+            entries.clear();
+            index.clear();
+            hits = 0;
+            misses = 0;
+        }
+};
+
+/* Append the bytes of \a symbol to the cache key \a key. */
+template <class S>
+inline void append_to_cache_key(std::string & key, S symbol)
+{
+    key.append(reinterpret_cast<const char *>(&symbol), sizeof(S));
+}
+
+}
+
+#endif // _HFST_OL_TRANSDUCER_LOOKUP_CACHE_H_
@@ -7,6 +7,8 @@
 // See the file COPYING included with this distribution for more
 // information.
 #include "transducer.h"
+#include <algorithm>
+#include <iterator>
 
 namespace hfst_ol {
 
@@ -67,13 +69,13 @@ bool InputString::initialize(const Encoder & encoder,
     return true;
 }
 
-TreeNode TreeNode::update_lexicon(SymbolNumber next_symbol,
+TreeNode TreeNode::update_lexicon(size_t self,
+                                  SymbolNumber next_symbol,
                                   TransitionTableIndex next_lexicon,
-                                  Weight weight)
+                                  Weight weight) const
 {
-    SymbolNumberVector str(this->string);
-    str.push_back(next_symbol);
-    return TreeNode(str,
+    return TreeNode(self,
+                    next_symbol,
                     this->input_state,
                     this->mutator_state,
                     next_lexicon,
@@ -81,13 +83,13 @@ TreeNode TreeNode::update_lexicon(SymbolNumber next_symbol,
                     this->weight + weight);
 }
 
-TreeNode TreeNode::update_mutator(SymbolNumber next_symbol,
+TreeNode TreeNode::update_mutator(size_t self,
+                                  SymbolNumber next_symbol,
                                   TransitionTableIndex next_mutator,
-                                  Weight weight)
+                                  Weight weight) const
 {
-    SymbolNumberVector str(this->string);
-    str.push_back(next_symbol);
-    return TreeNode(str,
+    return TreeNode(self,
+                    next_symbol,
                     this->input_state,
                     next_mutator,
                     this->lexicon_state,
@@ -95,15 +97,15 @@ TreeNode TreeNode::update_mutator(SymbolNumber next_symbol,
                     this->weight + weight);
 }
 
-TreeNode TreeNode::update(SymbolNumber next_symbol,
+TreeNode TreeNode::update(size_t self,
+                          SymbolNumber next_symbol,
                           unsigned int next_input,
                           TransitionTableIndex next_mutator,
                           TransitionTableIndex next_lexicon,
-                          Weight weight)
+                          Weight weight) const
 {
-    SymbolNumberVector str(this->string);
-    str.push_back(next_symbol);
-    return TreeNode(str,
+    return TreeNode(self,
+                    next_symbol,
                     next_input,
                     next_mutator,
                     next_lexicon,
@@ -111,14 +113,14 @@ TreeNode TreeNode::update(SymbolNumber next_symbol,
                     this->weight + weight);
 }
 
-TreeNode TreeNode::update(SymbolNumber next_symbol,
+TreeNode TreeNode::update(size_t self,
+                          SymbolNumber next_symbol,
                           TransitionTableIndex next_mutator,
                           TransitionTableIndex next_lexicon,
-                          Weight weight)
+                          Weight weight) const
 {
-    SymbolNumberVector str(this->string);
-    str.push_back(next_symbol);
-    return TreeNode(str,
+    return TreeNode(self,
+                    next_symbol,
                     this->input_state,
                     next_mutator,
                     next_lexicon,
@@ -126,26 +128,126 @@ TreeNode TreeNode::update(SymbolNumber next_symbol,
                     this->weight + weight);
 }
 
-void Speller::lexicon_epsilons(void)
+bool Speller::may_continue(const TreeNode & node) const
 {
-    if (!lexicon->has_epsilons_or_flags(queue.front().lexicon_state + 1)) {
+    if (checking) {
+        if (lexicon_lookahead == NULL) {
+            return true;
+        }
+        return node.input_state == input.len() ?
+            lexicon_lookahead->can_end(node.lexicon_state) :
+            lexicon_lookahead->can_consume(node.lexicon_state,
+                                           input[node.input_state]);
+    }
+    // The lexicon reads what the mutator writes, so all that's known of it
+    // is whether it can go anywhere at all
+    if (lexicon_lookahead != NULL &&
+        lexicon_lookahead->is_dead(node.lexicon_state)) {
+        return false;
+    }
+    if (mutator_lookahead == NULL) {
+        return true;
+    }
+    return node.input_state == input.len() ?
+        mutator_lookahead->can_end(node.mutator_state) :
+        mutator_lookahead->can_consume(node.mutator_state,
+                                       input[node.input_state]);
+}
+
+void Speller::push(const TreeNode & node)
+{
+    if (weights_grow && node.weight > weight_limit) {
+        return; // nothing this leads to could be light enough
+    }
+    if (use_lookahead && !may_continue(node)) {
+        return; // nothing this leads to reads the rest of the input
+    }
+    if (best_first) {
+        // Following a transition with no weight is common, so that case
+        // skips the heap
+        if (node.weight <= expanded_weight) {
+            lightest.push_back(nodes.size());
+        } else {
+            queue.push(QueuedTreeNode(node.weight, node.input_state,
+                                      nodes.size()));
+        }
+    }
+    nodes.push_back(node);
+}
+
+size_t Speller::pop(void)
+{
+    if (!best_first) {
+        return next_node++;
+    }
+    size_t i;
+    if (!lightest.empty()) {
+        i = lightest.back();
+        lightest.pop_back();
+    } else {
+        i = queue.top().node;
+        queue.pop();
+    }
+    expanded_weight = nodes[i].weight;
+    return i;
+}
+
+void Speller::start_search(bool best, Weight max_weight)
+{
+    best_first = best;
+    weight_limit = max_weight;
+    nodes.clear();
+    queue = TreeNodePriorityQueue();
+    lightest.clear();
+    // The start node goes in the heap
+    expanded_weight = -std::numeric_limits<Weight>::infinity();
+    next_node = 0;
+    // The start state of the flags is the first one
+    flag_states.assign(flag_feature_count, 0);
+    push(TreeNode());
+}
+
+bool Speller::apply_flag(unsigned int & state, SymbolNumber symbol)
+{
+    std::vector<hfst::FdValue>::const_iterator values =
+        flag_states.begin() + state * flag_feature_count;
+    flag_values.assign(values, values + flag_feature_count);
+    flag_scratch.assign_values(flag_values);
+    if (!flag_scratch.apply_operation(symbol)) {
+        return false;
+    }
+    const std::vector<hfst::FdValue> & result = flag_scratch.get_values();
+    if (std::equal(result.begin(), result.end(), values)) {
+        return true; // checks and settings to the same value are common
+    }
+    state = hfst::size_t_to_uint(flag_states.size() / flag_feature_count);
+    flag_states.insert(flag_states.end(), result.begin(), result.end());
+    return true;
+}
+
+void Speller::lexicon_epsilons(const TreeNode & node, size_t i)
+{
+    if (!lexicon->has_epsilons_or_flags(node.lexicon_state + 1)) {
         return;
     }
-    TransitionTableIndex next = lexicon->next(queue.front().lexicon_state, 0);
+    TransitionTableIndex next = lexicon->next(node.lexicon_state, 0);
     STransition i_s = lexicon->take_epsilons_and_flags(next);
     
     while (i_s.symbol != NO_SYMBOL_NUMBER) {
-        if (lexicon->get_transition(next).get_input_symbol() == 0) {
-            queue.push_back(queue.front().update_lexicon(i_s.symbol,
-                                                         i_s.index,
-                                                         i_s.weight));
+        if (lexicon->get_transition_input(next) == 0) {
+            push(node.update_lexicon(i,
+                                     i_s.symbol,
+                                     i_s.index,
+                                     i_s.weight));
         } else {
-            TreeNode front = queue.front();
-            if (front.flag_state.apply_operation(
-                    lexicon->get_transition(next).get_input_symbol())) {
-                queue.push_back(front.update_lexicon(i_s.symbol,
-                                                     i_s.index,
-                                                     i_s.weight));
+            unsigned int flag_state = node.flag_state;
+            if (apply_flag(flag_state, lexicon->get_transition_input(next))) {
+                TreeNode next_node = node.update_lexicon(i,
+                                                         i_s.symbol,
+                                                         i_s.index,
+                                                         i_s.weight);
+                next_node.flag_state = flag_state;
+                push(next_node);
             }
         }
         ++next;
@@ -153,27 +255,27 @@ void Speller::lexicon_epsilons(void)
     }
 }
 
-void Speller::lexicon_consume(void)
+void Speller::lexicon_consume(const TreeNode & node, size_t i)
 {
-    unsigned int input_state = queue.front().input_state;
+    unsigned int input_state = node.input_state;
     if (input_state >= input.len()||
         !lexicon->has_transitions(
-            queue.front().lexicon_state + 1, input[input_state])) {
+            node.lexicon_state + 1, input[input_state])) {
         return;
     }
 
-    TransitionTableIndex next = lexicon->next(queue.front().lexicon_state,
+    TransitionTableIndex next = lexicon->next(node.lexicon_state,
                                               input[input_state]);
     STransition i_s = lexicon->take_non_epsilons(next,
                                                  input[input_state]);
 
     while (i_s.symbol != NO_SYMBOL_NUMBER) {
-        queue.push_back(queue.front().update(
-                            i_s.symbol,
-                            input_state + 1,
-                            queue.front().mutator_state,
-                            i_s.index,
-                            i_s.weight));
+        push(node.update(i,
+                         i_s.symbol,
+                         input_state + 1,
+                         node.mutator_state,
+                         i_s.index,
+                         i_s.weight));
         
         ++next;
         i_s = lexicon->take_non_epsilons(next, input[input_state]);
@@ -181,40 +283,41 @@ void Speller::lexicon_consume(void)
     
 }
 
-void Speller::mutator_epsilons(void)
+void Speller::mutator_epsilons(const TreeNode & node, size_t i)
 {
-    if (!mutator->has_transitions(queue.front().mutator_state + 1, 0)) {
+    if (!mutator->has_transitions(node.mutator_state + 1, 0)) {
         return;
     }
-    TransitionTableIndex next_m = mutator->next(queue.front().mutator_state, 0);
+    TransitionTableIndex next_m = mutator->next(node.mutator_state, 0);
     STransition mutator_i_s = mutator->take_epsilons(next_m);
    
     while (mutator_i_s.symbol != NO_SYMBOL_NUMBER) {
         if (mutator_i_s.symbol == 0) {
-            queue.push_back(queue.front().update_mutator(mutator_i_s.symbol,
-                                                         mutator_i_s.index,
-                                                         mutator_i_s.weight));
+            push(node.update_mutator(i,
+                                     mutator_i_s.symbol,
+                                     mutator_i_s.index,
+                                     mutator_i_s.weight));
         } else {
             if (!lexicon->has_transitions(
-                    queue.front().lexicon_state + 1,
+                    node.lexicon_state + 1,
                     alphabet_translator[mutator_i_s.symbol])) {
                 ++next_m;
                 mutator_i_s = mutator->take_epsilons(next_m);
                 continue;
             }
             TransitionTableIndex next_l = lexicon->next(
-                queue.front().lexicon_state,
+                node.lexicon_state,
                 alphabet_translator[mutator_i_s.symbol]);
             STransition lexicon_i_s = lexicon->take_non_epsilons(
                 next_l,
                 alphabet_translator[mutator_i_s.symbol]);
             
             while (lexicon_i_s.symbol != NO_SYMBOL_NUMBER) {
-                queue.push_back(queue.front().update(
-                                    lexicon_i_s.symbol,
-                                    mutator_i_s.index,
-                                    lexicon_i_s.index,
-                                    lexicon_i_s.weight + mutator_i_s.weight));
+                push(node.update(i,
+                                 lexicon_i_s.symbol,
+                                 mutator_i_s.index,
+                                 lexicon_i_s.index,
+                                 lexicon_i_s.weight + mutator_i_s.weight));
                 ++next_l;
                 lexicon_i_s = lexicon->take_non_epsilons(
                     next_l,
@@ -226,16 +329,16 @@ void Speller::mutator_epsilons(void)
     }
 }
 
-void Speller::consume_input(void)
+void Speller::consume_input(const TreeNode & node, size_t i)
 {
-    unsigned int input_state = queue.front().input_state;
+    unsigned int input_state = node.input_state;
     if (input_state >= input.len()||
-        !mutator->has_transitions(queue.front().mutator_state + 1,
+        !mutator->has_transitions(node.mutator_state + 1,
                                   input[input_state])) {
         return; // not enough input to consume of no suitable transitions
     }
     
-    TransitionTableIndex next_m = mutator->next(queue.front().mutator_state,
+    TransitionTableIndex next_m = mutator->next(node.mutator_state,
                                                 input[input_state]);
     
     STransition mutator_i_s = mutator->take_non_epsilons(next_m,
@@ -245,14 +348,15 @@ void Speller::consume_input(void)
 
         if (mutator_i_s.symbol == 0) {
             
-            queue.push_back(queue.front().update(0,
-                                                 input_state + 1,
-                                                 mutator_i_s.index,
-                                                 queue.front().lexicon_state,
-                                                 mutator_i_s.weight));
+            push(node.update(i,
+                             0,
+                             input_state + 1,
+                             mutator_i_s.index,
+                             node.lexicon_state,
+                             mutator_i_s.weight));
         } else {
             if (!lexicon->has_transitions(
-                    queue.front().lexicon_state + 1,
+                    node.lexicon_state + 1,
                     alphabet_translator[mutator_i_s.symbol])) {
                 ++next_m;
                 mutator_i_s = mutator->take_non_epsilons(next_m,
@@ -260,7 +364,7 @@ void Speller::consume_input(void)
                 continue;
             }
             TransitionTableIndex next_l = lexicon->next(
-                queue.front().lexicon_state,
+                node.lexicon_state,
                 alphabet_translator[mutator_i_s.symbol]);
             
             STransition lexicon_i_s = lexicon->take_non_epsilons(
@@ -268,12 +372,12 @@ void Speller::consume_input(void)
                 alphabet_translator[mutator_i_s.symbol]);
             
             while (lexicon_i_s.symbol != NO_SYMBOL_NUMBER) {
-                queue.push_back(
-                    queue.front().update(lexicon_i_s.symbol,
-                                         input_state + 1,
-                                         mutator_i_s.index,
-                                         lexicon_i_s.index,
-                                         lexicon_i_s.weight + mutator_i_s.weight));
+                push(node.update(i,
+                                 lexicon_i_s.symbol,
+                                 input_state + 1,
+                                 mutator_i_s.index,
+                                 lexicon_i_s.index,
+                                 lexicon_i_s.weight + mutator_i_s.weight));
                 ++next_l;
                 lexicon_i_s = lexicon->take_non_epsilons(
                     next_l,
@@ -287,46 +391,95 @@ void Speller::consume_input(void)
 }
 
 
-CorrectionQueue Speller::correct(char * line)
+static bool lighter_correction(const StringWeightPair & lhs,
+                               const StringWeightPair & rhs)
+{
+    return lhs.second < rhs.second;
+}
+
+CorrectionQueue Speller::correct(char * line,
+                                 unsigned int nbest,
+                                 Weight max_weight)
 {
     // if input initialization fails, return empty correction queue
     if (!init_input(line, mutator->get_encoder(),
                     mutator->get_unknown_symbol())) {
         return CorrectionQueue();
     }
+    // The best weight of each correction found, and those weights in order
     std::map<std::string, Weight> corrections;
-    TreeNode start_node(lexicon->get_fd_table());
-    queue.assign(1, start_node);
+    std::multiset<Weight> weights;
+    checking = false;
+    // Without a limit, every node is expanded anyway, and the order doesn't
+    // matter
+    start_search(weights_grow &&
+                 (nbest != 0 ||
+                  max_weight != std::numeric_limits<Weight>::infinity()),
+                 max_weight);
 
-    while (queue.size() > 0) {
-        lexicon_epsilons();
-        mutator_epsilons();
-        if (queue.front().input_state == input.len()) {
+    while (has_queued()) {
+        if (best_first && nbest != 0 && weights.size() >= nbest &&
+            weight_limit <= queued_weight()) {
+            // Nothing left can beat the nbest corrections found
+            break;
+        }
+        size_t i = pop();
+        // A copy, since nodes may move as children are added
+        const TreeNode node = nodes[i];
+        if (weights_grow && node.weight > weight_limit) {
+            continue; // queued before the limit came down
+        }
+        ++nodes_expanded;
+        lexicon_epsilons(node, i);
+        mutator_epsilons(node, i);
+        if (node.input_state == input.len()) {
             /* if our transducers are in final states
              * we generate the correction
              */
-            if (mutator->final_index(queue.front().mutator_state)&&
-                lexicon->final_index(queue.front().lexicon_state)) {
-                std::string string = stringify(queue.front().string);
-                Weight weight = queue.front().weight +
-                    lexicon->final_weight(queue.front().lexicon_state) +
-                    mutator->final_weight(queue.front().mutator_state);
+            if (mutator->final_index(node.mutator_state)&&
+                lexicon->final_index(node.lexicon_state)) {
+                Weight weight = node.weight +
+                    lexicon->final_weight(node.lexicon_state) +
+                    mutator->final_weight(node.mutator_state);
+                if (weight > max_weight) {
+                    continue;
+                }
+                std::string string = stringify(i);
                 /* if the correction is novel or better than before, insert it
                  */
-                if (corrections.count(string) == 0||
-                    corrections[string] > weight) {
+                std::map<std::string, Weight>::iterator old =
+                    corrections.find(string);
+                if (old == corrections.end()) {
                     corrections[string] = weight;
+                    weights.insert(weight);
+                } else if (old->second > weight) {
+                    weights.erase(weights.find(old->second));
+                    weights.insert(weight);
+                    old->second = weight;
+                }
+                if (weights_grow && nbest != 0 && weights.size() >= nbest) {
+                    // From now on, only what's lighter than the nbest-th
+                    // correction matters
+                    std::multiset<Weight>::const_iterator nth =
+                        weights.begin();
+                    std::advance(nth, nbest - 1);
+                    weight_limit = *nth;
                 }
             }
         } else {
-            consume_input();
+            consume_input(node, i);
         }
-        queue.pop_front();
+    }
+    std::vector<StringWeightPair> sorted(corrections.begin(),
+                                         corrections.end());
+    std::stable_sort(sorted.begin(), sorted.end(), lighter_correction);
+    if (nbest != 0 && sorted.size() > nbest) {
+        sorted.resize(nbest);
     }
     CorrectionQueue correction_queue;
-    std::map<std::string, Weight>::iterator it;
-    for (it = corrections.begin(); it != corrections.end(); ++it) {
-        correction_queue.push(StringWeightPair(it->first, it->second));
+    for (std::vector<StringWeightPair>::const_iterator it = sorted.begin();
+         it != sorted.end(); ++it) {
+        correction_queue.push(*it);
     }
     return correction_queue;
 }
@@ -336,31 +489,49 @@ bool Speller::check(char * line)
     if (!init_input(line, lexicon->get_encoder(), NO_SYMBOL_NUMBER)) {
         return false;
     }
-    TreeNode start_node(lexicon->get_fd_table());
-    queue.assign(1, start_node);
+    checking = true;
+    start_search(false, std::numeric_limits<Weight>::infinity());
 
-    while (queue.size() > 0) {
-        if (queue.front().input_state == input.len()&&
-            lexicon->final_index(queue.front().lexicon_state)) {
+    while (has_queued()) {
+        size_t i = pop();
+        const TreeNode node = nodes[i];
+        ++nodes_expanded;
+        if (node.input_state == input.len()&&
+            lexicon->final_index(node.lexicon_state)) {
             return true;
         }
-        lexicon_epsilons();
-        lexicon_consume();
-        queue.pop_front();
+        lexicon_epsilons(node, i);
+        lexicon_consume(node, i);
     }
     return false;
 }
 
-std::string Speller::stringify(SymbolNumberVector symbol_vector)
+std::string Speller::stringify(const SymbolNumberVector & symbol_vector)
 {
     std::string s;
-    for (SymbolNumberVector::iterator it = symbol_vector.begin();
+    for (SymbolNumberVector::const_iterator it = symbol_vector.begin();
          it != symbol_vector.end(); ++it) {
+        // Epsilons and flags would make equal corrections look different
+        if (*it == 0 || lexicon->is_flag(*it)) {
+            continue;
+        }
         s.append(symbol_table[*it]);
     }
     return s;
 }
 
+std::string Speller::stringify(size_t i)
+{
+    output_scratch.clear();
+    for (; i != NO_TREE_NODE; i = nodes[i].parent) {
+        if (nodes[i].symbol != NO_SYMBOL_NUMBER) {
+            output_scratch.push_back(nodes[i].symbol);
+        }
+    }
+    std::reverse(output_scratch.begin(), output_scratch.end());
+    return stringify(output_scratch);
+}
+
 bool Speller::init_input(char * str,
                          const Encoder & encoder,
                          SymbolNumber other)
@@ -0,0 +1,290 @@
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+#include "ospell_batch.h"
+
+namespace hfst_ol {
+
+namespace {
+
+// Tokens handed to a thread at a time. Single tokens would have the
+// threads contending for the next one; larger blocks leave threads idle
+// at the end of a batch that has a few slow tokens.
+const size_t TOKENS_PER_BLOCK = 16;
+
+}
+
+BatchSpeller::BatchSpeller(Transducer * mutator_ptr, Transducer * lexicon_ptr,
+                           unsigned int threads):
+    mutator(mutator_ptr),
+    lexicon(lexicon_ptr),
+    spellers(),
+    nbest(0),
+    max_weight(std::numeric_limits<Weight>::infinity()),
+    cache()
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    , batch_tokens(NULL),
+    batch_results(NULL),
+    batch_blocks(0),
+    next_block(0),
+    batch_number(0),
+    helpers_working(0),
+    stopping(false)
+#endif
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+#else
+    threads = 1;
+#endif
+    if (threads == 0) {
+        threads = 1;
+    }
+    try {
+        for (unsigned int i = 0; i < threads; ++i) {
+            spellers.push_back(new Speller(mutator, lexicon));
+        }
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+        for (size_t i = 1; i < spellers.size(); ++i) {
+            helpers.push_back(std::thread(&BatchSpeller::help, this, i));
+        }
+#endif
+    } catch (...) {
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+        stop_helpers();
+#endif
+        for (size_t i = 0; i < spellers.size(); ++i) {
+            delete spellers[i];
+        }
+        throw;
+    }
+}
+
+BatchSpeller::~BatchSpeller(void)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    stop_helpers();
+#endif
+    for (size_t i = 0; i < spellers.size(); ++i) {
+        delete spellers[i];
+    }
+}
+
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+void BatchSpeller::stop_helpers(void)
+{
+    {
+        std::lock_guard<std::mutex> pool_lock(pool_mutex);
+        stopping = true;
+    }
+    batch_started.notify_all();
+    for (size_t i = 0; i < helpers.size(); ++i) {
+        helpers[i].join();
+    }
+    helpers.clear();
+}
+
+void BatchSpeller::help(size_t i)
+{
+    unsigned long batches_seen = 0;
+    std::unique_lock<std::mutex> pool_lock(pool_mutex);
+    while (true) {
+        batch_started.wait(pool_lock, [this, batches_seen]() {
+                return stopping || batch_number != batches_seen;
+            });
+        if (stopping) {
+            return;
+        }
+        batches_seen = batch_number;
+        pool_lock.unlock();
+        spell_blocks(i);
+        pool_lock.lock();
+        if (--helpers_working == 0) {
+            batch_done.notify_one();
+        }
+    }
+}
+
+void BatchSpeller::spell_blocks(size_t i)
+{
+    try {
+        for (size_t b = next_block++; b < batch_blocks; b = next_block++) {
+            size_t begin = b * TOKENS_PER_BLOCK;
+            size_t end = begin + TOKENS_PER_BLOCK;
+            spell_range(*spellers[i], *batch_tokens, *batch_results, begin,
+                        end < batch_tokens->size() ?
+                        end : batch_tokens->size());
+        }
+    } catch (...) {
+        errors[i] = std::current_exception();
+    }
+}
+#endif
+
+void BatchSpeller::set_nbest(unsigned int n)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    nbest = n;
+    cache.clear();
+}
+
+void BatchSpeller::set_max_weight(Weight w)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    max_weight = w;
+    cache.clear();
+}
+
+void BatchSpeller::set_cache_size(size_t size)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    cache.set_capacity(size);
+}
+
+size_t BatchSpeller::get_cache_hits(void) const
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> cache_lock(cache_mutex);
+#endif
+    return cache.get_hits();
+}
+
+size_t BatchSpeller::get_cache_misses(void) const
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> cache_lock(cache_mutex);
+#endif
+    return cache.get_misses();
+}
+
+void BatchSpeller::set_lookahead(bool on)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    for (size_t i = 0; i < spellers.size(); ++i) {
+        spellers[i]->use_lookahead = on;
+    }
+}
+
+size_t BatchSpeller::get_nodes_expanded(void)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    size_t nodes = 0;
+    for (size_t i = 0; i < spellers.size(); ++i) {
+        nodes += spellers[i]->nodes_expanded;
+    }
+    return nodes;
+}
+
+void BatchSpeller::spell(Speller & speller, const std::string & token,
+                         SpellResult & result)
+{
+    result.corrections.clear();
+    // The Speller wants a writable string
+    std::vector<char> buffer(token.begin(), token.end());
+    buffer.push_back('\0');
+    result.in_lexicon = speller.check(&buffer[0]);
+    if (result.in_lexicon) {
+        return;
+    }
+    if (cache.is_enabled()) {
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+        std::lock_guard<std::mutex> cache_lock(cache_mutex);
+#endif
+        const std::vector<StringWeightPair> * cached = cache.find(token);
+        if (cached != NULL) {
+            result.corrections = *cached;
+            return;
+        }
+    }
+    CorrectionQueue corrections = speller.correct(&buffer[0], nbest,
+                                                  max_weight);
+    result.corrections.reserve(corrections.size());
+    while (!corrections.empty()) {
+        result.corrections.push_back(corrections.top());
+        corrections.pop();
+    }
+    if (cache.is_enabled()) {
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+        std::lock_guard<std::mutex> cache_lock(cache_mutex);
+#endif
+        cache.insert(token, result.corrections);
+    }
+}
+
+void BatchSpeller::spell_range(Speller & speller, const StringVector & tokens,
+                               SpellResultVector & results,
+                               size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i) {
+        spell(speller, tokens[i], results[i]);
+    }
+}
+
+void BatchSpeller::spell(const StringVector & tokens,
+                         SpellResultVector & results)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    results.resize(tokens.size());
+    size_t blocks = (tokens.size() + TOKENS_PER_BLOCK - 1) / TOKENS_PER_BLOCK;
+    if (spellers.size() == 1 || blocks <= 1) {
+        spell_range(*spellers[0], tokens, results, 0, tokens.size());
+        return;
+    }
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    {
+        std::lock_guard<std::mutex> pool_lock(pool_mutex);
+        batch_tokens = &tokens;
+        batch_results = &results;
+        batch_blocks = blocks;
+        next_block = 0;
+        errors.assign(spellers.size(), std::exception_ptr());
+        helpers_working = helpers.size();
+        ++batch_number;
+    }
+    batch_started.notify_all();
+    spell_blocks(0);
+    {
+        std::unique_lock<std::mutex> pool_lock(pool_mutex);
+        batch_done.wait(pool_lock, [this]() { return helpers_working == 0; });
+        batch_tokens = NULL;
+        batch_results = NULL;
+    }
+    for (size_t i = 0; i < errors.size(); ++i) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+    }
+#endif
+}
+
+SpellResult BatchSpeller::spell(const std::string & token)
+{
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::lock_guard<std::mutex> batch_lock(batch_mutex);
+#endif
+    SpellResult result;
+    spell(*spellers[0], token, result);
+    return result;
+}
+
+}
@@ -0,0 +1,144 @@
+// -*- mode: c++; -*-
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+#ifndef _HFST_OL_TRANSDUCER_OSPELL_BATCH_H_
+#define _HFST_OL_TRANSDUCER_OSPELL_BATCH_H_
+
+#include <vector>
+#include <string>
+#include <limits>
+
+#include "transducer.h"
+#include "lookup_cache.h"
+
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  include <mutex>
+#  include <condition_variable>
+#  include <thread>
+#  include <atomic>
+#  include <exception>
+#endif
+
+namespace hfst_ol {
+
+/** \brief What spell-checking one token found. */
+struct SpellResult
+{
+    /* Whether the token is in the lexicon */
+    bool in_lexicon;
+    /* If it isn't, its corrections, the lightest first */
+    std::vector<StringWeightPair> corrections;
+
+    SpellResult(void): in_lexicon(false), corrections() {}
+};
+
+typedef std::vector<SpellResult> SpellResultVector;
+
+/** \brief Spell-checks batches of tokens in several threads.
+
+    Each thread has a Speller of its own, and they all share the error
+    model and the lexicon, which a search only reads. The threads are
+    started with the BatchSpeller and wait for batches in between, the
+    thread calling spell() taking part in the work. The corrections of
+    misspelled tokens are cached, so that a misspelling that recurs in the
+    input is corrected once for as long as it stays in the cache. The
+    results don't depend on the number of threads.
+
+    Several threads may call spell() on the same BatchSpeller; their
+    batches are then processed one after another. Without C++11 threads
+    everything is done in the calling thread.
+*/
+class BatchSpeller
+{
+protected:
+    Transducer * mutator;
+    Transducer * lexicon;
+    std::vector<Speller *> spellers;
+    unsigned int nbest;
+    Weight max_weight;
+    // Corrections of misspelled tokens, keyed on the token
+    LookupCache<std::vector<StringWeightPair> > cache;
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::mutex batch_mutex;
+    mutable std::mutex cache_mutex;
+
+    // The threads besides the caller's, helper i using spellers[i + 1]
+    std::vector<std::thread> helpers;
+    std::mutex pool_mutex;
+    std::condition_variable batch_started;
+    std::condition_variable batch_done;
+    // The batch being spelled, which helpers take blocks of
+    const StringVector * batch_tokens;
+    SpellResultVector * batch_results;
+    size_t batch_blocks;
+    std::atomic<size_t> next_block;
+    // Counts the batches, so that helpers know when there's a new one
+    unsigned long batch_number;
+    size_t helpers_working;
+    bool stopping;
+    // An error thrown by each speller in the current batch
+    std::vector<std::exception_ptr> errors;
+
+    /* Wait for batches and take blocks of them with spellers[i] */
+    void help(size_t i);
+    /* Spell-check blocks of the current batch with spellers[i] until
+        there are no more */
+    void spell_blocks(size_t i);
+    void stop_helpers(void);
+#endif
+
+    /* Spell-check \a token with \a speller, which no other thread uses */
+    void spell(Speller & speller, const std::string & token,
+               SpellResult & result);
+    /* Spell-check tokens[i] into results[i] for i in [begin, end) */
+    void spell_range(Speller & speller, const StringVector & tokens,
+                     SpellResultVector & results, size_t begin, size_t end);
+
+public:
+    /** Share \a mutator_ptr, the error model, and \a lexicon_ptr between
+        \a threads threads, 0 meaning one per core. The transducers must
+        outlive the BatchSpeller and not be used for anything that changes
+        them while it's in use. */
+    BatchSpeller(Transducer * mutator_ptr, Transducer * lexicon_ptr,
+                 unsigned int threads = 0);
+    ~BatchSpeller(void);
+
+    unsigned int get_thread_count(void) const
+        { return hfst::size_t_to_uint(spellers.size()); }
+
+    /** Give at most \a n corrections per token, 0 meaning all of them.
+        This empties the cache. */
+    void set_nbest(unsigned int n);
+    /** Give no corrections heavier than \a w. This empties the cache. */
+    void set_max_weight(Weight w);
+    /** Keep the corrections of the \a size most recently seen
+        misspellings. A \a size of zero, the default, disables the cache. */
+    void set_cache_size(size_t size);
+    size_t get_cache_hits(void) const;
+    size_t get_cache_misses(void) const;
+    /** Whether to leave out of the searches the paths that the
+        transducers' input lookahead rules out, as they do by default if
+        Transducer::build_input_lookahead() was called on the transducers
+        before the BatchSpeller was made. The results are the same either
+        way. */
+    void set_lookahead(bool on);
+    /** The search nodes expanded so far, for measuring the searches */
+    size_t get_nodes_expanded(void);
+
+    /** Check every token of \a tokens, and correct the ones that aren't
+        in the lexicon. results[i] is the result for tokens[i]. */
+    void spell(const StringVector & tokens, SpellResultVector & results);
+    /** As above, for a single token. */
+    SpellResult spell(const std::string & token);
+};
+
+}
+
+#endif // _HFST_OL_TRANSDUCER_OSPELL_BATCH_H_
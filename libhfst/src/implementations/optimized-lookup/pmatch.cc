@@ -9,9 +9,29 @@
 #include "pmatch.h"
 #include "hfst.h"
 
+#if !defined(NO_CPLUSPLUS_11)
+#  include <chrono>
+#endif
+
 using hfst::HfstTransducer;
 
 namespace hfst_ol {
+
+namespace {
+
+// Seconds from some fixed point, for measuring wall-clock time
+double wall_time(void)
+{
+#if !defined(NO_CPLUSPLUS_11)
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return ((double) time(NULL));
+#endif
+}
+
+}
+
 PmatchAlphabet::PmatchAlphabet(std::istream & inputstream,
                                SymbolNumber symbol_count,
                                PmatchContainer * cont):
@@ -69,6 +89,7 @@ PmatchAlphabet::PmatchAlphabet(TransducerAlphabet const & a,
     // We initialize the vector of which symbols have a printable representation
     // with false, then flip those that actually do to true
     printable_vector = std::vector<bool>(orig_symbol_count, false);
+    global_flags = std::vector<bool>(orig_symbol_count, false);
     for (SymbolNumber i = 1; i < symbol_table.size(); ++i) {
         if (is_special(symbol_table[i])) {
             add_special_symbol(symbol_table[i], i);
@@ -81,7 +102,8 @@ PmatchAlphabet::PmatchAlphabet(TransducerAlphabet const & a,
 }
 
 PmatchAlphabet::PmatchAlphabet(void):
-    TransducerAlphabet()
+    TransducerAlphabet(),
+    container(NULL)
 {}
 
 void PmatchAlphabet::add_symbol(const std::string & symbol)
@@ -110,9 +132,13 @@ void PmatchAlphabet::add_symbol(const std::string & symbol)
     TransducerAlphabet::add_symbol(symbol);
 }
 
-bool PmatchAlphabet::is_printable(SymbolNumber symbol)
+bool PmatchAlphabet::is_printable(SymbolNumber symbol) const
 {
-    return symbol < printable_vector.size() && printable_vector[symbol];
+    if (symbol < printable_vector.size()) {
+        return printable_vector[symbol];
+    }
+    // Symbols from the input that aren't in the alphabet
+    return symbol != NO_SYMBOL_NUMBER;
 }
 
 void PmatchAlphabet::add_special_symbol(const std::string & str,
@@ -268,11 +294,25 @@ void PmatchAlphabet::process_counter(std::string str, SymbolNumber sym)
     counters.push_back(0);
 }
 
-void PmatchAlphabet::count(SymbolNumber sym)
+void PmatchAlphabet::count(PmatchContext & c, SymbolNumber sym) const
 {
     if (is_counter(sym)) {
-        counters[sym]++;
+        if (c.counters.size() != counters.size()) {
+            c.counters = counters;
+        }
+        c.counters[sym]++;
+    }
+}
+
+/* The RTN for \a symbol, or NULL if it's in a mapped archive and hasn't
+   been loaded yet. The filters are built without loading anything, so
+   they take an RTN they can't see into as one that may match anything. */
+PmatchTransducer * PmatchContainer::rtn_if_loaded(SymbolNumber symbol) const
+{
+    if (lazy_rtns != NULL && lazy_rtns->has(symbol)) {
+        return lazy_rtns->get_loaded(symbol);
     }
+    return alphabet.get_rtn(symbol);
 }
 
 void PmatchContainer::collect_first_symbols(void)
@@ -280,7 +320,10 @@ void PmatchContainer::collect_first_symbols(void)
     // Fetch the first symbols from any
     // first-position rtn arcs in TOP. If they are potential epsilon loops,
     // clear out the set.
-    toplevel->collect_possible_first_symbols();
+    PmatchContext c;
+    reset_recursion(c);
+    possible_first_symbols.clear();
+    toplevel->collect_possible_first_symbols(c);
 
     SymbolNumber max_input_sym = 0;
     std::set<SymbolNumber> & possible_firsts = toplevel->possible_first_symbols;
@@ -288,13 +331,13 @@ void PmatchContainer::collect_first_symbols(void)
          it != possible_firsts.end(); ++it) {
         if (*it > max_input_sym) { max_input_sym = *it; }
         if (alphabet.has_rtn(*it)) {
-            if (alphabet.get_rtn(*it) == toplevel) {
+            PmatchTransducer * rtn = rtn_if_loaded(*it);
+            if (rtn == NULL || rtn == toplevel) {
                 possible_firsts.clear();
                 break;
             }
-            alphabet.get_rtn(*it)->collect_possible_first_symbols();
-            std::set<SymbolNumber> rtn_firsts =
-                alphabet.get_rtn(*it)->possible_first_symbols;
+            rtn->collect_possible_first_symbols(c);
+            std::set<SymbolNumber> rtn_firsts = rtn->possible_first_symbols;
             for (RtnNameMap::const_iterator it = alphabet.rtn_names.begin();
                  it != alphabet.rtn_names.end(); ++it) {
                 if (rtn_firsts.count(it->second) == 1) {
@@ -335,19 +378,325 @@ void PmatchContainer::collect_first_symbols(void)
             }
         }
     }
+    build_prefilter();
+    filters_stale = false;
+}
+
+// How deep in RTN calls the prefilter follows the input
+static const size_t PREFILTER_MAX_CALL_DEPTH = 16;
+// Upper limit for the size of the prefilter's tables of followers
+static const size_t PREFILTER_MAX_BYTES = 16 * 1024 * 1024;
+
+void PmatchContainer::build_prefilter(void)
+{
+    prefilter = PmatchPrefilter();
+    if (toplevel == NULL) {
+        return;
+    }
+    typedef std::pair<SymbolNumber, PmatchPrefilter::Position> Arc;
+    PmatchPrefilter::Position start;
+    start.transducer = toplevel;
+    start.index = 0;
+    std::vector<Arc> arcs;
+    if (!prefilter_closure(start, arcs)) {
+        // A match may be empty or begin with something we can't predict
+        return;
+    }
+    SymbolNumber other = orig_symbol_count;
+    std::map<SymbolNumber, SymbolNumberVector> list_members;
+    for (SymbolNumber sym = 0;
+         sym < other && sym < alphabet.symbol2lists.size(); ++sym) {
+        if (alphabet.symbol2lists[sym] == NO_SYMBOL_NUMBER) {
+            continue;
+        }
+        const SymbolNumberVector & lists =
+            alphabet.symbol_lists[alphabet.symbol2lists[sym]];
+        for (SymbolNumberVector::const_iterator it = lists.begin();
+             it != lists.end(); ++it) {
+            list_members[*it].push_back(sym);
+        }
+    }
+
+    // For each first symbol, the arcs that can consume it, and for each
+    // arc what may follow it (an empty vector for anything)
+    std::vector<std::vector<size_t> > arcs_of_symbol(other + 1);
+    std::vector<SymbolNumberVector> arc_followers;
+    std::vector<bool> arc_allows_anything;
+    SymbolNumberVector classes;
+    for (size_t k = 0; k < arcs.size(); ++k) {
+        std::vector<Arc> next_arcs;
+        SymbolNumberVector next_symbols;
+        bool anything = !prefilter_closure(arcs[k].second, next_arcs);
+        if (!anything) {
+            for (std::vector<Arc>::const_iterator it = next_arcs.begin();
+                 it != next_arcs.end(); ++it) {
+                prefilter_classes(it->first, list_members, classes);
+                next_symbols.insert(next_symbols.end(),
+                                    classes.begin(), classes.end());
+            }
+            std::sort(next_symbols.begin(), next_symbols.end());
+            next_symbols.erase(std::unique(next_symbols.begin(),
+                                           next_symbols.end()),
+                               next_symbols.end());
+        }
+        arc_followers.push_back(next_symbols);
+        arc_allows_anything.push_back(anything);
+        prefilter_classes(arcs[k].first, list_members, classes);
+        for (SymbolNumberVector::const_iterator it = classes.begin();
+             it != classes.end(); ++it) {
+            arcs_of_symbol[*it].push_back(k);
+        }
+    }
+
+    // First symbols that are consumed by the same arcs share a table
+    std::map<std::vector<size_t>, unsigned int> tables;
+    prefilter.other = other;
+    prefilter.first.assign(other + 1, 0);
+    for (SymbolNumber sym = 0; sym <= other; ++sym) {
+        const std::vector<size_t> & sym_arcs = arcs_of_symbol[sym];
+        if (sym_arcs.empty()) {
+            continue;
+        }
+        std::map<std::vector<size_t>, unsigned int>::const_iterator found =
+            tables.find(sym_arcs);
+        if (found != tables.end()) {
+            prefilter.first[sym] = found->second;
+            continue;
+        }
+        std::vector<char> next;
+        bool anything = false;
+        for (std::vector<size_t>::const_iterator it = sym_arcs.begin();
+             it != sym_arcs.end(); ++it) {
+            if (arc_allows_anything[*it]) {
+                anything = true;
+                break;
+            }
+            next.resize(other + 1, 0);
+            for (SymbolNumberVector::const_iterator follower =
+                     arc_followers[*it].begin();
+                 follower != arc_followers[*it].end(); ++follower) {
+                next[*follower] = 1;
+            }
+        }
+        if (anything) {
+            next.clear();
+        } else if (next.empty()) {
+            // Nothing can follow, which still needs a table
+            next.resize(other + 1, 0);
+        }
+        prefilter.followers.push_back(next);
+        unsigned int table = hfst::size_t_to_uint(prefilter.followers.size());
+        tables[sym_arcs] = table;
+        prefilter.first[sym] = table;
+    }
+    if (prefilter.followers.size() * (other + 1) > PREFILTER_MAX_BYTES) {
+        // Too big to be worth it, keep just the first symbols
+        for (size_t i = 0; i < prefilter.followers.size(); ++i) {
+            std::vector<char>().swap(prefilter.followers[i]);
+        }
+    }
+}
+
+/* Follow the arcs that don't consume input from \a start, through RTN
+   calls and returns, and put the arcs that consume input in \a arcs.
+   Returns false if a match could end on the way or we can't tell what
+   input comes next. */
+bool PmatchContainer::prefilter_closure(
+    const PmatchPrefilter::Position & start,
+    std::vector<std::pair<SymbolNumber,
+                          PmatchPrefilter::Position> > & arcs) const
+{
+    std::set<PmatchPrefilter::Position> seen;
+    std::vector<PmatchPrefilter::Position> todo(1, start);
+    std::vector<TransitionW> transitions;
+    while (!todo.empty()) {
+        PmatchPrefilter::Position pos = todo.back();
+        todo.pop_back();
+        if (!seen.insert(pos).second) {
+            continue;
+        }
+        if (pos.transducer->get_transitions(pos.index, transitions)) {
+            if (pos.returns.empty()) {
+                return false;
+            }
+            PmatchPrefilter::Position ret;
+            ret.transducer = pos.returns.back().first;
+            ret.index = pos.returns.back().second;
+            ret.returns.assign(pos.returns.begin(), pos.returns.end() - 1);
+            todo.push_back(ret);
+        }
+        for (std::vector<TransitionW>::const_iterator it = transitions.begin();
+             it != transitions.end(); ++it) {
+            SymbolNumber input = it->get_input_symbol();
+            SymbolNumber output = it->get_output_symbol();
+            PmatchPrefilter::Position next = pos;
+            next.index = it->get_target();
+            if (input == 0) {
+                if (output == alphabet.get_special(LC_entry)) {
+                    prefilter_skip_context(next, alphabet.get_special(LC_exit), todo);
+                } else if (output == alphabet.get_special(RC_entry)) {
+                    prefilter_skip_context(next, alphabet.get_special(RC_exit), todo);
+                } else if (output == alphabet.get_special(NLC_entry) ||
+                           output == alphabet.get_special(NRC_entry)) {
+                    // Matching goes on through the passthrough arcs of
+                    // this state
+                    continue;
+                } else if (alphabet.is_captured_tag(output)) {
+                    // This consumes whatever was captured
+                    return false;
+                } else {
+                    todo.push_back(next);
+                }
+            } else if (alphabet.is_flag_diacritic(input) ||
+                       input == alphabet.get_special(Pmatch_passthrough)) {
+                todo.push_back(next);
+            } else if (alphabet.has_rtn(input)) {
+                if (pos.returns.size() >= PREFILTER_MAX_CALL_DEPTH) {
+                    return false;
+                }
+                PmatchPrefilter::Position call;
+                call.transducer = rtn_if_loaded(input);
+                if (call.transducer == NULL) {
+                    return false;
+                }
+                call.index = 0;
+                call.returns = pos.returns;
+                call.returns.push_back(
+                    std::make_pair(pos.transducer, it->get_target()));
+                todo.push_back(call);
+            } else {
+                arcs.push_back(std::make_pair(input, next));
+            }
+        }
+    }
+    return true;
+}
+
+/* A positive context check doesn't move in the input, so skip from
+   \a start to wherever the context is exited. */
+void PmatchContainer::prefilter_skip_context(
+    const PmatchPrefilter::Position & start, SymbolNumber exit,
+    std::vector<PmatchPrefilter::Position> & after) const
+{
+    std::set<TransitionTableIndex> seen;
+    std::vector<TransitionTableIndex> todo(1, start.index);
+    std::vector<TransitionW> transitions;
+    while (!todo.empty()) {
+        TransitionTableIndex i = todo.back();
+        todo.pop_back();
+        if (!seen.insert(i).second) {
+            continue;
+        }
+        start.transducer->get_transitions(i, transitions);
+        for (std::vector<TransitionW>::const_iterator it = transitions.begin();
+             it != transitions.end(); ++it) {
+            if (it->get_input_symbol() == 0 && it->get_output_symbol() == exit) {
+                PmatchPrefilter::Position next = start;
+                next.index = it->get_target();
+                after.push_back(next);
+            } else {
+                todo.push_back(it->get_target());
+            }
+        }
+    }
+}
+
+/* The input symbols, with the prefilter's class for symbols that aren't
+   in the alphabet, that an arc with \a label can consume. */
+void PmatchContainer::prefilter_classes(
+    SymbolNumber label,
+    const std::map<SymbolNumber, SymbolNumberVector> & list_members,
+    SymbolNumberVector & classes) const
+{
+    SymbolNumber other = orig_symbol_count;
+    classes.clear();
+    if (label == alphabet.get_default_symbol()) {
+        for (SymbolNumber sym = 0; sym <= other; ++sym) {
+            classes.push_back(sym);
+        }
+        return;
+    }
+    if (label == alphabet.get_identity_symbol() ||
+        label == alphabet.get_unknown_symbol()) {
+        classes.push_back(other);
+        return;
+    }
+    if (label < alphabet.list2symbols.size() &&
+        alphabet.list2symbols[label] != NO_SYMBOL_NUMBER) {
+        std::map<SymbolNumber, SymbolNumberVector>::const_iterator members =
+            list_members.find(label);
+        if (members != list_members.end()) {
+            classes = members->second;
+        }
+        if (std::find(alphabet.exclusionary_lists.begin(),
+                      alphabet.exclusionary_lists.end(), label)
+            != alphabet.exclusionary_lists.end()) {
+            classes.push_back(other);
+        }
+        return;
+    }
+    if (label < other) {
+        classes.push_back(label);
+    }
+}
+
+/* The RTNs of an archive have the same alphabet as TOP, so theirs are
+   passed over without making anything of them. */
+static void skip_alphabet(std::istream & is, SymbolNumber symbol_count)
+{
+    for (SymbolNumber i = 0; i < symbol_count; ++i) {
+        is.ignore(std::numeric_limits<std::streamsize>::max(), '\0');
+    }
+    if (!is) {
+        HFST_THROW(TransducerHasWrongTypeException);
+    }
 }
 
 PmatchContainer::PmatchContainer(std::istream & inputstream):
-    entry_stack(),
+    lazy_rtns(NULL),
+    transducer_count(0),
+    verbose(false),
+    locate_mode(false),
+    profile_mode(false),
+    single_codepoint_tokenization(false),
+    memoize_rtns(false),
+    filters_stale(false)
+{
+    read_archive(inputstream, NULL);
+}
+
+PmatchContainer::PmatchContainer(MappedFile * file):
+    lazy_rtns(NULL),
+    transducer_count(0),
     verbose(false),
     locate_mode(false),
-    line_number(0),
     profile_mode(false),
     single_codepoint_tokenization(false),
-    running_weight(0.0)
+    memoize_rtns(false),
+    filters_stale(false)
+{
+    MemoryStreamBuf buf(file->get_data(), file->size());
+    std::istream inputstream(&buf);
+    try {
+        read_archive(inputstream, file);
+    } catch (...) {
+        if (lazy_rtns != NULL) {
+            delete lazy_rtns;
+        } else {
+            delete file;
+        }
+        throw;
+    }
+    if (lazy_rtns == NULL) {
+        // Everything has been copied out of the file already
+        delete file;
+    }
+}
+
+void PmatchContainer::read_archive(std::istream & inputstream,
+                                   MappedFile * file)
 {
     set_properties();
-    reset_recursion();
     std::string transducer_name;
     std::map<std::string, std::string> properties = parse_hfst3_header(inputstream);
     if (properties.count("name") == 0) {
@@ -370,8 +719,7 @@ PmatchContainer::PmatchContainer(std::istream & inputstream):
     hfst::set_xerox_composition(xerox_composition);
     TransducerHeader header(inputstream);
     alphabet = PmatchAlphabet(inputstream, header.symbol_count(), this);
-    orig_symbol_count = symbol_count = alphabet.get_orig_symbol_count();
-    global_flag_state = alphabet.get_fd_table();
+    orig_symbol_count = alphabet.get_orig_symbol_count();
     encoder = new Encoder(alphabet.get_symbol_table(), orig_symbol_count);
     toplevel = new hfst_ol::PmatchTransducer(
         inputstream,
@@ -380,6 +728,36 @@ PmatchContainer::PmatchContainer(std::istream & inputstream):
         alphabet,
         "TOP",
         this);
+    if (file != NULL && properties.count(rtn_index_property()) != 0) {
+        // Note where each RTN is and skip over it
+        lazy_rtns = new PmatchLazyRtns(this, file);
+        std::istringstream index(properties[rtn_index_property()]);
+        std::string line;
+        while (std::getline(index, line)) {
+            size_t tab = line.rfind('\t');
+            if (tab == std::string::npos) {
+                continue;
+            }
+            std::string name = line.substr(0, tab);
+            size_t size = strtoul(line.c_str() + tab + 1, NULL, 10);
+            properties = parse_hfst3_header(inputstream);
+            if (properties["name"] != name) {
+                HFST_THROW_MESSAGE(TransducerHeaderException,
+                                   "pmatch: RTN index doesn't match archive");
+            }
+            size_t offset = (size_t) inputstream.tellg();
+            if (offset + size > file->size()) {
+                HFST_THROW_MESSAGE(TransducerHeaderException,
+                                   "pmatch: RTN index doesn't match archive");
+            }
+            if (alphabet.rtn_names.count(name) != 0) {
+                lazy_rtns->add(alphabet.rtn_names[name], name, offset);
+            }
+            inputstream.seekg(offset + size);
+        }
+        collect_first_symbols();
+        return;
+    }
     while (inputstream.good()) {
         try {
             properties = parse_hfst3_header(inputstream);
@@ -388,8 +766,7 @@ PmatchContainer::PmatchContainer(std::istream & inputstream):
           (void)e; break;
         }
         header = TransducerHeader(inputstream);
-        TransducerAlphabet dummy = TransducerAlphabet(
-            inputstream, header.symbol_count());
+        skip_alphabet(inputstream, header.symbol_count());
         hfst_ol::PmatchTransducer * rtn =
             new hfst_ol::PmatchTransducer(inputstream,
                                           header.index_table_size(),
@@ -407,20 +784,19 @@ PmatchContainer::PmatchContainer(std::istream & inputstream):
 }
 
 PmatchContainer::PmatchContainer(Transducer * t):
-    entry_stack(),
+    lazy_rtns(NULL),
+    transducer_count(0),
     verbose(false),
     locate_mode(false),
     profile_mode(false),
     single_codepoint_tokenization(false),
-    running_weight(0.0)
+    memoize_rtns(false),
+    filters_stale(false)
 {
     set_properties();
-    reset_recursion();
     //TransducerHeader header = t->get_header();
     alphabet = PmatchAlphabet(t->get_alphabet(), this);
-    orig_symbol_count = symbol_count = alphabet.get_orig_symbol_count();
-    global_flag_state = alphabet.get_fd_table();
-    line_number = 0;
+    orig_symbol_count = alphabet.get_orig_symbol_count();
     encoder = new Encoder(alphabet.get_symbol_table(), orig_symbol_count);
     TransducerTable<TransitionW> transitions = t->copy_transitionw_table();
     TransducerTable<TransitionWIndex> indices = t->copy_windex_table();
@@ -438,16 +814,18 @@ PmatchContainer::PmatchContainer(Transducer * t):
 // so there's no advantage to passing it transducers in optimized-lookup
 // format.
 PmatchContainer::PmatchContainer(std::vector<HfstTransducer> transducers):
-    entry_stack(),
+    encoder(NULL),
+    toplevel(NULL),
+    lazy_rtns(NULL),
+    transducer_count(0),
     verbose(false),
     locate_mode(false),
-    line_number(0),
     profile_mode(false),
     single_codepoint_tokenization(false),
-    running_weight(0.0)
+    memoize_rtns(false),
+    filters_stale(false)
 {
     set_properties();
-    reset_recursion();
     if (transducers.size() == 0) {
         return;
     }
@@ -465,8 +843,7 @@ PmatchContainer::PmatchContainer(std::vector<HfstTransducer> transducers):
             hfst_transducer_to_hfst_ol(top);
         TransducerHeader header(backend->get_header());
         alphabet = PmatchAlphabet(backend->get_alphabet(), this);
-        orig_symbol_count = symbol_count = alphabet.get_orig_symbol_count();
-        global_flag_state = alphabet.get_fd_table();
+        orig_symbol_count = alphabet.get_orig_symbol_count();
         encoder = new Encoder(alphabet.get_symbol_table(), orig_symbol_count);
         TransducerTable<TransitionW> transitions = backend->copy_transitionw_table();
         TransducerTable<TransitionWIndex> indices = backend->copy_windex_table();
@@ -538,8 +915,7 @@ PmatchContainer::PmatchContainer(std::vector<HfstTransducer> transducers):
         //TransducerHeader header = harmonized_tmp->get_header();
         // this will be the alphabet of the entire container
         alphabet = PmatchAlphabet(harmonized_tmp->get_alphabet(), this);
-        orig_symbol_count = symbol_count = alphabet.get_orig_symbol_count();
-        global_flag_state = alphabet.get_fd_table();
+        orig_symbol_count = alphabet.get_orig_symbol_count();
         encoder = new Encoder(alphabet.get_symbol_table(), orig_symbol_count);
         TransducerTable<TransitionW> transitions = harmonized_tmp->copy_transitionw_table();
         TransducerTable<TransitionWIndex> indices = harmonized_tmp->copy_windex_table();
@@ -600,12 +976,29 @@ void PmatchContainer::add_rtn(Transducer * rtn, const std::string & name)
         this);
     if (!alphabet.has_rtn(name)) {
         alphabet.add_rtn(pmatch_rtn, name);
+        // The new RTN may begin matches with symbols that weren't
+        // possible before, so until they are rebuilt the filters let
+        // everything through
+        possible_first_symbols.clear();
+        prefilter = PmatchPrefilter();
+        filters_stale = true;
     } else {
         delete rtn;
     }
 }
 
-PmatchContainer::PmatchContainer(void)
+void PmatchContainer::finish_adding_rtns(void)
+{
+    collect_first_symbols();
+}
+
+PmatchContainer::PmatchContainer(void):
+    encoder(NULL),
+    toplevel(NULL),
+    lazy_rtns(NULL),
+    transducer_count(0),
+    memoize_rtns(false),
+    filters_stale(false)
 {
     // Not used, but apparently needed by swig to construct these
 }
@@ -722,29 +1115,45 @@ std::string PmatchAlphabet::name_from_insertion(const std::string & symbol)
     return symbol.substr(sizeof("@I.") - 1, symbol.size() - (sizeof("@I.@") - 1));
 }
 
-std::string PmatchAlphabet::end_tag(const SymbolNumber symbol)
+std::string PmatchAlphabet::end_tag(const SymbolNumber symbol) const
 {
-    if (end_tag_map.count(symbol) == 0) {
+    std::map<SymbolNumber, std::string>::const_iterator it =
+        end_tag_map.find(symbol);
+    if (it == end_tag_map.end()) {
         return "";
     } else {
-        return "</" + end_tag_map[symbol] + ">";
+        return "</" + it->second + ">";
     }
 }
 
-std::string PmatchAlphabet::start_tag(const SymbolNumber symbol)
+std::string PmatchAlphabet::start_tag(const SymbolNumber symbol) const
 {
-    if (end_tag_map.count(symbol) == 0) {
+    std::map<SymbolNumber, std::string>::const_iterator it =
+        end_tag_map.find(symbol);
+    if (it == end_tag_map.end()) {
         return "";
     } else {
-        return "<" + end_tag_map[symbol] + ">";
+        return "<" + it->second + ">";
     }
     
 }
 
+void PmatchAlphabet::count_pattern(PmatchContext & c,
+                                   SymbolNumber end_tag) const
+{
+    std::string tag = start_tag(end_tag);
+    if (c.pattern_counts.count(tag) == 0) {
+        c.pattern_counts[tag] = 1;
+    } else {
+        c.pattern_counts[tag] += 1;
+    }
+}
+
 PmatchContainer::~PmatchContainer(void)
 {
     delete encoder;
     delete toplevel;
+    delete lazy_rtns;
 }
 
 PmatchAlphabet::~PmatchAlphabet(void)
@@ -757,6 +1166,88 @@ PmatchAlphabet::~PmatchAlphabet(void)
 
 }
 
+const size_t PmatchLazyRtns::NO_RTN;
+
+PmatchLazyRtns::PmatchLazyRtns(PmatchContainer * cont, MappedFile * mapped_file):
+    container(cont), file(mapped_file), loaded(0)
+{}
+
+PmatchLazyRtns::~PmatchLazyRtns(void)
+{
+    for (std::deque<Entry>::iterator it = entries.begin();
+         it != entries.end(); ++it) {
+        delete it->transducer;
+    }
+    delete file;
+}
+
+void PmatchLazyRtns::add(SymbolNumber symbol, const std::string & name,
+                         size_t offset)
+{
+    if (has(symbol)) {
+        return;
+    }
+    if (entry_of_symbol.size() <= symbol) {
+        entry_of_symbol.resize(symbol + 1, NO_RTN);
+    }
+    entry_of_symbol[symbol] = entries.size();
+    entries.resize(entries.size() + 1);
+    entries.back().name = name;
+    entries.back().offset = offset;
+    entries.back().transducer = NULL;
+}
+
+PmatchTransducer * PmatchLazyRtns::get(SymbolNumber symbol)
+{
+    Entry & entry = entries[entry_of_symbol[symbol]];
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    PmatchTransducer * rtn = entry.transducer.load(std::memory_order_acquire);
+    if (rtn != NULL) {
+        return rtn;
+    }
+    std::lock_guard<std::mutex> lock(loading);
+    rtn = entry.transducer.load(std::memory_order_relaxed);
+    if (rtn == NULL) {
+        rtn = load(entry);
+        entry.transducer.store(rtn, std::memory_order_release);
+    }
+    return rtn;
+#else
+    if (entry.transducer == NULL) {
+        entry.transducer = load(entry);
+    }
+    return entry.transducer;
+#endif
+}
+
+PmatchTransducer * PmatchLazyRtns::get_loaded(SymbolNumber symbol) const
+{
+    const Entry & entry = entries[entry_of_symbol[symbol]];
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    return entry.transducer.load(std::memory_order_acquire);
+#else
+    return entry.transducer;
+#endif
+}
+
+PmatchTransducer * PmatchLazyRtns::load(Entry & entry)
+{
+    MemoryStreamBuf buf(file->get_data() + entry.offset,
+                        file->size() - entry.offset);
+    std::istream is(&buf);
+    TransducerHeader header(is);
+    skip_alphabet(is, header.symbol_count());
+    PmatchTransducer * rtn =
+        new PmatchTransducer(is,
+                             header.index_table_size(),
+                             header.target_table_size(),
+                             container->alphabet,
+                             entry.name,
+                             container);
+    ++loaded;
+    return rtn;
+}
+
 std::map<std::string, std::string> PmatchContainer::parse_hfst3_header(std::istream & f)
 {
     std::map<std::string, std::string> properties;
@@ -805,11 +1296,18 @@ std::map<std::string, std::string> PmatchContainer::parse_hfst3_header(std::istr
     }
 }
 
-void PmatchContainer::push_rtn_call(unsigned int return_index, PmatchTransducer * caller)
+void PmatchContext::push_rtn_call(unsigned int return_index,
+                                  const PmatchTransducer * caller,
+                                  RtnMemo * memo,
+                                  unsigned int tape_pos)
 {
+    ++rtn_frames;
     RtnStackFrame new_top;
     new_top.caller = caller;
     new_top.caller_index = return_index;
+    new_top.memo = memo;
+    new_top.tape_pos = tape_pos;
+    new_top.weight = running_weight;
     if (rtn_stacks.size() <= stack_depth) {
         rtn_stacks.push_back(RtnCallStack(1, new_top));
     } else {
@@ -817,21 +1315,34 @@ void PmatchContainer::push_rtn_call(unsigned int return_index, PmatchTransducer
     }
 }
 
-RtnStackFrame PmatchContainer::rtn_stack_top(void)
+RtnStackFrame PmatchContext::rtn_stack_top(void) const
 {
     return rtn_stacks[stack_depth].back();
 }
 
-PmatchTransducer * PmatchContainer::get_latest_rtn_caller(void)
+const PmatchTransducer * PmatchContext::get_latest_rtn_caller(void) const
 {
     return rtn_stacks[stack_depth - 1].back().caller;
 }
 
-void PmatchContainer::rtn_stack_pop(void)
+void PmatchContext::rtn_stack_pop(void)
 {
+    --rtn_frames;
     rtn_stacks[stack_depth].pop_back();
 }
 
+void PmatchContext::taint_rtn_memos(void)
+{
+    // The call in progress from each depth is the latest one made from it
+    for (unsigned int depth = 0;
+         depth < stack_depth && depth < rtn_stacks.size(); ++depth) {
+        if (!rtn_stacks[depth].empty() &&
+            rtn_stacks[depth].back().memo != NULL) {
+            rtn_stacks[depth].back().memo->tainted = true;
+        }
+    }
+}
+
 void PmatchAlphabet::add_rtn(PmatchTransducer * rtn, std::string const & name)
 {
     SymbolNumber symbol = rtn_names[name];
@@ -852,27 +1363,33 @@ bool PmatchAlphabet::has_rtn(std::string const & name) const
         return false;
     }
 #else	
-    return rtn_names.count(name) != 0 &&
-        rtn_names.at(name) < rtns.size() && rtns[rtn_names.at(name)] != NULL;
+    return rtn_names.count(name) != 0 && has_rtn(rtn_names.at(name));
 #endif
 }
 
 bool PmatchAlphabet::has_rtn(SymbolNumber symbol) const
 {
-    return symbol < rtns.size() && rtns[symbol] != NULL;
+    return symbol < rtns.size() &&
+        (rtns[symbol] != NULL ||
+         (container != NULL && container->lazy_rtns != NULL &&
+          container->lazy_rtns->has(symbol)));
 }
 
-PmatchTransducer * PmatchAlphabet::get_rtn(SymbolNumber symbol)
+PmatchTransducer * PmatchAlphabet::get_rtn(SymbolNumber symbol) const
 {
+    if (rtns[symbol] == NULL && container != NULL &&
+        container->lazy_rtns != NULL && container->lazy_rtns->has(symbol)) {
+        return container->lazy_rtns->get(symbol);
+    }
     return rtns[symbol];
 }
 
 PmatchTransducer * PmatchAlphabet::get_rtn(std::string name)
 {
-    return rtns[rtn_names[name]];
+    return get_rtn(rtn_names[name]);
 }
 
-std::string PmatchAlphabet::get_counter_name(SymbolNumber symbol)
+std::string PmatchAlphabet::get_counter_name(SymbolNumber symbol) const
 {
     if (symbol_table.size() <= symbol) {
         return "INVALID_COUNTER";
@@ -890,116 +1407,422 @@ SymbolNumber PmatchAlphabet::get_special(SpecialSymbol special) const
     return special_symbols.at(special);
 }
 
-void PmatchContainer::process(const std::string & input_str)
-{
-    initialize_input(input_str.c_str());
-    unsigned int input_pos = 0;
-    unsigned int printable_input_pos = 0;
-    running_weight = 0.0;
-    stack_depth = 0;
-    best_input_pos = 0;
-
-    ++line_number;
-    result.clear();
-    locations.clear();
-    old_captures.clear();
-    best_captures.clear();
-    captures.clear();
-    reset_recursion();
-    DoubleTape nonmatching_locations;
-    while (has_queued_input(input_pos)) {
-        best_result.clear();
-        SymbolNumber current_input = input[input_pos];
-        if (not_possible_first_symbol(current_input)) {
-            copy_to_result(current_input, current_input);
-            ++input_pos;
-            if (locate_mode && alphabet.is_printable(current_input)) {
-                ++printable_input_pos;
-                nonmatching_locations.push_back(
+void PmatchContainer::process(const std::string & input_str,
+                              PmatchContext & c,
+                              const PmatchBudget & b) const
+{
+    initialize_input(input_str.c_str(), c);
+    start_scan(c, b);
+    c.input_complete = true;
+    scan_input(c);
+    flush_nonmatching(c);
+    c.spent.time = wall_time() - c.spent.start_time;
+}
+
+/* Get \a c ready for scanning a new input from the beginning, with the
+   budget \a b. */
+void PmatchContainer::start_scan(PmatchContext & c,
+                                 const PmatchBudget & b) const
+{
+    c.scan_pos = 0;
+    c.printable_scan_pos = 0;
+    c.nonmatching_locations.clear();
+    c.running_weight = 0.0;
+    c.stack_depth = 0;
+    c.best_input_pos = 0;
+    c.global_flag_state = alphabet.get_fd_table();
+
+    ++c.line_number;
+    c.result.clear();
+    c.locations.clear();
+    c.old_captures.clear();
+    c.best_captures.clear();
+    c.captures.clear();
+    c.rtn_memo.clear();
+    c.candidate_bytes = 0;
+    c.rtn_frames = 0;
+    c.budget = b;
+    c.spent.clear();
+    c.spent.start_time = wall_time();
+    reset_recursion(c);
+}
+
+/* Look for matches from c.scan_pos onwards, as far as the input goes.
+
+   If the input isn't complete, stop at the first position where a match
+   attempt looked past the end of the input, as more input could change
+   its result, unless the input has at least \a max_lookahead symbols
+   from there on (when \a max_lookahead isn't 0). */
+void PmatchContainer::scan_input(PmatchContext & c,
+                                 size_t max_lookahead) const
+{
+    std::vector<unsigned long> old_counters;
+    unsigned int old_best_input_pos = 0;
+    Weight old_best_weight = 0.0;
+    while (c.has_queued_input(c.scan_pos)) {
+        c.best_result.clear();
+        SymbolNumber current_input = c.input[c.scan_pos];
+        // Once the budget is spent, the rest of the input goes through as is
+        bool skip = c.budget_exhausted() ||
+            not_possible_first_symbol(current_input);
+        if (!skip && prefilter.is_enabled()) {
+            if (!c.input_complete && c.scan_pos + 1 == c.input.size()) {
+                // The prefilter wants to see the next symbol too
+                return;
+            }
+            skip = !prefilter.may_start_at(c.input, c.scan_pos);
+        }
+        if (skip) {
+            copy_to_result(c, current_input, current_input);
+            ++c.scan_pos;
+            if (c.locate_mode && alphabet.is_printable(current_input)) {
+                ++c.printable_scan_pos;
+                c.nonmatching_locations.push_back(
                     SymbolPair(current_input, current_input));
+                if (!c.input_complete && max_lookahead > 0 &&
+                    c.nonmatching_locations.size() >= max_lookahead) {
+                    flush_nonmatching(c);
+                }
             }
             continue;
         }
-        tape.clear();
-        tape_locations.clear();
+        c.tape.clear();
+        c.tape_locations.clear();
+        c.candidate_bytes = 0;
         unsigned int tape_pos = 0;
-        unsigned int old_input_pos = input_pos;
-        toplevel->match(input_pos, tape_pos);
-        if (candidate_found()) {
+        unsigned int old_input_pos = c.scan_pos;
+        if (!c.input_complete) {
+            c.input_exhausted = false;
+            old_counters = c.counters;
+            old_best_input_pos = c.best_input_pos;
+            old_best_weight = c.best_weight;
+        }
+        toplevel->match(c, c.scan_pos, tape_pos);
+        if (!c.input_complete && c.input_exhausted &&
+            !c.budget_exhausted() &&
+            (max_lookahead == 0 ||
+             c.input.size() - c.scan_pos < max_lookahead)) {
+            // Try again when there's more input
+            c.counters.swap(old_counters);
+            c.best_input_pos = old_best_input_pos;
+            c.best_weight = old_best_weight;
+            c.rtn_memo.clear();
+            return;
+        }
+        if (c.candidate_found()) {
             // We got some output
-            if (locate_mode) {
+            if (c.locate_mode) {
                 // First we put into the locations vector all the nonmatching parts we've seen
-                if (!nonmatching_locations.empty()) {
-                    LocationVector ls;
-                    Location nonmatching = alphabet.locatefy(printable_input_pos - hfst::size_t_to_uint(nonmatching_locations.size()),
-                                                             WeightedDoubleTape(nonmatching_locations, 0.0));
-                    nonmatching.output = "@_NONMATCHING_@";
-                    ls.push_back(nonmatching);
-                    locations.push_back(ls);
-                    nonmatching_locations.clear();
-                }
+                flush_nonmatching(c);
                 LocationVector ls;
-                for (WeightedDoubleTapeVector::iterator it = tape_locations.begin();
-                     it != tape_locations.end(); ++it) {
-                    ls.push_back(alphabet.locatefy(printable_input_pos,
-                                                   *it));
+                for (WeightedDoubleTapeVector::iterator it = c.tape_locations.begin();
+                     it != c.tape_locations.end(); ++it) {
+                    ls.push_back(alphabet.locatefy(c.printable_scan_pos,
+                                                   *it, c));
                 }
                 sort(ls.begin(), ls.end());
-                locations.push_back(ls);
-                printable_input_pos += (best_input_pos - old_input_pos);
+                c.locations.push_back(ls);
+                c.printable_scan_pos += (c.best_input_pos - old_input_pos);
             } else {
-                copy_to_result(best_result);
+                copy_to_result(c, c.best_result);
             }
-            input_pos = best_input_pos;
-            old_captures.insert(old_captures.end(), best_captures.begin(), best_captures.end());
+            c.scan_pos = c.best_input_pos;
+            c.old_captures.insert(c.old_captures.end(), c.best_captures.begin(), c.best_captures.end());
         }
-        if (!candidate_found() || input_pos == old_input_pos) {
+        if (!c.candidate_found() || c.scan_pos == old_input_pos) {
             // If no input was consumed, we move one position up
-            copy_to_result(current_input, current_input);
-            ++input_pos;
-            if (locate_mode && alphabet.is_printable(current_input)) {
-                ++printable_input_pos;
-                nonmatching_locations.push_back(SymbolPair(current_input, current_input));
+            copy_to_result(c, current_input, current_input);
+            ++c.scan_pos;
+            if (c.locate_mode && alphabet.is_printable(current_input)) {
+                ++c.printable_scan_pos;
+                c.nonmatching_locations.push_back(SymbolPair(current_input, current_input));
             }
         }
     }
-    if (locate_mode && !nonmatching_locations.empty()) {
-        LocationVector ls;
-        Location nonmatching = alphabet.locatefy(printable_input_pos - hfst::size_t_to_uint(nonmatching_locations.size()),
-                                                 WeightedDoubleTape(nonmatching_locations, 0.0));
-        nonmatching.output = "@_NONMATCHING_@";
-        ls.push_back(nonmatching);
-        locations.push_back(ls);
+}
+
+/* In locate mode, report the input passed over since the last match. */
+void PmatchContainer::flush_nonmatching(PmatchContext & c) const
+{
+    if (!c.locate_mode || c.nonmatching_locations.empty()) {
+        return;
     }
+    LocationVector ls;
+    Location nonmatching = alphabet.locatefy(c.printable_scan_pos - hfst::size_t_to_uint(c.nonmatching_locations.size()),
+                                             WeightedDoubleTape(c.nonmatching_locations, 0.0), c);
+    nonmatching.output = "@_NONMATCHING_@";
+    ls.push_back(nonmatching);
+    c.locations.push_back(ls);
+    c.nonmatching_locations.clear();
 }
 
 std::string PmatchContainer::match(const std::string & input,
                                    double time_cutoff,
                                    Weight weight_cutoff)
 {
-    max_time = time_cutoff;
-    if (max_time > 0.0) {
-        start_clock = clock();
-        call_counter = 0;
-        limit_reached = false;
+    if (filters_stale) {
+        finish_adding_rtns();
     }
-    locate_mode = false;
-    process(input);
-    return alphabet.stringify(result);
+    return match(input, context, time_cutoff, weight_cutoff);
 }
 
 LocationVectorVector PmatchContainer::locate(const std::string & input,
                                              double time_cutoff,
                                              Weight weight_cutoff)
 {
-    max_time = time_cutoff;
-    if (max_time > 0.0) {
-        start_clock = clock();
-        call_counter = 0;
-        limit_reached = false;
+    if (filters_stale) {
+        finish_adding_rtns();
+    }
+    return locate(input, context, time_cutoff, weight_cutoff);
+}
+
+std::string PmatchContainer::match(const std::string & input,
+                                   PmatchContext & c,
+                                   double time_cutoff,
+                                   Weight weight_cutoff) const
+{
+    c.max_time = time_cutoff;
+    if (c.max_time > 0.0) {
+        c.start_clock = clock();
+        c.call_counter = 0;
+        c.limit_reached = false;
+    }
+    c.locate_mode = false;
+    process(input, c);
+    return alphabet.stringify(c.result, c);
+}
+
+LocationVectorVector PmatchContainer::locate(const std::string & input,
+                                             PmatchContext & c,
+                                             double time_cutoff,
+                                             Weight weight_cutoff) const
+{
+    c.max_time = time_cutoff;
+    if (c.max_time > 0.0) {
+        c.start_clock = clock();
+        c.call_counter = 0;
+        c.limit_reached = false;
+    }
+    c.locate_mode = true;
+    process(input, c);
+    return c.locations;
+}
+
+std::string PmatchContainer::match(const std::string & input,
+                                   PmatchContext & c,
+                                   const PmatchBudget & b) const
+{
+    c.max_time = 0.0;
+    c.locate_mode = false;
+    process(input, c, b);
+    return alphabet.stringify(c.result, c);
+}
+
+LocationVectorVector PmatchContainer::locate(const std::string & input,
+                                             PmatchContext & c,
+                                             const PmatchBudget & b) const
+{
+    c.max_time = 0.0;
+    c.locate_mode = true;
+    process(input, c, b);
+    return c.locations;
+}
+
+// How many symbols that aren't in the alphabet a stream holds on to at
+// least before it drops the ones it doesn't need any more
+static const size_t MIN_EXTRA_SYMBOLS_LIMIT = 1024;
+
+PmatchStream::PmatchStream(const PmatchContainer & cont, bool locate):
+    container(cont),
+    symbol_bytes(4),
+    max_lookahead(65536),
+    finished(false),
+    printable_seen(false),
+    retry_lookahead(0),
+    extra_symbols_limit(MIN_EXTRA_SYMBOLS_LIMIT)
+{
+    // Any symbol could be cut short at the end of a buffer, as could a
+    // UTF-8 character that isn't in the alphabet
+    const SymbolTable & symbols = container.alphabet.get_symbol_table();
+    for (SymbolNumber i = 0;
+         i < container.orig_symbol_count && i < symbols.size(); ++i) {
+        symbol_bytes = std::max(symbol_bytes, symbols[i].size());
+    }
+    context.locate_mode = locate;
+    container.initialize_input("", context);
+    if (container.alphabet.get_special(boundary) != NO_SYMBOL_NUMBER) {
+        // The boundary at the end comes when the stream does
+        context.input.pop_back();
+    }
+    container.start_scan(context);
+    context.input_complete = false;
+}
+
+void PmatchStream::push(const char * data, size_t length)
+{
+    if (finished) {
+        HFST_THROW_MESSAGE(HfstException,
+                           "pmatch: input pushed to a finished stream");
+    }
+    pending.append(data, length);
+    process_pending();
+}
+
+void PmatchStream::finish(void)
+{
+    if (finished) {
+        return;
+    }
+    finished = true;
+    process_pending();
+}
+
+void PmatchStream::process_pending(void)
+{
+    size_t limit = finished ? pending.size() :
+        (pending.size() > symbol_bytes ? pending.size() - symbol_bytes : 0);
+    size_t done = 0;
+    while (done < limit) {
+        done += container.tokenize_input(pending.c_str() + done,
+                                         limit - done, context);
+        if (done < limit && pending[done] == '\0') {
+            ++done;
+        }
+    }
+    pending.erase(0, done);
+    if (finished) {
+        SymbolNumber boundary_sym =
+            container.alphabet.get_special(boundary);
+        if (boundary_sym != NO_SYMBOL_NUMBER) {
+            context.input.push_back(boundary_sym);
+        }
+        context.input_complete = true;
+    }
+    if (finished ||
+        context.input.size() - context.scan_pos >= retry_lookahead) {
+        container.scan_input(context, max_lookahead);
+        // If a match attempt ran out of input, scanning stopped where it
+        // began. Trying it again costs as much as the input after that,
+        // so it waits until there's twice as much, which keeps the work
+        // linear in the length of the stream.
+        retry_lookahead = 0;
+        if (!finished && context.scan_pos < context.input.size()) {
+            retry_lookahead = 2 * (context.input.size() - context.scan_pos);
+            if (max_lookahead > 0 && retry_lookahead > max_lookahead) {
+                retry_lookahead = max_lookahead;
+            }
+        }
+    }
+    if (finished) {
+        container.flush_nonmatching(context);
+    }
+    context.spent.time = wall_time() - context.spent.start_time;
+    drop_processed_input();
+}
+
+/* Forget the input that is behind the scanning position by more than a
+   left context can look. */
+void PmatchStream::drop_processed_input(void)
+{
+    size_t keep = container.max_context_length + 1;
+    if (context.scan_pos <= keep) {
+        return;
+    }
+    unsigned int drop = context.scan_pos - hfst::size_t_to_uint(keep);
+    context.input.erase(context.input.begin(),
+                        context.input.begin() + drop);
+    context.scan_pos -= drop;
+    context.best_input_pos =
+        context.best_input_pos > drop ? context.best_input_pos - drop : 0;
+    std::vector<Capture> captures;
+    for (std::vector<Capture>::const_iterator it =
+             context.old_captures.begin();
+         it != context.old_captures.end(); ++it) {
+        if (it->begin >= drop) {
+            Capture capture = *it;
+            capture.begin -= drop;
+            capture.end -= drop;
+            captures.push_back(capture);
+        }
+    }
+    context.old_captures.swap(captures);
+    // The memo table is by input position
+    context.rtn_memo.clear();
+    drop_unused_extra_symbols();
+}
+
+static void renumber_extra_symbol(SymbolNumber & symbol,
+                                  SymbolNumber first_extra,
+                                  const SymbolTable & extra_symbols,
+                                  std::vector<SymbolNumber> & new_numbers,
+                                  SymbolTable & kept)
+{
+    if (symbol < first_extra) {
+        return;
+    }
+    SymbolNumber & new_number = new_numbers[symbol - first_extra];
+    if (new_number == NO_SYMBOL_NUMBER) {
+        new_number = hfst::size_t_to_uint(first_extra + kept.size());
+        kept.push_back(extra_symbols[symbol - first_extra]);
+    }
+    symbol = new_number;
+}
+
+/* Forget the symbols that aren't in the alphabet and are no longer in the
+   input held on to or in the output that hasn't been taken yet, and
+   number the rest from the beginning again. This is done once there are
+   twice as many as were kept the last time. */
+void PmatchStream::drop_unused_extra_symbols(void)
+{
+    if (context.extra_symbols.size() < extra_symbols_limit) {
+        return;
+    }
+    SymbolNumber first_extra = hfst::size_t_to_uint(
+        container.alphabet.get_symbol_table().size());
+    std::vector<SymbolNumber> new_numbers(context.extra_symbols.size(),
+                                          NO_SYMBOL_NUMBER);
+    SymbolTable kept;
+    for (SymbolNumberVector::iterator it = context.input.begin();
+         it != context.input.end(); ++it) {
+        renumber_extra_symbol(*it, first_extra, context.extra_symbols,
+                              new_numbers, kept);
+    }
+    for (DoubleTape::iterator it = context.result.begin();
+         it != context.result.end(); ++it) {
+        renumber_extra_symbol(it->input, first_extra, context.extra_symbols,
+                              new_numbers, kept);
+        renumber_extra_symbol(it->output, first_extra, context.extra_symbols,
+                              new_numbers, kept);
+    }
+    for (DoubleTape::iterator it = context.nonmatching_locations.begin();
+         it != context.nonmatching_locations.end(); ++it) {
+        renumber_extra_symbol(it->input, first_extra, context.extra_symbols,
+                              new_numbers, kept);
+        renumber_extra_symbol(it->output, first_extra, context.extra_symbols,
+                              new_numbers, kept);
     }
-    locate_mode = true;
-    process(input);
+    context.extra_symbols.swap(kept);
+    context.extra_symbol_numbers.clear();
+    for (size_t i = 0; i < context.extra_symbols.size(); ++i) {
+        context.extra_symbol_numbers[context.extra_symbols[i]] =
+            hfst::size_t_to_uint(first_extra + i);
+    }
+    extra_symbols_limit = std::max(MIN_EXTRA_SYMBOLS_LIMIT,
+                                   2 * context.extra_symbols.size());
+}
+
+std::string PmatchStream::take_output(void)
+{
+    std::string output = container.alphabet.stringify(context.result, context,
+                                                      printable_seen);
+    context.result.clear();
+    return output;
+}
+
+LocationVectorVector PmatchStream::take_locations(void)
+{
+    LocationVectorVector locations;
+    locations.swap(context.locations);
     return locations;
 }
 
@@ -1013,20 +1836,29 @@ bool counter_comp(std::pair<std::string, unsigned long> l,
 
 std::string PmatchContainer::get_profiling_info(void)
 {
+    return get_profiling_info(context);
+}
+
+std::string PmatchContainer::get_profiling_info(const PmatchContext & c) const
+{
+    // A context that hasn't passed a counter has no copy of them yet
+    const std::vector<unsigned long> & counters =
+        c.counters.size() == alphabet.counters.size() ?
+        c.counters : alphabet.counters;
     std::stringstream retval;
     size_t max_name_len = 0;
     retval << "Profiling information:\n";
     retval << "  Traversals of Counter() positions:\n";
     std::vector<std::pair<std::string, unsigned long> > counter_name_val_pairs;
-    for(SymbolNumber i = 0; i < alphabet.counters.size(); ++i) {
-        if (alphabet.counters[i] != NO_COUNTER) {
+    for(SymbolNumber i = 0; i < counters.size(); ++i) {
+        if (counters[i] != NO_COUNTER) {
             std::string counter_name = alphabet.get_counter_name(i);
             if (counter_name.size() > max_name_len) {
                 max_name_len = counter_name.size();
             }
             counter_name_val_pairs.push_back(
                 std::pair<std::string, unsigned long>(counter_name,
-                                                      alphabet.counters[i]));
+                                                      counters[i]));
         }
     }
     std::sort(counter_name_val_pairs.begin(), counter_name_val_pairs.end(),
@@ -1041,15 +1873,25 @@ std::string PmatchContainer::get_profiling_info(void)
         }
         retval << it->second << "\n";
     }
+    retval << "  RTN calls:\n";
+    retval << "    Made            " << c.rtn_calls << "\n";
+    if (memoize_rtns) {
+        retval << "    From memo table " << c.rtn_memo_hits << "\n";
+    }
     return retval.str();
 }
 
 std::string PmatchContainer::get_pattern_count_info(void)
+{
+    return get_pattern_count_info(context);
+}
+
+std::string PmatchContainer::get_pattern_count_info(const PmatchContext & c) const
 {
     size_t total = 0;
     std::string retval = "Pattern\t\t# of matches\n------------------------\n";
-    for (std::map<std::string, size_t>::iterator it = pattern_counts.begin();
-         it != pattern_counts.end(); ++it) {
+    for (std::map<std::string, size_t>::const_iterator it = c.pattern_counts.begin();
+         it != c.pattern_counts.end(); ++it) {
         retval.append(it->first);
         retval.append("\t\t");
         std::ostringstream converter;
@@ -1067,24 +1909,114 @@ std::string PmatchContainer::get_pattern_count_info(void)
     return retval;
 }
 
-void PmatchContainer::copy_to_result(const DoubleTape & best_result)
+std::string PmatchContainer::get_budget_info(const PmatchContext & c) const
+{
+    const PmatchBudgetUsage & spent = c.spent;
+    // Name the transducers by their numbers
+    std::vector<std::string> names(transducer_count);
+    if (toplevel != NULL && toplevel->local_index < names.size()) {
+        names[toplevel->local_index] = "TOP";
+    }
+    for (RtnNameMap::const_iterator it = alphabet.rtn_names.begin();
+         it != alphabet.rtn_names.end(); ++it) {
+        const PmatchTransducer * rtn = NULL;
+        if (it->second < alphabet.rtns.size()) {
+            rtn = alphabet.rtns[it->second];
+        }
+        if (rtn == NULL && lazy_rtns != NULL && lazy_rtns->has(it->second)) {
+            rtn = lazy_rtns->get_loaded(it->second);
+        }
+        if (rtn != NULL && rtn->local_index < names.size()) {
+            names[rtn->local_index] = it->first;
+        }
+    }
+    std::vector<std::pair<std::string, unsigned long> > steps;
+    size_t max_name_len = 0;
+    for (size_t i = 0; i < spent.steps_by_transducer.size(); ++i) {
+        if (spent.steps_by_transducer[i] == 0) {
+            continue;
+        }
+        std::string name = i < names.size() ? names[i] : "";
+        if (name.empty()) {
+            std::ostringstream converter;
+            converter << "#" << i;
+            name = converter.str();
+        }
+        max_name_len = std::max(max_name_len, name.size());
+        steps.push_back(std::pair<std::string, unsigned long>(
+                            name, spent.steps_by_transducer[i]));
+    }
+    std::sort(steps.begin(), steps.end(), counter_comp);
+
+    std::stringstream retval;
+    retval << "Budget:\n";
+    if (spent.exhausted != PmatchBudgetUsage::NO_LIMIT) {
+        retval << "  Ran out of " << PmatchBudgetUsage::limit_name(spent.exhausted)
+               << " at input position " << spent.exhausted_at << "\n";
+    }
+    retval << "  Seconds         " << spent.time;
+    if (c.budget.max_time > 0.0) {
+        retval << " of " << c.budget.max_time;
+    }
+    retval << "\n  Steps           " << spent.steps;
+    if (c.budget.max_steps > 0) {
+        retval << " of " << c.budget.max_steps;
+    }
+    retval << "\n";
+    if (c.budget.is_limited()) {
+        retval << "  Peak bytes      " << spent.peak_bytes;
+        if (c.budget.max_bytes > 0) {
+            retval << " of " << c.budget.max_bytes;
+        }
+        retval << "\n";
+        for (size_t i = 0; i < PmatchBudgetUsage::BYTE_KINDS; ++i) {
+            std::string kind = PmatchBudgetUsage::byte_kind_name(
+                (PmatchBudgetUsage::ByteKind) i);
+            retval << "    " << kind << std::string(14 - kind.size(), ' ')
+                   << spent.peak_bytes_by_kind[i] << "\n";
+        }
+    }
+    retval << "  Steps by transducer:\n";
+    for (std::vector<std::pair<std::string, unsigned long> >::const_iterator it =
+             steps.begin(); it != steps.end(); ++it) {
+        retval << "    " << it->first
+               << std::string(max_name_len + 8 - it->first.size(), ' ')
+               << it->second << "\n";
+    }
+    return retval.str();
+}
+
+void PmatchContainer::copy_to_result(PmatchContext & c,
+                                     const DoubleTape & best_result) const
 {
     for (DoubleTape::const_iterator it = best_result.begin();
          it != best_result.end(); ++it) {
-        result.push_back(*it);
+        c.result.push_back(*it);
     }
 }
 
-void PmatchContainer::copy_to_result(SymbolNumber input_sym, SymbolNumber output_sym)
+void PmatchContainer::copy_to_result(PmatchContext & c,
+                                     SymbolNumber input_sym,
+                                     SymbolNumber output_sym) const
 {
-    result.push_back(SymbolPair(input_sym, output_sym));
+    c.result.push_back(SymbolPair(input_sym, output_sym));
 }
 
-std::string PmatchAlphabet::stringify(const DoubleTape & str)
+std::string PmatchAlphabet::string_from_symbol(const PmatchContext & c,
+                                               SymbolNumber symbol) const
+{
+    if (symbol >= symbol_table.size()) {
+        return c.extra_symbols[symbol - symbol_table.size()];
+    }
+    return TransducerAlphabet::string_from_symbol(symbol);
+}
+
+std::string PmatchAlphabet::stringify(const DoubleTape & str,
+                                      PmatchContext & c,
+                                      bool & input_contained_printable_symbol) const
 {
     std::string retval;
     std::stack<unsigned int> start_tag_pos;
-    bool input_contained_printable_symbol = false;
     for (DoubleTape::const_iterator it = str.begin();
          it != str.end(); ++it) {
         if (!input_contained_printable_symbol && is_printable(it->input)) {
@@ -1099,11 +2031,7 @@ std::string PmatchAlphabet::stringify(const DoubleTape & str)
             }
         } else if (is_end_tag(output)) {
             if (container->count_patterns && input_contained_printable_symbol) {
-                if ((container->pattern_counts).count(start_tag(output)) == 0) {
-                    (container->pattern_counts)[start_tag(output)] = 1;
-                } else {
-                    (container->pattern_counts)[start_tag(output)] += 1;
-                }
+                count_pattern(c, output);
             }
             unsigned int pos;
             if (start_tag_pos.size() == 0) {
@@ -1122,7 +2050,7 @@ std::string PmatchAlphabet::stringify(const DoubleTape & str)
         } else {
             if ((!(container->extract_patterns) || start_tag_pos.size() != 0)
                 && is_printable(output)) {
-                retval.append(string_from_symbol(output));
+                retval.append(string_from_symbol(c, output));
             }
         }
     }
@@ -1130,7 +2058,8 @@ std::string PmatchAlphabet::stringify(const DoubleTape & str)
 }
 
 Location PmatchAlphabet::locatefy(unsigned int input_offset,
-                                  const WeightedDoubleTape & str)
+                                  const WeightedDoubleTape & str,
+                                  PmatchContext & c) const
 {
     Location retval;
     retval.start = input_offset;
@@ -1146,22 +2075,18 @@ Location PmatchAlphabet::locatefy(unsigned int input_offset,
         SymbolNumber output = it->output;
         if (is_end_tag(output)) {
             if (container->count_patterns) {
-                if ((container->pattern_counts).count(start_tag(output)) == 0) {
-                    (container->pattern_counts)[start_tag(output)] = 1;
-                } else {
-                    (container->pattern_counts)[start_tag(output)] += 1;
-                }
+                count_pattern(c, output);
             }
             retval.tag = start_tag(output);
             continue;
         }
         if (is_printable(output)) {
-            std::string s = string_from_symbol(output);
+            std::string s = string_from_symbol(c, output);
             retval.output.append(s);
             retval.output_symbol_strings.push_back(s);
         }
         if (is_printable(input)) {
-            std::string s = string_from_symbol(input);
+            std::string s = string_from_symbol(c, input);
             retval.input.append(s);
             retval.input_symbol_strings.push_back(s);
             ++input_offset;
@@ -1193,17 +2118,26 @@ std::string PmatchContainer::get_unsatisfied_rtn_name(void) const
     return "";
 }
 
-bool PmatchContainer::has_queued_input(unsigned int input_pos)
+bool PmatchContext::has_queued_input(unsigned int input_pos) const
 {
     // we catch underflow due to left context checking here
-    return input_pos < input.size() && (input_pos + 1 != 0);
+    if (input_pos < input.size()) {
+        return true;
+    }
+    if (!input_complete && input_pos + 1 != 0) {
+        input_exhausted = true;
+    }
+    return false;
 }
 
-bool PmatchContainer::input_matches_at(unsigned int pos,
-                                       SymbolNumberVector::iterator begin,
-                                       SymbolNumberVector::iterator end)
+bool PmatchContext::input_matches_at(unsigned int pos,
+                                     SymbolNumberVector::const_iterator begin,
+                                     SymbolNumberVector::const_iterator end) const
 {
     if (pos + (end - begin) > input.size()) {
+        if (!input_complete) {
+            input_exhausted = true;
+        }
         return false;
     }
     for (size_t i = 0; begin + i != end; ++i) {
@@ -1214,28 +2148,132 @@ bool PmatchContainer::input_matches_at(unsigned int pos,
     return true;
 }
 
+void PmatchContext::add_counts(const PmatchContext & other)
+{
+    for (std::map<std::string, size_t>::const_iterator it =
+             other.pattern_counts.begin();
+         it != other.pattern_counts.end(); ++it) {
+        pattern_counts[it->first] += it->second;
+    }
+    rtn_calls += other.rtn_calls;
+    rtn_memo_hits += other.rtn_memo_hits;
+    if (counters.size() != other.counters.size()) {
+        if (counters.size() == 0) {
+            counters = other.counters;
+        }
+        return;
+    }
+    for (size_t i = 0; i < counters.size(); ++i) {
+        if (counters[i] != NO_COUNTER) {
+            counters[i] += other.counters[i];
+        }
+    }
+}
+
+void PmatchBudgetUsage::clear(void)
+{
+    exhausted = NO_LIMIT;
+    exhausted_at = 0;
+    start_time = 0.0;
+    time = 0.0;
+    steps = 0;
+    steps_by_transducer.clear();
+    peak_bytes = 0;
+    for (size_t i = 0; i < BYTE_KINDS; ++i) {
+        peak_bytes_by_kind[i] = 0;
+    }
+}
+
+const char * PmatchBudgetUsage::limit_name(Limit limit)
+{
+    switch (limit) {
+    case TIME_LIMIT: return "time";
+    case STEP_LIMIT: return "steps";
+    case BYTE_LIMIT: return "bytes";
+    default: return "none";
+    }
+}
+
+const char * PmatchBudgetUsage::byte_kind_name(ByteKind kind)
+{
+    switch (kind) {
+    case TAPE_BYTES: return "Tape";
+    case CANDIDATE_BYTES: return "Candidates";
+    case CAPTURE_BYTES: return "Captures";
+    case RTN_CALL_BYTES: return "RTN calls";
+    case RTN_MEMO_BYTES: return "RTN memos";
+    default: return "";
+    }
+}
+
+size_t PmatchContext::measure_bytes(
+    size_t by_kind[PmatchBudgetUsage::BYTE_KINDS]) const
+{
+    by_kind[PmatchBudgetUsage::TAPE_BYTES] =
+        tape.capacity() * sizeof(SymbolPair);
+    by_kind[PmatchBudgetUsage::CANDIDATE_BYTES] =
+        candidate_bytes + best_result.capacity() * sizeof(SymbolPair);
+    by_kind[PmatchBudgetUsage::CAPTURE_BYTES] =
+        (captures.capacity() + best_captures.capacity() +
+         old_captures.capacity()) * sizeof(Capture);
+    // Each call pushes a frame and a set of local variables
+    by_kind[PmatchBudgetUsage::RTN_CALL_BYTES] = rtn_frames *
+        (sizeof(RtnStackFrame) + sizeof(PmatchTransducer::LocalVariables));
+    by_kind[PmatchBudgetUsage::RTN_MEMO_BYTES] = rtn_memo.get_bytes();
+    size_t total = 0;
+    for (size_t i = 0; i < PmatchBudgetUsage::BYTE_KINDS; ++i) {
+        total += by_kind[i];
+    }
+    return total;
+}
+
+bool PmatchContext::check_budget(void)
+{
+    if (budget_exhausted()) {
+        return true;
+    }
+    PmatchBudgetUsage::Limit limit = PmatchBudgetUsage::NO_LIMIT;
+    if (budget.max_steps > 0 && spent.steps > budget.max_steps) {
+        limit = PmatchBudgetUsage::STEP_LIMIT;
+    }
+    // Reading the clock costs about as much as a thousand steps
+    if (budget.max_time > 0.0 && spent.steps % 1024 == 0) {
+        spent.time = wall_time() - spent.start_time;
+        if (spent.time > budget.max_time) {
+            limit = PmatchBudgetUsage::TIME_LIMIT;
+        }
+    }
+    size_t by_kind[PmatchBudgetUsage::BYTE_KINDS];
+    size_t bytes = measure_bytes(by_kind);
+    if (bytes > spent.peak_bytes) {
+        spent.peak_bytes = bytes;
+        std::copy(by_kind, by_kind + PmatchBudgetUsage::BYTE_KINDS,
+                  spent.peak_bytes_by_kind);
+    }
+    if (budget.max_bytes > 0 && bytes > budget.max_bytes) {
+        limit = PmatchBudgetUsage::BYTE_LIMIT;
+    }
+    if (limit == PmatchBudgetUsage::NO_LIMIT) {
+        return false;
+    }
+    spent.exhausted = limit;
+    spent.exhausted_at = scan_pos;
+    taint_rtn_memos();
+    return true;
+}
+
 PmatchTransducer::PmatchTransducer(std::istream & is,
                                    TransitionTableIndex index_table_size,
                                    TransitionTableIndex transition_table_size,
                                    PmatchAlphabet & alpha,
                                    std::string _name,
                                    PmatchContainer * cont):
-    alphabet(alpha),
     name(_name),
+    local_index(cont->transducer_count++),
+    alphabet(alpha),
     container(cont)
 {
-    orig_symbol_count = hfst::size_t_to_uint(alphabet.get_symbol_table().size());
-    // initialize the stack for local variables
-    LocalVariables local_variables;
-    local_variables.flag_state = alphabet.get_fd_table();
-    local_variables.tape_step = 1;
-    local_variables.max_context_length_remaining = 254;
-    local_variables.context = none;
-    local_variables.context_placeholder = 0;
-    local_variables.default_symbol_trap = false;
-    local_variables.negative_context_success = false;
-    local_variables.pending_passthrough = false;
-    local_stack.push(local_variables);
+    init_local_variables();
 
     // Allocate and read tables
     char * indextab = (char*) malloc(TransitionWIndex::size * index_table_size);
@@ -1258,6 +2296,7 @@ PmatchTransducer::PmatchTransducer(std::istream & is,
         transitiontab += TransitionW::size;
     }
     free(orig_p);
+    find_memoizable();
 }
 
 PmatchTransducer::PmatchTransducer(std::vector<TransitionW> transition_vector,
@@ -1265,30 +2304,84 @@ PmatchTransducer::PmatchTransducer(std::vector<TransitionW> transition_vector,
                                    PmatchAlphabet & alpha,
                                    std::string _name,
                                    PmatchContainer * cont):
+    name(_name),
+    local_index(cont->transducer_count++),
     transition_table(transition_vector),
     index_table(index_vector),
     alphabet(alpha),
-    name(_name),
     container(cont)
+{
+    init_local_variables();
+    find_memoizable();
+}
+
+void PmatchTransducer::init_local_variables(void)
 {
     orig_symbol_count = hfst::size_t_to_uint(alphabet.get_symbol_table().size());
-    // initialize the stack for local variables
-    LocalVariables local_variables;
-    local_variables.flag_state = alphabet.get_fd_table();
-    local_variables.tape_step = 1;
-    local_variables.max_context_length_remaining = 254;
-    local_variables.context = none;
-    local_variables.context_placeholder = 0;
-    local_variables.default_symbol_trap = false;
-    local_variables.negative_context_success = false;
-    local_variables.pending_passthrough = false;
-    local_stack.push(local_variables);
+    // the bottom of the stack for local variables
+    initial_local_variables.flag_state = alphabet.get_fd_table();
+    initial_local_variables.tape_step = 1;
+    initial_local_variables.max_context_length_remaining = 254;
+    initial_local_variables.context = none;
+    initial_local_variables.context_placeholder = 0;
+    initial_local_variables.default_symbol_trap = false;
+    initial_local_variables.negative_context_success = false;
+    initial_local_variables.pending_passthrough = false;
+}
+
+/* A RTN may be memoised if nothing it does depends on or affects the
+   state of its caller apart from the input, the tape and the weight. It
+   may still call RTNs that can't be memoised, which is seen only when
+   they get called. */
+void PmatchTransducer::find_memoizable(void)
+{
+    memoizable = true;
+    SymbolNumberVector impure;
+    impure.push_back(alphabet.get_special(entry));
+    impure.push_back(alphabet.get_special(exit));
+    impure.push_back(alphabet.get_special(LC_entry));
+    impure.push_back(alphabet.get_special(RC_entry));
+    impure.push_back(alphabet.get_special(NLC_entry));
+    impure.push_back(alphabet.get_special(NRC_entry));
+    for (std::vector<TransitionW>::const_iterator it = transition_table.begin();
+         it != transition_table.end(); ++it) {
+        SymbolNumber input = it->get_input_symbol();
+        SymbolNumber output = it->get_output_symbol();
+        if (input == NO_SYMBOL_NUMBER) {
+            continue;
+        }
+        if (alphabet.is_global_flag(input) ||
+            (input == 0 &&
+             (std::find(impure.begin(), impure.end(), output) != impure.end() ||
+              alphabet.is_capture_tag(output) ||
+              alphabet.is_captured_tag(output) ||
+              alphabet.is_counter(output)))) {
+            memoizable = false;
+            return;
+        }
+    }
+}
+
+PmatchTransducer::LocalStack &
+PmatchTransducer::get_local_stack(PmatchContext & c) const
+{
+    // A deque doesn't move its elements when it grows, so the stacks of
+    // transducers further up the call chain stay where they are
+    while (c.local_stacks.size() <= local_index) {
+        c.local_stacks.push_back(LocalStack());
+    }
+    LocalStack & local_stack = c.local_stacks[local_index];
+    if (local_stack.empty()) {
+        local_stack.push(initial_local_variables);
+    }
+    return local_stack;
 }
 
 // Precompute which symbols may be at the start of a match.
 // For now we ignore default arcs, as does the rest of pmatch.
-void PmatchTransducer::collect_possible_first_symbols(void)
+void PmatchTransducer::collect_possible_first_symbols(PmatchContext & c)
 {
+    possible_first_symbols.clear();
     SymbolNumberVector input_symbols;
     SymbolNumberVector special_symbol_v = alphabet.get_specials();
     std::set<SymbolNumber> special_symbols(special_symbol_v.begin(),
@@ -1315,7 +2408,7 @@ void PmatchTransducer::collect_possible_first_symbols(void)
     }
     std::set<TransitionTableIndex> seen_indices;
     try {
-        collect_first(0, input_symbols, seen_indices);
+        collect_first(c, 0, input_symbols, seen_indices);
     } catch (bool e) {
         // If the end state can be reached without any input
         // or we have initial wildcards
@@ -1326,36 +2419,75 @@ void PmatchTransducer::collect_possible_first_symbols(void)
 
 }
 
-void PmatchTransducer::collect_first_epsilon(TransitionTableIndex i,
+bool PmatchTransducer::get_transitions(TransitionTableIndex i,
+                                       std::vector<TransitionW> & transitions) const
+{
+    transitions.clear();
+    if (indexes_transition_table(i)) {
+        i -= TRANSITION_TARGET_TABLE_START;
+        bool final = transition_table[i].final();
+        for (++i; i < transition_table.size() &&
+                 transition_table[i].get_input_symbol() != NO_SYMBOL_NUMBER; ++i) {
+            transitions.push_back(transition_table[i]);
+        }
+        return final;
+    }
+    for (SymbolNumber sym = 0; sym < orig_symbol_count; ++sym) {
+        TransitionTableIndex slot = i + 1 + sym;
+        if (slot >= index_table.size()) {
+            break;
+        }
+        if (index_table[slot].get_input_symbol() != sym) {
+            continue;
+        }
+        for (TransitionTableIndex t =
+                 index_table[slot].get_target() - TRANSITION_TARGET_TABLE_START;
+             t < transition_table.size(); ++t) {
+            SymbolNumber input = transition_table[t].get_input_symbol();
+            // Flags and RTN calls are indexed along with the epsilons
+            if (input != sym &&
+                (sym != 0 || input == NO_SYMBOL_NUMBER ||
+                 !(alphabet.is_flag_diacritic(input) ||
+                   alphabet.has_rtn(input)))) {
+                break;
+            }
+            transitions.push_back(transition_table[t]);
+        }
+    }
+    return index_table[i].final();
+}
+
+void PmatchTransducer::collect_first_epsilon(PmatchContext & c,
+                                             TransitionTableIndex i,
                                              SymbolNumberVector const& input_symbols,
                                              std::set<TransitionTableIndex> & seen_indices)
 {
     while(true) {
         SymbolNumber output = transition_table[i].get_output_symbol();
         if (transition_table[i].get_input_symbol() == 0) {
-            if (!checking_context()) {
-                if (!try_entering_context(output)) {
-                    collect_first(transition_table[i].get_target(), input_symbols, seen_indices);
+            if (!checking_context(c)) {
+                if (!try_entering_context(c, output)) {
+                    collect_first(c, transition_table[i].get_target(), input_symbols, seen_indices);
                     ++i;
                 } else {
                     // We're going to fake through a context
-                    collect_first(transition_table[i].get_target(), input_symbols, seen_indices);
+                    collect_first(c, transition_table[i].get_target(), input_symbols, seen_indices);
                     ++i;
                 }
             } else {
                 // We *are* checking context and may be done
-                if (try_exiting_context(output)) {
-                    collect_first(transition_table[i].get_target(), input_symbols, seen_indices);
+                if (try_exiting_context(c, output)) {
+                    collect_first(c, transition_table[i].get_target(), input_symbols, seen_indices);
                     ++i;
                 } else {
                     // Don't touch output when checking context
-                    collect_first(transition_table[i].get_target(), input_symbols, seen_indices);
+                    collect_first(c, transition_table[i].get_target(), input_symbols, seen_indices);
                     ++i;
                 }
             }
         } else if (alphabet.is_flag_diacritic(
                        transition_table[i].get_input_symbol())) {
-            collect_first(transition_table[i].get_target(), input_symbols, seen_indices);
+            collect_first(c, transition_table[i].get_target(), input_symbols, seen_indices);
             ++i;
         } else if (alphabet.has_rtn(transition_table[i].get_input_symbol())) {
             possible_first_symbols.insert(transition_table[i].get_input_symbol());
@@ -1368,29 +2500,31 @@ void PmatchTransducer::collect_first_epsilon(TransitionTableIndex i,
 
 }
 
-void PmatchTransducer::collect_first_epsilon_index(TransitionTableIndex i,
+void PmatchTransducer::collect_first_epsilon_index(PmatchContext & c,
+                                                   TransitionTableIndex i,
                                                    SymbolNumberVector const& input_symbols,
                                                    std::set<TransitionTableIndex> & seen_indices)
 {
     if (index_table[i].get_input_symbol() == 0) {
-        collect_first_epsilon(
+        collect_first_epsilon(c,
             index_table[i].get_target() - TRANSITION_TARGET_TABLE_START,
             input_symbols, seen_indices);
     }
 }
 
-void PmatchTransducer::collect_first_transition(TransitionTableIndex i,
+void PmatchTransducer::collect_first_transition(PmatchContext & c,
+                                                TransitionTableIndex i,
                                                 SymbolNumberVector const& input_symbols,
                                                 std::set<TransitionTableIndex> & seen_indices)
 {
     for (SymbolNumberVector::const_iterator it = input_symbols.begin();
          it != input_symbols.end(); ++it) {
         if (transition_table[i].get_input_symbol() == *it) {
-            if (!checking_context()) {
+            if (!checking_context(c)) {
                 // if this is unknown or identity, game over
                 if (*it == alphabet.get_identity_symbol() ||
                     *it == alphabet.get_unknown_symbol()) {
-                    container->reset_recursion();
+                    container->reset_recursion(c);
                     throw true;
                 }
                 if (alphabet.list2symbols[*it] != NO_SYMBOL_NUMBER) {
@@ -1400,7 +2534,7 @@ void PmatchTransducer::collect_first_transition(TransitionTableIndex i,
                                   alphabet.exclusionary_lists.end(),
                                   *it)
                         != alphabet.exclusionary_lists.end()) {
-                        container->reset_recursion();
+                        container->reset_recursion(c);
                         throw true;
                     }
                     for (SymbolNumberVector::const_iterator sym_it =
@@ -1413,37 +2547,39 @@ void PmatchTransducer::collect_first_transition(TransitionTableIndex i,
                 }
             } else {
                 // faking through a context check
-                collect_first(transition_table[i].get_target(),
+                collect_first(c, transition_table[i].get_target(),
                               input_symbols, seen_indices);
             }
         }
     }
 }
 
-void PmatchTransducer::collect_first_index(TransitionTableIndex i,
+void PmatchTransducer::collect_first_index(PmatchContext & c,
+                                           TransitionTableIndex i,
                                            SymbolNumberVector const& input_symbols,
                                            std::set<TransitionTableIndex> & seen_indices)
 {
     for (SymbolNumberVector::const_iterator it = input_symbols.begin();
          it != input_symbols.end(); ++it) {
         if (index_table[i+*it].get_input_symbol() == *it) {
-            collect_first_transition(index_table[i+*it].get_target() -
+            collect_first_transition(c, index_table[i+*it].get_target() -
                                      TRANSITION_TARGET_TABLE_START,
                                      input_symbols, seen_indices);
         }
     }
 }
 
-void PmatchTransducer::collect_first(TransitionTableIndex i,
+void PmatchTransducer::collect_first(PmatchContext & c,
+                                     TransitionTableIndex i,
                                      SymbolNumberVector const& input_symbols,
                                      std::set<TransitionTableIndex> & seen_indices)
 {
-    if (!container->try_recurse()) {
-        container->reset_recursion();
+    if (!c.try_recurse()) {
+        container->reset_recursion(c);
         throw true;
     }
     if (seen_indices.count(i) == 1) {
-        container->unrecurse();
+        c.unrecurse();
         return;
     } else {
         seen_indices.insert(i);
@@ -1455,20 +2591,20 @@ void PmatchTransducer::collect_first(TransitionTableIndex i,
         // If we can get to finality without any input,
         // throw a bool indicating that the full input set is needed
         if (transition_table[i].final()) {
-            container->reset_recursion();
+            container->reset_recursion(c);
             throw true;
         }
 
-        collect_first_epsilon(i+1, input_symbols, seen_indices);
-        collect_first_transition(i+1, input_symbols, seen_indices);
+        collect_first_epsilon(c, i+1, input_symbols, seen_indices);
+        collect_first_transition(c, i+1, input_symbols, seen_indices);
         
     } else {
         if (index_table[i].final()) {
-            container->reset_recursion();
+            container->reset_recursion(c);
             throw true;
         }
-        collect_first_epsilon_index(i+1, input_symbols, seen_indices);
-        collect_first_index(i+1, input_symbols, seen_indices);
+        collect_first_epsilon_index(c, i+1, input_symbols, seen_indices);
+        collect_first_index(c, i+1, input_symbols, seen_indices);
     }
 }
 
@@ -1551,23 +2687,38 @@ void PmatchContainer::set_properties(std::map<std::string, std::string> & proper
     }
 }
 
-void PmatchContainer::initialize_input(const char * input_s)
+void PmatchContainer::initialize_input(const char * input_s,
+                                       PmatchContext & c) const
+{
+    c.input.clear();
+    c.extra_symbols.clear();
+    c.extra_symbol_numbers.clear();
+    SymbolNumber boundary_sym = alphabet.get_special(boundary);
+    if (boundary_sym != NO_SYMBOL_NUMBER) {
+        c.input.push_back(boundary_sym);
+    }
+    tokenize_input(input_s, std::string::npos, c);
+    if (boundary_sym != NO_SYMBOL_NUMBER) {
+        c.input.push_back(boundary_sym);
+    }
+}
+
+/* Append the symbols of \a input_s to c.input, up to its end or until
+   \a limit bytes have been consumed, and return how many bytes were. */
+size_t PmatchContainer::tokenize_input(const char * input_s, size_t limit,
+                                       PmatchContext & c) const
 {
-    input.clear();
     char * input_str = const_cast<char *>(input_s);
     char ** input_str_ptr = &input_str;
     SymbolNumber k = NO_SYMBOL_NUMBER;
-    SymbolNumber boundary_sym = alphabet.get_special(boundary);
     char * single_codepoint_scratch;
     char * single_codepoint_scratch_orig = NULL;
     if (single_codepoint_tokenization) {
         single_codepoint_scratch = new char[5];
         single_codepoint_scratch_orig = single_codepoint_scratch;
     }
-    if (boundary_sym != NO_SYMBOL_NUMBER) {
-        input.push_back(boundary_sym);
-    }
-    while (**input_str_ptr != 0) {
+    while (**input_str_ptr != 0 &&
+           (size_t)(*input_str_ptr - input_s) < limit) {
         char * original_input_loc = *input_str_ptr;
         if (single_codepoint_tokenization) {
             int bytes_to_tokenize = nByte_utf8(**input_str_ptr);
@@ -1593,43 +2744,70 @@ void PmatchContainer::initialize_input(const char * input_s)
                 // if utf-8 tokenization fails too, just grab a byte
                 bytes_to_tokenize = 1;
             }
-            char new_symbol[5];
-            memcpy(new_symbol, *input_str_ptr, bytes_to_tokenize);
-            new_symbol[bytes_to_tokenize] = '\0';
+            std::string new_symbol(*input_str_ptr, bytes_to_tokenize);
             (*input_str_ptr) += bytes_to_tokenize;
-            alphabet.add_symbol(new_symbol);
-            encoder->read_input_symbol(new_symbol, symbol_count);
-            k = symbol_count;
-            ++symbol_count;
+            // Give it a number past the end of the alphabet, the same
+            // one every time it appears in this input
+            std::map<std::string, SymbolNumber>::const_iterator extra =
+                c.extra_symbol_numbers.find(new_symbol);
+            if (extra != c.extra_symbol_numbers.end()) {
+                k = extra->second;
+            } else {
+                k = hfst::size_t_to_uint(alphabet.get_symbol_table().size()
+                                         + c.extra_symbols.size());
+                c.extra_symbols.push_back(new_symbol);
+                c.extra_symbol_numbers[new_symbol] = k;
+            }
         }
-        input.push_back(k);
-    }
-    if (boundary_sym != NO_SYMBOL_NUMBER) {
-        input.push_back(boundary_sym);
+        c.input.push_back(k);
     }
     if (single_codepoint_tokenization) {
         delete single_codepoint_scratch_orig;
     }
-    return;
+    return *input_str_ptr - input_s;
 }
 
-void PmatchTransducer::match(unsigned int input_tape_pos,
-                             unsigned int tape_pos)
+void PmatchTransducer::match(PmatchContext & c,
+                             unsigned int input_tape_pos,
+                             unsigned int tape_pos) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     local_stack.top().context = none;
     local_stack.top().tape_step = 1;
     local_stack.top().context_placeholder = 0;
     local_stack.top().default_symbol_trap = false;
-    get_analyses(input_tape_pos, tape_pos, 0);
+    get_analyses(c, input_tape_pos, tape_pos, 0);
 }
 
-void PmatchTransducer::rtn_call(unsigned int input_tape_pos,
+void PmatchTransducer::rtn_call(PmatchContext & c,
+                                unsigned int input_tape_pos,
                                 unsigned int tape_pos,
-                                PmatchTransducer * caller,
-                                TransitionTableIndex caller_index)
-{
-    container->push_rtn_call(caller_index, caller);
-    container->increase_stack_depth();
+                                const PmatchTransducer * caller,
+                                TransitionTableIndex caller_index) const
+{
+    ++c.rtn_calls;
+    RtnMemo * memo = NULL;
+    bool was_exhausted = c.input_exhausted;
+    if (container->memoize_rtns) {
+        if (!memoizable) {
+            // This could make the callers' results differ from call to call
+            c.taint_rtn_memos();
+        } else {
+            RtnMemo * found = c.rtn_memo.find(this, input_tape_pos);
+            if (found == NULL) {
+                memo = c.rtn_memo.add(this, input_tape_pos);
+                c.input_exhausted = false;
+            } else if (found->complete) {
+                replay_rtn_call(c, *found, tape_pos, caller, caller_index);
+                return;
+            }
+            // Otherwise we're being called from within ourselves at the
+            // same position, which just doesn't get memoised
+        }
+    }
+    LocalStack & local_stack = get_local_stack(c);
+    c.push_rtn_call(caller_index, caller, memo, tape_pos);
+    c.increase_stack_depth();
     LocalVariables new_top(local_stack.top());
     new_top.flag_state = alphabet.get_fd_table();
     new_top.tape_step = 1;
@@ -1637,87 +2815,144 @@ void PmatchTransducer::rtn_call(unsigned int input_tape_pos,
     new_top.context_placeholder = 0;
     new_top.default_symbol_trap = false;
     local_stack.push(new_top);
-    get_analyses(input_tape_pos, tape_pos, 0);
+    get_analyses(c, input_tape_pos, tape_pos, 0);
     local_stack.pop();
-    container->decrease_stack_depth();
-    container->rtn_stack_pop();
+    c.decrease_stack_depth();
+    c.rtn_stack_pop();
+    if (memo != NULL) {
+        if (memo->tainted) {
+            c.rtn_memo.remove(this, input_tape_pos);
+        } else {
+            memo->complete = true;
+            memo->exhausted = c.input_exhausted;
+        }
+        c.input_exhausted = c.input_exhausted || was_exhausted;
+    }
 }
 
-void PmatchTransducer::rtn_return(unsigned int input_tape_pos,
-                                  unsigned int tape_pos)
+/* Return to the caller in each of the ways a call was seen to return
+   before, without going through the RTN. */
+void PmatchTransducer::replay_rtn_call(PmatchContext & c,
+                                       const RtnMemo & memo,
+                                       unsigned int tape_pos,
+                                       const PmatchTransducer * caller,
+                                       TransitionTableIndex caller_index) const
 {
+    ++c.rtn_memo_hits;
+    if (memo.exhausted) {
+        c.input_exhausted = true;
+    }
+    c.push_rtn_call(caller_index, caller);
+    c.increase_stack_depth();
+    Weight old_weight = c.get_weight();
+    for (std::vector<RtnCompletion>::const_iterator it =
+             memo.completions.begin(); it != memo.completions.end(); ++it) {
+        unsigned int end_tape_pos = tape_pos;
+        for (DoubleTape::const_iterator sym = it->output.begin();
+             sym != it->output.end(); ++sym) {
+            c.tape.write(end_tape_pos++, sym->input, sym->output);
+        }
+        c.set_weight(old_weight + it->weight);
+        caller->rtn_return(c, it->input_pos, end_tape_pos);
+    }
+    c.set_weight(old_weight);
+    c.decrease_stack_depth();
+    c.rtn_stack_pop();
+}
+
+void PmatchTransducer::rtn_return(PmatchContext & c,
+                                  unsigned int input_tape_pos,
+                                  unsigned int tape_pos) const
+{
+    LocalStack & local_stack = get_local_stack(c);
     LocalVariables new_top(local_stack.top());
-    container->decrease_stack_depth();
-    TransitionTableIndex entry_index = container->rtn_stack_top().caller_index;
+    c.decrease_stack_depth();
+    TransitionTableIndex entry_index = c.rtn_stack_top().caller_index;
     new_top.flag_state = alphabet.get_fd_table();
     new_top.tape_step = 1;
     new_top.context = none;
     new_top.context_placeholder = 0;
     new_top.default_symbol_trap = false;
     local_stack.push(new_top);
-    get_analyses(input_tape_pos, tape_pos, entry_index);
+    get_analyses(c, input_tape_pos, tape_pos, entry_index);
     local_stack.pop();
-    container->increase_stack_depth();
+    c.increase_stack_depth();
 }
 
-void PmatchTransducer::handle_final_state(unsigned int input_pos,
-                                          unsigned int tape_pos)
+void PmatchTransducer::handle_final_state(PmatchContext & c,
+                                          unsigned int input_pos,
+                                          unsigned int tape_pos) const
 {
-    if (container->get_stack_depth() > 0) {
+    if (c.get_stack_depth() > 0) {
+        RtnStackFrame & frame = c.rtn_stacks[c.get_stack_depth() - 1].back();
+        if (frame.memo != NULL) {
+            RtnCompletion completion;
+            completion.input_pos = input_pos;
+            completion.output = c.tape.extract_slice(frame.tape_pos, tape_pos);
+            completion.weight = c.get_weight() - frame.weight;
+            c.rtn_memo.add_completion(frame.memo, completion);
+        }
         // We're not the toplevel, return to caller
-        PmatchTransducer * rtn_target = container->get_latest_rtn_caller();
-        rtn_target->rtn_return(input_pos, tape_pos);
-    } else if (container->is_in_locate_mode()) {
-        container->grab_location(input_pos, tape_pos);
+        const PmatchTransducer * rtn_target = c.get_latest_rtn_caller();
+        rtn_target->rtn_return(c, input_pos, tape_pos);
+    } else if (c.locate_mode) {
+        container->grab_location(c, input_pos, tape_pos);
     } else {
-        container->note_analysis(input_pos, tape_pos);
+        container->note_analysis(c, input_pos, tape_pos);
     }
 }
 
-void PmatchContainer::note_analysis(unsigned int input_pos, unsigned int tape_pos)
+void PmatchContainer::note_analysis(PmatchContext & c,
+                                    unsigned int input_pos,
+                                    unsigned int tape_pos) const
 {
-    if ((input_pos > best_input_pos) ||
-        (input_pos == best_input_pos &&
-         best_weight > running_weight)) {
-        best_result = tape.extract_slice(0, tape_pos);
-        best_captures = captures;
-        best_input_pos = input_pos;
-        best_weight = running_weight;
+    if ((input_pos > c.best_input_pos) ||
+        (input_pos == c.best_input_pos &&
+         c.best_weight > c.running_weight)) {
+        c.best_result = c.tape.extract_slice(0, tape_pos);
+        c.best_captures = c.captures;
+        c.best_input_pos = input_pos;
+        c.best_weight = c.running_weight;
     } else if (verbose &&
-               input_pos == best_input_pos &&
-               best_weight == running_weight) {
-        DoubleTape discarded(tape.extract_slice(0, tape_pos));
-        std::cerr << "\n\tline " << line_number << ": conflicting equally weighted matches found, keeping:\n\t"
-                  << alphabet.stringify(best_result) << std::endl
+               input_pos == c.best_input_pos &&
+               c.best_weight == c.running_weight) {
+        DoubleTape discarded(c.tape.extract_slice(0, tape_pos));
+        std::cerr << "\n\tline " << c.line_number << ": conflicting equally weighted matches found, keeping:\n\t"
+                  << alphabet.stringify(c.best_result, c) << std::endl
                   << "\tdiscarding:\n\t"
-                  << alphabet.stringify(discarded) << std::endl << std::endl;
+                  << alphabet.stringify(discarded, c) << std::endl << std::endl;
     }
 }
 
-void PmatchContainer::grab_location(unsigned int input_pos, unsigned int tape_pos)
+void PmatchContainer::grab_location(PmatchContext & c,
+                                    unsigned int input_pos,
+                                    unsigned int tape_pos) const
 {
-    if (tape_locations.size() != 0) {
-        if (input_pos < best_input_pos) {
+    if (c.tape_locations.size() != 0) {
+        if (input_pos < c.best_input_pos) {
             // We already have better matches
             return;
-        } else if (input_pos > best_input_pos) {
+        } else if (input_pos > c.best_input_pos) {
             // The old locations are worse
-            best_captures.clear();
-            tape_locations.clear();
+            c.best_captures.clear();
+            c.tape_locations.clear();
+            c.candidate_bytes = 0;
         }
     }
-    best_input_pos = input_pos;
-    best_captures = captures;
-    WeightedDoubleTape rv(tape.extract_slice(0, tape_pos), running_weight);
-    tape_locations.push_back(rv);
+    c.best_input_pos = input_pos;
+    c.best_captures = c.captures;
+    WeightedDoubleTape rv(c.tape.extract_slice(0, tape_pos), c.running_weight);
+    c.tape_locations.push_back(rv);
+    c.candidate_bytes += sizeof(WeightedDoubleTape) +
+        rv.size() * sizeof(SymbolPair);
 }
 
-std::pair<SymbolNumberVector::iterator,
-          SymbolNumberVector::iterator> PmatchContainer::get_longest_matching_capture(
-    SymbolNumber key, unsigned int input_pos)
+std::pair<SymbolNumberVector::const_iterator,
+          SymbolNumberVector::const_iterator> PmatchContext::get_longest_matching_capture(
+    SymbolNumber key, unsigned int input_pos) const
 {
-    std::pair<SymbolNumberVector::iterator, SymbolNumberVector::iterator> longest_so_far(input.begin(), input.begin());
-    for (std::vector<Capture>::iterator it =
+    std::pair<SymbolNumberVector::const_iterator, SymbolNumberVector::const_iterator> longest_so_far(input.begin(), input.begin());
+    for (std::vector<Capture>::const_iterator it =
              captures.begin(); it != captures.end(); ++it) {
         if (key == it->name && input_matches_at(input_pos, input.begin() + it->begin, input.begin() + it->end)) {
             if ((it->end - it->begin) <= longest_so_far.second - longest_so_far.first) {
@@ -1728,7 +2963,7 @@ std::pair<SymbolNumberVector::iterator,
             }
         }
     }
-    for (std::vector<Capture>::iterator it =
+    for (std::vector<Capture>::const_iterator it =
              old_captures.begin(); it != old_captures.end(); ++it) {
         if (key == it->name && input_matches_at(input_pos, input.begin() + it->begin, input.begin() + it->end)) {
             if ((it->end - it->begin) <= longest_so_far.second - longest_so_far.first) {
@@ -1742,71 +2977,73 @@ std::pair<SymbolNumberVector::iterator,
     return longest_so_far;
 }
 
-void PmatchTransducer::take_epsilons(unsigned int input_pos,
+void PmatchTransducer::take_epsilons(PmatchContext & c,
+                                     unsigned int input_pos,
                                      unsigned int tape_pos,
-                                     TransitionTableIndex i)
+                                     TransitionTableIndex i) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     i = make_transition_table_index(i, 0);
     while (is_good(i)) {
         SymbolNumber input = transition_table[i].get_input_symbol();
         SymbolNumber output = transition_table[i].get_output_symbol();
         TransitionTableIndex target = transition_table[i].get_target();
-        Weight old_weight = container->get_weight();
-        container->increment_weight(transition_table[i].get_weight());
+        Weight old_weight = c.get_weight();
+        c.increment_weight(transition_table[i].get_weight());
         // We also handle paths where we're checking contexts here
         if (input == 0) {
             if (container->profile_mode) {
-                alphabet.count(output);
+                alphabet.count(c, output);
             }
-            if (!checking_context()) {
-                if (!try_entering_context(output)) {
+            if (!checking_context(c)) {
+                if (!try_entering_context(c, output)) {
                     // no context to enter, regular input epsilon
-                    container->tape.write(tape_pos, 0, output);
+                    c.tape.write(tape_pos, 0, output);
                     
                     // if it's an entry or exit arc, adjust entry stack
                     if (output == alphabet.get_special(entry)) {
-                        container->entry_stack.push(input_pos);
+                        c.entry_stack.push(input_pos);
                     } else if (output == alphabet.get_special(exit)) {
-                        container->entry_stack.pop();
+                        c.entry_stack.pop();
                     } else if (alphabet.is_capture_tag(output)) {
                         // if it's a capture tag, remember where we were
                         Capture capture;
-                        capture.begin = container->entry_stack.back();
+                        capture.begin = c.entry_stack.back();
                         capture.end = input_pos;
                         capture.name = output;
-                        container->captures.push_back(capture);
+                        c.captures.push_back(capture);
                     } else if (alphabet.is_captured_tag(output)) {
                         // if it's a captured tag, try each previously
                         // captured sequence
-                        std::pair<SymbolNumberVector::iterator, SymbolNumberVector::iterator> cap =
-                            container->get_longest_matching_capture(alphabet.captured2capture[output], input_pos);
+                        std::pair<SymbolNumberVector::const_iterator, SymbolNumberVector::const_iterator> cap =
+                            c.get_longest_matching_capture(alphabet.captured2capture[output], input_pos);
                         if (cap.second - cap.first != 0) {
-                            container->tape.write(tape_pos, cap);
-                            get_analyses(input_pos + (cap.second - cap.first),
+                            c.tape.write(tape_pos, cap);
+                            get_analyses(c, input_pos + (cap.second - cap.first),
                                          tape_pos + (cap.second - cap.first), target);
                         }
                         ++i;
-                        container->set_weight(old_weight);
+                        c.set_weight(old_weight);
                         continue;
                     }
                     
-                    get_analyses(input_pos, tape_pos + 1, target);
+                    get_analyses(c, input_pos, tape_pos + 1, target);
                     
                     if (output == alphabet.get_special(entry)) {
-                        container->entry_stack.pop_back();
+                        c.entry_stack.pop_back();
                     } else if (output == alphabet.get_special(exit)) {
-                        container->entry_stack.unpop();
+                        c.entry_stack.unpop();
                     } else if (alphabet.is_capture_tag(output)) {
-                        container->captures.pop_back();
+                        c.captures.pop_back();
                     }
                 } else {
-                    check_context(input_pos, tape_pos, i);
+                    check_context(c, input_pos, tape_pos, i);
                 }
             } else {
                 // We *are* checking context and may be done
-                if (try_exiting_context(output)) {
+                if (try_exiting_context(c, output)) {
                     // We've successfully completed a context check
-                    get_analyses(local_stack.top().context_placeholder, tape_pos, target);
+                    get_analyses(c, local_stack.top().context_placeholder, tape_pos, target);
                     local_stack.pop();
                 } else {
                     if (local_stack.top().negative_context_success == true) {
@@ -1814,27 +3051,29 @@ void PmatchTransducer::take_epsilons(unsigned int input_pos,
                         return;
                     } else {
                         // Don't alter tapes when checking context
-                        get_analyses(input_pos, tape_pos, target);
+                        get_analyses(c, input_pos, tape_pos, target);
                     }
                 }
             }
         } else if (alphabet.is_flag_diacritic(input)) {
-            take_flag(input, input_pos, tape_pos, i);
+            take_flag(c, input, input_pos, tape_pos, i);
         } else if (alphabet.has_rtn(input)) {
-            alphabet.get_rtn(input)->rtn_call(input_pos, tape_pos, this, target);
+            alphabet.get_rtn(input)->rtn_call(c, input_pos, tape_pos, this, target);
         } else { // it's not epsilon and it's not a flag or Ins, so nothing to do
-            container->set_weight(old_weight);
+            c.set_weight(old_weight);
             return;
         }
         ++i;
-        container->set_weight(old_weight);
+        c.set_weight(old_weight);
     }
 }
 
-void PmatchTransducer::check_context(unsigned int input_pos,
+void PmatchTransducer::check_context(PmatchContext & c,
+                                     unsigned int input_pos,
                                      unsigned int tape_pos,
-                                     TransitionTableIndex i)
+                                     TransitionTableIndex i) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     // The context placeholder remembers the position in the input before
     // a context check. If the context check is successful, the placeholder
     // will be used as the input position going forwards.
@@ -1842,9 +3081,9 @@ void PmatchTransducer::check_context(unsigned int input_pos,
     if (local_stack.top().context == LC ||
         local_stack.top().context == NLC) {
         // Jump to the left-hand side of the input
-        input_pos = container->entry_stack.top() - 1;
+        input_pos = c.entry_stack.top() - 1;
     }
-    get_analyses(input_pos, tape_pos, transition_table[i].get_target());
+    get_analyses(c, input_pos, tape_pos, transition_table[i].get_target());
 
 
     // In case we have a negative context, we check to see if the context matched.
@@ -1862,15 +3101,17 @@ void PmatchTransducer::check_context(unsigned int input_pos,
     }
 }
 
-void PmatchTransducer::take_flag(SymbolNumber input,
+void PmatchTransducer::take_flag(PmatchContext & c,
+                                 SymbolNumber input,
                                  unsigned int input_pos,
                                  unsigned int tape_pos,
-                                 TransitionTableIndex i)
+                                 TransitionTableIndex i) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     std::vector<short> old_global_values;
     if (alphabet.is_global_flag(input)) {
-        (old_global_values = container->global_flag_state.get_values());
-        if (((container->global_flag_state).apply_operation
+        (old_global_values = c.global_flag_state.get_values());
+        if ((c.global_flag_state.apply_operation
              (*(alphabet.get_operation(input)))) == false) {
             return;
         }
@@ -1880,20 +3121,22 @@ void PmatchTransducer::take_flag(SymbolNumber input,
             *(alphabet.get_operation(input)))) {
         // flag diacritic allowed
         // generally we shouldn't care to write flags
-//                container->tape.write(tape_pos, input, output);
-        get_analyses(input_pos, tape_pos, transition_table[i].get_target());
+//                c.tape.write(tape_pos, input, output);
+        get_analyses(c, input_pos, tape_pos, transition_table[i].get_target());
     }
     if (alphabet.is_global_flag(input)) {
-        (container->global_flag_state).assign_values(old_global_values);
+        c.global_flag_state.assign_values(old_global_values);
     }
     local_stack.top().flag_state.assign_values(old_values);
 }
 
-void PmatchTransducer::take_transitions(SymbolNumber input,
+void PmatchTransducer::take_transitions(PmatchContext & c,
+                                        SymbolNumber input,
                                         unsigned int input_pos,
                                         unsigned int tape_pos,
-                                        TransitionTableIndex i)
+                                        TransitionTableIndex i) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     i = make_transition_table_index(i, input);
     
     while (is_good(i)) {
@@ -1903,37 +3146,37 @@ void PmatchTransducer::take_transitions(SymbolNumber input,
         if (this_input == NO_SYMBOL_NUMBER) {
             return;
         } else if (this_input == input) {
-            Weight old_weight = container->get_weight();
-            container->increment_weight(transition_table[i].get_weight());
-            if (!checking_context()) {
+            Weight old_weight = c.get_weight();
+            c.increment_weight(transition_table[i].get_weight());
+            if (!checking_context(c)) {
                 if (this_output == alphabet.get_identity_symbol() ||
                     (this_output == alphabet.get_unknown_symbol()) ||
                     (alphabet.list2symbols[this_output] != NO_SYMBOL_NUMBER)) {
                 // we got here via a meta-arc, so look back in the
                 // input tape to find the symbol we want to write
-                    this_output = container->input[input_pos];
+                    this_output = c.input[input_pos];
                 }
                 if (this_input == alphabet.get_identity_symbol() ||
                     (this_input == alphabet.get_unknown_symbol()) ||
                     (alphabet.list2symbols[this_input] != NO_SYMBOL_NUMBER)) {
-                    this_input = container->input[input_pos];
+                    this_input = c.input[input_pos];
                 }
                 if (this_input == alphabet.get_special(Pmatch_passthrough)) {
-                    get_analyses(input_pos, tape_pos, target); // awkward
+                    get_analyses(c, input_pos, tape_pos, target); // awkward
                 } else {
-                    container->tape.write(tape_pos, this_input, this_output);
-                    get_analyses(input_pos + 1, tape_pos + 1, target);
+                    c.tape.write(tape_pos, this_input, this_output);
+                    get_analyses(c, input_pos + 1, tape_pos + 1, target);
                 }
             } else {
                 // Checking context so don't touch output
                 if (local_stack.top().max_context_length_remaining > 0) {
                     local_stack.top().max_context_length_remaining -= 1;
-                    get_analyses(input_pos + local_stack.top().tape_step, tape_pos, target);
+                    get_analyses(c, input_pos + local_stack.top().tape_step, tape_pos, target);
                     local_stack.top().max_context_length_remaining += 1;
                 }
             }
             local_stack.top().default_symbol_trap = false;
-            container->set_weight(old_weight);
+            c.set_weight(old_weight);
         } else {
             return;
         }
@@ -1941,81 +3184,99 @@ void PmatchTransducer::take_transitions(SymbolNumber input,
     }
 }
 
-void PmatchTransducer::get_analyses(unsigned int input_pos,
+void PmatchTransducer::get_analyses(PmatchContext & c,
+                                    unsigned int input_pos,
                                     unsigned int tape_pos,
-                                    TransitionTableIndex i)
+                                    TransitionTableIndex i) const
 {
-    if (container->max_time > 0.0) {
-        ++container->call_counter;
+    LocalStack & local_stack = get_local_stack(c);
+    if (c.spend_step(local_index)) {
+        c.taint_rtn_memos();
+        return;
+    }
+    if (c.max_time > 0.0) {
+        ++c.call_counter;
         // Have we spent too much time?
-        if (container->limit_reached ||
-            (container->call_counter % 1000000 == 0 &&
-             (container->candidate_found() &&
+        if (c.limit_reached ||
+            (c.call_counter % 1000000 == 0 &&
+             (c.candidate_found() &&
               // if we have at least something, stop doing more work
-              (((double)(clock() - container->start_clock)) / CLOCKS_PER_SEC) > container->max_time))) {
-            container->limit_reached = true;
+              (((double)(clock() - c.start_clock)) / CLOCKS_PER_SEC) > c.max_time))) {
+            c.limit_reached = true;
+            c.taint_rtn_memos();
             return;
         }
     }
-    if (!container->try_recurse()) {
+    if (!c.try_recurse()) {
         if (container->verbose) {
             std::cerr << "pmatch: out of stack space, truncating result\n";
         }
+        c.taint_rtn_memos();
         return;
     }
     local_stack.top().default_symbol_trap = true;
-    take_epsilons(input_pos, tape_pos, i + 1);
+    take_epsilons(c, input_pos, tape_pos, i + 1);
     if (local_stack.top().pending_passthrough == true) {
         local_stack.top().pending_passthrough = false;
         // A negative context failed (successfully)
-        take_transitions(alphabet.get_special(Pmatch_passthrough),
+        take_transitions(c, alphabet.get_special(Pmatch_passthrough),
                          input_pos, tape_pos, i+1);
     }
     // Check for finality even if the input string hasn't ended
     if (is_final(i)) {
-        Weight old_weight = container->get_weight();
-        container->increment_weight(get_weight(i));
-        handle_final_state(input_pos, tape_pos);
-        container->set_weight(old_weight);
+        Weight old_weight = c.get_weight();
+        c.increment_weight(get_weight(i));
+        handle_final_state(c, input_pos, tape_pos);
+        c.set_weight(old_weight);
     }
     
     SymbolNumber input;
-    if (!container->has_queued_input(input_pos)) {
-        container->unrecurse();
+    if (!c.has_queued_input(input_pos)) {
+        c.unrecurse();
         return;
     } else {
-        input = container->input[input_pos];
+        input = c.input[input_pos];
     }
 
-    if (alphabet.symbol2lists[input] != NO_SYMBOL_NUMBER) {
+    if (input >= alphabet.symbol2lists.size()) {
+// A symbol that isn't in the alphabet is allowed by every exclusionary list
+        for(SymbolNumberVector::const_iterator it =
+                alphabet.exclusionary_lists.begin();
+            it != alphabet.exclusionary_lists.end(); ++it) {
+            take_transitions(c, *it, input_pos, tape_pos, i+1);
+        }
+    } else if (alphabet.symbol2lists[input] != NO_SYMBOL_NUMBER) {
 // At least one symbol list could allow this symbol
         for(SymbolNumberVector::const_iterator it =
                 alphabet.symbol_lists[alphabet.symbol2lists[input]].begin();
             it != alphabet.symbol_lists[alphabet.symbol2lists[input]].end(); ++it) {
-            take_transitions(*it, input_pos, tape_pos, i+1);
+            take_transitions(c, *it, input_pos, tape_pos, i+1);
         }
     }
     // The "normal" case where we have a regular input symbol
     if (input < orig_symbol_count) {
-        take_transitions(input, input_pos, tape_pos, i+1);
+        take_transitions(c, input, input_pos, tape_pos, i+1);
     } else {
         if (alphabet.get_identity_symbol() != NO_SYMBOL_NUMBER) {
-            take_transitions(alphabet.get_identity_symbol(), input_pos, tape_pos, i+1);
+            take_transitions(c, alphabet.get_identity_symbol(), input_pos, tape_pos, i+1);
         }
         if (alphabet.get_unknown_symbol() != NO_SYMBOL_NUMBER) {
-            take_transitions(alphabet.get_unknown_symbol(), input_pos, tape_pos, i+1);
+            take_transitions(c, alphabet.get_unknown_symbol(), input_pos, tape_pos, i+1);
         }
     }
-    container->unrecurse();
+    c.unrecurse();
 }
 
-bool PmatchTransducer::checking_context(void) const
+bool PmatchTransducer::checking_context(PmatchContext & c) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     return local_stack.top().context != none;
 }
 
-bool PmatchTransducer::try_entering_context(SymbolNumber symbol)
+bool PmatchTransducer::try_entering_context(PmatchContext & c,
+                                            SymbolNumber symbol) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     LocalVariables new_top;
     if (symbol == alphabet.get_special(LC_entry)) {
         new_top = local_stack.top();
@@ -2042,19 +3303,21 @@ bool PmatchTransducer::try_entering_context(SymbolNumber symbol)
     return true;
 }
 
-bool PmatchTransducer::try_exiting_context(SymbolNumber symbol)
+bool PmatchTransducer::try_exiting_context(PmatchContext & c,
+                                           SymbolNumber symbol) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     switch (local_stack.top().context) {
     case LC:
         if (symbol == alphabet.get_special(LC_exit)) {
-            exit_context();
+            exit_context(c);
             return true;
         } else {
             return false;
         }
     case RC:
         if (symbol == alphabet.get_special(RC_exit)) {
-            exit_context();
+            exit_context(c);
             return true;
         } else {
             return false;
@@ -2074,8 +3337,9 @@ bool PmatchTransducer::try_exiting_context(SymbolNumber symbol)
     }
 }
 
-void PmatchTransducer::exit_context(void)
+void PmatchTransducer::exit_context(PmatchContext & c) const
 {
+    LocalStack & local_stack = get_local_stack(c);
     LocalVariables new_top(local_stack.top());
     new_top.context = none;
     new_top.negative_context_success = false;
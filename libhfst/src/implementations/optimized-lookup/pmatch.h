@@ -11,6 +11,7 @@
 
 #include <map>
 #include <stack>
+#include <deque>
 #include <sstream>
 #include <algorithm>
 #include <ctime>
@@ -18,10 +19,16 @@
 #include "HfstExceptionDefs.h"
 #include "transducer.h"
 
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  include <atomic>
+#  include <mutex>
+#endif
+
 namespace hfst_ol {
 
     class PmatchTransducer;
     class PmatchContainer;
+    class PmatchContext;
     struct Location;
     struct WeightedDoubleTape;
     struct RtnStackFrame;
@@ -91,8 +98,9 @@ namespace hfst_ol {
         bool is_guard(const SymbolNumber symbol) const;
         bool is_counter(const SymbolNumber symbol) const;
         bool is_global_flag(const SymbolNumber symbol) const;
-        std::string end_tag(const SymbolNumber symbol);
-        std::string start_tag(const SymbolNumber symbol);
+        std::string end_tag(const SymbolNumber symbol) const;
+        std::string start_tag(const SymbolNumber symbol) const;
+        void count_pattern(PmatchContext & c, SymbolNumber end_tag) const;
         PmatchContainer * container;
 
     public:
@@ -113,202 +121,145 @@ namespace hfst_ol {
         static bool is_global_flag(const std::string & symbol);
         static std::string name_from_insertion(
             const std::string & symbol);
-        bool is_printable(SymbolNumber symbol);
+        bool is_printable(SymbolNumber symbol) const;
         bool is_global_flag(SymbolNumber symbol);
         void add_special_symbol(const std::string & str, SymbolNumber symbol_number);
         void process_symbol_list(std::string str, SymbolNumber sym);
         void process_counter(std::string str, SymbolNumber sym);
-        void count(SymbolNumber sym);
+        void count(PmatchContext & c, SymbolNumber sym) const;
         void add_rtn(PmatchTransducer * rtn, std::string const & name);
         bool has_rtn(std::string const & name) const;
         bool has_rtn(SymbolNumber symbol) const;
-        PmatchTransducer * get_rtn(SymbolNumber symbol);
+        PmatchTransducer * get_rtn(SymbolNumber symbol) const;
         PmatchTransducer * get_rtn(std::string name);
-        std::string get_counter_name(SymbolNumber symbol);
+        std::string get_counter_name(SymbolNumber symbol) const;
         SymbolNumber get_special(SpecialSymbol special) const;
         SymbolNumberVector get_specials(void) const;
-        std::string stringify(const DoubleTape & str);
+        using TransducerAlphabet::string_from_symbol;
+        /* The string of \a symbol in a result of a match with \a c,
+           epsilon being the empty string. */
+        std::string string_from_symbol(const PmatchContext & c,
+                                       SymbolNumber symbol) const;
+        std::string stringify(const DoubleTape & str, PmatchContext & c) const
+            {
+                bool printable_seen = false;
+                return stringify(str, c, printable_seen);
+            }
+        /* As above, for output made in parts, \a printable_seen telling
+           whether the earlier parts had any printable input. */
+        std::string stringify(const DoubleTape & str, PmatchContext & c,
+                              bool & printable_seen) const;
         Location locatefy(unsigned int input_offset,
-                          const WeightedDoubleTape & str);
+                          const WeightedDoubleTape & str,
+                          PmatchContext & c) const;
 
         friend class PmatchTransducer;
         friend class PmatchContainer;
     };
 
-    struct RtnStackFrame
+    // One way a call of a RTN came back to its caller
+    struct RtnCompletion
     {
-        PmatchTransducer * caller;
-        TransitionTableIndex caller_index;
+        unsigned int input_pos;
+        // What the RTN wrote on the tape, and the weight it added
+        DoubleTape output;
+        Weight weight;
     };
 
-    struct Capture
+    // What calling a RTN at some input position came to
+    struct RtnMemo
     {
-        unsigned int begin;
-        unsigned int end;
-        SymbolNumber name;
+        std::vector<RtnCompletion> completions;
+        // Whether the call has returned for the last time
+        bool complete;
+        // Whether something happened during the call that makes it
+        // unsafe to repeat the result elsewhere
+        bool tainted;
+        // Whether the call looked past the end of incomplete input
+        bool exhausted;
+        RtnMemo(void): complete(false), tainted(false), exhausted(false) {}
     };
 
-    class PmatchContainer
+    // The memos of the RTN calls made on one input
+    class RtnMemoTable
     {
     protected:
-        PmatchAlphabet alphabet;
-        Encoder * encoder;
-        SymbolNumber orig_symbol_count;
-        SymbolNumber symbol_count;
-        PmatchTransducer * toplevel;
-        SymbolNumberVector input;
-        // This tracks the ENTRY and EXIT tags
-        PositionStack entry_stack;
-        RtnCallStacks rtn_stacks;
-        DoubleTape tape;
-        DoubleTape best_result;
-        DoubleTape result;
-        LocationVectorVector locations;
-        WeightedDoubleTapeVector tape_locations;
-        std::vector<Capture> captures;
-        std::vector<Capture> best_captures;
-        std::vector<Capture> old_captures;
-        std::vector<char> possible_first_symbols;
-        // The flag state for global flags
-        hfst::FdState<SymbolNumber> global_flag_state;
-        bool verbose;
-        
-        bool count_patterns;
-        bool delete_patterns;
-        bool extract_patterns;
-        bool locate_mode;
-        bool mark_patterns;
-        size_t max_context_length;
-        size_t max_recursion;
-        bool need_separators;
-        bool xerox_composition;
-
-        unsigned long line_number;
-        std::map<std::string, size_t> pattern_counts;
-        bool profile_mode;
-        bool single_codepoint_tokenization;
-        unsigned int recursion_depth_left;
-        // An optional time limit for operations
-        double max_time;
-        // When we started work
-        clock_t start_clock;
-        // A counter to avoid checking the clock too often
-        unsigned long call_counter;
-        // A flag to set for when time has been overstepped
-        bool limit_reached;
-        // The global running weight
-        Weight running_weight;
-        Weight weight_limit;
-        // This is the depth of the stack from the point of view of the
-        // container. When it's 0, we're in the toplevel, even if the
-        // stack of variables is bigger due to having passed through a RTN.
-        unsigned int stack_depth;
-        // Where in the input the best candidate so far has gotten to
-        unsigned int best_input_pos;
-        Weight best_weight;
-
-        void collect_first_symbols(void);
+        // A deque, so the memos stay where they are as more are added
+        std::deque<RtnMemo> memos;
+        // For each input position, the RTNs called there and the indices
+        // of their memos
+        std::vector<std::vector<std::pair<const PmatchTransducer *, size_t> > >
+            by_position;
+        // Roughly how much memory the memos take
+        size_t bytes;
 
     public:
-
-        PmatchContainer(std::istream & is);
-        PmatchContainer(Transducer * toplevel);
-        PmatchContainer(std::vector<hfst::HfstTransducer> transducers);
-        PmatchContainer(void);
-        ~PmatchContainer(void);
-
-
-        void set_properties(void);
-        void set_properties(std::map<std::string, std::string> & properties);
-        void initialize_input(const char * input);
-        bool has_unsatisfied_rtns(void) const;
-        std::string get_unsatisfied_rtn_name(void) const;
-        void add_rtn(Transducer * rtn, const std::string & name);
-        void process(const std::string & input);
-        std::string match(const std::string & input,
-                          double time_cutoff = 0.0,
-                          Weight weight_cutoff = 0.0);
-        LocationVectorVector locate(const std::string & input,
-                                    double time_cutoff = 0.0,
-                                    Weight weight_cutoff = 0.0);
-        void note_analysis(unsigned int input_pos, unsigned int tape_pos);
-        void grab_location(unsigned int input_pos, unsigned int tape_pos);
-        std::pair<SymbolNumberVector::iterator,
-                  SymbolNumberVector::iterator>
-        get_longest_matching_capture(SymbolNumber key, unsigned int input_pos);
-        std::string get_profiling_info(void);
-        std::string get_pattern_count_info(void);
-        bool has_queued_input(unsigned int input_pos);
-        bool input_matches_at(unsigned int pos,
-                              SymbolNumberVector::iterator begin,
-                              SymbolNumberVector::iterator end);
-        bool not_possible_first_symbol(SymbolNumber sym)
+        RtnMemoTable(void): bytes(0) {}
+        RtnMemo * find(const PmatchTransducer * rtn, unsigned int pos)
         {
-            if (possible_first_symbols.size() == 0) {
-                return false;
+            if (pos >= by_position.size()) {
+                return NULL;
             }
-            return sym >= possible_first_symbols.size() ||
-                possible_first_symbols[sym] == 0;
-        }
-        void copy_to_result(const DoubleTape & best_result);
-        void copy_to_result(SymbolNumber input, SymbolNumber output);
-        static std::map<std::string, std::string> parse_hfst3_header(std::istream & f);
-        void set_verbose(bool b) { verbose = b; }
-        void set_locate_mode(bool b) { locate_mode = b; }
-        void set_extract_patterns(bool b)
-            { extract_patterns = b; }
-        void set_single_codepoint_tokenization(bool b)
-            { single_codepoint_tokenization = b; }
-        void set_count_patterns(bool b)
-            { count_patterns = b; }
-        void set_delete_patterns(bool b)
-            { delete_patterns = b; }
-        void set_mark_patterns(bool b)
-            { mark_patterns = b; }
-        void set_max_recursion(size_t max)
-            { max_recursion = max; }
-        void set_max_context(size_t max)
-            { max_context_length = max; }
-        bool is_in_locate_mode(void) { return locate_mode; }
-        void set_profile(bool b) { profile_mode = b; }
-        void set_weight(Weight w) { running_weight = w; }
-        void increment_weight(Weight w) { running_weight += w; }
-        Weight get_weight(void) { return running_weight; }
-        void increase_stack_depth(void) { ++stack_depth; }
-        void decrease_stack_depth(void)
-            {
-                if (stack_depth == 0) {
-                    HFST_THROW_MESSAGE(HfstException, "pmatch: negative stack depth");
+            for (size_t i = 0; i < by_position[pos].size(); ++i) {
+                if (by_position[pos][i].first == rtn) {
+                    return &memos[by_position[pos][i].second];
                 }
-                --stack_depth;
             }
-        void push_rtn_call(unsigned int return_index, PmatchTransducer * caller);
-        RtnStackFrame rtn_stack_top(void);
-        PmatchTransducer * get_latest_rtn_caller(void);
-        void rtn_stack_pop(void);
-        unsigned int get_stack_depth(void) { return stack_depth; }
-        bool candidate_found(void)
-            {
-                if (locate_mode) {
-                    return tape_locations.size() != 0;
-                } else {
-                    return best_result.size() != 0;
-                }
+            return NULL;
+        }
+        RtnMemo * add(const PmatchTransducer * rtn, unsigned int pos)
+        {
+            if (pos >= by_position.size()) {
+                by_position.resize(pos + 1);
             }
-        bool try_recurse(void)
+            by_position[pos].push_back(std::make_pair(rtn, memos.size()));
+            memos.push_back(RtnMemo());
+            bytes += sizeof(RtnMemo) +
+                sizeof(std::pair<const PmatchTransducer *, size_t>);
+            return &memos.back();
+        }
+        void add_completion(RtnMemo * memo, const RtnCompletion & completion)
         {
-            if (recursion_depth_left > 0) {
-                --recursion_depth_left;
-                return true;
-            } else {
-                return false;
+            memo->completions.push_back(completion);
+            bytes += sizeof(RtnCompletion) +
+                completion.output.size() * sizeof(SymbolPair);
+        }
+        void remove(const PmatchTransducer * rtn, unsigned int pos)
+        {
+            // The memo itself is left unused until clear()
+            for (size_t i = 0; pos < by_position.size() &&
+                     i < by_position[pos].size(); ++i) {
+                if (by_position[pos][i].first == rtn) {
+                    by_position[pos].erase(by_position[pos].begin() + i);
+                    return;
+                }
             }
         }
-        void unrecurse(void) { ++recursion_depth_left; }
-        void reset_recursion(void) { recursion_depth_left = (unsigned int)max_recursion; }
+        void clear(void)
+        {
+            memos.clear();
+            by_position.clear();
+            bytes = 0;
+        }
+        size_t get_bytes(void) const { return bytes; }
+    };
 
-        friend class PmatchTransducer;
-        friend class PmatchAlphabet;
+    struct RtnStackFrame
+    {
+        const PmatchTransducer * caller;
+        TransitionTableIndex caller_index;
+        // If the call is being memoised, where its completions go, and
+        // the tape position and weight at the time of the call
+        RtnMemo * memo;
+        unsigned int tape_pos;
+        Weight weight;
+    };
+
+    struct Capture
+    {
+        unsigned int begin;
+        unsigned int end;
+        SymbolNumber name;
     };
 
     struct Location
@@ -336,14 +287,15 @@ namespace hfst_ol {
 
     class PmatchTransducer
     {
-    protected:
-        std::string name;
+    public:
         enum ContextChecking{none, LC, NLC, RC, NRC};
 
 // Transducers have static data, ie. tables for describing the states and
 // transitions, and dynamic data, which is altered during lookup.
 // In pmatch several instances of the same transducer may be operating
 // in a stack, so this dynamic data is put in a class of its own.
+// The stacks live in a PmatchContext, so the transducer itself is not
+// modified by matching.
         struct LocalVariables
         {
             hfst::FdState<SymbolNumber> flag_state;
@@ -358,7 +310,15 @@ namespace hfst_ol {
             bool pending_passthrough;
         };
 
-        std::stack<LocalVariables> local_stack;
+        typedef std::stack<LocalVariables, std::vector<LocalVariables> >
+            LocalStack;
+
+    protected:
+        std::string name;
+        // The bottom of a fresh local stack
+        LocalVariables initial_local_variables;
+        // Which of the local stacks of a PmatchContext is ours
+        unsigned int local_index;
     
         std::vector<TransitionW> transition_table;
         std::vector<TransitionWIndex> index_table;
@@ -367,7 +327,7 @@ namespace hfst_ol {
         SymbolNumber orig_symbol_count;
         PmatchContainer * container;
 
-        bool is_final(TransitionTableIndex i)
+        bool is_final(TransitionTableIndex i) const
         {
             if (indexes_transition_table(i)) {
                 return transition_table[i - TRANSITION_TARGET_TABLE_START].final();
@@ -376,7 +336,7 @@ namespace hfst_ol {
             }
         }
 
-        Weight get_weight(TransitionTableIndex i)
+        Weight get_weight(TransitionTableIndex i) const
         {
             if (indexes_transition_table(i)) {
                 return transition_table[i - TRANSITION_TARGET_TABLE_START].get_weight();
@@ -386,7 +346,7 @@ namespace hfst_ol {
         }
 
         TransitionTableIndex make_transition_table_index(
-            TransitionTableIndex i, SymbolNumber input) {
+            TransitionTableIndex i, SymbolNumber input) const {
             if (indexes_transition_table(i)) {
                 return i - TRANSITION_TARGET_TABLE_START;
             } else {
@@ -398,48 +358,66 @@ namespace hfst_ol {
             }
         }
 
+        // Whether the result of calling this as a RTN depends only on
+        // where in the input it's called, see find_memoizable()
+        bool memoizable;
+
+        void init_local_variables(void);
+        void find_memoizable(void);
+        LocalStack & get_local_stack(PmatchContext & c) const;
+
         // The mutually recursive lookup-handling functions
 
-        void take_epsilons(unsigned int input_pos,
+        void take_epsilons(PmatchContext & c,
+                           unsigned int input_pos,
                            unsigned int tape_pos,
-                           TransitionTableIndex i);
+                           TransitionTableIndex i) const;
 
-        void check_context(unsigned int input_pos,
+        void check_context(PmatchContext & c,
+                           unsigned int input_pos,
                            unsigned int tape_pos,
-                           TransitionTableIndex i);
+                           TransitionTableIndex i) const;
   
-        void take_flag(SymbolNumber input,
+        void take_flag(PmatchContext & c,
+                       SymbolNumber input,
                        unsigned int input_pos,
                        unsigned int tape_pos,
-                       TransitionTableIndex i);
+                       TransitionTableIndex i) const;
   
-        void take_transitions(SymbolNumber input,
+        void take_transitions(PmatchContext & c,
+                              SymbolNumber input,
                               unsigned int input_pos,
                               unsigned int tape_pos,
-                              TransitionTableIndex i);
+                              TransitionTableIndex i) const;
 
-        void get_analyses(unsigned int input_pos,
+        void get_analyses(PmatchContext & c,
+                          unsigned int input_pos,
                           unsigned int tape_pos,
-                          TransitionTableIndex index);
+                          TransitionTableIndex index) const;
 
-        bool checking_context(void) const;
-        bool try_entering_context(SymbolNumber symbol);
-        bool try_exiting_context(SymbolNumber symbol);
-        void exit_context(void);
+        bool checking_context(PmatchContext & c) const;
+        bool try_entering_context(PmatchContext & c, SymbolNumber symbol) const;
+        bool try_exiting_context(PmatchContext & c, SymbolNumber symbol) const;
+        void exit_context(PmatchContext & c) const;
 
-        void collect_first_epsilon(TransitionTableIndex i,
+        void collect_first_epsilon(PmatchContext & c,
+                                   TransitionTableIndex i,
                                    SymbolNumberVector const& input_symbols,
                                    std::set<TransitionTableIndex> & seen_indices);
-        void collect_first_epsilon_index(TransitionTableIndex i,
+        void collect_first_epsilon_index(PmatchContext & c,
+                                         TransitionTableIndex i,
                                          SymbolNumberVector const& input_symbols,
                                          std::set<TransitionTableIndex> & seen_indices);
-        void collect_first_transition(TransitionTableIndex i,
+        void collect_first_transition(PmatchContext & c,
+                                      TransitionTableIndex i,
                                       SymbolNumberVector const& input_symbols,
                                       std::set<TransitionTableIndex> & seen_indices);
-        void collect_first_index(TransitionTableIndex i,
+        void collect_first_index(PmatchContext & c,
+                                 TransitionTableIndex i,
                                  SymbolNumberVector const& input_symbols,
                                  std::set<TransitionTableIndex> & seen_indices);
-        void collect_first(TransitionTableIndex i,
+        void collect_first(PmatchContext & c,
+                           TransitionTableIndex i,
                            SymbolNumberVector const& input_symbols,
                            std::set<TransitionTableIndex> & seen_indices);
 
@@ -475,16 +453,671 @@ namespace hfst_ol {
         static bool is_good(TransitionTableIndex i)
         { return  i < TRANSITION_TARGET_TABLE_START; }
 
-        void match(unsigned int input_pos, unsigned int tape_pos);
-        void rtn_call(unsigned int input_pos, unsigned int tape_pos,
-                      PmatchTransducer * caller, TransitionTableIndex caller_index);
-        void rtn_return(unsigned int input_pos, unsigned int tape_pos);
-        void handle_final_state(unsigned int input_pos, unsigned int tape_pos);
-        void collect_possible_first_symbols(void);
+        void match(PmatchContext & c,
+                   unsigned int input_pos, unsigned int tape_pos) const;
+        void rtn_call(PmatchContext & c,
+                      unsigned int input_pos, unsigned int tape_pos,
+                      const PmatchTransducer * caller,
+                      TransitionTableIndex caller_index) const;
+        void replay_rtn_call(PmatchContext & c, const RtnMemo & memo,
+                             unsigned int tape_pos,
+                             const PmatchTransducer * caller,
+                             TransitionTableIndex caller_index) const;
+        void rtn_return(PmatchContext & c,
+                        unsigned int input_pos, unsigned int tape_pos) const;
+        void handle_final_state(PmatchContext & c,
+                                unsigned int input_pos,
+                                unsigned int tape_pos) const;
+        void collect_possible_first_symbols(PmatchContext & c);
+        /* Put the transitions leaving state \a i in \a transitions and
+           return whether \a i is final. */
+        bool get_transitions(TransitionTableIndex i,
+                             std::vector<TransitionW> & transitions) const;
 
         friend class PmatchContainer;
     };
 
+/** \brief A precomputed test of which pairs of consecutive input symbols
+    can begin a match.
+
+    Without it PmatchContainer::process() tries to match at every input
+    position whose symbol may begin a match. For sparse rulesets, eg. lists
+    of names, most of those attempts fail after a symbol or two, so this
+    also looks at the symbol that follows. The table is derived from TOP
+    and the RTNs it calls, and it errs on the side of allowing a match.
+*/
+    class PmatchPrefilter
+    {
+    public:
+        // A point in a walk through TOP and the RTNs it calls
+        struct Position
+        {
+            const PmatchTransducer * transducer;
+            TransitionTableIndex index;
+            // Where to go on when each pending RTN call returns
+            std::vector<std::pair<const PmatchTransducer *,
+                                  TransitionTableIndex> > returns;
+            bool operator<(const Position & rhs) const
+            {
+                if (transducer != rhs.transducer) {
+                    return transducer < rhs.transducer;
+                }
+                if (index != rhs.index) {
+                    return index < rhs.index;
+                }
+                return returns < rhs.returns;
+            }
+        };
+
+    protected:
+        // Input symbols from this on are not in the alphabet, and are all
+        // the same to the prefilter
+        SymbolNumber other;
+        // For each first symbol, 0 if no match can begin with it,
+        // otherwise 1 + the index of what may follow it in followers
+        std::vector<unsigned int> first;
+        // Which symbols may follow. Empty means anything, including the
+        // end of input.
+        std::vector<std::vector<char> > followers;
+
+        SymbolNumber symbol_class(SymbolNumber symbol) const
+            { return symbol < other ? symbol : other; }
+
+    public:
+        PmatchPrefilter(void): other(0) {}
+        bool is_enabled(void) const { return !first.empty(); }
+        /* Whether a match could begin at \a pos of \a input. */
+        bool may_start_at(const SymbolNumberVector & input,
+                          unsigned int pos) const
+        {
+            if (first.empty()) {
+                return true;
+            }
+            unsigned int f = first[symbol_class(input[pos])];
+            if (f == 0) {
+                return false;
+            }
+            const std::vector<char> & next = followers[f - 1];
+            if (next.empty()) {
+                return true;
+            }
+            return pos + 1 < input.size() &&
+                next[symbol_class(input[pos + 1])] != 0;
+        }
+
+        friend class PmatchContainer;
+    };
+
+/** \brief Limits on the work done for one input.
+
+    When one of them runs out, the search going on is stopped and the best
+    match it had found, if any, is used. The rest of the input is passed
+    through as if nothing matched in it, so the result always covers all
+    of the input. A limit of 0 means no limit.
+*/
+    struct PmatchBudget
+    {
+        /** Wall-clock time in seconds */
+        double max_time;
+        /** States visited in the transducers */
+        unsigned long max_steps;
+        /** Bytes held in the working state of the search: the tape, the
+            candidate results, captures, RTN calls in progress and
+            memoised RTN results. This is an estimate of the memory used,
+            not counting the input and the output. */
+        size_t max_bytes;
+
+        PmatchBudget(void): max_time(0.0), max_steps(0), max_bytes(0) {}
+        bool is_limited(void) const
+            { return max_time > 0.0 || max_steps > 0 || max_bytes > 0; }
+    };
+
+/** \brief What matching an input has spent of its PmatchBudget. */
+    struct PmatchBudgetUsage
+    {
+        enum Limit { NO_LIMIT, TIME_LIMIT, STEP_LIMIT, BYTE_LIMIT };
+        enum ByteKind { TAPE_BYTES, CANDIDATE_BYTES, CAPTURE_BYTES,
+                        RTN_CALL_BYTES, RTN_MEMO_BYTES, BYTE_KINDS };
+
+        /** Which limit ran out, if any */
+        Limit exhausted;
+        /** The input position, in symbols, of the search that was
+            stopped */
+        unsigned int exhausted_at;
+        /** When the input was started on, and the seconds spent on it */
+        double start_time;
+        double time;
+        unsigned long steps;
+        /** The steps taken in each transducer, by its number in the
+            container (see PmatchContainer::get_budget_info()) */
+        std::vector<unsigned long> steps_by_transducer;
+        /** The most bytes held at once, and what they were held in at
+            that point. Only measured with a limited budget. */
+        size_t peak_bytes;
+        size_t peak_bytes_by_kind[BYTE_KINDS];
+
+        PmatchBudgetUsage(void) { clear(); }
+        void clear(void);
+        static const char * limit_name(Limit limit);
+        static const char * byte_kind_name(ByteKind kind);
+    };
+
+/** \brief The working state of a match.
+
+    Matches that are given a PmatchContext don't modify the PmatchContainer,
+    so several threads can use the same container at the same time as long
+    as each thread has a PmatchContext of its own. A context can be reused
+    for any number of matches with the container it was first used with.
+*/
+    class PmatchContext
+    {
+    public:
+        SymbolNumberVector input;
+        // Input symbols that are not in the alphabet of the container,
+        // numbered from the size of its symbol table onwards
+        SymbolTable extra_symbols;
+        std::map<std::string, SymbolNumber> extra_symbol_numbers;
+        // This tracks the ENTRY and EXIT tags
+        PositionStack entry_stack;
+        RtnCallStacks rtn_stacks;
+        // The local variables of each transducer, see
+        // PmatchTransducer::LocalVariables
+        std::deque<PmatchTransducer::LocalStack> local_stacks;
+        DoubleTape tape;
+        DoubleTape best_result;
+        DoubleTape result;
+        LocationVectorVector locations;
+        WeightedDoubleTapeVector tape_locations;
+        std::vector<Capture> captures;
+        std::vector<Capture> best_captures;
+        std::vector<Capture> old_captures;
+        // The flag state for global flags
+        hfst::FdState<SymbolNumber> global_flag_state;
+        // Whether we are locating or matching
+        bool locate_mode;
+        unsigned long line_number;
+        std::map<std::string, size_t> pattern_counts;
+        // Traversals of Counter() positions, for profiling
+        std::vector<unsigned long> counters;
+        unsigned int recursion_depth_left;
+        // An optional time limit for operations
+        double max_time;
+        // When we started work
+        clock_t start_clock;
+        // A counter to avoid checking the clock too often
+        unsigned long call_counter;
+        // A flag to set for when time has been overstepped
+        bool limit_reached;
+        // The global running weight
+        Weight running_weight;
+        // This is the depth of the stack from the point of view of the
+        // container. When it's 0, we're in the toplevel, even if the
+        // stack of variables is bigger due to having passed through a RTN.
+        unsigned int stack_depth;
+        // Where in the input the best candidate so far has gotten to
+        unsigned int best_input_pos;
+        Weight best_weight;
+        // How far the container has gotten in scanning the input for
+        // matches, and how many printable symbols that is
+        unsigned int scan_pos;
+        unsigned int printable_scan_pos;
+        // Input passed over since the last match, for locate mode
+        DoubleTape nonmatching_locations;
+        // Whether input ends where it ends, or more may be pushed to a
+        // PmatchStream
+        bool input_complete;
+        // Set when matching looks past the end of incomplete input
+        mutable bool input_exhausted;
+        // The results of RTN calls on this input, if memoising them
+        RtnMemoTable rtn_memo;
+        // RTN calls made, and how many of them were answered from rtn_memo
+        unsigned long rtn_calls;
+        unsigned long rtn_memo_hits;
+        /** The limits on matching the current input, set from the
+            container's when the input is started on */
+        PmatchBudget budget;
+        /** What has been spent on the current input */
+        PmatchBudgetUsage spent;
+        // The bytes held in tape_locations, and the RTN calls in
+        // progress, for measuring the budget
+        size_t candidate_bytes;
+        size_t rtn_frames;
+
+        PmatchContext(void):
+            locate_mode(false), line_number(0), recursion_depth_left(0),
+            max_time(0.0), start_clock(0), call_counter(0),
+            limit_reached(false), running_weight(0.0), stack_depth(0),
+            best_input_pos(0), best_weight(0.0), scan_pos(0),
+            printable_scan_pos(0), input_complete(true),
+            input_exhausted(false), rtn_calls(0), rtn_memo_hits(0),
+            candidate_bytes(0), rtn_frames(0) {}
+
+        void set_weight(Weight w) { running_weight = w; }
+        void increment_weight(Weight w) { running_weight += w; }
+        Weight get_weight(void) const { return running_weight; }
+        void increase_stack_depth(void) { ++stack_depth; }
+        void decrease_stack_depth(void)
+            {
+                if (stack_depth == 0) {
+                    HFST_THROW_MESSAGE(HfstException, "pmatch: negative stack depth");
+                }
+                --stack_depth;
+            }
+        void push_rtn_call(unsigned int return_index,
+                           const PmatchTransducer * caller,
+                           RtnMemo * memo = NULL,
+                           unsigned int tape_pos = 0);
+        /** \brief Stop memoising the RTN calls in progress. */
+        void taint_rtn_memos(void);
+        RtnStackFrame rtn_stack_top(void) const;
+        const PmatchTransducer * get_latest_rtn_caller(void) const;
+        void rtn_stack_pop(void);
+        unsigned int get_stack_depth(void) const { return stack_depth; }
+        bool candidate_found(void) const
+            {
+                if (locate_mode) {
+                    return tape_locations.size() != 0;
+                } else {
+                    return best_result.size() != 0;
+                }
+            }
+        bool has_queued_input(unsigned int input_pos) const;
+        bool input_matches_at(unsigned int pos,
+                              SymbolNumberVector::const_iterator begin,
+                              SymbolNumberVector::const_iterator end) const;
+        std::pair<SymbolNumberVector::const_iterator,
+                  SymbolNumberVector::const_iterator>
+        get_longest_matching_capture(SymbolNumber key,
+                                     unsigned int input_pos) const;
+        bool try_recurse(void)
+        {
+            if (recursion_depth_left > 0) {
+                --recursion_depth_left;
+                return true;
+            } else {
+                return false;
+            }
+        }
+        void unrecurse(void) { ++recursion_depth_left; }
+        /** \brief Count a step taken in the transducer numbered
+            \a transducer, and tell whether the budget has run out. */
+        bool spend_step(unsigned int transducer)
+        {
+            ++spent.steps;
+            if (transducer >= spent.steps_by_transducer.size()) {
+                spent.steps_by_transducer.resize(transducer + 1, 0);
+            }
+            ++spent.steps_by_transducer[transducer];
+            return budget.is_limited() && check_budget();
+        }
+        bool budget_exhausted(void) const
+            { return spent.exhausted != PmatchBudgetUsage::NO_LIMIT; }
+        /** \brief The bytes held in each PmatchBudgetUsage::ByteKind,
+            and in total. */
+        size_t measure_bytes(size_t by_kind[PmatchBudgetUsage::BYTE_KINDS]) const;
+        /** \brief Add the pattern counts and profiling counters of
+            \a other to those of this context, eg. to sum up the work
+            of several threads. */
+        void add_counts(const PmatchContext & other);
+
+    protected:
+        bool check_budget(void);
+    };
+
+/** \brief The RTNs of a memory-mapped pmatch archive.
+
+    Each RTN is made into a PmatchTransducer from its place in the file
+    when PmatchAlphabet::get_rtn() first asks for it, so loading the
+    archive costs only as much as the RTNs that actually get called.
+    Several threads may ask for RTNs at once.
+*/
+    class PmatchLazyRtns
+    {
+    protected:
+        struct Entry
+        {
+            std::string name;
+            // Where the RTN's transducer header is in the file
+            size_t offset;
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+            std::atomic<PmatchTransducer *> transducer;
+#else
+            PmatchTransducer * transducer;
+#endif
+        };
+
+        PmatchContainer * container;
+        MappedFile * file;
+        std::deque<Entry> entries;
+        // For each symbol, its index in entries, or NO_RTN
+        std::vector<size_t> entry_of_symbol;
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+        std::atomic<size_t> loaded;
+        std::mutex loading;
+#else
+        size_t loaded;
+#endif
+        static const size_t NO_RTN = (size_t) -1;
+
+        PmatchTransducer * load(Entry & entry);
+
+    public:
+        /** Take ownership of \a mapped_file, whose RTNs belong to \a cont. */
+        PmatchLazyRtns(PmatchContainer * cont, MappedFile * mapped_file);
+        ~PmatchLazyRtns(void);
+        /** Note that the RTN \a name for \a symbol is at \a offset in the
+            file. The first one for a symbol is the one that counts. */
+        void add(SymbolNumber symbol, const std::string & name, size_t offset);
+        bool has(SymbolNumber symbol) const
+            {
+                return symbol < entry_of_symbol.size() &&
+                    entry_of_symbol[symbol] != NO_RTN;
+            }
+        PmatchTransducer * get(SymbolNumber symbol);
+        /** The RTN for \a symbol if it has been loaded, otherwise NULL */
+        PmatchTransducer * get_loaded(SymbolNumber symbol) const;
+        /** How many of the RTNs have been loaded so far. */
+        size_t get_loaded_count(void) const { return loaded; }
+        size_t size(void) const { return entries.size(); }
+    };
+
+    class PmatchContainer
+    {
+    protected:
+        PmatchAlphabet alphabet;
+        Encoder * encoder;
+        SymbolNumber orig_symbol_count;
+        PmatchTransducer * toplevel;
+        // The RTNs that are loaded when first called, if any
+        PmatchLazyRtns * lazy_rtns;
+        // How many PmatchTransducers have been made for this container,
+        // each using a local stack of its own in a PmatchContext
+        unsigned int transducer_count;
+        std::vector<char> possible_first_symbols;
+        PmatchPrefilter prefilter;
+        bool verbose;
+        
+        bool count_patterns;
+        bool delete_patterns;
+        bool extract_patterns;
+        bool locate_mode;
+        bool mark_patterns;
+        size_t max_context_length;
+        size_t max_recursion;
+        bool need_separators;
+        bool xerox_composition;
+
+        bool profile_mode;
+        bool single_codepoint_tokenization;
+        bool memoize_rtns;
+        // Whether RTNs have been added since the filters were built
+        bool filters_stale;
+        PmatchBudget budget;
+
+        // for matching through the methods that don't take a PmatchContext
+        PmatchContext context;
+
+        void read_archive(std::istream & inputstream, MappedFile * file);
+        PmatchTransducer * rtn_if_loaded(SymbolNumber symbol) const;
+        void collect_first_symbols(void);
+        void build_prefilter(void);
+        bool prefilter_closure(
+            const PmatchPrefilter::Position & start,
+            std::vector<std::pair<SymbolNumber,
+                                  PmatchPrefilter::Position> > & arcs) const;
+        void prefilter_skip_context(
+            const PmatchPrefilter::Position & start, SymbolNumber exit,
+            std::vector<PmatchPrefilter::Position> & after) const;
+        void prefilter_classes(
+            SymbolNumber label,
+            const std::map<SymbolNumber, SymbolNumberVector> & list_members,
+            SymbolNumberVector & classes) const;
+        void start_scan(PmatchContext & c) const
+            { start_scan(c, budget); }
+        void start_scan(PmatchContext & c, const PmatchBudget & b) const;
+        size_t tokenize_input(const char * input, size_t limit,
+                              PmatchContext & c) const;
+        void scan_input(PmatchContext & c, size_t max_lookahead = 0) const;
+        void flush_nonmatching(PmatchContext & c) const;
+
+    public:
+
+        PmatchContainer(std::istream & is);
+        /** \brief Load a pmatch archive from \a file, taking ownership of
+            it.
+
+            If TOP's header has an index of the RTNs, as written by
+            hfst-pmatch2fst, the RTNs are only read from the file when
+            they are first called. Otherwise this is the same as reading
+            the archive from a stream. */
+        PmatchContainer(MappedFile * file);
+        PmatchContainer(Transducer * toplevel);
+        PmatchContainer(std::vector<hfst::HfstTransducer> transducers);
+        PmatchContainer(void);
+        ~PmatchContainer(void);
+
+
+        void set_properties(void);
+        void set_properties(std::map<std::string, std::string> & properties);
+        void initialize_input(const char * input, PmatchContext & c) const;
+        bool has_unsatisfied_rtns(void) const;
+        std::string get_unsatisfied_rtn_name(void) const;
+        /** Add \a rtn, taking ownership of it, to be called as \a name.
+
+            The filters of where matches may start are then out of date.
+            The next match(), locate() or process() that uses the
+            container's own context rebuilds them. The overloads that take
+            a PmatchContext and PmatchStream don't modify the container, so
+            until finish_adding_rtns() is called they try matches
+            everywhere, which gives the same results more slowly. */
+        void add_rtn(Transducer * rtn, const std::string & name);
+        /** Build the filters of where matches may start again, taking the
+            RTNs given to add_rtn() into account. Call this after adding
+            RTNs, before matching in several threads. */
+        void finish_adding_rtns(void);
+        void process(const std::string & input, PmatchContext & c) const
+            { process(input, c, budget); }
+        void process(const std::string & input, PmatchContext & c,
+                     const PmatchBudget & b) const;
+        void process(const std::string & input)
+            {
+                if (filters_stale) {
+                    finish_adding_rtns();
+                }
+                context.locate_mode = locate_mode;
+                process(input, context);
+            }
+        std::string match(const std::string & input,
+                          double time_cutoff = 0.0,
+                          Weight weight_cutoff = 0.0);
+        LocationVectorVector locate(const std::string & input,
+                                    double time_cutoff = 0.0,
+                                    Weight weight_cutoff = 0.0);
+        /** \brief Match \a input using \a c for the working state.
+
+            This doesn't modify the container, so several threads may
+            call it at once, each with a PmatchContext of its own. */
+        std::string match(const std::string & input,
+                          PmatchContext & c,
+                          double time_cutoff = 0.0,
+                          Weight weight_cutoff = 0.0) const;
+        /** \brief Locate matches in \a input using \a c for the working
+            state.
+
+            @see match(const std::string &, PmatchContext &, double, Weight) */
+        LocationVectorVector locate(const std::string & input,
+                                    PmatchContext & c,
+                                    double time_cutoff = 0.0,
+                                    Weight weight_cutoff = 0.0) const;
+        /** \brief Match \a input using \a c for the working state, with
+            \a b as the budget instead of the container's.
+
+            @see PmatchBudget */
+        std::string match(const std::string & input,
+                          PmatchContext & c,
+                          const PmatchBudget & b) const;
+        /** \brief Locate matches in \a input using \a c for the working
+            state, with \a b as the budget instead of the container's. */
+        LocationVectorVector locate(const std::string & input,
+                                    PmatchContext & c,
+                                    const PmatchBudget & b) const;
+        void note_analysis(PmatchContext & c,
+                           unsigned int input_pos, unsigned int tape_pos) const;
+        void grab_location(PmatchContext & c,
+                           unsigned int input_pos, unsigned int tape_pos) const;
+        std::string get_profiling_info(void);
+        std::string get_profiling_info(const PmatchContext & c) const;
+        std::string get_pattern_count_info(void);
+        /** \brief A report of what the last input matched with \a c
+            spent of its budget, and where. */
+        std::string get_budget_info(const PmatchContext & c) const;
+        std::string get_pattern_count_info(const PmatchContext & c) const;
+        bool not_possible_first_symbol(SymbolNumber sym) const
+        {
+            if (possible_first_symbols.size() == 0) {
+                return false;
+            }
+            return sym >= possible_first_symbols.size() ||
+                possible_first_symbols[sym] == 0;
+        }
+        void copy_to_result(PmatchContext & c,
+                            const DoubleTape & best_result) const;
+        void copy_to_result(PmatchContext & c,
+                            SymbolNumber input, SymbolNumber output) const;
+        static std::map<std::string, std::string> parse_hfst3_header(std::istream & f);
+        void set_verbose(bool b) { verbose = b; }
+        void set_locate_mode(bool b) { locate_mode = b; }
+        void set_extract_patterns(bool b)
+            { extract_patterns = b; }
+        void set_single_codepoint_tokenization(bool b)
+            { single_codepoint_tokenization = b; }
+        void set_count_patterns(bool b)
+            { count_patterns = b; }
+        void set_delete_patterns(bool b)
+            { delete_patterns = b; }
+        void set_mark_patterns(bool b)
+            { mark_patterns = b; }
+        void set_max_recursion(size_t max)
+            { max_recursion = max; }
+        void set_max_context(size_t max)
+            { max_context_length = max; }
+        bool is_in_locate_mode(void) const { return locate_mode; }
+        void set_profile(bool b) { profile_mode = b; }
+        /** \brief Remember what calling a RTN at an input position came
+            to, for the rest of the input, and reuse that instead of
+            calling it again there. Only RTNs that don't depend on their
+            callers (no captures, contexts, global flags, counters or
+            entry and exit markers) are memoised. */
+        void set_memoize_rtns(bool b) { memoize_rtns = b; }
+        /** \brief Limit the work done for each input. The limits are
+            taken into a PmatchContext when it starts on an input. */
+        void set_budget(const PmatchBudget & b) { budget = b; }
+        const PmatchBudget & get_budget(void) const { return budget; }
+        void reset_recursion(PmatchContext & c) const
+            { c.recursion_depth_left = (unsigned int)max_recursion; }
+        /** \brief The context used by the methods that don't take one. */
+        PmatchContext & get_context(void) { return context; }
+        /** \brief The symbols of the container, by symbol number. */
+        const SymbolTable & get_symbol_table(void) const
+            { return alphabet.get_symbol_table(); }
+
+        /** \brief The name of the header property of TOP that lists the
+            names and sizes in bytes of the RTNs that follow it in an
+            archive, one "name<TAB>size" per line. */
+        static const char * rtn_index_property(void) { return "rtn-index"; }
+        /** \brief The RTNs that are loaded on first use, or NULL if all
+            of them were loaded up front. */
+        const PmatchLazyRtns * get_lazy_rtns(void) const { return lazy_rtns; }
+
+        friend class PmatchTransducer;
+        friend class PmatchAlphabet;
+        friend class PmatchStream;
+        friend class PmatchLazyRtns;
+    };
+
+/** \brief Matching input that arrives in pieces, eg. a long document
+    without newlines or a network stream.
+
+    The input may be pushed in buffers of any size, even ones that end in
+    the middle of a symbol. After each push, the output for the part of
+    the input where no longer match is possible any more is ready to be
+    taken. Only the input that is still being matched and the left
+    context before it, up to the container's max context length, is kept
+    around, so memory use doesn't grow with the length of the stream.
+
+    The results are the same as those of matching the whole input at once
+    with PmatchContainer::match() or locate(), except that
+    - a match that is still going on after max_lookahead symbols is cut
+      there, as if the input ended,
+    - in locate mode, a stretch of nonmatching input longer than that is
+      reported in several parts and
+    - a captured string is forgotten once the input it came from has been
+      dropped.
+    NUL bytes in the input are skipped. A match attempt that runs out of
+    input is tried again once the input after its start has doubled in
+    length, so its result may come a few pushes later than it could.
+
+    The container isn't modified, so several streams may share one.
+*/
+    class PmatchStream
+    {
+    protected:
+        const PmatchContainer & container;
+        PmatchContext context;
+        // Input that hasn't been made into symbols yet
+        std::string pending;
+        // Input this long may still be the beginning of a longer symbol
+        size_t symbol_bytes;
+        size_t max_lookahead;
+        bool finished;
+        // For PmatchAlphabet::stringify(), across calls
+        bool printable_seen;
+        // How many symbols the input has to have from the scanning
+        // position on before it is scanned again
+        size_t retry_lookahead;
+        // How many extra symbols there may be before the unused ones are
+        // dropped
+        size_t extra_symbols_limit;
+
+        void process_pending(void);
+        void drop_processed_input(void);
+        void drop_unused_extra_symbols(void);
+
+    public:
+        /** \brief Start matching a stream with \a container, in locate
+            mode if \a locate is true. */
+        PmatchStream(const PmatchContainer & container, bool locate = false);
+
+        /** \brief Add the next \a length bytes of input at \a data. */
+        void push(const char * data, size_t length);
+        void push(const std::string & data)
+            { push(data.data(), data.size()); }
+        /** \brief Mark the end of the input, after which everything can be
+            taken. Nothing may be pushed after this. */
+        void finish(void);
+
+        /** \brief The output for the input processed since the last call,
+            in match mode. */
+        std::string take_output(void);
+        /** \brief The locations found since the last call, in locate
+            mode. */
+        LocationVectorVector take_locations(void);
+
+        /** \brief How far ahead a single match may look, in symbols
+            (default 65536, 0 for no limit). */
+        void set_max_lookahead(size_t symbols) { max_lookahead = symbols; }
+        /** \brief Limit the work done for the rest of the stream, which
+            counts as one input. By default the container's budget is
+            used. */
+        void set_budget(const PmatchBudget & b) { context.budget = b; }
+        /** \brief How many symbols of input are being held on to. */
+        size_t get_buffered_size(void) const
+            { return context.input.size(); }
+        /** \brief The context with the pattern counts and profiling
+            counters of this stream. */
+        PmatchContext & get_context(void) { return context; }
+    };
+
 }
 
 #endif //_HFST_OL_TRANSDUCER_PMATCH_H_
@@ -47,8 +47,18 @@ void print_escaping_newlines(std::string const & str, std::ostream & outstream)
     outstream << str.substr(i, j-i);
 }
 
+const BinaryLocationWriter & binary_writer(const TokenizeSettings& s)
+{
+    static const BinaryLocationWriter no_header;
+    return s.binary_writer != NULL ? *s.binary_writer : no_header;
+}
+
 void print_nonmatching_sequence(std::string const & str, std::ostream & outstream, const TokenizeSettings& s)
 {
+    if (s.output_format == binary) {
+        binary_writer(s).write_verbatim(str, outstream);
+        return;
+    }
     if (s.output_format == tokenize || s.output_format == space_separated) {
         outstream << str;
     } else if (s.output_format == xerox) {
@@ -338,11 +348,12 @@ const hfst::StringVector split_at(const hfst::StringVector & syms,
  * Look up form, filtering out empties and those that don't cover the
  * full string.
  */
-const LocationVector locate_fullmatch(hfst_ol::PmatchContainer & container,
+const LocationVector locate_fullmatch(const hfst_ol::PmatchContainer & container,
+                                      hfst_ol::PmatchContext & c,
                                       string & form,
                                       const TokenizeSettings& s)
 {
-    LocationVectorVector sublocs = container.locate(form, s.time_cutoff);
+    LocationVectorVector sublocs = container.locate(form, c, s.time_cutoff);
     LocationVector loc_filtered;
     // TODO: Worth noticing about? Is this as safe as checking that input.length != form.length?
     // if(sublocs.size() != 1) {
@@ -369,7 +380,8 @@ const LocationVector locate_fullmatch(hfst_ol::PmatchContainer & container,
     return loc_filtered;
 }
 
-void print_location_vector_giellacg(hfst_ol::PmatchContainer & container,
+void print_location_vector_giellacg(const hfst_ol::PmatchContainer & container,
+                                    hfst_ol::PmatchContext & c,
                                     LocationVector const & locations,
                                     std::ostream & outstream,
                                     const TokenizeSettings& s)
@@ -409,7 +421,7 @@ void print_location_vector_giellacg(hfst_ol::PmatchContainer & container,
             const size_t first = it->find_first_not_of(' ');
             const size_t last = it->find_last_not_of(' ') + 1;
             string form = it->substr(first, last-first);
-            LocationVector loc = locate_fullmatch(container, form, s);
+            LocationVector loc = locate_fullmatch(container, c, form, s);
             if(loc.size() == 0 && s.verbose) {
                 std::cerr << "Warning: The analysis of \"<" << locations.at(0).input << ">\" has backtracking around the substring \"<" << form << ">\", but that substring has no analyses." << std::endl;
                 // but push it anyway, since we want exactly one subvector per splitpoint
@@ -541,7 +553,8 @@ std::string empty_to_underscore(std::string to_test)
 }
 
 
-void print_location_vector(hfst_ol::PmatchContainer & container,
+void print_location_vector(const hfst_ol::PmatchContainer & container,
+                           hfst_ol::PmatchContext & c,
                            LocationVector const & locations,
                            std::ostream & outstream,
                            int token_number,
@@ -587,7 +600,7 @@ void print_location_vector(hfst_ol::PmatchContainer & container,
         }
         outstream << std::endl;
     } else if (s.output_format == giellacg && locations.size() != 0) {
-        print_location_vector_giellacg(container, locations, outstream, s);
+        print_location_vector_giellacg(container, c, locations, outstream, s);
     } else if (s.output_format == xerox) {
         float best_weight = std::numeric_limits<float>::max();
         if (s.beam >= 0.0) {
@@ -688,12 +701,187 @@ void print_location_vector(hfst_ol::PmatchContainer & container,
 //    std::cerr << "from print_location_vector\n";
 }
 
+// The binary format, see pmatch_tokenize_binary.h
+
+static void put_uint(std::string & buffer, unsigned int value)
+{
+    char bytes[4] = { (char) (value & 0xff), (char) ((value >> 8) & 0xff),
+                      (char) ((value >> 16) & 0xff),
+                      (char) ((value >> 24) & 0xff) };
+    buffer.append(bytes, 4);
+}
+
+static void put_string(std::string & buffer, const string & str)
+{
+    put_uint(buffer, hfst::size_t_to_uint(str.size()));
+    buffer.append(str);
+}
+
+static void put_record(std::ostream & outstream, char kind,
+                       const std::string & payload)
+{
+    std::string head(1, kind);
+    put_uint(head, hfst::size_t_to_uint(payload.size()));
+    outstream.write(head.data(), head.size());
+    outstream.write(payload.data(), payload.size());
+}
+
+namespace {
+// Numbers the symbols of one record: those of the stream header as they
+// are there, others after them in order of appearance
+class BinarySymbolNumbering
+{
+    const hfst_ol::StringSymbolMap & header;
+    unsigned int header_size;
+    std::map<string, unsigned int> local;
+public:
+    std::string local_symbols;
+    unsigned int local_count;
+
+    BinarySymbolNumbering(const hfst_ol::StringSymbolMap & h,
+                          unsigned int size):
+        header(h), header_size(size), local_count(0) {}
+
+    unsigned int number(const string & str)
+    {
+        hfst_ol::StringSymbolMap::const_iterator found = header.find(str);
+        if (found != header.end()) {
+            return found->second;
+        }
+        std::pair<std::map<string, unsigned int>::iterator, bool> inserted =
+            local.insert(std::make_pair(str, header_size + local_count));
+        if (inserted.second) {
+            put_string(local_symbols, str);
+            ++local_count;
+        }
+        return inserted.first->second;
+    }
+
+    void put_symbols(std::string & buffer, const vector<string> & strs)
+    {
+        put_uint(buffer, hfst::size_t_to_uint(strs.size()));
+        for (vector<string>::const_iterator it = strs.begin();
+             it != strs.end(); ++it) {
+            put_uint(buffer, number(*it));
+        }
+    }
+};
+}
+
+static void put_parts(std::string & buffer, const vector<size_t> & parts)
+{
+    put_uint(buffer, hfst::size_t_to_uint(parts.size()));
+    for (vector<size_t>::const_iterator it = parts.begin();
+         it != parts.end(); ++it) {
+        put_uint(buffer, hfst::size_t_to_uint(*it));
+    }
+}
+
+BinaryLocationWriter::BinaryLocationWriter(void)
+{}
+
+BinaryLocationWriter::BinaryLocationWriter(const hfst_ol::PmatchContainer & container):
+    symbols(container.get_symbol_table())
+{
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        // Where a string is in the table more than once, the first one is
+        // used
+        symbol_numbers.insert(std::make_pair(symbols[i], (hfst_ol::SymbolNumber) i));
+    }
+}
+
+void BinaryLocationWriter::write_header(std::ostream & outstream) const
+{
+    std::string header(BINARY_MAGIC, BINARY_MAGIC_LENGTH);
+    put_uint(header, hfst::size_t_to_uint(symbols.size()));
+    for (hfst_ol::SymbolTable::const_iterator it = symbols.begin();
+         it != symbols.end(); ++it) {
+        put_string(header, *it);
+    }
+    outstream.write(header.data(), header.size());
+}
+
+void BinaryLocationWriter::write(const LocationVectorVector & locations,
+                                 std::ostream & outstream,
+                                 const TokenizeSettings & s) const
+{
+    BinarySymbolNumbering numbering(symbol_numbers,
+                                    hfst::size_t_to_uint(symbols.size()));
+    std::string tokens;
+    unsigned int token_count = 0;
+    for (LocationVectorVector::const_iterator it = locations.begin();
+         it != locations.end(); ++it) {
+        bool nonmatching = it->size() == 1 &&
+            it->at(0).output.compare("@_NONMATCHING_@") == 0;
+        if (nonmatching && !s.print_all) {
+            continue;
+        }
+        // Filtering copies the readings, so it's skipped when there's
+        // nothing to filter
+        LocationVector filtered;
+        if (!nonmatching && (s.dedupe || it->size() > (size_t) s.max_weight_classes)) {
+            filtered = keep_n_best_weight(dedupe_locations(*it, s), s);
+        }
+        const LocationVector & readings = filtered.empty() ? *it : filtered;
+        if (readings.empty()) {
+            continue;
+        }
+        put_uint(tokens, readings.at(0).start);
+        put_uint(tokens, readings.at(0).length);
+        tokens.push_back(nonmatching ? (char) BINARY_NONMATCHING : 0);
+        put_uint(tokens, hfst::size_t_to_uint(readings.size()));
+        for (LocationVector::const_iterator loc = readings.begin();
+             loc != readings.end(); ++loc) {
+            float weight = loc->weight;
+            unsigned int weight_bits;
+            std::memcpy(&weight_bits, &weight, 4);
+            put_uint(tokens, weight_bits);
+            put_uint(tokens, loc->tag.empty() ?
+                     BINARY_NO_TAG : numbering.number(loc->tag));
+            numbering.put_symbols(tokens, loc->input_symbol_strings);
+            // The output of a nonmatching token is a placeholder
+            numbering.put_symbols(tokens, nonmatching ?
+                                  vector<string>() : loc->output_symbol_strings);
+            put_parts(tokens, loc->input_parts);
+            put_parts(tokens, nonmatching ?
+                      vector<size_t>() : loc->output_parts);
+        }
+        ++token_count;
+    }
+    std::string payload;
+    put_uint(payload, numbering.local_count);
+    payload.append(numbering.local_symbols);
+    put_uint(payload, token_count);
+    payload.append(tokens);
+    put_record(outstream, BINARY_UNIT, payload);
+}
+
+void BinaryLocationWriter::write_verbatim(const std::string & str,
+                                          std::ostream & outstream) const
+{
+    put_record(outstream, BINARY_VERBATIM, str);
+}
+
 void match_and_print(hfst_ol::PmatchContainer & container,
                      std::ostream & outstream,
                      const string & input_text,
                      const TokenizeSettings& s)
 {
-    LocationVectorVector locations = container.locate(input_text, s.time_cutoff);
+    match_and_print(container, container.get_context(), outstream, input_text, s);
+}
+
+void match_and_print(const hfst_ol::PmatchContainer & container,
+                     hfst_ol::PmatchContext & c,
+                     std::ostream & outstream,
+                     const string & input_text,
+                     const TokenizeSettings& s)
+{
+    LocationVectorVector locations = container.locate(input_text, c, s.time_cutoff);
+    if (s.output_format == binary) {
+        // Every input gets a record, so they can be told apart
+        binary_writer(s).write(locations, outstream, s);
+        return;
+    }
     if (locations.size() == 0 && s.print_all) {
         print_no_output(input_text, outstream, s);
     }
@@ -708,6 +896,7 @@ void match_and_print(hfst_ol::PmatchContainer & container,
             // All nonmatching cases have been handled
         }
         print_location_vector(container,
+                              c,
                               keep_n_best_weight(dedupe_locations(*it, s), s),
                               outstream,
                               token_number,
@@ -725,6 +914,9 @@ void process_input(hfst_ol::PmatchContainer & container,
                    const TokenizeSettings& s)
 {
     container.set_single_codepoint_tokenization(!s.tokenize_multichar);
+    if (s.output_format == binary) {
+        binary_writer(s).write_header(outstream);
+    }
     size_t bufsize = 4096;
     for(char line[bufsize]; instream.getline(line, bufsize); ) {
         string input_text(line);
@@ -13,6 +13,7 @@
 #include <iterator>
 
 #include "pmatch.h"
+#include "pmatch_tokenize_binary.h"
 
 namespace hfst_ol_tokenize {
 
@@ -23,9 +24,12 @@ enum OutputFormat {
     cg,
     finnpos,
     giellacg,
-    conllu
+    conllu,
+    binary
 };
 
+class BinaryLocationWriter;
+
 struct TokenizeSettings {
         OutputFormat output_format = tokenize;
         int max_weight_classes = std::numeric_limits<int>::max();
@@ -36,6 +40,36 @@ struct TokenizeSettings {
         bool verbose = true;
         float beam = -1.0;
         bool tokenize_multichar = false;
+        // For the binary format; if NULL, all symbols are written as local
+        // to their records
+        const BinaryLocationWriter * binary_writer = NULL;
+};
+
+/** \brief Writes the results of PmatchContainer::locate() in the format
+    described in pmatch_tokenize_binary.h.
+
+    The symbol table of the container is written once, in the stream
+    header, and other symbols in the record of each input they occur in,
+    so that a writer can be shared by several threads. */
+class BinaryLocationWriter
+{
+public:
+    /** A writer with no symbols in the stream header */
+    BinaryLocationWriter(void);
+    BinaryLocationWriter(const hfst_ol::PmatchContainer & container);
+
+    void write_header(std::ostream & outstream) const;
+    /** Write \a locations as one record, filtered by \a s like
+        match_and_print() does */
+    void write(const hfst_ol::LocationVectorVector & locations,
+               std::ostream & outstream,
+               const TokenizeSettings & s) const;
+    void write_verbatim(const std::string & str,
+                        std::ostream & outstream) const;
+
+protected:
+    hfst_ol::SymbolTable symbols;
+    hfst_ol::StringSymbolMap symbol_numbers;
 };
 
 void print_nonmatching_sequence(std::string const & str, std::ostream & outstream, const TokenizeSettings& s);
@@ -45,6 +79,15 @@ void match_and_print(hfst_ol::PmatchContainer & container,
                      const string & input_text,
                      const TokenizeSettings& s);
 
+/** \brief Like match_and_print(PmatchContainer &, std::ostream &, const string &, const TokenizeSettings&),
+    but with \a c for the working state, so several threads can share
+    \a container. */
+void match_and_print(const hfst_ol::PmatchContainer & container,
+                     hfst_ol::PmatchContext & c,
+                     std::ostream & outstream,
+                     const string & input_text,
+                     const TokenizeSettings& s);
+
 void process_input(hfst_ol::PmatchContainer & container,
                    std::istream& instream,
                    std::ostream& outstream,
@@ -0,0 +1,351 @@
+// Copyright (c) 2016-2017 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+/**
+ * @file pmatch_tokenize_binary.h
+ *
+ * @brief The binary output format of hfst-tokenize (--binary), and a
+ * reader for it.
+ *
+ * The format carries what PmatchContainer::locate() returns, with
+ * symbols as numbers instead of strings, so a consumer gets the tokens
+ * without splitting any text. All integers are unsigned and
+ * little-endian, weights are IEEE 754 single precision floats.
+ *
+ * \verbatim
+   stream:   "HFSTTOK1", u32 symbol count, that many symbols, records...
+   symbol:   u32 length in bytes, the UTF-8 bytes
+   record:   u8 kind, u32 payload length in bytes, payload
+
+   kind 'U', the tokens of one input:
+             u32 local symbol count, that many symbols,
+             u32 token count, that many tokens
+   token:    u32 start, u32 length (in input symbols),
+             u8 flags (1: the input didn't match), u32 reading count,
+             that many readings
+   reading:  f32 weight, u32 tag symbol (0xffffffff: no tag),
+             u32 n, n input symbols, u32 n, n output symbols,
+             u32 n, n input part boundaries, u32 n, n output part boundaries
+
+   kind 'V', text copied verbatim, like the superblanks of the input:
+             the bytes
+   \endverbatim
+ *
+ * Symbols are numbered from 0 in the order they appear in the stream
+ * header, which has the symbol table of the tokenizer. The local symbols
+ * of a 'U' record, like tags or input that isn't in the alphabet, are
+ * numbered after them and are valid only in that record. The part
+ * boundaries are indices into the input and output symbols of a reading,
+ * as in hfst_ol::Location.
+ *
+ * This header depends only on the standard library, so that it can be
+ * copied into programs that don't link with HFST.
+ */
+
+#ifndef _HFST_OL_TRANSDUCER_PMATCH_TOKENIZE_BINARY_H_
+#define _HFST_OL_TRANSDUCER_PMATCH_TOKENIZE_BINARY_H_
+
+#include <istream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+namespace hfst_ol_tokenize {
+
+const char BINARY_MAGIC[] = "HFSTTOK1";
+const size_t BINARY_MAGIC_LENGTH = 8;
+const char BINARY_UNIT = 'U';
+const char BINARY_VERBATIM = 'V';
+const unsigned char BINARY_NONMATCHING = 1;
+const unsigned int BINARY_NO_TAG = 0xffffffff;
+
+/**
+ * @brief Reads the records of a stream in the binary format one at a
+ * time. Everything returned points into buffers that are reused, so it's
+ * valid until the next call to next().
+ */
+class BinaryLocationReader
+{
+public:
+    /** A run of symbol numbers or part boundaries */
+    struct Numbers
+    {
+        const unsigned int * begin;
+        unsigned int size;
+        const unsigned int * end(void) const { return begin + size; }
+        unsigned int operator[](unsigned int i) const { return begin[i]; }
+    };
+
+    struct Reading
+    {
+        float weight;
+        unsigned int tag;
+        Numbers input;
+        Numbers output;
+        Numbers input_parts;
+        Numbers output_parts;
+    };
+
+    struct Token
+    {
+        unsigned int start;
+        unsigned int length;
+        bool nonmatching;
+        const Reading * readings;
+        unsigned int reading_count;
+    };
+
+    enum RecordKind { UNIT, VERBATIM };
+
+    /** Reads the stream header. If it's not there, good() is false. */
+    BinaryLocationReader(std::istream & is):
+        in(is), ok(false), kind(UNIT)
+    {
+        char magic[BINARY_MAGIC_LENGTH];
+        if (!in.read(magic, BINARY_MAGIC_LENGTH) ||
+            std::memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_LENGTH) != 0) {
+            return;
+        }
+        char count[4];
+        if (!in.read(count, 4)) {
+            return;
+        }
+        // The symbol table goes through the same parsing as a record
+        unsigned int header_size = to_uint(count);
+        std::string header(count, 4);
+        for (unsigned int i = 0; i < header_size; ++i) {
+            char length[4];
+            if (!in.read(length, 4)) {
+                return;
+            }
+            size_t old_size = header.size();
+            header.append(length, 4);
+            header.resize(old_size + 4 + to_uint(length));
+            if (!in.read(&header[old_size + 4], to_uint(length))) {
+                return;
+            }
+        }
+        const unsigned char * pos =
+            reinterpret_cast<const unsigned char *>(header.data());
+        ok = read_symbols(pos, pos + header.size(), symbols);
+    }
+
+    /** False if the stream header was missing or a record was
+        malformed */
+    bool good(void) const { return ok; }
+
+    /** Reads the next record. Returns false at the end of the stream or
+        if the record is malformed. */
+    bool next(void)
+    {
+        tokens.clear();
+        readings.clear();
+        numbers.clear();
+        local_symbols.clear();
+        text.clear();
+        if (!ok) {
+            return false;
+        }
+        char head[5];
+        if (!in.read(head, 5)) {
+            if (in.gcount() != 0) {
+                ok = false;
+            }
+            return false;
+        }
+        unsigned int length = to_uint(head + 1);
+        payload.resize(length);
+        if (length > 0 && !in.read(&payload[0], length)) {
+            ok = false;
+            return false;
+        }
+        const unsigned char * pos =
+            reinterpret_cast<const unsigned char *>(payload.data());
+        const unsigned char * end = pos + length;
+        if (head[0] == BINARY_VERBATIM) {
+            kind = VERBATIM;
+            text.assign(payload);
+            return true;
+        }
+        kind = UNIT;
+        ok = head[0] == BINARY_UNIT && read_unit(pos, end);
+        return ok;
+    }
+
+    RecordKind get_kind(void) const { return kind; }
+    /** The tokens of a UNIT record */
+    const std::vector<Token> & get_tokens(void) const { return tokens; }
+    /** The text of a VERBATIM record */
+    const std::string & get_text(void) const { return text; }
+
+    /** The number of symbols usable in the current record */
+    size_t symbol_count(void) const
+        { return symbols.size() + local_symbols.size(); }
+    /** The number of symbols in the stream header */
+    size_t header_symbol_count(void) const { return symbols.size(); }
+    const std::string & symbol(unsigned int number) const
+    {
+        if (number < symbols.size()) {
+            return symbols[number];
+        }
+        return local_symbols[number - symbols.size()];
+    }
+    /** The symbols of \a n concatenated */
+    std::string string_of(const Numbers & n) const
+    {
+        std::string retval;
+        for (const unsigned int * it = n.begin; it != n.end(); ++it) {
+            retval.append(symbol(*it));
+        }
+        return retval;
+    }
+
+protected:
+    std::istream & in;
+    bool ok;
+    RecordKind kind;
+    std::vector<std::string> symbols;
+    std::vector<std::string> local_symbols;
+    std::string payload;
+    std::string text;
+    std::vector<Token> tokens;
+    std::vector<Reading> readings;
+    std::vector<unsigned int> numbers;
+
+    static unsigned int to_uint(const char * p)
+    {
+        return to_uint(reinterpret_cast<const unsigned char *>(p));
+    }
+
+    static unsigned int to_uint(const unsigned char * p)
+    {
+        return (unsigned int) p[0] | ((unsigned int) p[1] << 8) |
+            ((unsigned int) p[2] << 16) | ((unsigned int) p[3] << 24);
+    }
+
+    static bool read_uint(const unsigned char *& pos,
+                          const unsigned char * end,
+                          unsigned int & value)
+    {
+        if (end - pos < 4) {
+            return false;
+        }
+        value = to_uint(pos);
+        pos += 4;
+        return true;
+    }
+
+    static bool read_symbols(const unsigned char *& pos,
+                             const unsigned char * end,
+                             std::vector<std::string> & into)
+    {
+        unsigned int count;
+        if (!read_uint(pos, end, count)) {
+            return false;
+        }
+        for (unsigned int i = 0; i < count; ++i) {
+            unsigned int length;
+            if (!read_uint(pos, end, length) ||
+                (size_t) (end - pos) < length) {
+                return false;
+            }
+            into.push_back(std::string(reinterpret_cast<const char *>(pos),
+                                       length));
+            pos += length;
+        }
+        return true;
+    }
+
+    bool read_numbers(const unsigned char *& pos,
+                      const unsigned char * end,
+                      Numbers & into)
+    {
+        unsigned int count;
+        if (!read_uint(pos, end, count) ||
+            (size_t) (end - pos) / 4 < count) {
+            return false;
+        }
+        // Space for these was reserved in read_unit(), so the pointer
+        // stays valid
+        into.begin = numbers.data() + numbers.size();
+        into.size = count;
+        for (unsigned int i = 0; i < count; ++i) {
+            numbers.push_back(to_uint(pos));
+            pos += 4;
+        }
+        return true;
+    }
+
+    bool read_unit(const unsigned char * pos, const unsigned char * end)
+    {
+        if (!read_symbols(pos, end, local_symbols)) {
+            return false;
+        }
+        // Every number takes 4 bytes and every reading and token at least
+        // 13, so these bound what the record can have and nothing is
+        // moved while the record is read
+        numbers.reserve((end - pos) / 4);
+        readings.reserve((end - pos) / 13);
+        unsigned int token_count;
+        if (!read_uint(pos, end, token_count) ||
+            (size_t) (end - pos) / 13 < token_count) {
+            return false;
+        }
+        tokens.reserve(token_count);
+        for (unsigned int i = 0; i < token_count; ++i) {
+            Token t;
+            if (!read_uint(pos, end, t.start) ||
+                !read_uint(pos, end, t.length) || pos == end) {
+                return false;
+            }
+            t.nonmatching = (*pos++ & BINARY_NONMATCHING) != 0;
+            if (!read_uint(pos, end, t.reading_count)) {
+                return false;
+            }
+            t.readings = readings.data() + readings.size();
+            for (unsigned int j = 0; j < t.reading_count; ++j) {
+                Reading r;
+                unsigned int weight_bits;
+                if (!read_uint(pos, end, weight_bits) ||
+                    !read_uint(pos, end, r.tag) ||
+                    !read_numbers(pos, end, r.input) ||
+                    !read_numbers(pos, end, r.output) ||
+                    !read_numbers(pos, end, r.input_parts) ||
+                    !read_numbers(pos, end, r.output_parts)) {
+                    return false;
+                }
+                std::memcpy(&r.weight, &weight_bits, 4);
+                readings.push_back(r);
+            }
+            tokens.push_back(t);
+        }
+        for (std::vector<Reading>::const_iterator it = readings.begin();
+             it != readings.end(); ++it) {
+            if (!valid(it->input) || !valid(it->output) ||
+                (it->tag != BINARY_NO_TAG && it->tag >= symbol_count())) {
+                return false;
+            }
+        }
+        return pos == end;
+    }
+
+    bool valid(const Numbers & n) const
+    {
+        for (const unsigned int * it = n.begin; it != n.end(); ++it) {
+            if (*it >= symbol_count()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}
+
+#endif //_HFST_OL_TRANSDUCER_PMATCH_TOKENIZE_BINARY_H_
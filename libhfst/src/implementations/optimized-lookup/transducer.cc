@@ -10,6 +10,22 @@
 #include "./transducer.h"
 
 #include <cstdio> // testing
+#include <fstream>
+#include <streambuf>
+
+#ifndef _MSC_VER
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#endif
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HFST_OL_SSE2 1
+#endif
 
 #ifndef MAIN_TEST
 
@@ -178,40 +194,61 @@ Weight TransitionWIndex::final_weight(void) const
     return weight.w;
 }
 
-void OlLetterTrie::add_string(const char * p, SymbolNumber symbol_key)
+namespace {
+
+// The number of consecutive set bits in \a mask from the lowest one up,
+// \a mask having at least one unset bit
+inline unsigned int count_trailing_ones(unsigned int mask)
 {
-    if (*(p+1) == 0)
-    {
-        symbols[(unsigned char)(*p)] = symbol_key;
-        return;
+#if defined(__GNUC__)
+    return __builtin_ctz(~mask);
+#else
+    unsigned int n = 0;
+    while (mask & 1u) {
+        mask >>= 1;
+        ++n;
     }
-    if (letters[(unsigned char)(*p)] == NULL)
-    {
-        letters[(unsigned char)(*p)] = new OlLetterTrie();
-    }
-    letters[(unsigned char)(*p)]->add_string(p+1,symbol_key);
+    return n;
+#endif
 }
 
-bool OlLetterTrie::has_key_starting_with(const char c) const
-{
-    return letters[(unsigned char) c] != NULL;
 }
 
-SymbolNumber OlLetterTrie::find_key(char ** p)
+TransitionTableIndex symbol_run_length(const SymbolNumber * p,
+                                       SymbolNumber symbol)
 {
-    const char * old_p = *p;
-    ++(*p);
-    if (letters[(unsigned char)(*old_p)] == NULL)
-    {
-        return symbols[(unsigned char)(*old_p)];
+    TransitionTableIndex n = 0;
+#if defined(__AVX2__)
+    const __m256i wanted = _mm256_set1_epi16((short) symbol);
+    while (true) {
+        __m256i block = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(p + n));
+        // Two bits of the mask for each 16-bit symbol
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi16(block, wanted));
+        if (mask != 0xffffffffu) {
+            return n + count_trailing_ones(mask) / 2;
+        }
+        n += 16;
     }
-    SymbolNumber s = letters[(unsigned char)(*old_p)]->find_key(p);
-    if (s == NO_SYMBOL_NUMBER)
-    {
-        --(*p);
-        return symbols[(unsigned char)(*old_p)];
+#elif defined(HFST_OL_SSE2)
+    const __m128i wanted = _mm_set1_epi16((short) symbol);
+    while (true) {
+        __m128i block = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(p + n));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+            _mm_cmpeq_epi16(block, wanted));
+        if (mask != 0xffffu) {
+            return n + count_trailing_ones(mask) / 2;
+        }
+        n += 8;
     }
-    return s;
+#else
+    while (p[n] == symbol) {
+        ++n;
+    }
+    return n;
+#endif
 }
 
 void Encoder::read_input_symbols(const SymbolTable & kt)
@@ -236,7 +273,7 @@ void Encoder::read_input_symbol(const char * s, const int s_num)
     letters.add_string(s, s_num);
 }
 
-SymbolNumber Encoder::find_key(char ** p)
+SymbolNumber Encoder::find_key(char ** p) const
 {
     if (!should_ascii_tokenize((unsigned char) **p) ||
         ascii_symbols[(unsigned char)(**p)] == NO_SYMBOL_NUMBER)
@@ -249,37 +286,126 @@ SymbolNumber Encoder::find_key(char ** p)
 }
 
 bool Transducer::initialize_input(const char * input)
+{
+    return initialize_input(input, context);
+}
+
+bool Transducer::initialize_input(const char * input,
+                                  LookupContext & c) const
 {
     char * input_str = const_cast<char *>(input);
     char ** input_str_ptr = &input_str;
     unsigned int i = 0;
     SymbolNumber k = NO_SYMBOL_NUMBER;
+    c.extra_symbols.clear();
     while(**input_str_ptr != 0) {
         char * original_input_loc = *input_str_ptr;
         k = encoder->find_key(input_str_ptr);
         if (k == NO_SYMBOL_NUMBER) {
-            // Add what we assume to be an unknown utf-8 symbol to the alphabet
+            // Give what we assume to be an unknown utf-8 symbol a number
+            // past the end of the alphabet
             *input_str_ptr = original_input_loc;
             int bytes_to_tokenize = nByte_utf8(**input_str_ptr);
             if (bytes_to_tokenize == 0) {
                 return false; // tokenization failed
             }
-            char * new_symbol = new char[bytes_to_tokenize + 1];
-            memcpy(new_symbol, *input_str_ptr, bytes_to_tokenize);
-            new_symbol[bytes_to_tokenize] = '\0';
+            std::string new_symbol(*input_str_ptr, bytes_to_tokenize);
             (*input_str_ptr) += bytes_to_tokenize;
-            alphabet->add_symbol(new_symbol);
-            k = hfst::size_t_to_uint(alphabet->get_symbol_table().size() - 1);
-            encoder->read_input_symbol(new_symbol, k);
-            delete [] new_symbol;
+            size_t extra = 0;
+            while (extra < c.extra_symbols.size() &&
+                   c.extra_symbols[extra] != new_symbol) {
+                ++extra;
+            }
+            if (extra == c.extra_symbols.size()) {
+                c.extra_symbols.push_back(new_symbol);
+            }
+            k = hfst::size_t_to_uint(alphabet->get_symbol_table().size() + extra);
         }
-        input_tape.write(i, k);
+        c.input_tape.write(i, k);
         ++i;
     }
-    input_tape.write(i, NO_SYMBOL_NUMBER);
+    c.input_tape.write(i, NO_SYMBOL_NUMBER);
     return true;
 }
 
+namespace {
+
+// Epsilon in results
+const std::string EPSILON_STRING;
+
+// Collects the output strings of results, counting each distinct
+// input/output path once, as the set of paths it used to be collected
+// into did
+class OneLevelPathCollector: public LookupVisitor
+{
+    const Transducer & transducer;
+    const LookupContext & context;
+    HfstOneLevelPaths & results;
+    std::set<std::pair<Weight, std::vector<unsigned int> > > seen;
+public:
+    OneLevelPathCollector(const Transducer & t, const LookupContext & c,
+                          HfstOneLevelPaths & paths):
+        transducer(t), context(c), results(paths), seen() {}
+
+    bool visit(const SymbolPair * path, size_t length, Weight weight)
+        {
+            std::pair<Weight, std::vector<unsigned int> > key;
+            key.first = weight;
+            key.second.reserve(length);
+            for (size_t i = 0; i < length; ++i) {
+                key.second.push_back(((unsigned int)path[i].input << 16) |
+                                     path[i].output);
+            }
+            if (!seen.insert(key).second) {
+                return false;
+            }
+            HfstOneLevelPath result;
+            result.first = weight;
+            for (size_t i = 0; i < length; ++i) {
+                result.second.push_back(
+                    transducer.symbol_string(context, path[i].output));
+            }
+            results.insert(result);
+            return true;
+        }
+};
+
+class TwoLevelPathCollector: public LookupVisitor
+{
+    const Transducer & transducer;
+    const LookupContext & context;
+    HfstTwoLevelPaths & results;
+public:
+    TwoLevelPathCollector(const Transducer & t, const LookupContext & c,
+                          HfstTwoLevelPaths & paths):
+        transducer(t), context(c), results(paths) {}
+
+    bool visit(const SymbolPair * path, size_t length, Weight weight)
+        {
+            HfstTwoLevelPath result;
+            result.first = weight;
+            for (size_t i = 0; i < length; ++i) {
+                result.second.push_back(StringPair(
+                    transducer.symbol_string(context, path[i].input),
+                    transducer.symbol_string(context, path[i].output)));
+            }
+            return results.insert(result).second;
+        }
+};
+
+}
+
+const std::string & Transducer::symbol_string(const LookupContext & c,
+                                              SymbolNumber symbol) const
+{
+    const SymbolTable & symbol_table = alphabet->get_symbol_table();
+    if (symbol >= symbol_table.size()) {
+        return c.extra_symbols[symbol - symbol_table.size()];
+    }
+    // represent epsilon as blank string
+    return symbol == 0 ? EPSILON_STRING : symbol_table[symbol];
+}
+
 void Transducer::include_symbol_in_alphabet(const std::string & sym)
 {
     SymbolNumber key = alphabet->symbol_from_string(sym);
@@ -305,29 +431,54 @@ HfstOneLevelPaths * Transducer::lookup_fd(const StringVector & s, ssize_t limit,
     return lookup_fd(input_str, limit, time_cutoff);
 }
 
+HfstOneLevelPaths * Transducer::lookup_fd(const StringVector & s,
+                                          LookupContext & c, ssize_t limit,
+                                          double time_cutoff) const
+{
+    std::string input_str;
+    for (StringVector::const_iterator it = s.begin(); it != s.end(); ++it) {
+        input_str.append(*it);
+    }
+    return lookup_fd(input_str, c, limit, time_cutoff);
+}
+
 HfstOneLevelPaths * Transducer::lookup_fd(const std::string & s, ssize_t limit,
                                           double time_cutoff)
 {
-    return lookup_fd(s.c_str(), limit, time_cutoff);
+    return lookup_fd(s.c_str(), context, limit, time_cutoff);
+}
+
+HfstOneLevelPaths * Transducer::lookup_fd(const std::string & s,
+                                          LookupContext & c, ssize_t limit,
+                                          double time_cutoff) const
+{
+    return lookup_fd(s.c_str(), c, limit, time_cutoff);
 }
 
 HfstTwoLevelPaths * Transducer::lookup_fd_pairs(const std::string & s, ssize_t limit,
                                                 double time_cutoff)
 {
-    return lookup_fd_pairs(s.c_str(), limit, time_cutoff);
+    return lookup_fd_pairs(s.c_str(), context, limit, time_cutoff);
 }
 
 bool Transducer::is_lookup_infinitely_ambiguous(const std::string & s)
 {
-    if (!initialize_input(s.c_str())) {
+    return is_lookup_infinitely_ambiguous(s, context);
+}
+
+bool Transducer::is_lookup_infinitely_ambiguous(const std::string & s,
+                                                LookupContext & c) const
+{
+    if (!initialize_input(s.c_str(), c)) {
         return false;
     }
-    traversal_states.clear();
+    c.flag_state = hfst::FdState<SymbolNumber>(alphabet->get_fd_table());
+    c.traversal_states.clear();
     try {
-        find_loop(0, 0);
+        find_loop(c, 0, 0);
     } catch (bool e) {
-        current_weight = 0.0;
-        flag_state = alphabet->get_fd_table();
+        c.current_weight = 0.0;
+        c.flag_state = alphabet->get_fd_table();
         return e;
     }
     return false;
@@ -342,104 +493,171 @@ bool Transducer::is_lookup_infinitely_ambiguous(const StringVector & s)
     return is_lookup_infinitely_ambiguous(input_str);
 }
 
+bool Transducer::is_lookup_infinitely_ambiguous(const StringVector & s,
+                                                LookupContext & c) const
+{
+    std::string input_str;
+    for (StringVector::const_iterator it = s.begin(); it != s.end(); ++it) {
+        input_str.append(*it);
+    }
+    return is_lookup_infinitely_ambiguous(input_str, c);
+}
+
+void Transducer::start_lookup(LookupContext & c, ssize_t limit,
+                              double time_cutoff) const
+{
+    c.max_lookups = limit;
+    c.max_time = 0.0;
+    if (time_cutoff > 0.0) {
+        c.max_time = time_cutoff;
+        c.start_clock = clock();
+    }
+    c.current_weight = 0.0;
+    c.results_found = 0;
+    c.found_transition = false;
+    c.recursion_depth_left = MAX_RECURSION_DEPTH;
+    c.flag_state = hfst::FdState<SymbolNumber>(alphabet->get_fd_table());
+    c.traversal_states.clear();
+}
 
 HfstOneLevelPaths * Transducer::lookup_fd(const char * s, ssize_t limit,
                                           double time_cutoff)
 {
-    max_lookups = limit;
-    max_time = 0.0;
-    if (time_cutoff > 0.0) {
-        max_time = time_cutoff;
-        start_clock = clock();
+    return lookup_fd(s, context, limit, time_cutoff);
+}
+
+std::string Transducer::cache_key(const LookupContext & c,
+                                  ssize_t limit) const
+{
+    // The limit, the encoded input and the strings of the symbols that
+    // were numbered past the end of the alphabet for this input
+    std::string key;
+    append_to_cache_key(key, limit);
+    for (unsigned int i = 0; c.input_tape[i] != NO_SYMBOL_NUMBER; ++i) {
+        append_to_cache_key(key, c.input_tape[i]);
+    }
+    for (SymbolTable::const_iterator it = c.extra_symbols.begin();
+         it != c.extra_symbols.end(); ++it) {
+        key.push_back('\0');
+        key.append(*it);
+    }
+    return key;
+}
+
+HfstOneLevelPaths * Transducer::lookup_fd(const char * s, LookupContext & c,
+                                          ssize_t limit,
+                                          double time_cutoff) const
+{
+    start_lookup(c, limit, time_cutoff);
+    if (!initialize_input(s, c)) {
+        return new HfstOneLevelPaths;
+    }
+    std::string key;
+    if (c.cache.is_enabled()) {
+        key = cache_key(c, limit);
+        const HfstOneLevelPaths * cached = c.cache.find(key);
+        if (cached != NULL) {
+            return new HfstOneLevelPaths(*cached);
+        }
     }
     HfstOneLevelPaths * results = new HfstOneLevelPaths;
-    if (!initialize_input(s)) {
-        return results;
-    }
-    lookup_paths = new HfstTwoLevelPaths;
-    traversal_states.clear();
-    //current_weight += s.second;
-    get_analyses(0, 0, 0);
-    //current_weight -= s.second;
-    for (HfstTwoLevelPaths::iterator it = lookup_paths->begin();
-         it != lookup_paths->end(); ++it) {
-        HfstOneLevelPath output_path;
-        output_path.first = it->first;
-        for (StringPairVector::const_iterator v_it = (it->second).begin();
-             v_it != (it->second).end(); ++v_it) {
-            output_path.second.push_back(v_it->second);
-        }
-        results->insert(output_path);
-    }
-    delete lookup_paths;
-    lookup_paths = NULL;
+    OneLevelPathCollector collector(*this, c, *results);
+    c.visitor = &collector;
+    get_analyses(c, 0, 0, 0);
+    c.visitor = NULL;
+    // Results that were cut short by the time limit are not cached
+    if (c.cache.is_enabled() &&
+        (c.max_time <= 0.0 ||
+         ((double) clock() - c.start_clock) / CLOCKS_PER_SEC <= c.max_time)) {
+        c.cache.insert(key, *results);
+    }
     return results;
 }
 
+void Transducer::lookup_fd(const char * s, LookupContext & c,
+                           LookupVisitor & visitor, ssize_t limit,
+                           double time_cutoff) const
+{
+    start_lookup(c, limit, time_cutoff);
+    if (!initialize_input(s, c)) {
+        return;
+    }
+    c.visitor = &visitor;
+    get_analyses(c, 0, 0, 0);
+    c.visitor = NULL;
+}
+
+void Transducer::lookup_fd(const std::string & s, LookupContext & c,
+                           LookupVisitor & visitor, ssize_t limit,
+                           double time_cutoff) const
+{
+    lookup_fd(s.c_str(), c, visitor, limit, time_cutoff);
+}
+
 HfstTwoLevelPaths * Transducer::lookup_fd_pairs(const char * s, ssize_t limit,
                                                 double time_cutoff)
 {
-    max_lookups = limit;
-    max_time = 0.0;
-    if (time_cutoff > 0.0) {
-        max_time = time_cutoff;
-        start_clock = clock();
-    }
+    return lookup_fd_pairs(s, context, limit, time_cutoff);
+}
+
+HfstTwoLevelPaths * Transducer::lookup_fd_pairs(const char * s,
+                                                LookupContext & c,
+                                                ssize_t limit,
+                                                double time_cutoff) const
+{
     HfstTwoLevelPaths * results = new HfstTwoLevelPaths;
-    lookup_paths = results;
-    if (!initialize_input(s)) {
-        lookup_paths = NULL;
-        return results;
-    }
-    traversal_states.clear();
-    //current_weight += s.second;
-    get_analyses(0, 0, 0);
-    //current_weight -= s.second;
-    lookup_paths = NULL;
+    TwoLevelPathCollector collector(*this, c, *results);
+    lookup_fd(s, c, collector, limit, time_cutoff);
     return results;
 }
 
-void Transducer::try_epsilon_transitions(unsigned int input_pos,
+void Transducer::try_epsilon_transitions(LookupContext & c,
+                                         unsigned int input_pos,
                                          unsigned int output_pos,
-                                         TransitionTableIndex i)
+                                         TransitionTableIndex i) const
 {
     while (true)
     {
+        // Take the run of epsilons before the next flag, if any
+        TransitionTableIndex epsilons_end =
+            i + tables->get_transition_run_length(i, 0);
+        for (; i < epsilons_end; ++i) {
+            Weight old_weight = c.current_weight;
+            c.output_tape.write(output_pos, 0,
+                                tables->get_transition_output(i));
+            c.current_weight += tables->get_weight(i);
+            get_analyses(c, input_pos, output_pos + 1,
+                         tables->get_transition_target(i));
+            c.found_transition = true;
+            c.current_weight = old_weight;
+        }
         SymbolNumber input = tables->get_transition_input(i);
         SymbolNumber output = tables->get_transition_output(i);
         TransitionTableIndex target = tables->get_transition_target(i);
         Weight weight = tables->get_weight(i);
-        Weight old_weight = current_weight;
-        if (input == 0) // epsilon
-        {
-            output_tape.write(output_pos, input, output);
-            current_weight += weight;
-            get_analyses(input_pos, output_pos + 1, target);
-            found_transition = true;
-            current_weight = old_weight;
-            ++i;
-        } else if (alphabet->is_flag_diacritic(input)) {
-            FlagDiacriticState flags = flag_state.get_values();
-            if (flag_state.apply_operation(
+        Weight old_weight = c.current_weight;
+        if (alphabet->is_flag_diacritic(input)) {
+            FlagDiacriticState flags = c.flag_state.get_values();
+            if (c.flag_state.apply_operation(
                     *(alphabet->get_operation(input)))) {
                 // flag diacritic allowed
                 TraversalState flag_reachable(target, flags);
-                if (traversal_states.count(flag_reachable) == 1) {
+                if (c.traversal_states.count(flag_reachable) == 1) {
                     // We've been here before at this input, back out
-                    flag_state.assign_values(flags);
+                    c.flag_state.assign_values(flags);
                     ++i;
                     continue;
                 }
 
-                traversal_states.insert(flag_reachable);
-                output_tape.write(output_pos, input, output);
-                current_weight += weight;
-                get_analyses(input_pos, output_pos + 1, target);
-                found_transition = true;
-                current_weight = old_weight;
-                traversal_states.erase(flag_reachable);
+                c.traversal_states.insert(flag_reachable);
+                c.output_tape.write(output_pos, input, output);
+                c.current_weight += weight;
+                get_analyses(c, input_pos, output_pos + 1, target);
+                c.found_transition = true;
+                c.current_weight = old_weight;
+                c.traversal_states.erase(flag_reachable);
             }
-            flag_state.assign_values(flags);
+            c.flag_state.assign_values(flags);
             ++i;
         } else { // it's not epsilon and it's not a flag, so nothing to do
             return;
@@ -447,243 +665,266 @@ void Transducer::try_epsilon_transitions(unsigned int input_pos,
     }
 }
 
-void Transducer::try_epsilon_indices(unsigned int input_pos,
+void Transducer::try_epsilon_indices(LookupContext & c,
+                                     unsigned int input_pos,
                                      unsigned int output_pos,
-                                     TransitionTableIndex i)
+                                     TransitionTableIndex i) const
 {
     if (tables->get_index_input(i) == 0)
     {
-        try_epsilon_transitions(input_pos,
+        try_epsilon_transitions(c, input_pos,
                                 output_pos,
                                 tables->get_index_target(i) -
                                 TRANSITION_TARGET_TABLE_START);
-        found_transition = true;
+        c.found_transition = true;
     }
 }
 
-void Transducer::find_transitions(SymbolNumber input,
+void Transducer::find_transitions(LookupContext & c,
+                                  SymbolNumber input,
                                   unsigned int input_pos,
                                   unsigned int output_pos,
-                                  TransitionTableIndex i)
+                                  TransitionTableIndex i) const
 {
-
-    while (tables->get_transition_input(i) != NO_SYMBOL_NUMBER)
+    if (input == NO_SYMBOL_NUMBER) {
+        return;
+    }
+    TransitionTableIndex end = i + tables->get_transition_run_length(i, input);
+    for (; i < end; ++i)
     {
-        if (tables->get_transition_input(i) == input)
-        {
-            Weight old_weight = current_weight;
-            // We're not going to find an epsilon / flag loop
-            traversal_states.clear();
-            SymbolNumber output = tables->get_transition_output(i);
-            if (output == alphabet->get_default_symbol()
-                || output == alphabet->get_identity_symbol()
-                || output == alphabet->get_unknown_symbol()) {
-                // we got here via default, identity or unknown, so look
-                // back in the input tape to find the symbol we want to write
-                output = input_tape[input_pos - 1];
-            }
-            output_tape.write(output_pos, input, output);
-            current_weight += tables->get_weight(i);
-            get_analyses(input_pos,
-                         output_pos + 1,
-                         tables->get_transition_target(i));
-            current_weight = old_weight;
-            found_transition = true;
-        }
-        else
-        {
-            return;
+        Weight old_weight = c.current_weight;
+        // We're not going to find an epsilon / flag loop
+        c.traversal_states.clear();
+        SymbolNumber output = tables->get_transition_output(i);
+        if (output == alphabet->get_default_symbol()
+            || output == alphabet->get_identity_symbol()
+            || output == alphabet->get_unknown_symbol()) {
+            // we got here via default, identity or unknown, so look
+            // back in the input tape to find the symbol we want to write
+            output = c.input_tape[input_pos - 1];
         }
-        ++i;
+        c.output_tape.write(output_pos, input, output);
+        c.current_weight += tables->get_weight(i);
+        get_analyses(c, input_pos,
+                     output_pos + 1,
+                     tables->get_transition_target(i));
+        c.current_weight = old_weight;
+        c.found_transition = true;
     }
 }
 
-void Transducer::find_index(SymbolNumber input,
+void Transducer::find_index(LookupContext & c,
+                            SymbolNumber input,
                             unsigned int input_pos,
                             unsigned int output_pos,
-                            TransitionTableIndex i)
+                            TransitionTableIndex i) const
 {
     if (tables->get_index_input(i+input) == input)
     {
-        find_transitions(input,
+        find_transitions(c, input,
                          input_pos,
                          output_pos,
                          tables->get_index_target(i+input) -
                          TRANSITION_TARGET_TABLE_START);
-        found_transition = true;
+        c.found_transition = true;
     }
 }
 
 
 
 
-void Transducer::get_analyses(unsigned int input_pos,
+void Transducer::get_analyses(LookupContext & c,
+                              unsigned int input_pos,
                               unsigned int output_pos,
-                              TransitionTableIndex i)
+                              TransitionTableIndex i) const
 {
-    found_transition = false;
+    c.found_transition = false;
     
-    if (recursion_depth_left == 0) {
+    if (c.recursion_depth_left == 0) {
 //        std::cerr << __FILE__ <<
 //            ": maximum recursion depth exceeded, discarding results\n";
         return;
     }
-    if (max_lookups >= 0 && (ssize_t)lookup_paths->size() >= max_lookups) {
+    if (c.max_lookups >= 0 && (ssize_t)c.results_found >= c.max_lookups) {
         // Back out because we have enough results already
         return;
     }
-    if (max_time > 0.0) {
+    if (c.max_time > 0.0) {
         // quit if we've overspent our time
-        if ((((double) clock() - start_clock) / CLOCKS_PER_SEC) > max_time) {
+        if ((((double) clock() - c.start_clock) / CLOCKS_PER_SEC) > c.max_time) {
             return;
         }
     }
-    --recursion_depth_left;
+    if (lookahead != NULL &&
+        !(c.input_tape[input_pos] == NO_SYMBOL_NUMBER ?
+          lookahead->can_end(i) :
+          lookahead->can_consume(i, c.input_tape[input_pos]))) {
+        // Nothing from here can match the rest of the input
+        return;
+    }
+    --c.recursion_depth_left;
     if (indexes_transition_table(i))
     {
         i -= TRANSITION_TARGET_TABLE_START;
         // First we check for finality and collect the result
-        if (input_tape[input_pos] == NO_SYMBOL_NUMBER) {
-            if (max_lookups < 0 || (ssize_t)lookup_paths->size() < max_lookups) {
-                output_tape.write(output_pos, NO_SYMBOL_NUMBER, NO_SYMBOL_NUMBER);
+        if (c.input_tape[input_pos] == NO_SYMBOL_NUMBER) {
+            if (c.max_lookups < 0 || (ssize_t)c.results_found < c.max_lookups) {
+                c.output_tape.write(output_pos, NO_SYMBOL_NUMBER, NO_SYMBOL_NUMBER);
                 if (tables->get_transition_finality(i)) {
-                    Weight old_weight = current_weight;
-                    current_weight += tables->get_weight(i);
-                    note_analysis();
-                    current_weight = old_weight;
+                    Weight old_weight = c.current_weight;
+                    c.current_weight += tables->get_weight(i);
+                    note_analysis(c);
+                    c.current_weight = old_weight;
                 }
             }
         }
 
         // Then we check epsilons
-        try_epsilon_transitions(input_pos,
+        try_epsilon_transitions(c, input_pos,
                                 output_pos,
                                 i+1);
 
-        if (input_tape[input_pos] == NO_SYMBOL_NUMBER) {
+        if (c.input_tape[input_pos] == NO_SYMBOL_NUMBER) {
             // No more input
-            ++recursion_depth_left;
+            ++c.recursion_depth_left;
             return;
         }
         
-        SymbolNumber input = input_tape[input_pos];
+        SymbolNumber input = c.input_tape[input_pos];
         ++input_pos;
 
         if (input < alphabet->get_orig_symbol_count()) {
             // Input is in the alphabet
-            find_transitions(input,
+            find_transitions(c, input,
                              input_pos,
                              output_pos,
                              i+1);
         } else {
             if (alphabet->get_identity_symbol() != NO_SYMBOL_NUMBER) {
-                find_transitions(alphabet->get_identity_symbol(),
+                find_transitions(c, alphabet->get_identity_symbol(),
                                  input_pos, output_pos, i+1);
             }
             if (alphabet->get_unknown_symbol() != NO_SYMBOL_NUMBER) {
-                find_transitions(alphabet->get_unknown_symbol(),
+                find_transitions(c, alphabet->get_unknown_symbol(),
                                  input_pos, output_pos, i+1);
             }
         }
         if (alphabet->get_default_symbol() != NO_SYMBOL_NUMBER &&
-            !found_transition) {
-            find_transitions(alphabet->get_default_symbol(),
+            !c.found_transition) {
+            find_transitions(c, alphabet->get_default_symbol(),
                              input_pos, output_pos, i+1);
         }
     }
     else
     {
-        if (input_tape[input_pos] == NO_SYMBOL_NUMBER) {
-            if (max_lookups < 0 || (ssize_t)lookup_paths->size() < max_lookups) {
-                output_tape.write(output_pos, NO_SYMBOL_NUMBER, NO_SYMBOL_NUMBER);
+        if (c.input_tape[input_pos] == NO_SYMBOL_NUMBER) {
+            if (c.max_lookups < 0 || (ssize_t)c.results_found < c.max_lookups) {
+                c.output_tape.write(output_pos, NO_SYMBOL_NUMBER, NO_SYMBOL_NUMBER);
                 if (tables->get_index_finality(i)) {
-                    Weight old_weight = current_weight;
-                    current_weight += tables->get_final_weight(i);
-                    note_analysis();
-                    current_weight = old_weight;
+                    Weight old_weight = c.current_weight;
+                    c.current_weight += tables->get_final_weight(i);
+                    note_analysis(c);
+                    c.current_weight = old_weight;
                 }
             }
         }
         
-        try_epsilon_indices(input_pos,
+        try_epsilon_indices(c, input_pos,
                             output_pos,
                             i+1);
         
-        if (input_tape[input_pos] == NO_SYMBOL_NUMBER) {
-            ++recursion_depth_left;
+        if (c.input_tape[input_pos] == NO_SYMBOL_NUMBER) {
+            ++c.recursion_depth_left;
             return;
         }
       
-        SymbolNumber input = input_tape[input_pos];
+        SymbolNumber input = c.input_tape[input_pos];
         ++input_pos;
 
         if (input < alphabet->get_orig_symbol_count()) {
             // Input is in the alphabet
-            find_index(input, input_pos, output_pos, i+1);
+            find_index(c, input, input_pos, output_pos, i+1);
         } else {
             if (alphabet->get_identity_symbol() != NO_SYMBOL_NUMBER) {
-                find_index(alphabet->get_identity_symbol(),
+                find_index(c, alphabet->get_identity_symbol(),
                            input_pos, output_pos, i+1);
             }
             if (alphabet->get_unknown_symbol() != NO_SYMBOL_NUMBER) {
-                find_index(alphabet->get_unknown_symbol(),
+                find_index(c, alphabet->get_unknown_symbol(),
                            input_pos, output_pos, i+1);
             }
         }
         // If we have a default symbol defined and we didn't find an index,
         // check for that
-        if (alphabet->get_default_symbol() != NO_SYMBOL_NUMBER && !found_transition) {
-            find_index(alphabet->get_default_symbol(),
+        if (alphabet->get_default_symbol() != NO_SYMBOL_NUMBER && !c.found_transition) {
+            find_index(c, alphabet->get_default_symbol(),
                        input_pos, output_pos, i+1);
         }
     }
-    output_tape.write(output_pos, NO_SYMBOL_NUMBER, NO_SYMBOL_NUMBER);
-    ++recursion_depth_left;
+    c.output_tape.write(output_pos, NO_SYMBOL_NUMBER, NO_SYMBOL_NUMBER);
+    ++c.recursion_depth_left;
 }
 
-void Transducer::note_analysis(void)
+void Transducer::note_analysis(LookupContext & c) const
 {
-    HfstTwoLevelPath result;
-    for (DoubleTape::const_iterator it = output_tape.begin();
-         it->output != NO_SYMBOL_NUMBER; ++it) {
-        result.second.push_back(StringPair(alphabet->string_from_symbol(it->input),
-                                           alphabet->string_from_symbol(it->output)));
+    size_t length = 0;
+    while (c.output_tape[length].output != NO_SYMBOL_NUMBER) {
+        ++length;
+    }
+    if (c.visitor->visit(&c.output_tape[0], length, c.current_weight)) {
+        ++c.results_found;
     }
-    result.first = current_weight;
-    lookup_paths->insert(result);
 }
 
 Transducer::Transducer():
-    header(NULL), alphabet(NULL), tables(NULL),
-    current_weight(0.0), lookup_paths(NULL), encoder(NULL),
-    input_tape(), output_tape(),
-    flag_state(), found_transition(false), max_lookups(-1),
-    recursion_depth_left(MAX_RECURSION_DEPTH){}
+    header(NULL), alphabet(NULL), tables(NULL), mapped_file(NULL),
+    mapped_size(0),
+    encoder(NULL), context(), lookahead(NULL) {}
 
 Transducer::Transducer(std::istream& is):
     header(new TransducerHeader(is)),
     alphabet(new TransducerAlphabet(is, header->symbol_count())),
-    tables(NULL), current_weight(0.0), lookup_paths(NULL),
+    tables(NULL), mapped_file(NULL), mapped_size(0),
     encoder(new Encoder(alphabet->get_symbol_table(),
-                        header->input_symbol_count())),
-    input_tape(), output_tape(),
-    flag_state(alphabet->get_fd_table()), found_transition(false), max_lookups(-1),
-    recursion_depth_left(MAX_RECURSION_DEPTH)
+                        header->input_symbol_count())), context(),
+    lookahead(NULL)
 {
     load_tables(is);
 }
 
+Transducer::Transducer(MappedFile * file, size_t offset):
+    header(NULL), alphabet(NULL), tables(NULL),
+    mapped_file(file), mapped_size(0),
+    encoder(NULL), context(), lookahead(NULL)
+{
+    if (offset > file->size()) {
+        HFST_THROW(TransducerHasWrongTypeException);
+    }
+    MemoryStreamBuf buf(file->get_data() + offset, file->size() - offset);
+    std::istream is(&buf);
+    try {
+        header = new TransducerHeader(is);
+        alphabet = new TransducerAlphabet(is, header->symbol_count());
+        encoder = new Encoder(alphabet->get_symbol_table(),
+                              header->input_symbol_count());
+        map_tables(offset + buf.position());
+    } catch (...) {
+        // The destructor won't run; the file stays the caller's
+        delete header;
+        delete alphabet;
+        delete encoder;
+        delete tables;
+        throw;
+    }
+}
 
 Transducer::Transducer(bool weighted):
     header(new TransducerHeader(weighted)),
     alphabet(new TransducerAlphabet()),
-    current_weight(0.0),
-    lookup_paths(NULL),
+    mapped_file(NULL), mapped_size(0),
     encoder(new Encoder(alphabet->get_symbol_table(),
-                        header->input_symbol_count())),
-    input_tape(), output_tape(),
-    flag_state(alphabet->get_fd_table()), found_transition(false),
-    max_lookups(-1), recursion_depth_left(MAX_RECURSION_DEPTH)
+                        header->input_symbol_count())), context(),
+    lookahead(NULL)
 {
     if(weighted)
         tables = new TransducerTables<TransitionWIndex,TransitionW>();
@@ -697,15 +938,12 @@ Transducer::Transducer(const TransducerHeader& header,
                        const TransducerTable<Transition>& transition_table):
     header(new TransducerHeader(header)),
     alphabet(new TransducerAlphabet(alphabet)),
-    tables(new TransducerTables<TransitionIndex,Transition>(
+    tables(new SoaTransducerTables<TransitionIndex,Transition>(
                index_table, transition_table)),
-    current_weight(0.0),
-    lookup_paths(NULL),
+    mapped_file(NULL), mapped_size(0),
     encoder(new Encoder(alphabet.get_symbol_table(),
-                        header.input_symbol_count())),
-    input_tape(), output_tape(),
-    flag_state(alphabet.get_fd_table()), found_transition(false), max_lookups(-1),
-    recursion_depth_left(MAX_RECURSION_DEPTH)
+                        header.input_symbol_count())), context(),
+    lookahead(NULL)
 {}
 
 Transducer::Transducer(const TransducerHeader& header,
@@ -714,15 +952,12 @@ Transducer::Transducer(const TransducerHeader& header,
                        const TransducerTable<TransitionW>& transition_table):
     header(new TransducerHeader(header)),
     alphabet(new TransducerAlphabet(alphabet)),
-    tables(new TransducerTables<TransitionWIndex,TransitionW>(
+    tables(new SoaTransducerTables<TransitionWIndex,TransitionW>(
                index_table, transition_table)),
-    current_weight(0.0),
-    lookup_paths(NULL),
+    mapped_file(NULL), mapped_size(0),
     encoder(new Encoder(alphabet.get_symbol_table(),
-                        header.input_symbol_count())),
-    input_tape(), output_tape(),
-    flag_state(alphabet.get_fd_table()), found_transition(false), max_lookups(-1),
-    recursion_depth_left(MAX_RECURSION_DEPTH)
+                        header.input_symbol_count())), context(),
+    lookahead(NULL)
 {}
 
 Transducer::~Transducer()
@@ -731,6 +966,10 @@ Transducer::~Transducer()
     delete alphabet;
     delete tables;
     delete encoder;
+    if (mapped_file != NULL) {
+        mapped_file->release();
+    }
+    delete lookahead;
 }
 
 TransducerTable<TransitionWIndex> Transducer::copy_windex_table()
@@ -786,16 +1025,94 @@ TransducerTable<Transition> Transducer::copy_transition_table()
 void Transducer::load_tables(std::istream& is)
 {
     if(header->probe_flag(Weighted))
-        tables = new TransducerTables<TransitionWIndex,TransitionW>(
+        tables = new SoaTransducerTables<TransitionWIndex,TransitionW>(
             is, header->index_table_size(),header->target_table_size());
     else
-        tables = new TransducerTables<TransitionIndex,Transition>(
+        tables = new SoaTransducerTables<TransitionIndex,Transition>(
             is, header->index_table_size(),header->target_table_size());
     if(!is) {
         HFST_THROW(TransducerHasWrongTypeException);
     }
 }
 
+void Transducer::map_tables(size_t offset)
+{
+    TransitionTableIndex index_size = header->index_table_size();
+    TransitionTableIndex target_size = header->target_table_size();
+    size_t table_bytes;
+    if(header->probe_flag(Weighted)) {
+        table_bytes = MappedTransducerTables<TransitionWIndex,TransitionW>::
+            byte_size(index_size, target_size);
+    } else {
+        table_bytes = MappedTransducerTables<TransitionIndex,Transition>::
+            byte_size(index_size, target_size);
+    }
+    if (offset + table_bytes > mapped_file->size()) {
+        HFST_THROW(TransducerHasWrongTypeException);
+    }
+    const char * p = mapped_file->get_data() + offset;
+    if(header->probe_flag(Weighted))
+        tables = new MappedTransducerTables<TransitionWIndex,TransitionW>(
+            p, index_size, target_size);
+    else
+        tables = new MappedTransducerTables<TransitionIndex,Transition>(
+            p, index_size, target_size);
+    mapped_size = offset + table_bytes;
+}
+
+MappedFile::MappedFile(const std::string & filename):
+    data(NULL), length(0), mapped(false), references(1)
+{
+#ifndef _MSC_VER
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        HFST_THROW_MESSAGE(StreamNotReadableException, filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        ::close(fd);
+        HFST_THROW_MESSAGE(StreamNotReadableException, filename);
+    }
+    length = st.st_size;
+    if (length > 0) {
+        void * p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            data = static_cast<char*>(p);
+            mapped = true;
+        }
+    }
+    ::close(fd);
+    if (mapped || length == 0) {
+        return;
+    }
+#endif
+    // No mmap available, fall back to reading the whole file
+    std::ifstream ifs(filename.c_str(), std::ios::in | std::ios::binary);
+    if (!ifs) {
+        HFST_THROW_MESSAGE(StreamNotReadableException, filename);
+    }
+    ifs.seekg(0, std::ios::end);
+    length = ifs.tellg();
+    ifs.seekg(0, std::ios::beg);
+    data = (char*) malloc(length > 0 ? length : 1);
+    ifs.read(data, length);
+    if (!ifs) {
+        free(data);
+        HFST_THROW_MESSAGE(StreamNotReadableException, filename);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _MSC_VER
+    if (mapped) {
+        munmap(data, length);
+        return;
+    }
+#endif
+    free(data);
+}
+
 void Transducer::write(std::ostream& os) const
 {
     header->write(os);
@@ -909,7 +1226,7 @@ TransitionTableIndex Transducer::next(const TransitionTableIndex i,
     if (i >= TRANSITION_TARGET_TABLE_START) {
         return i - TRANSITION_TARGET_TABLE_START + 1;
     } else {
-        return get_index(i+1+symbol).get_target() - TRANSITION_TARGET_TABLE_START;
+        return tables->get_index_target(i+1+symbol) - TRANSITION_TARGET_TABLE_START;
     }
 }
 
@@ -917,65 +1234,291 @@ bool Transducer::has_transitions(const TransitionTableIndex i,
                                  const SymbolNumber symbol) const
 {
     if (i >= TRANSITION_TARGET_TABLE_START) {
-        return (get_transition(i - TRANSITION_TARGET_TABLE_START).get_input_symbol() == symbol);
+        return (tables->get_transition_input(i - TRANSITION_TARGET_TABLE_START) == symbol);
     } else {
-        return (get_index(i+symbol).get_input_symbol() == symbol);
+        return (tables->get_index_input(i+symbol) == symbol);
     }
 }
 
-bool Transducer::has_epsilons_or_flags(const TransitionTableIndex i)
+bool Transducer::has_epsilons_or_flags(const TransitionTableIndex i) const
 {
     if (i >= TRANSITION_TARGET_TABLE_START) {
-        return(get_transition(i - TRANSITION_TARGET_TABLE_START)
-               .get_input_symbol() == 0 ||
-               is_flag(get_transition(i - TRANSITION_TARGET_TABLE_START)
-                       .get_input_symbol()));
+        SymbolNumber input =
+            tables->get_transition_input(i - TRANSITION_TARGET_TABLE_START);
+        return(input == 0 || is_flag(input));
     } else {
-        return (get_index(i).get_input_symbol() == 0);
+        return (tables->get_index_input(i) == 0);
     }
 }
 
 STransition Transducer::take_epsilons(const TransitionTableIndex i) const
 {
-    if (get_transition(i).get_input_symbol() != 0) {
+    if (tables->get_transition_input(i) != 0) {
         return STransition(0, NO_SYMBOL_NUMBER);
     }
-    return STransition(get_transition(i).get_target(),
-                       get_transition(i).get_output_symbol(),
-                       get_transition(i).get_weight());
+    return STransition(tables->get_transition_target(i),
+                       tables->get_transition_output(i),
+                       tables->get_weight(i));
 }
 
-STransition Transducer::take_epsilons_and_flags(const TransitionTableIndex i)
+STransition Transducer::take_epsilons_and_flags(const TransitionTableIndex i) const
 {
-    if (get_transition(i).get_input_symbol() != 0&&
-        !is_flag(get_transition(i).get_input_symbol())) {
+    SymbolNumber input = tables->get_transition_input(i);
+    if (input != 0 && !is_flag(input)) {
         return STransition(0, NO_SYMBOL_NUMBER);
     }
-    return STransition(get_transition(i).get_target(),
-                       get_transition(i).get_output_symbol(),
-                       get_transition(i).get_weight());
+    return STransition(tables->get_transition_target(i),
+                       tables->get_transition_output(i),
+                       tables->get_weight(i));
 }
 
 STransition Transducer::take_non_epsilons(const TransitionTableIndex i,
                                           const SymbolNumber symbol) const
 {
-    if (get_transition(i).get_input_symbol() != symbol) {
+    if (tables->get_transition_input(i) != symbol) {
         return STransition(0, NO_SYMBOL_NUMBER);
     }
-    return STransition(get_transition(i).get_target(),
-                       get_transition(i).get_output_symbol(),
-                       get_transition(i).get_weight());
+    return STransition(tables->get_transition_target(i),
+                       tables->get_transition_output(i),
+                       tables->get_weight(i));
 }
 
 Weight Transducer::final_weight(const TransitionTableIndex i) const
 {
     if (i >= TRANSITION_TARGET_TABLE_START) {
-        return get_transition(i - TRANSITION_TARGET_TABLE_START).get_weight();
+        return tables->get_weight(i - TRANSITION_TARGET_TABLE_START);
     } else {
-        return get_index(i).final_weight();
+        return tables->get_final_weight(i);
     }
 }
 
+bool Transducer::has_negative_weights(void) const
+{
+    if (!header->probe_flag(Weighted)) {
+        return false;
+    }
+    for (TransitionTableIndex i = 0; i < header->index_table_size(); ++i) {
+        if (tables->get_index_finality(i) && tables->get_final_weight(i) < 0.0) {
+            return true;
+        }
+    }
+    // Final weights in the transition table are in the same place as the
+    // weights of transitions
+    for (TransitionTableIndex i = 0; i < header->target_table_size(); ++i) {
+        if (tables->get_weight(i) < 0.0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+namespace {
+
+const unsigned int NO_STATE = UINT_MAX;
+
+/* Number the state at \a index, if it isn't numbered yet, and queue it.
+   Return its number. */
+unsigned int add_lookahead_state(TransitionTableIndex index,
+                                 std::vector<unsigned int> & index_states,
+                                 std::vector<unsigned int> & transition_states,
+                                 std::vector<TransitionTableIndex> & states)
+{
+    unsigned int & number = index >= TRANSITION_TARGET_TABLE_START ?
+        transition_states[index - TRANSITION_TARGET_TABLE_START] :
+        index_states[index];
+    if (number == NO_STATE) {
+        number = hfst::size_t_to_uint(states.size());
+        states.push_back(index);
+    }
+    return number;
+}
+
+}
+
+InputLookahead::InputLookahead(const TransducerHeader & header,
+                               const TransducerAlphabet & alphabet,
+                               const TransducerTablesInterface & tables):
+    symbol_count(header.symbol_count()),
+    row_words((header.symbol_count() + 2 + 31) / 32),
+    rows(),
+    index_rows(header.index_table_size(), NO_STATE),
+    transition_rows(header.target_table_size(), NO_STATE),
+    reachable(row_words, 0)
+{
+    const size_t end_bit = symbol_count;
+    const size_t any_bit = symbol_count + 1;
+    const TransitionTableIndex index_size = header.index_table_size();
+    const TransitionTableIndex transition_size = header.target_table_size();
+    const SymbolNumber input_symbol_count = header.input_symbol_count();
+    // Until the rows are shared, index_rows and transition_rows have the
+    // numbers of the states, and each state has a row of its own
+    std::vector<TransitionTableIndex> states;
+    std::vector<unsigned int> state_rows;
+    // The states that reach each state by an epsilon or a flag
+    std::vector<std::vector<unsigned int> > epsilon_sources;
+    if (index_size > 0) {
+        add_lookahead_state(0, index_rows, transition_rows, states);
+    }
+    for (size_t n = 0; n < states.size(); ++n) {
+        state_rows.resize((n + 1) * row_words, 0);
+        unsigned int * row = &state_rows[n * row_words];
+        TransitionTableIndex state = states[n];
+        // Where the transitions of the state start in the transition
+        // table: one place for a state in the transition table, and for a
+        // state in the index table, one for each input symbol, with
+        // epsilons and flags together
+        std::vector<TransitionTableIndex> run_starts;
+        bool final;
+        if (state >= TRANSITION_TARGET_TABLE_START) {
+            TransitionTableIndex i = state - TRANSITION_TARGET_TABLE_START;
+            final = i < transition_size && tables.get_transition_finality(i);
+            run_starts.push_back(i + 1);
+        } else {
+            final = tables.get_index_finality(state);
+            for (SymbolNumber symbol = 0; symbol < input_symbol_count;
+                 ++symbol) {
+                if ((symbol != 0 && alphabet.is_flag_diacritic(symbol)) ||
+                    state + 1 + symbol >= index_size) {
+                    continue; // flags are with the epsilons, at 0
+                }
+                if (tables.get_index_input(state + 1 + symbol) == symbol) {
+                    run_starts.push_back(
+                        tables.get_index_target(state + 1 + symbol) -
+                        TRANSITION_TARGET_TABLE_START);
+                }
+            }
+        }
+        if (final) {
+            row[end_bit / 32] |= 1u << (end_bit % 32);
+        }
+        for (size_t r = 0; r < run_starts.size(); ++r) {
+            // From an index, a run goes on for as long as the input is the
+            // same or both are epsilons or flags; from a state in the
+            // transition table, up to the next state
+            SymbolNumber first_input = NO_SYMBOL_NUMBER;
+            for (TransitionTableIndex i = run_starts[r]; i < transition_size;
+                 ++i) {
+                SymbolNumber input = tables.get_transition_input(i);
+                if (input == NO_SYMBOL_NUMBER) {
+                    break;
+                }
+                bool epsilon = input == 0 || alphabet.is_flag_diacritic(input);
+                if (state < TRANSITION_TARGET_TABLE_START) {
+                    if (first_input == NO_SYMBOL_NUMBER) {
+                        first_input = input;
+                    } else if (input != first_input &&
+                               !(epsilon && (first_input == 0 ||
+                                  alphabet.is_flag_diacritic(first_input)))) {
+                        break;
+                    }
+                }
+                unsigned int target = add_lookahead_state(
+                    tables.get_transition_target(i), index_rows,
+                    transition_rows, states);
+                if (epsilon) {
+                    epsilon_sources.resize(states.size());
+                    epsilon_sources[target].push_back(hfst::size_t_to_uint(n));
+                } else if (input == alphabet.get_identity_symbol() ||
+                           input == alphabet.get_unknown_symbol() ||
+                           input == alphabet.get_default_symbol()) {
+                    row[any_bit / 32] |= 1u << (any_bit % 32);
+                } else {
+                    row[input / 32] |= 1u << (input % 32);
+                }
+            }
+        }
+    }
+    epsilon_sources.resize(states.size());
+
+    // What a state's epsilon targets can do, it can do too. Go on until
+    // nothing changes, which takes more than one round only where there
+    // are epsilon loops.
+    std::vector<unsigned int> changed;
+    std::vector<bool> queued(states.size(), true);
+    for (size_t n = 0; n < states.size(); ++n) {
+        changed.push_back(hfst::size_t_to_uint(n));
+    }
+    while (!changed.empty()) {
+        unsigned int target = changed.back();
+        changed.pop_back();
+        queued[target] = false;
+        for (size_t s = 0; s < epsilon_sources[target].size(); ++s) {
+            unsigned int source = epsilon_sources[target][s];
+            bool grew = false;
+            for (size_t w = 0; w < row_words; ++w) {
+                unsigned int & bits = state_rows[source * row_words + w];
+                unsigned int more = bits | state_rows[target * row_words + w];
+                if (more != bits) {
+                    bits = more;
+                    grew = true;
+                }
+            }
+            if (grew && !queued[source]) {
+                queued[source] = true;
+                changed.push_back(source);
+            }
+        }
+    }
+
+    // A state that can consume anything has every symbol's bit, so that
+    // can_consume() only tests one bit
+    std::vector<unsigned int> all(row_words, 0);
+    for (size_t b = 0; b < symbol_count + 2; ++b) {
+        all[b / 32] |= 1u << (b % 32);
+    }
+    for (size_t n = 0; n < states.size(); ++n) {
+        unsigned int * row = &state_rows[n * row_words];
+        if ((row[any_bit / 32] >> (any_bit % 32)) & 1) {
+            bool end = (row[end_bit / 32] >> (end_bit % 32)) & 1;
+            std::copy(all.begin(), all.end(), row);
+            if (!end) {
+                row[end_bit / 32] &= ~(1u << (end_bit % 32));
+            }
+        }
+        for (size_t w = 0; w < row_words; ++w) {
+            reachable[w] |= row[w];
+        }
+    }
+
+    // States with the same bits share a row
+    std::map<std::vector<unsigned int>, unsigned int> row_numbers;
+    std::vector<unsigned int> none(row_words, 0);
+    row_numbers[none] = 0;
+    row_numbers[all] = 1;
+    rows.insert(rows.end(), none.begin(), none.end());
+    rows.insert(rows.end(), all.begin(), all.end());
+    std::vector<unsigned int> number_of_state(states.size());
+    for (size_t n = 0; n < states.size(); ++n) {
+        std::vector<unsigned int> row(state_rows.begin() + n * row_words,
+                                      state_rows.begin() + (n + 1) * row_words);
+        std::map<std::vector<unsigned int>, unsigned int>::iterator it =
+            row_numbers.find(row);
+        if (it == row_numbers.end()) {
+            it = row_numbers.insert(std::make_pair(
+                row, hfst::size_t_to_uint(rows.size() / row_words))).first;
+            rows.insert(rows.end(), row.begin(), row.end());
+        }
+        number_of_state[n] = it->second;
+    }
+    // Positions that aren't reachable states get the row that rules
+    // nothing out
+    for (size_t i = 0; i < index_rows.size(); ++i) {
+        index_rows[i] = index_rows[i] == NO_STATE ?
+            1 : number_of_state[index_rows[i]];
+    }
+    for (size_t i = 0; i < transition_rows.size(); ++i) {
+        transition_rows[i] = transition_rows[i] == NO_STATE ?
+            1 : number_of_state[transition_rows[i]];
+    }
+}
+
+void Transducer::build_input_lookahead(void)
+{
+    if (lookahead == NULL) {
+        lookahead = new InputLookahead(*header, *alphabet, *tables);
+    }
+}
 
 }
 
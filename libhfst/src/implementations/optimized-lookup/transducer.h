@@ -20,6 +20,7 @@
 #include <vector>
 #include <set>
 #include <iostream>
+#include <streambuf>
 #include <limits>
 #include <string>
 #include <cstdlib>
@@ -35,6 +36,8 @@
 #include "../../HfstFlagDiacritics.h"
 #include "../../HfstSymbolDefs.h"
 #include "../../HfstDataTypes.h"
+#include "lookup_cache.h"
+#include "letter_trie.h"
 
 #ifdef _MSC_VER
  #include <BaseTsd.h>
@@ -652,6 +655,7 @@ public:
   
     void append(const T& v) {table.push_back(v);}
     void set(size_t index, const T& v) {table[index] = v;}
+    void resize(size_t size, const T& entry) {table.resize(size, entry);}
   
     const T& operator[](TransitionTableIndex i) const
         {
@@ -680,10 +684,12 @@ class TransducerTablesInterface
 {
 public:
     virtual ~TransducerTablesInterface() {}
-  
-    virtual const TransitionIndex& get_index(
+
+    /* Whole entries, made from the fields on request. The weighted types
+       serve unweighted tables too, with zero weights. */
+    virtual TransitionWIndex get_index(
         TransitionTableIndex i) const = 0;
-    virtual const Transition& get_transition(
+    virtual TransitionW get_transition(
         TransitionTableIndex i) const = 0;
     virtual Weight get_weight(
         TransitionTableIndex i) const = 0;
@@ -703,10 +709,45 @@ public:
         TransitionTableIndex i) const = 0;
     virtual Weight get_final_weight(
         TransitionTableIndex i) const = 0;
+
+    /* The number of consecutive entries in the transition table from \a i
+       on that have \a input as their input symbol. */
+    virtual TransitionTableIndex get_transition_run_length(
+        TransitionTableIndex i, SymbolNumber input) const
+        {
+            TransitionTableIndex n = 0;
+            while (get_transition_input(i + n) == input) {
+                ++n;
+            }
+            return n;
+        }
   
     virtual void display() const {}
 };
 
+/* Print the entries of \a tables like TransducerTable::display does. */
+inline void display_tables(const TransducerTablesInterface & tables,
+                           TransitionTableIndex index_table_size,
+                           TransitionTableIndex transition_table_size,
+                           bool weighted)
+{
+    std::cout << "Transition index table:" << std::endl;
+    for (TransitionTableIndex i = 0; i < index_table_size; ++i) {
+        std::cout << i << ": ";
+        tables.get_index(i).display();
+    }
+    std::cout << "Transition table:" << std::endl;
+    for (TransitionTableIndex i = 0; i < transition_table_size; ++i) {
+        std::cout << i << "/" << i + TRANSITION_TARGET_TABLE_START << ": ";
+        TransitionW transition = tables.get_transition(i);
+        if (weighted) {
+            transition.display();
+        } else {
+            transition.Transition::display();
+        }
+    }
+}
+
 template <class T1, class T2>
 class TransducerTables : public TransducerTablesInterface
 {
@@ -726,10 +767,17 @@ public:
                      const TransducerTable<T2>& transition_table):
         index_table(index_table), transition_table(transition_table) {}
 
-    const TransitionIndex& get_index(TransitionTableIndex i) const
-        {return index_table[i];}
-    const Transition& get_transition(TransitionTableIndex i) const
-        {return transition_table[i];}
+    TransitionWIndex get_index(TransitionTableIndex i) const
+        {
+            return TransitionWIndex(index_table[i].get_input_symbol(),
+                                    index_table[i].get_target());
+        }
+    TransitionW get_transition(TransitionTableIndex i) const
+        {
+            const T2 & t = transition_table[i];
+            return TransitionW(t.get_input_symbol(), t.get_output_symbol(),
+                               t.get_target(), t.get_weight());
+        }
     Weight get_weight(TransitionTableIndex i) const
         { return transition_table[i].get_weight(); }
     SymbolNumber get_transition_input(TransitionTableIndex i) const
@@ -758,36 +806,391 @@ public:
         }
 };
 
+/** \brief A read-only view of a whole file.
 
-// There follow some classes for implementing lookup
-    
-class OlLetterTrie;
-typedef std::vector<OlLetterTrie*> OlLetterTrieVector;
+    On POSIX systems the file is mmapped, so the pages are shared between
+    all processes that map the same file. Elsewhere the file is read into
+    memory.
 
-class OlLetterTrie
+    Several transducers in one file share its mapping. Each holds a
+    reference, got with share() and dropped with release(); the creator
+    holds the first one. The count isn't locked, so references should be
+    taken and dropped in one thread.
+*/
+class MappedFile
 {
-private:
-    OlLetterTrieVector letters;
-    SymbolNumberVector symbols;
-    
+protected:
+    char * data;
+    size_t length;
+    bool mapped;
+    unsigned int references;
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
 public:
-    OlLetterTrie():
-        letters(UCHAR_MAX+1, static_cast<OlLetterTrie*>(NULL)),
-        symbols(UCHAR_MAX+1,NO_SYMBOL_NUMBER)
-        {}
+    MappedFile(const std::string & filename);
+    ~MappedFile();
+    const char * get_data(void) const { return data; }
+    size_t size(void) const { return length; }
+    /** Take another reference to the file */
+    MappedFile * share(void) { ++references; return this; }
+    /** Drop a reference, and delete the file if it was the last one */
+    void release(void)
+        {
+            if (--references == 0) {
+                delete this;
+            }
+        }
+};
+
+/** \brief An istream source over a memory region, eg. for parsing the
+    headers and alphabets in a MappedFile. */
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(const char * p, size_t length)
+        {
+            char * begin = const_cast<char*>(p);
+            setg(begin, begin, begin + length);
+        }
+    size_t position(void) const { return gptr() - eback(); }
+protected:
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which = std::ios_base::in)
+        {
+            off_type base = 0;
+            if (dir == std::ios_base::cur) {
+                base = gptr() - eback();
+            } else if (dir == std::ios_base::end) {
+                base = egptr() - eback();
+            }
+            return seekpos(pos_type(base + off), which);
+        }
+    pos_type seekpos(pos_type pos,
+                     std::ios_base::openmode which = std::ios_base::in)
+        {
+            off_type off = pos;
+            if (!(which & std::ios_base::in) || off < 0 ||
+                off > egptr() - eback()) {
+                return pos_type(off_type(-1));
+            }
+            setg(eback(), eback() + off, egptr());
+            return pos;
+        }
+};
+
+/** \brief Index and transition tables that are accessed in place
+    in a MappedFile.
+
+    The entries are stored packed and possibly unaligned, so the fields
+    are read with memcpy, and whole entries are made from them on request.
+    Nothing is written after construction, so threads can share the
+    tables.
+*/
+template <class T1, class T2>
+class MappedTransducerTables : public TransducerTablesInterface
+{
+protected:
+    const char * index_data;
+    const char * transition_data;
+    TransitionTableIndex index_table_size;
+    TransitionTableIndex transition_table_size;
 
-    ~OlLetterTrie() {
-        for (size_t i=0 ; i<letters.size() ; ++i) {
-            delete letters[i];
-            letters[i] = 0;
+    template <class V>
+    static V read_field(const char * p)
+        {
+            V v;
+            memcpy(&v, p, sizeof(V));
+            return v;
         }
-    }
-    
-    void add_string(const char * p,SymbolNumber symbol_key);
-    bool has_key_starting_with(const char c) const;
-    
-    SymbolNumber find_key(char ** p);
+    const char * index_entry(TransitionTableIndex i) const
+        {
+            return index_data + T1::size * (size_t) i;
+        }
+    const char * transition_entry(TransitionTableIndex i) const
+        {
+            if (i >= TRANSITION_TARGET_TABLE_START) {
+                i -= TRANSITION_TARGET_TABLE_START;
+            }
+            return transition_data + T2::size * (size_t) i;
+        }
+public:
+    MappedTransducerTables(const char * p,
+                           TransitionTableIndex index_table_size,
+                           TransitionTableIndex transition_table_size):
+        index_data(p),
+        transition_data(p + T1::size * (size_t) index_table_size),
+        index_table_size(index_table_size),
+        transition_table_size(transition_table_size) {}
+
+    static size_t byte_size(TransitionTableIndex index_table_size,
+                            TransitionTableIndex transition_table_size)
+        {
+            return T1::size * (size_t) index_table_size +
+                T2::size * (size_t) transition_table_size;
+        }
+
+    TransitionWIndex get_index(TransitionTableIndex i) const
+        { return TransitionWIndex(get_index_input(i), get_index_target(i)); }
+    TransitionW get_transition(TransitionTableIndex i) const
+        {
+            return TransitionW(get_transition_input(i),
+                               get_transition_output(i),
+                               get_transition_target(i), get_weight(i));
+        }
+    Weight get_weight(TransitionTableIndex i) const
+        {
+            if (T2::size == Transition::size) {
+                return 0.0;
+            }
+            return read_field<Weight>(transition_entry(i) +
+                                      Transition::size);
+        }
+    SymbolNumber get_transition_input(TransitionTableIndex i) const
+        { return read_field<SymbolNumber>(transition_entry(i)); }
+    TransitionTableIndex get_transition_run_length(
+        TransitionTableIndex i, SymbolNumber input) const
+        {
+            const char * p = transition_entry(i);
+            TransitionTableIndex n = 0;
+            while (read_field<SymbolNumber>(p) == input) {
+                ++n;
+                p += T2::size;
+            }
+            return n;
+        }
+    SymbolNumber get_transition_output(TransitionTableIndex i) const
+        {
+            return read_field<SymbolNumber>(transition_entry(i) +
+                                            sizeof(SymbolNumber));
+        }
+    TransitionTableIndex get_transition_target(TransitionTableIndex i) const
+        {
+            return read_field<TransitionTableIndex>(
+                transition_entry(i) + 2 * sizeof(SymbolNumber));
+        }
+    bool get_transition_finality(TransitionTableIndex i) const
+        {
+            return get_transition_input(i) == NO_SYMBOL_NUMBER &&
+                get_transition_output(i) == NO_SYMBOL_NUMBER &&
+                get_transition_target(i) == 1;
+        }
+    SymbolNumber get_index_input(TransitionTableIndex i) const
+        { return read_field<SymbolNumber>(index_entry(i)); }
+    TransitionTableIndex get_index_target(TransitionTableIndex i) const
+        {
+            return read_field<TransitionTableIndex>(
+                index_entry(i) + sizeof(SymbolNumber));
+        }
+    bool get_index_finality(TransitionTableIndex i) const
+        {
+            return get_index_input(i) == NO_SYMBOL_NUMBER &&
+                get_index_target(i) != NO_TABLE_INDEX;
+        }
+    Weight get_final_weight(TransitionTableIndex i) const
+        {
+            if (T2::size == Transition::size) {
+                return 0.0;
+            }
+            return read_field<Weight>(index_entry(i) + sizeof(SymbolNumber));
+        }
+
+    void display() const
+        {
+            display_tables(*this, index_table_size, transition_table_size,
+                           T2::size != Transition::size);
+        }
+};
+
+/* The number of symbols that may be read past the end of an array given
+   to symbol_run_length. */
+const size_t SYMBOL_RUN_PADDING = 16;
+
+/* The number of consecutive symbols from \a p on that are equal to
+   \a symbol, compared several at a time with SSE2 or AVX2 where
+   available. The run must end before the array does, and the array must
+   be followed by SYMBOL_RUN_PADDING readable symbols. */
+TransitionTableIndex symbol_run_length(const SymbolNumber * p,
+                                       SymbolNumber symbol);
+
+/** \brief Index and transition tables stored as a structure of arrays.
+
+    The on-disk tables interleave symbols, targets and weights in packed
+    entries. Here each field has an array of its own, which keeps the
+    input symbols of a state's transitions contiguous so that runs of
+    them can be compared with vector instructions. The layout is built
+    when the transducer is loaded; the format on disk is unchanged.
+    Whole entries are made from the arrays on request.
+*/
+template <class T1, class T2>
+class SoaTransducerTables : public TransducerTablesInterface
+{
+protected:
+    std::vector<SymbolNumber> index_inputs;
+    // For final weighted indices, the bits of the final weight
+    std::vector<TransitionTableIndex> index_targets;
+    // Followed by SYMBOL_RUN_PADDING copies of NO_SYMBOL_NUMBER
+    std::vector<SymbolNumber> transition_inputs;
+    std::vector<SymbolNumber> transition_outputs;
+    std::vector<TransitionTableIndex> transition_targets;
+    // Empty for unweighted transducers
+    std::vector<Weight> transition_weights;
+
+    static bool weighted(void) { return T2::size != Transition::size; }
+    static TransitionTableIndex offset(TransitionTableIndex i)
+        {
+            return (i < TRANSITION_TARGET_TABLE_START) ?
+                i : i - TRANSITION_TARGET_TABLE_START;
+        }
+
+    void reserve(TransitionTableIndex index_table_size,
+                 TransitionTableIndex transition_table_size)
+        {
+            index_inputs.reserve(index_table_size);
+            index_targets.reserve(index_table_size);
+            transition_inputs.reserve(transition_table_size +
+                                      SYMBOL_RUN_PADDING);
+            transition_outputs.reserve(transition_table_size);
+            transition_targets.reserve(transition_table_size);
+            if (weighted()) {
+                transition_weights.reserve(transition_table_size);
+            }
+        }
+    void append_index(SymbolNumber input, TransitionTableIndex target)
+        {
+            index_inputs.push_back(input);
+            index_targets.push_back(target);
+        }
+    void append_transition(SymbolNumber input, SymbolNumber output,
+                           TransitionTableIndex target, Weight weight)
+        {
+            transition_inputs.push_back(input);
+            transition_outputs.push_back(output);
+            transition_targets.push_back(target);
+            if (weighted()) {
+                transition_weights.push_back(weight);
+            }
+        }
+    void pad(void)
+        {
+            transition_inputs.insert(transition_inputs.end(),
+                                     SYMBOL_RUN_PADDING, NO_SYMBOL_NUMBER);
+        }
+    template <class V>
+    static V read_field(const char * p)
+        {
+            V v;
+            memcpy(&v, p, sizeof(V));
+            return v;
+        }
+public:
+    /* Read the tables in the on-disk format from \a is. */
+    SoaTransducerTables(std::istream& is,
+                        TransitionTableIndex index_table_size,
+                        TransitionTableIndex transition_table_size)
+        {
+            reserve(index_table_size, transition_table_size);
+            std::vector<char> buffer(T1::size * (size_t) index_table_size +
+                                     T2::size * (size_t) transition_table_size);
+            if (!buffer.empty()) {
+                is.read(&buffer[0], buffer.size());
+            }
+            const char * p = buffer.empty() ? NULL : &buffer[0];
+            for (TransitionTableIndex i = 0; i < index_table_size; ++i) {
+                append_index(
+                    read_field<SymbolNumber>(p),
+                    read_field<TransitionTableIndex>(p + sizeof(SymbolNumber)));
+                p += T1::size;
+            }
+            for (TransitionTableIndex i = 0; i < transition_table_size; ++i) {
+                append_transition(
+                    read_field<SymbolNumber>(p),
+                    read_field<SymbolNumber>(p + sizeof(SymbolNumber)),
+                    read_field<TransitionTableIndex>(
+                        p + 2 * sizeof(SymbolNumber)),
+                    weighted() ?
+                    read_field<Weight>(p + Transition::size) : 0.0f);
+                p += T2::size;
+            }
+            pad();
+        }
+    SoaTransducerTables(const TransducerTable<T1>& index_table,
+                        const TransducerTable<T2>& transition_table)
+        {
+            reserve(index_table.size(), transition_table.size());
+            for (TransitionTableIndex i = 0; i < index_table.size(); ++i) {
+                append_index(index_table[i].get_input_symbol(),
+                             index_table[i].get_target());
+            }
+            for (TransitionTableIndex i = 0; i < transition_table.size();
+                 ++i) {
+                const T2 & t = transition_table[i];
+                append_transition(t.get_input_symbol(),
+                                  t.get_output_symbol(),
+                                  t.get_target(), t.get_weight());
+            }
+            pad();
+        }
+
+    TransitionWIndex get_index(TransitionTableIndex i) const
+        { return TransitionWIndex(get_index_input(i), get_index_target(i)); }
+    TransitionW get_transition(TransitionTableIndex i) const
+        {
+            return TransitionW(get_transition_input(i),
+                               get_transition_output(i),
+                               get_transition_target(i), get_weight(i));
+        }
+    Weight get_weight(TransitionTableIndex i) const
+        { return weighted() ? transition_weights[offset(i)] : 0.0f; }
+    SymbolNumber get_transition_input(TransitionTableIndex i) const
+        { return transition_inputs[offset(i)]; }
+    SymbolNumber get_transition_output(TransitionTableIndex i) const
+        { return transition_outputs[offset(i)]; }
+    TransitionTableIndex get_transition_target(TransitionTableIndex i) const
+        { return transition_targets[offset(i)]; }
+    bool get_transition_finality(TransitionTableIndex i) const
+        {
+            i = offset(i);
+            return transition_inputs[i] == NO_SYMBOL_NUMBER &&
+                transition_outputs[i] == NO_SYMBOL_NUMBER &&
+                transition_targets[i] == 1;
+        }
+    SymbolNumber get_index_input(TransitionTableIndex i) const
+        { return index_inputs[offset(i)]; }
+    TransitionTableIndex get_index_target(TransitionTableIndex i) const
+        { return index_targets[offset(i)]; }
+    bool get_index_finality(TransitionTableIndex i) const
+        {
+            i = offset(i);
+            return index_inputs[i] == NO_SYMBOL_NUMBER &&
+                index_targets[i] != NO_TABLE_INDEX;
+        }
+    Weight get_final_weight(TransitionTableIndex i) const
+        {
+            if (!weighted()) {
+                return 0.0;
+            }
+            Weight w;
+            memcpy(&w, &index_targets[offset(i)], sizeof(Weight));
+            return w;
+        }
+    TransitionTableIndex get_transition_run_length(
+        TransitionTableIndex i, SymbolNumber input) const
+        { return symbol_run_length(&transition_inputs[offset(i)], input); }
+
+    void display() const
+        {
+            display_tables(*this, index_inputs.size(),
+                           transition_targets.size(), weighted());
+        }
+};
+
+
+// There follow some classes for implementing lookup
     
+class OlLetterTrie: public CompactLetterTrie<SymbolNumber>
+{
+public:
+    OlLetterTrie(): CompactLetterTrie<SymbolNumber>(NO_SYMBOL_NUMBER) {}
 };
 
 class Encoder {
@@ -808,7 +1211,7 @@ public:
             read_input_symbols(st);
         }
 
-    SymbolNumber find_key(char ** p);
+    SymbolNumber find_key(char ** p) const;
 
     friend class Transducer;
     friend class PmatchContainer;
@@ -844,8 +1247,8 @@ struct DoubleTape: public std::vector<SymbolPair>
             }
         }
 
-    void write(unsigned int pos, std::pair<SymbolNumberVector::iterator,
-               SymbolNumberVector::iterator> start_and_end)
+    void write(unsigned int pos, std::pair<SymbolNumberVector::const_iterator,
+               SymbolNumberVector::const_iterator> start_and_end)
         {
             size_t size = start_and_end.second - start_and_end.first;
             while (pos + size >= this->size()) {
@@ -891,20 +1294,40 @@ public:
         }
 };
 
-/** \brief A compiled transducer format, suitable for fast lookup operations.
- */
-class Transducer
+/** \brief Receives the results of a lookup one at a time, as they are
+    found.
+
+    A result is a span of input and output symbol number pairs and its
+    weight. The span points into the working state of the lookup and is
+    only valid during the call, so nothing is allocated per result unless
+    the visitor copies it. Transducer::symbol_string gives the string of a
+    symbol, including input symbols that are not in the alphabet of the
+    transducer.
+*/
+class LookupVisitor
 {
-protected:
-    TransducerHeader* header;
-    TransducerAlphabet* alphabet;
-    TransducerTablesInterface* tables;
-    void load_tables(std::istream& is);
+public:
+    virtual ~LookupVisitor() {}
+    /* Called for each result. Returns whether the result counts towards
+       the limit of the lookup, which a visitor that drops duplicates
+       doesn't want for results it has seen before. */
+    virtual bool visit(const SymbolPair * path, size_t length,
+                       Weight weight) = 0;
+};
+
+/** \brief The working state of a lookup.
 
-    // for lookup
+    Lookups that are given a LookupContext don't modify the Transducer,
+    so several threads can use the same Transducer at the same time as
+    long as each thread has a LookupContext of its own.
+*/
+class LookupContext
+{
+public:
     Weight current_weight;
-    HfstTwoLevelPaths * lookup_paths;
-    Encoder * encoder;
+    // Where the results of the lookup go, and how many it has counted
+    LookupVisitor * visitor;
+    size_t results_found;
     Tape input_tape;
     DoubleTape output_tape;
     hfst::FdState<SymbolNumber> flag_state;
@@ -919,44 +1342,168 @@ protected:
     double max_time;
     clock_t start_clock;
 
-    void try_epsilon_transitions(unsigned int input_tape_pos,
+    // Input symbols that are not in the alphabet of the transducer,
+    // numbered from the size of its symbol table onwards
+    SymbolTable extra_symbols;
+
+    // Results of lookup_fd for recently seen inputs, disabled by default
+    LookupCache<HfstOneLevelPaths> cache;
+
+    LookupContext(size_t cache_size = 0):
+        current_weight(0.0), visitor(NULL), results_found(0), input_tape(),
+        output_tape(), flag_state(), found_transition(false),
+        max_lookups(-1), recursion_depth_left(MAX_RECURSION_DEPTH),
+        max_time(0.0), start_clock(0), extra_symbols(), cache(cache_size) {}
+};
+
+/** \brief For each state of a transducer, the input symbols it can consume
+    next, directly or after epsilons and flag diacritics, and whether it
+    can end there without consuming any more input.
+
+    Flag diacritics are taken to always succeed, so a set may have symbols
+    that a search wouldn't get to consume, but never lacks one that it
+    would. A search can then give up on a state with one bit test when the
+    next input symbol isn't in its set. States with identity, unknown or
+    default transitions can consume anything.
+*/
+class InputLookahead
+{
+protected:
+    // Each row has a bit for every symbol, and then the END and ANY bits
+    size_t symbol_count;
+    size_t row_words;
+    // Row 0 has no bits set and row 1 all of them; the rest are the
+    // distinct rows of the states
+    std::vector<unsigned int> rows;
+    // The row of the state at each position of the index table and of
+    // the transition table
+    std::vector<unsigned int> index_rows;
+    std::vector<unsigned int> transition_rows;
+    // The rows of all the reachable states together
+    std::vector<unsigned int> reachable;
+
+    unsigned int row_of(TransitionTableIndex state) const
+        {
+            return state >= TRANSITION_TARGET_TABLE_START ?
+                transition_rows[state - TRANSITION_TARGET_TABLE_START] :
+                index_rows[state];
+        }
+    bool has_bit(TransitionTableIndex state, size_t bit) const
+        {
+            return (rows[row_of(state) * row_words + bit / 32] >>
+                    (bit % 32)) & 1;
+        }
+
+public:
+    /* Go through the states reachable from the start of the transducer
+       that has \a tables and \a alphabet. */
+    InputLookahead(const TransducerHeader & header,
+                   const TransducerAlphabet & alphabet,
+                   const TransducerTablesInterface & tables);
+
+    /** Whether \a symbol can be the next input consumed from \a state.
+        Symbols past the end of the alphabet can only be consumed by
+        identity, unknown or default transitions. */
+    bool can_consume(TransitionTableIndex state, SymbolNumber symbol) const
+        {
+            return has_bit(state, symbol < symbol_count ?
+                           symbol : symbol_count + 1);
+        }
+    /** Whether a final state can be reached from \a state without
+        consuming input */
+    bool can_end(TransitionTableIndex state) const
+        { return has_bit(state, symbol_count); }
+    /** Whether any state reachable from the start can consume \a symbol,
+        that is, whether \a symbol can be anywhere in an input that
+        matches */
+    bool can_ever_consume(SymbolNumber symbol) const
+        {
+            size_t bit = symbol < symbol_count ? symbol : symbol_count + 1;
+            return (reachable[bit / 32] >> (bit % 32)) & 1;
+        }
+    /** Whether nothing at all can follow \a state */
+    bool is_dead(TransitionTableIndex state) const
+        { return row_of(state) == 0; }
+    /** The number of distinct rows, for seeing how much they share */
+    size_t row_count(void) const
+        { return rows.size() / row_words; }
+};
+
+/** \brief A compiled transducer format, suitable for fast lookup operations.
+ */
+class Transducer
+{
+protected:
+    TransducerHeader* header;
+    TransducerAlphabet* alphabet;
+    TransducerTablesInterface* tables;
+    MappedFile* mapped_file;
+    size_t mapped_size;
+    void load_tables(std::istream& is);
+    void map_tables(size_t offset);
+
+    Encoder * encoder;
+    // for lookup through the methods that don't take a LookupContext
+    LookupContext context;
+    // Built on request, see build_input_lookahead()
+    InputLookahead * lookahead;
+
+    void try_epsilon_transitions(LookupContext & c,
+                                 unsigned int input_tape_pos,
                                  unsigned int output_tape_pos,
-                                 TransitionTableIndex i);
+                                 TransitionTableIndex i) const;
   
-    void try_epsilon_indices(unsigned int input_tape_pos,
+    void try_epsilon_indices(LookupContext & c,
+                             unsigned int input_tape_pos,
                              unsigned int output_tape_pos,
-                             TransitionTableIndex i);
+                             TransitionTableIndex i) const;
 
-    void find_transitions(SymbolNumber input,
+    void find_transitions(LookupContext & c,
+                          SymbolNumber input,
                           unsigned int input_tape_pos,
                           unsigned int output_tape_pos,
-                          TransitionTableIndex i);
+                          TransitionTableIndex i) const;
 
-    void find_index(SymbolNumber input,
+    void find_index(LookupContext & c,
+                    SymbolNumber input,
                     unsigned int input_tape_pos,
                     unsigned int output_tape_pos,
-                    TransitionTableIndex i);
+                    TransitionTableIndex i) const;
     
-    void get_analyses(unsigned int input_tape_pos,
+    void get_analyses(LookupContext & c,
+                      unsigned int input_tape_pos,
                       unsigned int output_tape_pos,
-                      TransitionTableIndex i);
+                      TransitionTableIndex i) const;
     
-    void find_loop_epsilon_transitions(unsigned int input_pos,
-                                       TransitionTableIndex i);
-    void find_loop_epsilon_indices(unsigned int input_pos,
-                                   TransitionTableIndex i);
-    void find_loop_transitions(SymbolNumber input,
+    void find_loop_epsilon_transitions(LookupContext & c,
+                                       unsigned int input_pos,
+                                       TransitionTableIndex i) const;
+    void find_loop_epsilon_indices(LookupContext & c,
+                                   unsigned int input_pos,
+                                   TransitionTableIndex i) const;
+    void find_loop_transitions(LookupContext & c,
+                               SymbolNumber input,
                                unsigned int input_pos,
-                               TransitionTableIndex i);
-    void find_loop_index(SymbolNumber input,
+                               TransitionTableIndex i) const;
+    void find_loop_index(LookupContext & c,
+                         SymbolNumber input,
                          unsigned int input_pos,
-                         TransitionTableIndex i);
-    void find_loop(unsigned int input_pos,
-                   TransitionTableIndex i);
+                         TransitionTableIndex i) const;
+    void find_loop(LookupContext & c,
+                   unsigned int input_pos,
+                   TransitionTableIndex i) const;
 
+    std::string cache_key(const LookupContext & c, ssize_t limit) const;
+    void start_lookup(LookupContext & c, ssize_t limit,
+                      double time_cutoff) const;
+    void note_analysis(LookupContext & c) const;
 
 public:
     Transducer(std::istream& is);
+    /* Use the transducer starting at \a offset in \a file without copying
+       its tables. The transducer takes over one reference to \a file,
+       unless the constructor throws. */
+    Transducer(MappedFile * file, size_t offset = 0);
     Transducer(bool weighted);
     Transducer(Transducer * t);
     Transducer();
@@ -976,6 +1523,14 @@ public:
 
     const TransducerHeader& get_header() const
         { return *header; }
+    bool is_memory_mapped() const
+        { return mapped_file != NULL; }
+    /** The file the tables are in, or NULL if they aren't mapped */
+    const MappedFile * get_mapped_file() const
+        { return mapped_file; }
+    // The number of bytes the transducer occupies in its MappedFile
+    size_t get_mapped_size() const
+        { return mapped_size; }
     const TransducerAlphabet& get_alphabet() const
         { return *alphabet; }
     const Encoder& get_encoder(void) const
@@ -985,10 +1540,12 @@ public:
     const SymbolTable& get_symbol_table() const
         { return alphabet->get_symbol_table(); }
 
-    const TransitionIndex& get_index(TransitionTableIndex i) const
+    TransitionWIndex get_index(TransitionTableIndex i) const
         { return tables->get_index(i); }
-    const Transition& get_transition(TransitionTableIndex i) const
+    TransitionW get_transition(TransitionTableIndex i) const
         { return tables->get_transition(i); }
+    SymbolNumber get_transition_input(TransitionTableIndex i) const
+        { return tables->get_transition_input(i); }
     
     bool final_index(TransitionTableIndex i) const
         {
@@ -1005,6 +1562,10 @@ public:
 
     bool is_lookup_infinitely_ambiguous(const StringVector & s);
     bool is_lookup_infinitely_ambiguous(const std::string & input);
+    bool is_lookup_infinitely_ambiguous(const std::string & input,
+                                        LookupContext & c) const;
+    bool is_lookup_infinitely_ambiguous(const StringVector & s,
+                                        LookupContext & c) const;
     
     TransducerTable<TransitionWIndex> copy_windex_table();
     TransducerTable<TransitionW> copy_transitionw_table();
@@ -1021,7 +1582,20 @@ public:
         TransitionTableIndex state_index) const;
 
 
+    /* Cache the results of lookup_fd for the \a size most recently
+       looked up inputs, or stop caching if \a size is zero. This only
+       concerns the methods that don't take a LookupContext. */
+    void set_lookup_cache_size(size_t size)
+        { context.cache.set_capacity(size); }
+    size_t get_lookup_cache_hits(void) const
+        { return context.cache.get_hits(); }
+    size_t get_lookup_cache_misses(void) const
+        { return context.cache.get_misses(); }
+
     bool initialize_input(const char * input_str);
+    /* Tokenize \a input_str onto the input tape of \a c. Symbols that are
+       not in the alphabet are collected in c.extra_symbols. */
+    bool initialize_input(const char * input_str, LookupContext & c) const;
     void include_symbol_in_alphabet(const std::string & sym);
     HfstOneLevelPaths * lookup_fd(const StringVector & s, ssize_t limit = -1,
         double time_cutoff = 0.0);
@@ -1037,7 +1611,37 @@ public:
                                         double time_cutoff = 0.0);
     HfstTwoLevelPaths * lookup_fd_pairs(const char * s, ssize_t limit = -1,
                                         double time_cutoff = 0.0);
-    void note_analysis(void);
+    /* Reentrant versions of lookup_fd and lookup_fd_pairs. These may be
+       called from several threads at once if each uses its own \a c. */
+    HfstOneLevelPaths * lookup_fd(const StringVector & s, LookupContext & c,
+                                  ssize_t limit = -1,
+                                  double time_cutoff = 0.0) const;
+    HfstOneLevelPaths * lookup_fd(const std::string & s, LookupContext & c,
+                                  ssize_t limit = -1,
+                                  double time_cutoff = 0.0) const;
+    HfstOneLevelPaths * lookup_fd(const char * s, LookupContext & c,
+                                  ssize_t limit = -1,
+                                  double time_cutoff = 0.0) const;
+    HfstTwoLevelPaths * lookup_fd_pairs(const char * s, LookupContext & c,
+                                        ssize_t limit = -1,
+                                        double time_cutoff = 0.0) const;
+    /* Look up \a s, passing each result to \a visitor as it is found
+       instead of collecting the results. With a nonnegative \a limit, stops
+       after \a limit results that \a visitor counted. These bypass the
+       lookup cache. */
+    void lookup_fd(const char * s, LookupContext & c, LookupVisitor & visitor,
+                   ssize_t limit = -1, double time_cutoff = 0.0) const;
+    void lookup_fd(const std::string & s, LookupContext & c,
+                   LookupVisitor & visitor, ssize_t limit = -1,
+                   double time_cutoff = 0.0) const;
+
+    /* The string of \a symbol in a result of a lookup with \a c, epsilon
+       being the empty string. */
+    const std::string & symbol_string(const LookupContext & c,
+                                      SymbolNumber symbol) const;
+    std::string string_from_symbol(const LookupContext & c,
+                                   SymbolNumber symbol) const
+        { return symbol_string(c, symbol); }
 
     // Methods for supporting ospell
     SymbolNumber get_unknown_symbol(void) const
@@ -1045,7 +1649,7 @@ public:
     StringSymbolMap get_string_symbol_map(void) const
         { return alphabet->build_string_symbol_map(); }
     STransition take_epsilons(const TransitionTableIndex i) const;
-    STransition take_epsilons_and_flags(const TransitionTableIndex i);
+    STransition take_epsilons_and_flags(const TransitionTableIndex i) const;
     STransition take_non_epsilons(const TransitionTableIndex i,
                                   const SymbolNumber symbol) const;
     TransitionTableIndex next(const TransitionTableIndex i,
@@ -1053,12 +1657,26 @@ public:
     TransitionTableIndex next_e(const TransitionTableIndex i) const;
     bool has_transitions(const TransitionTableIndex i,
                          const SymbolNumber symbol) const;
-    bool has_epsilons_or_flags(const TransitionTableIndex i);
+    bool has_epsilons_or_flags(const TransitionTableIndex i) const;
     Weight final_weight(const TransitionTableIndex i) const;
-    bool is_flag(const SymbolNumber symbol)
+    bool is_flag(const SymbolNumber symbol) const
         { return alphabet->is_flag_diacritic(symbol); }
-    bool is_weighted(void)
+    bool is_weighted(void) const
         { return header->probe_flag(Weighted);}
+    /** Whether any transition or final weight is negative. This goes
+        through all of the tables. */
+    bool has_negative_weights(void) const;
+
+    /** Go through the tables once to find which input symbols each state
+        can consume next, so that lookup and spell-checking can stop
+        following paths that can't match the rest of the input. Spellers
+        only use the lookahead if it was built before they were made. This
+        is done once; the tables must not change afterwards. It's not safe
+        to call while other threads use the transducer. */
+    void build_input_lookahead(void);
+    /** The lookahead made by build_input_lookahead(), or NULL */
+    const InputLookahead * get_input_lookahead(void) const
+        { return lookahead; }
 
     
     friend class ConvertTransducer;
@@ -1200,23 +1818,32 @@ typedef std::priority_queue<StringWeightPair,
 
   };*/
 
+const size_t NO_TREE_NODE = (std::numeric_limits<size_t>::max)();
+
+/* A node of the search of Speller. The output is kept as a tree: a node
+   has the symbol it adds and the index of its parent in Speller::nodes.
+   Likewise the flag diacritic state is an index into the snapshots in
+   Speller, which only get added to when a flag changes the state. */
 class TreeNode
 {
 public:
-    SymbolNumberVector string;
+    size_t parent;
+    SymbolNumber symbol;
     unsigned int input_state;
     TransitionTableIndex mutator_state;
     TransitionTableIndex lexicon_state;
-    hfst::FdState<SymbolNumber> flag_state;
+    unsigned int flag_state;
     Weight weight;
 
-    TreeNode(SymbolNumberVector prev_string,
+    TreeNode(size_t parent_node,
+             SymbolNumber next_symbol,
              unsigned int i,
              TransitionTableIndex mutator,
              TransitionTableIndex lexicon,
-             hfst::FdState<SymbolNumber> state,
+             unsigned int state,
              Weight w):
-        string(prev_string),
+        parent(parent_node),
+        symbol(next_symbol),
         input_state(i),
         mutator_state(mutator),
         lexicon_state(lexicon),
@@ -1224,40 +1851,69 @@ public:
         weight(w)
         { }
 
-    TreeNode(hfst::FdState<SymbolNumber> start_state): // starting state node
-        string(SymbolNumberVector()),
+    TreeNode(void): // starting state node
+        parent(NO_TREE_NODE),
+        symbol(NO_SYMBOL_NUMBER),
         input_state(0),
         mutator_state(0),
         lexicon_state(0),
-        flag_state(start_state),
+        flag_state(0),
         weight(0.0)
         { }
 
-    TreeNode update_lexicon(SymbolNumber next_symbol,
+    /* The updates make a child of this node, which is \a self in
+       Speller::nodes */
+    TreeNode update_lexicon(size_t self,
+                            SymbolNumber next_symbol,
                             TransitionTableIndex next_lexicon,
-                            Weight weight);
+                            Weight weight) const;
 
-    TreeNode update_mutator(SymbolNumber next_symbol,
+    TreeNode update_mutator(size_t self,
+                            SymbolNumber next_symbol,
                             TransitionTableIndex next_mutator,
-                            Weight weight);
-
-    void increment_mutator(void);
+                            Weight weight) const;
 
-    TreeNode update(SymbolNumber next_symbol,
+    TreeNode update(size_t self,
+                    SymbolNumber next_symbol,
                     unsigned int next_input,
                     TransitionTableIndex next_mutator,
                     TransitionTableIndex next_lexicon,
-                    Weight weight);
+                    Weight weight) const;
 
-    TreeNode update(SymbolNumber next_symbol,
+    TreeNode update(size_t self,
+                    SymbolNumber next_symbol,
                     TransitionTableIndex next_mutator,
                     TransitionTableIndex next_lexicon,
-                    Weight weight);
+                    Weight weight) const;
+};
 
+typedef std::vector<TreeNode> TreeNodeVector;
 
+/* A node waiting in the best-first search of Speller, by its index in
+   Speller::nodes. The lightest node comes first, and of equally heavy ones
+   the one further in the input. */
+struct QueuedTreeNode
+{
+    Weight weight;
+    unsigned int input_state;
+    size_t node;
+
+    QueuedTreeNode(Weight w, unsigned int i, size_t n):
+        weight(w),
+        input_state(i),
+        node(n)
+        { }
+
+    bool operator<(const QueuedTreeNode & rhs) const
+        { // true when rhs comes first
+            if (weight != rhs.weight) {
+                return weight > rhs.weight;
+            }
+            return input_state < rhs.input_state;
+        }
 };
 
-typedef std::deque<TreeNode> TreeNodeQueue;
+typedef std::priority_queue<QueuedTreeNode> TreeNodePriorityQueue;
 
 int nByte_utf8(unsigned char c);
 
@@ -1274,12 +1930,12 @@ public:
 
     bool initialize(const Encoder & encoder, char * input, SymbolNumber other);
     
-    unsigned int len(void)
+    unsigned int len(void) const
         {
             return (unsigned int)s.size();
         }
 
-    SymbolNumber operator[](unsigned int i)
+    SymbolNumber operator[](unsigned int i) const
         {
             return s[i];
         }
@@ -1297,6 +1953,13 @@ public:
 
 /** \brief A spellchecker, constructed from two optimized-lookup transducer
     instances. An alphabet translator is built at construction time.
+
+    When the corrections are limited by number or weight, and neither
+    transducer has negative weights, the search is best-first: the
+    lightest node of the mutator and lexicon product is expanded next,
+    nodes too heavy to lead to a correction that's wanted aren't expanded,
+    and the search stops once nothing lighter than the corrections found
+    is left.
 */
 class Speller
 {
@@ -1304,37 +1967,121 @@ public:
     Transducer * mutator;
     Transducer * lexicon;
     InputString input;
-    TreeNodeQueue queue;
+    // The nodes of the current search. They're only added to until the
+    // search starts over, and then the space is reused.
+    TreeNodeVector nodes;
+    TreeNodePriorityQueue queue;
+    // Nodes as light as the one being expanded, which is as light as any,
+    // so they go ahead of the queue without being ordered
+    std::vector<size_t> lightest;
+    Weight expanded_weight;
+    // Whether the search is best-first. If not, nodes are expanded in the
+    // order they were created, and next_node is the next one.
+    bool best_first;
+    size_t next_node;
     SymbolNumberVector alphabet_translator;
 //    hfst::FdTable<SymbolNumber> operations;
     std::vector<std::string> symbol_table;
+    // The flag diacritic states of the current search, each of
+    // flag_feature_count values, one after another
+    std::vector<hfst::FdValue> flag_states;
+    size_t flag_feature_count;
+    // For applying flag operations to a state in flag_states
+    hfst::FdState<SymbolNumber> flag_scratch;
+    std::vector<hfst::FdValue> flag_values;
+    // For stringify(size_t)
+    SymbolNumberVector output_scratch;
+    // Whether a node can only get heavier as it's expanded
+    bool weights_grow;
+    // Nodes heavier than this aren't queued, if weights_grow. In a search
+    // for the n best corrections, it comes down to the n-th best found.
+    Weight weight_limit;
+    // Which input symbols the states of the transducers can consume next,
+    // or NULL if Transducer::build_input_lookahead() wasn't called
+    const InputLookahead * mutator_lookahead;
+    const InputLookahead * lexicon_lookahead;
+    // Whether nodes that can't lead to a result are left out of the search
+    bool use_lookahead;
+    // Whether the search is check()'s, which reads the input with the
+    // lexicon, or correct()'s, which reads it with the mutator
+    bool checking;
+    // The nodes expanded by all the searches so far
+    size_t nodes_expanded;
     
     Speller(Transducer * mutator_ptr, Transducer * lexicon_ptr):
         mutator(mutator_ptr),
         lexicon(lexicon_ptr),
         input(InputString()),
-        queue(TreeNodeQueue()),
+        nodes(TreeNodeVector()),
+        queue(TreeNodePriorityQueue()),
+        lightest(),
+        expanded_weight(0.0),
+        best_first(false),
+        next_node(0),
         alphabet_translator(SymbolNumberVector()),
 //  operations(lexicon->get_fd_table()),
-        symbol_table(lexicon->get_symbol_table())
+        symbol_table(lexicon->get_symbol_table()),
+        flag_states(),
+        flag_feature_count(lexicon->get_fd_table().num_features()),
+        flag_scratch(lexicon->get_fd_table()),
+        flag_values(),
+        output_scratch(),
+        weights_grow(!mutator_ptr->has_negative_weights() &&
+                     !lexicon_ptr->has_negative_weights()),
+        weight_limit(std::numeric_limits<Weight>::infinity()),
+        mutator_lookahead(NULL),
+        lexicon_lookahead(NULL),
+        use_lookahead(true),
+        checking(false),
+        nodes_expanded(0)
         {
             build_alphabet_translator();
+            // The transducers may be shared, so their lookaheads are only
+            // used if they were built beforehand
+            mutator_lookahead = mutator->get_input_lookahead();
+            lexicon_lookahead = lexicon->get_input_lookahead();
         }
     
     bool init_input(char * str, const Encoder & encoder, SymbolNumber other);
 
     void build_alphabet_translator(void);
-    void lexicon_epsilons(void);
-    void mutator_epsilons(void);
-    void consume_input(void);
-    void lexicon_consume(void);
+    /* Whether the rest of the input can still be read from \a node */
+    bool may_continue(const TreeNode & node) const;
+    void push(const TreeNode & node);
+    bool has_queued(void) const
+        {
+            return best_first ? !(queue.empty() && lightest.empty()) :
+                next_node < nodes.size();
+        }
+    /* The weight of the lightest queued node in a best-first search */
+    Weight queued_weight(void) const
+        { return lightest.empty() ? queue.top().weight : expanded_weight; }
+    /* Take the next node from the queue, and return its index in nodes */
+    size_t pop(void);
+    void start_search(bool best, Weight max_weight);
+    /* Change \a state, an index into flag_states, to the one that follows
+       by the flag \a symbol. Return false if the flag doesn't allow it. */
+    bool apply_flag(unsigned int & state, SymbolNumber symbol);
+    /* The expansions of the node \a i. \a node is a copy of it, since
+       nodes may move as children are added. */
+    void lexicon_epsilons(const TreeNode & node, size_t i);
+    void mutator_epsilons(const TreeNode & node, size_t i);
+    void consume_input(const TreeNode & node, size_t i);
+    void lexicon_consume(const TreeNode & node, size_t i);
     /** See if \a line is in the lexicon.
      */
     bool check(char * line);
-    /** Return a priority queue of corrections of \a line.
+    /** Return a priority queue of corrections of \a line: at most
+        \a nbest of them, or all if it's 0, and none heavier than
+        \a max_weight. The search stops as soon as the \a nbest best
+        corrections are known, unless there are negative weights.
      */
-    CorrectionQueue correct(char * line);
-    std::string stringify(SymbolNumberVector symbol_vector);
+    CorrectionQueue correct(char * line, unsigned int nbest = 0,
+                            Weight max_weight =
+                            std::numeric_limits<Weight>::infinity());
+    std::string stringify(const SymbolNumberVector & symbol_vector);
+    /** The output of the path from the start to the node \a i */
+    std::string stringify(size_t i);
 };
 
 }
@@ -151,6 +151,10 @@ UNICODE_ESCAPE ("\\u"{HEXCHAR}{HEXCHAR}{HEXCHAR}{HEXCHAR})|("\\U00"{HEXCHAR}{HEX
     pmatchlval.label = strcpy((char *) malloc(strlen("vector-similarity-projection-factor") + 1), "vector-similarity-projection-factor");
     return VARIABLE_NAME;
 }
+"vector-search-candidates" {
+    pmatchlval.label = strcpy((char *) malloc(strlen("vector-search-candidates") + 1), "vector-search-candidates");
+    return VARIABLE_NAME;
+}
 
 "~"   { return COMPLEMENT; }
 "\\"  { return TERM_COMPLEMENT; }
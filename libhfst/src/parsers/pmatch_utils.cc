@@ -92,7 +92,7 @@ std::set<std::string> unsatisfied_insertions;
 std::set<std::string> used_definitions;
 std::set<std::string> function_names;
 std::set<std::string> capture_names;
-std::vector<WordVector> word_vectors;
+WordVectorIndex word_vectors;
 char* startptr;
 hfst::ImplementationType format;
 size_t len;
@@ -329,109 +329,8 @@ PmatchObject * make_with_tag_exit(std::string key)
     return new PmatchString("@C.PMATCH_GLOBAL_" + key + "@");
 }
 
-// Get the n best candidates in the original space using an insertion sort
-std::vector<std::pair<WordVector, WordVecFloat> > get_top_n(size_t n,
-                                                            std::vector<WordVector> & vecs,
-                                                            WordVector & comparison_point)
-{
-    std::vector<std::pair<WordVector, WordVecFloat> > retval;
-    for (std::vector<WordVector>::const_iterator it = vecs.begin();
-         it != vecs.end(); ++it) {
-        WordVecFloat cosdist = cosine_distance(*it, comparison_point);
-        for (size_t i = 0; i <= retval.size(); ++i) {
-            if (i == retval.size()) {
-                // We made it to the top
-                retval.push_back(std::pair<WordVector, WordVecFloat>(
-                                     WordVector(*it), cosdist));
-                break;
-            } else {
-                // Walking the list
-                if (cosdist >= retval[i].second) {
-                    if (i == 0 && retval.size() == n) {
-                        break;
-                    }
-                    retval.insert(retval.begin() + i, std::pair<WordVector, WordVecFloat>(
-                                      WordVector(*it), cosdist));
-                    break;
-                } else {
-                    continue;
-                }
-            }
-        }
-        if (retval.size() > n) {
-            retval.erase(retval.begin());
-        }
-    }
-    return retval;    
-}
-
-// Get the n best candidates in the transformed space using an insertion sort
-std::vector<std::pair<WordVector, WordVecFloat> > get_top_n_transformed(
-    size_t n,
-    const std::vector<WordVector> & vecs,
-    std::vector<WordVecFloat> plane_vec,
-    std::vector<WordVecFloat> comparison_point,
-    WordVecFloat translation_term,
-    bool negative)
-{
-    std::vector<std::pair<WordVector, WordVecFloat> > retval;
-    WordVecFloat plane_vec_square_sum = square_sum(plane_vec);
-    WordVecFloat comparison_point_norm = norm(comparison_point);
-    for (std::vector<WordVector>::const_iterator it = vecs.begin();
-         it != vecs.end(); ++it) {
-        WordVector transformed_vec(*it);
-
-        /*
-         * First, given a plane "plane_vec = translation term" and a point,
-         * find the multiple of plane_vec which produces a vector going
-         * from point to the nearest point in the plane.
-         */
-
-        WordVecFloat transformed_vec_scaler =
-            (translation_term - dot_product(transformed_vec.vector, plane_vec))
-            / plane_vec_square_sum;
-        transformed_vec_scaler *= vector_similarity_projection_factor;
-        if(negative) {
-            transformed_vec.vector =
-                pointwise_minus(transformed_vec.vector,
-                                pointwise_multiplication(transformed_vec_scaler, plane_vec));
-        } else {
-            transformed_vec.vector =
-                pointwise_plus(transformed_vec.vector,
-                               pointwise_multiplication(transformed_vec_scaler, plane_vec));
-        }
-        transformed_vec.norm = norm(transformed_vec.vector);
-        WordVecFloat cosdist = 1 - dot_product(transformed_vec.vector, comparison_point)
-            / (transformed_vec.norm * comparison_point_norm);
-        for (size_t i = 0; i <= retval.size(); ++i) {
-            if (i == retval.size()) {
-                // We made it to the top
-                retval.push_back(std::pair<WordVector, WordVecFloat>(transformed_vec,
-                                                                     cosdist));
-                break;
-            } else {
-                // Walking the list
-                if (cosdist >= retval[i].second) {
-                    if (i == 0 && retval.size() == n) {
-                        break;
-                    }
-                    retval.insert(retval.begin() + i,
-                                  std::pair<WordVector, WordVecFloat>(transformed_vec, cosdist));
-                    break;
-                } else {
-                    continue;
-                }
-            }
-        }
-        if (retval.size() > n) {
-            retval.erase(retval.begin());
-        }
-    }
-    return retval;    
-}
-
-template<typename T> std::vector<T> pointwise_minus(std::vector<T> l,
-                                                    std::vector<T> r)
+template<typename T> std::vector<T> pointwise_minus(const std::vector<T> & l,
+                                                    const std::vector<T> & r)
 {
     std::vector<T> ret(l.size(), 0);
     for(size_t i = 0; i < l.size(); ++i) {
@@ -440,8 +339,8 @@ template<typename T> std::vector<T> pointwise_minus(std::vector<T> l,
     return ret;
 }
 
-template<typename T> std::vector<T> pointwise_plus(std::vector<T> l,
-                                                   std::vector<T> r)
+template<typename T> std::vector<T> pointwise_plus(const std::vector<T> & l,
+                                                   const std::vector<T> & r)
 {
     std::vector<T> ret(l.size(), 0);
     for(size_t i = 0; i < l.size(); ++i) {
@@ -450,8 +349,8 @@ template<typename T> std::vector<T> pointwise_plus(std::vector<T> l,
     return ret;
 }
 
-template<typename T> std::vector<T> pointwise_multiplication(T l,
-                                                             std::vector<T> r)
+template<typename T> std::vector<T> pointwise_multiplication(
+    T l, const std::vector<T> & r)
 {
     std::vector<T> ret(r.size(), 0);
     for(size_t i = 0; i < r.size(); ++i) {
@@ -460,8 +359,8 @@ template<typename T> std::vector<T> pointwise_multiplication(T l,
     return ret;
 }
 
-template<typename T> T dot_product(std::vector<T> l,
-                                   std::vector<T> r)
+template<typename T> T dot_product(const std::vector<T> & l,
+                                   const std::vector<T> & r)
 {
     T ret = 0;
     for(size_t i = 0; i < l.size(); ++i) {
@@ -470,7 +369,7 @@ template<typename T> T dot_product(std::vector<T> l,
     return ret;
 }
 
-template<typename T> T square_sum(std::vector<T> v)
+template<typename T> T square_sum(const std::vector<T> & v)
 {
     T ret = 0;
     for(size_t i = 0; i < v.size(); ++i) {
@@ -479,52 +378,40 @@ template<typename T> T square_sum(std::vector<T> v)
     return ret;
 }
 
-template<typename T> T norm(std::vector<T> v)
+template<typename T> T norm(const std::vector<T> & v)
 {
     return sqrt(square_sum(v));
 }
 
-WordVecFloat cosine_distance(WordVector left, WordVector right)
+WordVecFloat cosine_distance(const std::vector<WordVecFloat> & left,
+                             const std::vector<WordVecFloat> & right)
 {
-    // Sometimes very nearby vectors combined with rounding error will produce
-    // a slightly negative distance, so make sure to return at least 0.0
-    WordVecFloat retval = 1.0 - dot_product(left.vector, right.vector) /
-        (left.norm * right.norm);
+    WordVecFloat retval = 1.0 - dot_product(left, right) / (norm(left) * norm(right));
     return std::max(static_cast<WordVecFloat>(0.0), retval);
 }
 
-WordVecFloat cosine_distance(std::vector<WordVecFloat> left, std::vector<WordVecFloat> right)
+// The "vector-search-candidates" variable, if set, makes searches in
+// word_vectors approximate
+static void set_vector_search_mode(void)
 {
-    WordVecFloat retval = 1.0 - dot_product(left, right) / (norm(left) * norm(right));
-    return std::max(static_cast<WordVecFloat>(0.0), retval);
+    word_vectors.set_approximate_candidates(
+        strtoul(variables["vector-search-candidates"].c_str(), NULL, 10));
 }
 
-// Single-word Like()
-PmatchObject * compile_like_arc(std::string word,
-                                unsigned int nwords)
+static std::vector<WordVecFloat> word_vector(size_t i)
 {
-    WordVector this_word;
-    for (std::vector<WordVector>::iterator it = word_vectors.begin();
-         it != word_vectors.end(); ++it) {
-        if (word == it->word) {
-            this_word = *it;
-            break;
-        }
-    }
-    if (this_word.word == "") {
-        // got no matches
-        PmatchString * word_o = new PmatchString(word);
-        word_o->multichar = true;
-        pmatchwarning("no matches for argument to Like() operation");
-        return word_o;
-    }
-
-    std::vector<std::pair<WordVector, WordVecFloat> > top_n = get_top_n(nwords, word_vectors, this_word);
+    return std::vector<WordVecFloat>(
+        word_vectors.vector(i),
+        word_vectors.vector(i) + word_vectors.dimension());
+}
 
+static PmatchObject * make_like_arc(
+    const std::vector<WordVectorIndex::Neighbour> & top_n)
+{
     HfstTokenizer tok;
     HfstTransducer * retval = new HfstTransducer(format);
     for (size_t i = 0; i < top_n.size(); ++i) {
-        HfstTransducer tmp(top_n[i].first.word, tok, format);
+        HfstTransducer tmp(word_vectors.word(top_n[i].first), tok, format);
         if (include_cosine_distances) {
             tmp.set_final_weights(top_n[i].second);
         }
@@ -533,23 +420,31 @@ PmatchObject * compile_like_arc(std::string word,
     return new PmatchTransducerContainer(retval);
 }
 
+// Single-word Like()
+PmatchObject * compile_like_arc(std::string word,
+                                unsigned int nwords)
+{
+    size_t this_word = word_vectors.find(word);
+    if (this_word == word_vectors.size()) {
+        // got no matches
+        PmatchString * word_o = new PmatchString(word);
+        word_o->multichar = true;
+        pmatchwarning("no matches for argument to Like() operation");
+        return word_o;
+    }
+    set_vector_search_mode();
+    return make_like_arc(word_vectors.nearest(
+                             word_vectors.vector(this_word), nwords));
+}
+
 // the general case
 PmatchObject * compile_like_arc(std::string word1, std::string word2,
                                 unsigned int nwords, bool is_negative)
 {
-    WordVector this_word1;
-    WordVector this_word2;
-    for (std::vector<WordVector>::iterator it = word_vectors.begin();
-         (it != word_vectors.end() &&
-          (this_word1.word == "" || this_word2.word == "")); ++it) {
-        if (word1 == it->word) {
-            this_word1 = *it;
-        }
-        if (word2 == it->word) {
-            this_word2 = *it;
-        }
-    }
-    if (this_word1.word == "" && this_word2.word == "") {
+    size_t this_word1 = word_vectors.find(word1);
+    size_t this_word2 = word_vectors.find(word2);
+    size_t no_word = word_vectors.size();
+    if (this_word1 == no_word && this_word2 == no_word) {
         // got no matches
         PmatchString * word1_o = new PmatchString(word1);
         PmatchString * word2_o = new PmatchString(word2);
@@ -558,21 +453,13 @@ PmatchObject * compile_like_arc(std::string word1, std::string word2,
         return new PmatchBinaryOperation(Disjunct, word1_o, word2_o);
     }
 
-    if (this_word1.word == "" || this_word2.word == "") {
+    set_vector_search_mode();
+    if (this_word1 == no_word || this_word2 == no_word) {
         // just one match
         pmatchwarning("only one match for arguments to Like() operation, using nearest neighbours");
-        WordVector this_word = (this_word1.word == "" ? this_word2 : this_word1);
-        std::vector<std::pair<WordVector, WordVecFloat> > top_n = get_top_n(nwords, word_vectors, this_word);
-        HfstTokenizer tok;
-        HfstTransducer * retval = new HfstTransducer(format);
-        for (size_t i = 0; i < top_n.size(); ++i) {
-            HfstTransducer tmp(top_n[i].first.word, tok, format);
-            if (include_cosine_distances) {
-                tmp.set_final_weights(top_n[i].second);
-            }
-            retval->disjunct(tmp);
-        }
-        return new PmatchTransducerContainer(retval);
+        size_t this_word = (this_word1 == no_word ? this_word2 : this_word1);
+        return make_like_arc(word_vectors.nearest(
+                                 word_vectors.vector(this_word), nwords));
     }
 
     if(variables["vector-similarity-projection-factor"] != "1.0") {
@@ -594,47 +481,31 @@ PmatchObject * compile_like_arc(std::string word1, std::string word2,
      * half of the norm of |B - A|.
      *
      */
-        
-    std::vector<WordVecFloat> B_minus_A = pointwise_minus(
-        this_word1.vector, this_word2.vector);
-    WordVecFloat hyperplane_translation_term = dot_product(B_minus_A, this_word1.vector)
+
+    std::vector<WordVecFloat> vector1 = word_vector(this_word1);
+    std::vector<WordVecFloat> vector2 = word_vector(this_word2);
+    std::vector<WordVecFloat> B_minus_A = pointwise_minus(vector1, vector2);
+    WordVecFloat hyperplane_translation_term = dot_product(B_minus_A, vector1)
         - square_sum(B_minus_A) * 0.5;
 
     std::vector<WordVecFloat> comparison_point;
     if (is_negative == true) {
         WordVecFloat comparison_scaler =
-            (hyperplane_translation_term - dot_product(this_word1.vector, B_minus_A)) / square_sum(B_minus_A);
+            (hyperplane_translation_term - dot_product(vector1, B_minus_A)) / square_sum(B_minus_A);
         comparison_scaler *= vector_similarity_projection_factor;
-        comparison_point = pointwise_minus(this_word1.vector, pointwise_multiplication(comparison_scaler, B_minus_A));
+        comparison_point = pointwise_minus(vector1, pointwise_multiplication(comparison_scaler, B_minus_A));
     } else {
-        comparison_point = pointwise_plus(this_word2.vector, pointwise_multiplication(
+        comparison_point = pointwise_plus(vector2, pointwise_multiplication(
                                               static_cast<WordVecFloat>(0.5), B_minus_A));
     }
-    
-    std::vector<std::pair<WordVector, WordVecFloat> > top_n = get_top_n_transformed(nwords,
-                                                                                    word_vectors,
-                                                                                    B_minus_A,
-                                                                                    comparison_point,
-                                                                                    hyperplane_translation_term,
-                                                                                    is_negative);
-    HfstTokenizer tok;
-    HfstTransducer * retval = new HfstTransducer(format);
-    for (size_t i = 0; i < top_n.size() && i <= nwords; ++i) {
-        HfstTransducer tmp(top_n[i].first.word, tok, format);
-        if (include_cosine_distances) {
-            tmp.set_final_weights(top_n[i].second);
-        }
-        retval->disjunct(tmp);
-        // if (include_cosine_distances) {
-        //     for (size_t j = i + 1; j < word_vectors.size() && j <= nwords; ++j) {
-        //         HfstTransducer tmp2(word_vectors[i].word + "_cos_" + word_vectors[j].word, tok, format);
-        //         tmp2.set_final_weights(cosine_distance(projected_i,
-        //                                                get_projected_vector(word_vectors[j].vector, B_minus_A, hyperplane_translation_term)));
-        //         retval->disjunct(tmp2);
-        //     }
-        // }
-    }
-    return new PmatchTransducerContainer(retval);
+
+    return make_like_arc(word_vectors.nearest_transformed(
+                             &comparison_point[0],
+                             &B_minus_A[0],
+                             hyperplane_translation_term,
+                             vector_similarity_projection_factor,
+                             is_negative,
+                             nwords));
 }
 
 PmatchTransducerContainer * make_counter(std::string name)
@@ -1062,6 +933,7 @@ void init_globals(void)
     variables["need-separators"] = "on";
     variables["xerox-composition"] = "on";
     variables["vector-similarity-projection-factor"] = "1.0";
+    variables["vector-search-candidates"] = "0";
     call_stack.clear();
     def_insed_expressions.clear();
     inserted_names.clear();
@@ -1301,74 +1173,21 @@ std::string path_from_filename(char * filename)
 
 void read_vec(std::string filename)
 {
-    if (word_vectors.size() != 0) {
-        word_vectors.clear();
+    if (word_vectors.size() != 0 && word_vectors.get_filename() != filename) {
         std::cerr << "pmatch: vector model file " << filename
                   << " overrides earlier one\n";
     }
-    std::ifstream infile;
-    std::string line;
-    size_t linenumber = 0;
-    char separator = '\t';
-    infile.open(filename.c_str());
-    if(!infile.good()) {
+    if (!word_vectors.read(filename)) {
         std::cerr << "pmatch: could not open vector file " << filename <<
             " for reading\n";
+        word_vectors.clear();
         return;
-    } else {
-        while(infile.good()) {
-            std::getline(infile, line);
-            ++linenumber;
-            if (linenumber == 1) { continue; } // first line is metadata
-            if (line.empty()) { continue; }
-            size_t pos = line.find(separator);
-            if (pos == std::string::npos) {
-                separator = ' ';
-                pos = line.find(separator);
-                if (pos == std::string::npos) {
-                    std::cerr << "pmatch warning: vector file " << filename <<
-                        " doesn't appear to be tab- or space-separated\n  (reading line " << linenumber << ")\n";
-                    break;
-                }
-            }
-            std::string word = line.substr(0, pos);
-            std::vector<WordVecFloat> components;
-            size_t nextpos;
-            while (std::string::npos != (nextpos = line.find(separator, pos + 1))) {
-                components.push_back(strtod(line.substr(pos + 1, nextpos - pos).c_str(), NULL));
-                pos = nextpos;
-            }
-            // there can be one more from pos to the newline if there isn't a
-            // separator at the end
-#if defined(NO_CPLUSPLUS_11)
-            if (*(line.rbegin()) != separator) {
-#else
-            if (line.back() != separator) {
-#endif
-#if defined _MSC_VER && 1200 <= _MSC_VER
-	      components.push_back((float)strtod(line.substr(pos + 1).c_str(), NULL));
-#else
-	      components.push_back(strtof(line.substr(pos + 1).c_str(), NULL));
-#endif
-            }
-            if (word_vectors.size() != 0 && word_vectors[0].vector.size() != components.size()) {
-                std::cerr << "pmatch warning: vector file " << filename <<
-                    " appears malformed\n  (reading line " << linenumber << ")\n";
-                continue;
-            }
-            WordVector wv;
-            wv.word = word;
-            wv.vector = components;
-            wv.norm = norm(components);
-            word_vectors.push_back(wv);
-        }
     }
-    infile.close();
     if (verbose) {
         if (word_vectors.size() == 0) {
             std::cerr << "Tried to read word vector file, empty result\n";
         }
-        std::cerr << "Read " << word_vectors.size() << " vectors of dimensionality " << word_vectors[0].vector.size() << std::endl;
+        std::cerr << "Read " << word_vectors.size() << " vectors of dimensionality " << word_vectors.dimension() << std::endl;
     }
 }
 
@@ -26,6 +26,7 @@
 #include "HfstTransducer.h"
 #include "HfstXeroxRules.h"
 #include "xre_utils.h"
+#include "pmatch_vectors.h"
 
 void pmatchwarning(const char *msg);
 
@@ -36,8 +37,6 @@ struct PmatchObject;
 struct PmatchTransducerContainer;
 
 typedef std::pair<std::string, std::string> StringPair;
-typedef float WordVecFloat;
-struct WordVector;
 
 extern char* data;
 extern char* startptr;
@@ -51,7 +50,7 @@ extern std::set<std::string> unsatisfied_insertions;
 extern std::set<std::string> used_definitions;
 extern std::set<std::string> function_names;
 extern std::set<std::string> capture_names;
-extern std::vector<WordVector> word_vectors;
+extern WordVectorIndex word_vectors;
 extern ImplementationType format;
 extern bool verbose;
 extern bool flatten;
@@ -134,30 +133,16 @@ PmatchTransducerContainer * make_captured_tag(std::string tag);
 PmatchObject * make_with_tag_entry(std::string key, std::string value);
 PmatchObject * make_with_tag_exit(std::string key);
 
-std::vector<std::pair<WordVector, WordVecFloat> > get_top_n(
-    size_t n,
-    const std::vector<WordVector> & vecs,
-    WordVector & comparison_point);
-
-std::vector<std::pair<WordVector, WordVecFloat> > get_top_n_transformed(
-    size_t n,
-    const std::vector<WordVector> & vecs,
-    std::vector<WordVecFloat> plane_vec,
-    std::vector<WordVecFloat> comparison_point,
-    WordVecFloat translation_term,
-    bool negative);
-
-template<typename T> std::vector<T> pointwise_minus(std::vector<T> l,
-                                                    std::vector<T> r);
-template<typename T> std::vector<T> pointwise_plus(std::vector<T> l,
-                                                   std::vector<T> r);
-template<typename T> std::vector<T> pointwise_multiplication(T,
-                                                             std::vector<T> r);
-template<typename T> T dot_product(std::vector<T> l,
-                                   std::vector<T> r);
-template<typename T> T square_sum(std::vector<T> v);
-template<typename T> T norm(std::vector<T> v);
-WordVecFloat cosine_distance(WordVector left, WordVector right);
+template<typename T> std::vector<T> pointwise_minus(const std::vector<T> & l,
+                                                    const std::vector<T> & r);
+template<typename T> std::vector<T> pointwise_plus(const std::vector<T> & l,
+                                                   const std::vector<T> & r);
+template<typename T> std::vector<T> pointwise_multiplication(
+    T, const std::vector<T> & r);
+template<typename T> T dot_product(const std::vector<T> & l,
+                                   const std::vector<T> & r);
+template<typename T> T square_sum(const std::vector<T> & v);
+template<typename T> T norm(const std::vector<T> & v);
 PmatchObject * compile_like_arc(std::string word1, std::string word2,
                                 unsigned int nwords = 10, bool is_negative = false);
 PmatchObject * compile_like_arc(std::string word,
@@ -235,16 +220,9 @@ HfstTransducer * read_spaced_text(std::string filename,
  */
 std::string path_from_filename(char * filename);
 
-struct WordVector
-{
-    std::string word;
-    std::vector<WordVecFloat> vector;
-    WordVecFloat norm;
-};
-
 /**
  * @brief Given a list of words and their vector representations, parse it into
- * hfst::pmatch::word_vectors
+ * hfst::pmatch::word_vectors, unless it's already there
  */
 void read_vec(std::string filename);
 
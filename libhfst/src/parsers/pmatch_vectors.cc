@@ -0,0 +1,481 @@
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+/**
+ * @file pmatch_vectors.cc
+ *
+ * @brief implements word vector searches for pmatch.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include "HfstExceptionDefs.h"
+#include "pmatch_vectors.h"
+#include "implementations/optimized-lookup/transducer.h"
+
+#if defined(__AVX__)
+#  include <immintrin.h>
+#  define HFST_VEC_AVX 1
+#elif defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#  include <xmmintrin.h>
+#  define HFST_VEC_SSE 1
+#endif
+
+namespace hfst { namespace pmatch {
+
+namespace {
+
+const size_t SIGNATURE_BITS = 64;
+
+// Keeps the n best (distance, index) pairs seen so far in a heap with the
+// worst one on top. Comparing pairs, a later index at the same distance
+// is worse, so searches are stable with respect to the order of the model.
+class TopN
+{
+public:
+    typedef std::pair<WordVecFloat, size_t> Entry;
+    TopN(size_t n): n(n) { heap.reserve(n); }
+    void offer(WordVecFloat distance, size_t i)
+        {
+            if (distance != distance || n == 0) {
+                // NaN, from a vector of length 0
+                return;
+            }
+            Entry e(distance, i);
+            if (heap.size() < n) {
+                heap.push_back(e);
+                std::push_heap(heap.begin(), heap.end());
+            } else if (e < heap.front()) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = e;
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    // From the worst to the best
+    std::vector<WordVectorIndex::Neighbour> result(void)
+        {
+            std::sort_heap(heap.begin(), heap.end());
+            std::vector<WordVectorIndex::Neighbour> retval;
+            retval.reserve(heap.size());
+            for (std::vector<Entry>::reverse_iterator it = heap.rbegin();
+                 it != heap.rend(); ++it) {
+                retval.push_back(
+                    WordVectorIndex::Neighbour(it->second, it->first));
+            }
+            return retval;
+        }
+private:
+    size_t n;
+    std::vector<Entry> heap;
+};
+
+// l . r and l . s in one pass over l
+inline void dot2(const WordVecFloat * l, const WordVecFloat * r,
+                 const WordVecFloat * s, size_t length,
+                 WordVecFloat & lr, WordVecFloat & ls)
+{
+    size_t i = 0;
+    lr = 0.0; ls = 0.0;
+#if defined(HFST_VEC_AVX)
+    __m256 acc_r = _mm256_setzero_ps();
+    __m256 acc_s = _mm256_setzero_ps();
+    for (; i + 8 <= length; i += 8) {
+        __m256 x = _mm256_loadu_ps(l + i);
+        acc_r = _mm256_add_ps(acc_r, _mm256_mul_ps(x, _mm256_loadu_ps(r + i)));
+        acc_s = _mm256_add_ps(acc_s, _mm256_mul_ps(x, _mm256_loadu_ps(s + i)));
+    }
+    float sums_r[8], sums_s[8];
+    _mm256_storeu_ps(sums_r, acc_r);
+    _mm256_storeu_ps(sums_s, acc_s);
+    for (size_t j = 0; j < 8; ++j) {
+        lr += sums_r[j];
+        ls += sums_s[j];
+    }
+#elif defined(HFST_VEC_SSE)
+    __m128 acc_r = _mm_setzero_ps();
+    __m128 acc_s = _mm_setzero_ps();
+    for (; i + 4 <= length; i += 4) {
+        __m128 x = _mm_loadu_ps(l + i);
+        acc_r = _mm_add_ps(acc_r, _mm_mul_ps(x, _mm_loadu_ps(r + i)));
+        acc_s = _mm_add_ps(acc_s, _mm_mul_ps(x, _mm_loadu_ps(s + i)));
+    }
+    float sums_r[4], sums_s[4];
+    _mm_storeu_ps(sums_r, acc_r);
+    _mm_storeu_ps(sums_s, acc_s);
+    for (size_t j = 0; j < 4; ++j) {
+        lr += sums_r[j];
+        ls += sums_s[j];
+    }
+#endif
+    for (; i < length; ++i) {
+        lr += l[i] * r[i];
+        ls += l[i] * s[i];
+    }
+}
+
+// The cosine distance of two vectors from their dot product and the
+// product of their norms, or NaN if either has length 0. Nearby vectors
+// can come out slightly negative from rounding error, so the distance is
+// at least 0.
+inline WordVecFloat cosine_distance(double dot_product, double norm_product)
+{
+    if (norm_product == 0.0) {
+        return std::numeric_limits<WordVecFloat>::quiet_NaN();
+    }
+    double distance = 1.0 - dot_product / norm_product;
+    return static_cast<WordVecFloat>(distance < 0.0 ? 0.0 : distance);
+}
+
+inline unsigned int count_set_bits(unsigned long long word)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    unsigned int n = 0;
+    for (; word != 0; word &= word - 1) {
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// A fixed sequence of normally distributed numbers (xorshift64* and
+// Box-Muller), so that the approximate searches are repeatable
+class Gaussians
+{
+public:
+    Gaussians(void): state(0x9E3779B97F4A7C15ULL), have_spare(false) {}
+    WordVecFloat next(void)
+        {
+            if (have_spare) {
+                have_spare = false;
+                return spare;
+            }
+            double u1 = uniform(), u2 = uniform();
+            double r = std::sqrt(-2.0 * std::log(u1));
+            spare = static_cast<WordVecFloat>(r * std::sin(6.283185307179586 * u2));
+            have_spare = true;
+            return static_cast<WordVecFloat>(r * std::cos(6.283185307179586 * u2));
+        }
+private:
+    unsigned long long state;
+    bool have_spare;
+    WordVecFloat spare;
+    // in (0, 1]
+    double uniform(void)
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            unsigned long long r = state * 0x2545F4914F6CDD1DULL;
+            return (static_cast<double>(r >> 11) + 1.0) / 9007199254740992.0;
+        }
+};
+
+struct WordOrder
+{
+    const std::vector<std::string> & words;
+    WordOrder(const std::vector<std::string> & w): words(w) {}
+    bool operator()(size_t l, size_t r) const
+        { return words[l] < words[r]; }
+    bool operator()(size_t l, const std::string & r) const
+        { return words[l] < r; }
+};
+
+}
+
+WordVectorIndex::WordVectorIndex(void):
+    file_size(0), dim(0), stride(0), approximate_candidates(0)
+{}
+
+void WordVectorIndex::clear(void)
+{
+    filename.clear();
+    file_size = 0;
+    dim = 0;
+    stride = 0;
+    words.clear();
+    components.clear();
+    norms.clear();
+    by_word.clear();
+    hyperplanes.clear();
+    signatures.clear();
+}
+
+WordVecFloat WordVectorIndex::dot(const WordVecFloat * l,
+                                  const WordVecFloat * r,
+                                  size_t length)
+{
+    size_t i = 0;
+    WordVecFloat retval = 0.0;
+#if defined(HFST_VEC_AVX)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= length; i += 8) {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(l + i),
+                                               _mm256_loadu_ps(r + i)));
+    }
+    float sums[8];
+    _mm256_storeu_ps(sums, acc);
+    for (size_t j = 0; j < 8; ++j) {
+        retval += sums[j];
+    }
+#elif defined(HFST_VEC_SSE)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= length; i += 4) {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(l + i),
+                                         _mm_loadu_ps(r + i)));
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, acc);
+    for (size_t j = 0; j < 4; ++j) {
+        retval += sums[j];
+    }
+#endif
+    for (; i < length; ++i) {
+        retval += l[i] * r[i];
+    }
+    return retval;
+}
+
+bool WordVectorIndex::read(const std::string & fname)
+{
+    hfst_ol::MappedFile * file;
+    try {
+        file = new hfst_ol::MappedFile(fname);
+    } catch (const StreamNotReadableException &) {
+        return false;
+    }
+    if (fname == filename && file->size() == file_size && size() != 0) {
+        delete file;
+        return true;
+    }
+    clear();
+    const char * p = file->get_data();
+    const char * end = p + file->size();
+    size_t line_count = 0;
+    for (const char * c = p; c < end; ++line_count) {
+        const char * eol = static_cast<const char*>(
+            memchr(c, '\n', end - c));
+        c = (eol == NULL ? end : eol + 1);
+    }
+    words.reserve(line_count);
+    norms.reserve(line_count);
+
+    std::string line;
+    std::vector<WordVecFloat> vec;
+    size_t linenumber = 0;
+    char separator = '\t';
+    while (p < end) {
+        const char * eol = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (eol == NULL) {
+            eol = end;
+        }
+        line.assign(p, eol);
+        p = (eol == end ? end : eol + 1);
+        ++linenumber;
+        if (linenumber == 1) { continue; } // first line is metadata
+        if (line.empty()) { continue; }
+        size_t pos = line.find(separator);
+        if (pos == std::string::npos) {
+            separator = ' ';
+            pos = line.find(separator);
+            if (pos == std::string::npos) {
+                std::cerr << "pmatch warning: vector file " << fname <<
+                    " doesn't appear to be tab- or space-separated\n  (reading line " << linenumber << ")\n";
+                break;
+            }
+        }
+        size_t word_end = pos;
+        // Terminate each field in place for strtof()
+        bool trailing_separator = (line[line.size() - 1] == separator);
+        char * buf = &line[0];
+        vec.clear();
+        size_t nextpos;
+        while (std::string::npos != (nextpos = line.find(separator, pos + 1))) {
+            buf[nextpos] = '\0';
+#if defined _MSC_VER && 1200 <= _MSC_VER
+            vec.push_back((float)strtod(buf + pos + 1, NULL));
+#else
+            vec.push_back(strtof(buf + pos + 1, NULL));
+#endif
+            pos = nextpos;
+        }
+        // there can be one more from pos to the newline if there isn't a
+        // separator at the end
+        if (!trailing_separator) {
+#if defined _MSC_VER && 1200 <= _MSC_VER
+            vec.push_back((float)strtod(buf + pos + 1, NULL));
+#else
+            vec.push_back(strtof(buf + pos + 1, NULL));
+#endif
+        }
+        if (size() != 0 && dim != vec.size()) {
+            std::cerr << "pmatch warning: vector file " << fname <<
+                " appears malformed\n  (reading line " << linenumber << ")\n";
+            continue;
+        }
+        if (size() == 0) {
+            dim = vec.size();
+            stride = (dim + 7) & ~static_cast<size_t>(7);
+            components.reserve(line_count * stride);
+        }
+        add(line.substr(0, word_end), vec);
+    }
+    index_words();
+    filename = fname;
+    file_size = file->size();
+    delete file;
+    return true;
+}
+
+void WordVectorIndex::add(const std::string & w,
+                          const std::vector<WordVecFloat> & v)
+{
+    words.push_back(w);
+    size_t offset = components.size();
+    components.insert(components.end(), v.begin(), v.end());
+    components.resize(offset + stride, 0.0);
+    norms.push_back(std::sqrt(dot(&components[offset],
+                                  &components[offset], stride)));
+}
+
+void WordVectorIndex::index_words(void)
+{
+    by_word.resize(words.size());
+    for (size_t i = 0; i < by_word.size(); ++i) {
+        by_word[i] = i;
+    }
+    // Stable, so that find() gives the first of duplicates
+    std::stable_sort(by_word.begin(), by_word.end(), WordOrder(words));
+}
+
+size_t WordVectorIndex::find(const std::string & w) const
+{
+    std::vector<size_t>::const_iterator it =
+        std::lower_bound(by_word.begin(), by_word.end(), w, WordOrder(words));
+    if (it == by_word.end() || words[*it] != w) {
+        return size();
+    }
+    return *it;
+}
+
+std::vector<WordVecFloat> WordVectorIndex::padded(
+    const WordVecFloat * point) const
+{
+    std::vector<WordVecFloat> retval(stride, 0.0);
+    std::copy(point, point + dim, retval.begin());
+    return retval;
+}
+
+void WordVectorIndex::compute_signatures(void) const
+{
+    Gaussians gaussians;
+    hyperplanes.assign(SIGNATURE_BITS * stride, 0.0);
+    for (size_t b = 0; b < SIGNATURE_BITS; ++b) {
+        for (size_t i = 0; i < dim; ++i) {
+            hyperplanes[b * stride + i] = gaussians.next();
+        }
+    }
+    signatures.resize(size());
+    for (size_t i = 0; i < size(); ++i) {
+        signatures[i] = signature(vector(i));
+    }
+}
+
+WordVectorIndex::Signature WordVectorIndex::signature(
+    const WordVecFloat * padded_point) const
+{
+    Signature retval = 0;
+    for (size_t b = 0; b < SIGNATURE_BITS; ++b) {
+        if (dot(padded_point, &hyperplanes[b * stride], stride) > 0.0) {
+            retval |= (static_cast<Signature>(1) << b);
+        }
+    }
+    return retval;
+}
+
+std::vector<WordVectorIndex::Neighbour> WordVectorIndex::nearest(
+    const WordVecFloat * point, size_t n) const
+{
+    std::vector<WordVecFloat> p = padded(point);
+    WordVecFloat point_norm = std::sqrt(dot(&p[0], &p[0], stride));
+    TopN top(n);
+    if (approximate_candidates == 0 || approximate_candidates >= size()) {
+        for (size_t i = 0; i < size(); ++i) {
+            top.offer(cosine_distance(dot(vector(i), &p[0], stride),
+                                      norms[i] * point_norm), i);
+        }
+        return top.result();
+    }
+    if (signatures.size() != size()) {
+        compute_signatures();
+    }
+    Signature point_signature = signature(&p[0]);
+    std::vector<std::pair<unsigned int, size_t> > candidates(size());
+    for (size_t i = 0; i < size(); ++i) {
+        candidates[i] = std::pair<unsigned int, size_t>(
+            count_set_bits(signatures[i] ^ point_signature), i);
+    }
+    std::nth_element(candidates.begin(),
+                     candidates.begin() + approximate_candidates,
+                     candidates.end());
+    for (size_t c = 0; c < approximate_candidates; ++c) {
+        size_t i = candidates[c].second;
+        top.offer(cosine_distance(dot(vector(i), &p[0], stride),
+                                  norms[i] * point_norm), i);
+    }
+    return top.result();
+}
+
+std::vector<WordVectorIndex::Neighbour> WordVectorIndex::nearest_transformed(
+    const WordVecFloat * point,
+    const WordVecFloat * plane,
+    WordVecFloat translation_term,
+    WordVecFloat factor,
+    bool negative,
+    size_t n) const
+{
+    std::vector<WordVecFloat> c = padded(point);
+    std::vector<WordVecFloat> pl = padded(plane);
+    double plane_square_sum = dot(&pl[0], &pl[0], stride);
+    double plane_dot_point = dot(&pl[0], &c[0], stride);
+    double point_norm = std::sqrt(dot(&c[0], &c[0], stride));
+    double sign = negative ? -1.0 : 1.0;
+    TopN top(n);
+    for (size_t i = 0; i < size(); ++i) {
+        /*
+         * Given a plane "plane . x = translation_term" and a vector v, the
+         * multiple s of plane which goes from v to the nearest point in
+         * the plane is (translation_term - v . plane) / |plane|^2. The
+         * transformed vector v' = v +- factor * s * plane isn't built;
+         * v' . point and |v'| follow from v . plane and v . point.
+         */
+        WordVecFloat v_dot_plane, v_dot_point;
+        dot2(vector(i), &pl[0], &c[0], stride, v_dot_plane, v_dot_point);
+        double s = sign * factor * (translation_term - v_dot_plane)
+            / plane_square_sum;
+        double transformed_dot_point = v_dot_point + s * plane_dot_point;
+        double transformed_square_sum =
+            static_cast<double>(norms[i]) * norms[i]
+            + 2.0 * s * v_dot_plane + s * s * plane_square_sum;
+        double transformed_norm =
+            std::sqrt(std::max(0.0, transformed_square_sum));
+        top.offer(cosine_distance(transformed_dot_point,
+                                  transformed_norm * point_norm), i);
+    }
+    return top.result();
+}
+
+} }
@@ -0,0 +1,142 @@
+// Copyright (c) 2016 University of Helsinki
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3 of the License, or (at your option) any later version.
+// See the file COPYING included with this distribution for more
+// information.
+
+/**
+ * @file pmatch_vectors.h
+ *
+ * @brief Nearest neighbour searches in word vector models for the
+ * Like() and Unlike() operations of pmatch.
+ */
+
+#ifndef GUARD_pmatch_vectors_h
+#define GUARD_pmatch_vectors_h
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+namespace hfst { namespace pmatch {
+
+typedef float WordVecFloat;
+
+/**
+ * @brief A word vector model, stored for finding the nearest neighbours
+ * of a point by cosine distance.
+ *
+ * The vectors are kept one after another in one array, padded with zeros
+ * to a multiple of 8 components, so that dot products are computed with
+ * SIMD instructions where the compiler targets them. By default a search
+ * goes through all the vectors. With set_approximate_candidates(), a
+ * search first picks that many candidates by comparing 64-bit random
+ * projection signatures and only ranks those exactly.
+ */
+class WordVectorIndex
+{
+public:
+    /** A word, as an index into the model, and its distance to the point
+        searched for */
+    typedef std::pair<size_t, WordVecFloat> Neighbour;
+
+    WordVectorIndex(void);
+
+    /**
+     * @brief Read a model in the word2vec text format: a line of
+     * metadata, then a word and its components on each line, separated
+     * by tabs or spaces. Earlier contents are discarded, unless they were
+     * read from the same file, of the same size, in which case the file
+     * isn't parsed again.
+     *
+     * Returns false if the file can't be read. Malformed lines are
+     * skipped with a warning.
+     */
+    bool read(const std::string & filename);
+    void clear(void);
+    size_t size(void) const { return words.size(); }
+    size_t dimension(void) const { return dim; }
+    /** The file the model was read from, or "" */
+    const std::string & get_filename(void) const { return filename; }
+
+    const std::string & word(size_t i) const { return words[i]; }
+    const WordVecFloat * vector(size_t i) const
+        { return &components[i * stride]; }
+    WordVecFloat norm(size_t i) const { return norms[i]; }
+    /** The index of \a w, or size() if it's not in the model */
+    size_t find(const std::string & w) const;
+
+    /**
+     * @brief Search approximately, ranking only the \a n vectors whose
+     * random projection signatures are closest to the point's. 0, the
+     * default, means an exact search.
+     *
+     * The signatures are computed on the first approximate search, which
+     * costs about as much as 64 exact searches.
+     */
+    void set_approximate_candidates(size_t n) { approximate_candidates = n; }
+    size_t get_approximate_candidates(void) const
+        { return approximate_candidates; }
+
+    /**
+     * @brief The \a n vectors nearest to \a point, which has dimension()
+     * components, by cosine distance.
+     *
+     * The result is ordered from the most distant to the nearest. Of
+     * vectors at the same distance, the one earlier in the model wins.
+     */
+    std::vector<Neighbour> nearest(const WordVecFloat * point,
+                                   size_t n) const;
+
+    /**
+     * @brief Like nearest(), but each vector v is first moved towards
+     * the hyperplane {x : x . \a plane = \a translation_term} by
+     * \a factor times its distance to it (or as far away, if
+     * \a negative). Always searches exactly.
+     */
+    std::vector<Neighbour> nearest_transformed(
+        const WordVecFloat * point,
+        const WordVecFloat * plane,
+        WordVecFloat translation_term,
+        WordVecFloat factor,
+        bool negative,
+        size_t n) const;
+
+    /** The dot product of \a l and \a r, of \a length components */
+    static WordVecFloat dot(const WordVecFloat * l, const WordVecFloat * r,
+                            size_t length);
+
+protected:
+    typedef unsigned long long Signature;
+
+    std::string filename;
+    size_t file_size;
+    size_t dim;
+    // dim rounded up to a multiple of 8
+    size_t stride;
+    std::vector<std::string> words;
+    std::vector<WordVecFloat> components;
+    std::vector<WordVecFloat> norms;
+    // Model indices sorted by word, for find()
+    std::vector<size_t> by_word;
+
+    size_t approximate_candidates;
+    // The random hyperplanes, 64 of them one after another, and for each
+    // vector the sides of them it's on
+    mutable std::vector<WordVecFloat> hyperplanes;
+    mutable std::vector<Signature> signatures;
+
+    void add(const std::string & w, const std::vector<WordVecFloat> & v);
+    void index_words(void);
+    std::vector<WordVecFloat> padded(const WordVecFloat * point) const;
+    void compute_signatures(void) const;
+    Signature signature(const WordVecFloat * padded_point) const;
+};
+
+} }
+
+#endif // GUARD_pmatch_vectors_h
@@ -206,6 +206,7 @@ libhfst_source_files = ["libhfst/src/parsers/XfstCompiler" + cpp,
                         "libhfst/src/string-utils" + cpp,
                         "libhfst/src/implementations/HfstBasicTransducer" + cpp,
                         "libhfst/src/implementations/HfstBasicTransition" + cpp,
+                        "libhfst/src/implementations/HfstCompactBasicTransducer" + cpp,
                         "libhfst/src/implementations/ConvertTransducerFormat" + cpp,
                         "libhfst/src/implementations/HfstTropicalTransducerTransitionData" + cpp,
                         "libhfst/src/implementations/ConvertTropicalWeightTransducer" + cpp,
@@ -224,6 +225,7 @@ libhfst_source_files = ["libhfst/src/parsers/XfstCompiler" + cpp,
                         "libhfst/src/implementations/optimized-lookup/transducer" + cpp,
                         "libhfst/src/implementations/optimized-lookup/convert" + cpp,
                         "libhfst/src/implementations/optimized-lookup/ospell" + cpp,
+                        "libhfst/src/implementations/optimized-lookup/ospell_batch" + cpp,
                         "libhfst/src/implementations/optimized-lookup/pmatch" + cpp,
                         "libhfst/src/implementations/optimized-lookup/find_epsilon_loops" + cpp,
                         "libhfst/src/parsers/xre_lex" + cpp,
@@ -239,6 +241,7 @@ libhfst_source_files = ["libhfst/src/parsers/XfstCompiler" + cpp,
                         "libhfst/src/parsers/XreCompiler" + cpp,
                         "libhfst/src/parsers/lexc-utils" + cpp,
                         "libhfst/src/parsers/pmatch_utils" + cpp,
+                        "libhfst/src/parsers/pmatch_vectors" + cpp,
                         "libhfst/src/parsers/xre_utils" + cpp,
                         "libhfst/src/parsers/xfst-utils" + cpp,
                         "libhfst/src/parsers/xfst_help_message" + cpp,
@@ -157,6 +157,7 @@ done
 for file in \
 ConvertTransducerFormat.h FomaTransducer.h \
 HfstOlTransducer.h HfstBasicTransition.h HfstBasicTransducer.h \
+HfstCompactBasicTransducer.h HfstTransducerTraversal.h \
 HfstTropicalTransducerTransitionData.h LogWeightTransducer.h \
 TropicalWeightTransducer.h;
 do
@@ -166,7 +167,8 @@ done
 for file in \
 ConvertFomaTransducer ConvertLogWeightTransducer ConvertOlTransducer \
 ConvertTransducerFormat ConvertTropicalWeightTransducer FomaTransducer \
-HfstOlTransducer HfstBasicTransducer HfstBasicTransition HfstTropicalTransducerTransitionData \
+HfstOlTransducer HfstBasicTransducer HfstBasicTransition HfstCompactBasicTransducer \
+HfstTropicalTransducerTransitionData \
 LogWeightTransducer TropicalWeightTransducer;
 do
     cp libhfst/src/implementations/$file.cc $1/libhfst/src/implementations/$file.cpp
@@ -185,7 +187,7 @@ done
 
 # implementations/optimized-lookup
 for file in \
-convert pmatch transducer;
+convert pmatch transducer ospell_batch;
 do
     cp libhfst/src/implementations/optimized-lookup/$file.cc \
         $1/libhfst/src/implementations/optimized-lookup/$file.cpp
@@ -198,12 +200,18 @@ do
     cp libhfst/src/implementations/optimized-lookup/$file.cc \
         $1/libhfst/src/implementations/optimized-lookup/$file.cpp
 done
+for file in \
+lookup_cache letter_trie pmatch_tokenize_binary;
+do
+    cp libhfst/src/implementations/optimized-lookup/$file.h \
+        $1/libhfst/src/implementations/optimized-lookup/$file.h
+done
 
 # libhfst/src/parsers
 for file in \
 LexcCompiler PmatchCompiler XreCompiler XfstCompiler xfst_help_message \
 TwolcCompiler \
-lexc-utils pmatch_utils xre_utils xfst-utils SfstCompiler SfstAlphabet SfstBasic SfstUtf8;
+lexc-utils pmatch_utils pmatch_vectors xre_utils xfst-utils SfstCompiler SfstAlphabet SfstBasic SfstUtf8;
 do
     cp libhfst/src/parsers/$file.cc \
         $1/libhfst/src/parsers/$file.cpp
@@ -366,14 +374,15 @@ done
 
 # hfst-proc
 for file in \
-hfst-proc formatter lookup-path lookup-state tokenizer transducer applicators alphabet;
+hfst-proc formatter lookup-path lookup-state tokenizer transducer applicators alphabet \
+parallel;
 do
     cp tools/src/hfst-proc/$file.cc $1/tools/src/hfst-proc/$file.cpp
 done
 
 for file in \
 hfst-proc.h formatter.h lookup-path.h lookup-state.h tokenizer.h \
-transducer.h buffer.h applicators.h alphabet.h;
+transducer.h buffer.h applicators.h alphabet.h parallel.h;
 do
     cp tools/src/hfst-proc/$file $1/tools/src/hfst-proc/
 done
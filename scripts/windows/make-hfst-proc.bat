@@ -36,6 +36,7 @@ cl /EHsc /Zc:wchar_t /Fehfst-proc.exe ^
 ..\..\tools\src\hfst-proc\_transducer.cpp ^
 ..\..\tools\src\hfst-proc\applicators.cpp ^
 ..\..\tools\src\hfst-proc\alphabet.cpp ^
+..\..\tools\src\hfst-proc\parallel.cpp ^
 HfstApply.cpp ^
 HfstInputStream.cpp ^
 HfstTransducer.cpp ^
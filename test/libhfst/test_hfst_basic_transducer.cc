@@ -5,7 +5,10 @@
    for HfstBasicTransducer.
 */
 
+#include <sstream>
+
 #include "HfstTransducer.h"
+#include "implementations/HfstCompactBasicTransducer.h"
 #include "auxiliary_functions.cc"
 
 using namespace hfst;
@@ -14,6 +17,49 @@ using namespace hfst;
 using implementations::HfstState;
 using implementations::HfstBasicTransition;
 using implementations::HfstBasicTransducer;
+using implementations::HfstCompactBasicTransducer;
+using implementations::HfstTropicalTransducerTransitionData;
+
+/* The transitions of \a t as (source, target, input, output, weight)
+   lines, for comparing transducers built in different ways */
+std::set<std::string> transition_lines(const HfstBasicTransducer & t)
+{
+  std::set<std::string> lines;
+  for (HfstState s = 0; s <= t.get_max_state(); s++)
+    {
+      const implementations::HfstBasicTransitions & transitions = t[s];
+      for (implementations::HfstBasicTransitions::const_iterator it
+             = transitions.begin(); it != transitions.end(); it++)
+        {
+          std::ostringstream line;
+          line << s << "\t" << it->get_target_state() << "\t"
+               << it->get_input_symbol() << "\t" << it->get_output_symbol()
+               << "\t" << it->get_weight();
+          lines.insert(line.str());
+        }
+    }
+  return lines;
+}
+
+/* \a paths with their symbol ids written as strings */
+HfstTwoLevelPaths id_paths_to_strings(const HfstTwoLevelIdPaths & paths)
+{
+  HfstTwoLevelPaths result;
+  for (HfstTwoLevelIdPaths::const_iterator it = paths.begin();
+       it != paths.end(); it++)
+    {
+      StringPairVector spv;
+      for (SymbolIdPairVector::const_iterator pair = it->second.begin();
+           pair != it->second.end(); pair++)
+        spv.push_back
+          (StringPair(HfstTropicalTransducerTransitionData::get_symbol_string
+                      (pair->first),
+                      HfstTropicalTransducerTransitionData::get_symbol_string
+                      (pair->second)));
+      result.insert(HfstTwoLevelPath(it->first, spv));
+    }
+  return result;
+}
 
 
 int main(int argc, char **argv)
@@ -152,6 +198,258 @@ int main(int argc, char **argv)
   }
 
 
+  verbose_print("HfstCompactBasicTransducer");
+
+  {
+    /* An empty compact transducer has one non-final state. */
+    HfstCompactBasicTransducer empty;
+    assert(empty.get_number_of_states() == 1);
+    assert(empty.get_number_of_transitions() == 0);
+    assert(not empty.is_final_state(0));
+
+    /* [a:b c:d] | [a:b e* c:d], with a loop */
+    HfstBasicTransducer basic(tc);
+    HfstState s3 = basic.add_state();
+    basic.add_transition(0, HfstBasicTransition(s3, "a", "b", 0.5));
+    basic.add_transition(s3, HfstBasicTransition(s3, "e", "e", 0.25));
+    basic.add_transition(s3, HfstBasicTransition(s2, "c", "d", 0));
+
+    HfstCompactBasicTransducer compact(basic);
+    assert(compact.get_number_of_states() == basic.get_max_state() + 1);
+    assert(compact.get_number_of_transitions() == 5);
+    assert(not compact.is_final_state(0) && compact.is_final_state(s2));
+    assert(compact.get_final_weight(s2) == 1.0);
+    try {
+      float w = compact.get_final_weight(s3);
+      (void)w;
+      assert(false);
+    }
+    catch (const HfstException e) {};
+
+    /* Lookup gives the same results as in the mutable transducer. */
+    const char * inputs[] = { "ac", "aeec", "ae", "", "ax", NULL };
+    const size_t result_counts[] = { 2, 1, 0, 0, 0 };
+    for (unsigned int i = 0; inputs[i] != NULL; i++)
+      {
+        StringVector input;
+        for (const char * c = inputs[i]; *c != '\0'; c++)
+          input.push_back(std::string(1, *c));
+        HfstTwoLevelPaths basic_results;
+        HfstTwoLevelPaths compact_results;
+        basic.lookup(input, basic_results);
+        compact.lookup(input, compact_results);
+        assert(basic_results == compact_results);
+        assert(compact_results.size() == result_counts[i]);
+      }
+
+    /* Converting back gives the same transducer. */
+    HfstBasicTransducer thawed(compact);
+    assert(thawed.get_max_state() == basic.get_max_state());
+    HfstCompactBasicTransducer refrozen(thawed);
+    assert(refrozen.get_number_of_transitions() == 5);
+    if (HfstTransducer::is_implementation_type_available
+        (TROPICAL_OPENFST_TYPE))
+      {
+        HfstTransducer original(basic, TROPICAL_OPENFST_TYPE);
+        HfstTransducer copy(thawed, TROPICAL_OPENFST_TYPE);
+        assert(original.compare(copy));
+      }
+  }
+
+
+  verbose_print("HfstBasicTransducer: symbol ids");
+
+  {
+    typedef HfstTropicalTransducerTransitionData Data;
+    assert(Data::get_symbol_id("@_EPSILON_SYMBOL_@") == EPSILON_SYMBOL_ID);
+    assert(Data::get_symbol_id("@_UNKNOWN_SYMBOL_@") == UNKNOWN_SYMBOL_ID);
+    assert(Data::get_symbol_id("@_IDENTITY_SYMBOL_@") == IDENTITY_SYMBOL_ID);
+
+    /* [ a:b | ?:? | ?:x | 0:c a ] [ @P.F.X@ [ @R.F.X@ | @D.F.X@ ] b ]*,
+       built once with strings and once with ids. */
+    const char * transitions[][5] = {
+      { "0", "1", "a", "b", "1" },
+      { "0", "1", "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@", "0.5" },
+      { "0", "1", "@_UNKNOWN_SYMBOL_@", "x", "0.25" },
+      { "0", "2", "@_EPSILON_SYMBOL_@", "c", "0" },
+      { "2", "1", "a", "a", "0" },
+      { "1", "3", "@P.F.X@", "@P.F.X@", "0" },
+      { "3", "4", "@R.F.X@", "@R.F.X@", "0" },
+      { "3", "4", "@D.F.X@", "@D.F.X@", "0" },
+      { "4", "1", "b", "b", "2" } };
+    HfstBasicTransducer by_strings;
+    HfstBasicTransducer by_ids;
+    for (unsigned int i = 0; i < sizeof(transitions) / sizeof(transitions[0]);
+         i++)
+      {
+        HfstState source = atoi(transitions[i][0]);
+        HfstState target = atoi(transitions[i][1]);
+        float weight = (float) atof(transitions[i][4]);
+        by_strings.add_transition
+          (source, HfstBasicTransition(target, transitions[i][2],
+                                       transitions[i][3], weight));
+        by_ids.add_transition(source, target,
+                              Data::get_symbol_id(transitions[i][2]),
+                              Data::get_symbol_id(transitions[i][3]),
+                              weight);
+      }
+    by_strings.set_final_weight(1, 0);
+    by_ids.set_final_weight(1, 0);
+    assert(transition_lines(by_ids) == transition_lines(by_strings));
+    assert(by_ids.get_alphabet() == by_strings.get_alphabet());
+
+    /* The ids of the alphabet and of the transition pairs are those of
+       the strings. */
+    SymbolIdSet alphabet_ids = by_ids.get_alphabet_ids();
+    StringSet alphabet_strings;
+    for (SymbolIdSet::const_iterator it = alphabet_ids.begin();
+         it != alphabet_ids.end(); it++)
+      alphabet_strings.insert(Data::get_symbol_string(*it));
+    assert(alphabet_strings == by_strings.get_alphabet());
+    SymbolIdPairSet id_pairs = by_ids.get_transition_id_pairs();
+    StringPairSet string_pairs;
+    for (SymbolIdPairSet::const_iterator it = id_pairs.begin();
+         it != id_pairs.end(); it++)
+      string_pairs.insert(StringPair(Data::get_symbol_string(it->first),
+                                     Data::get_symbol_string(it->second)));
+    assert(string_pairs == by_strings.get_transition_pairs());
+
+    /* The lookup tables know the alphabet and the flag diacritics. */
+    HfstBasicTransducer::IdLookupTables tables;
+    HfstBasicTransducer::build_id_lookup_tables(by_ids.get_alphabet(), tables);
+    for (SymbolId id = 0; id <= Data::get_max_number(); id++)
+      {
+        const std::string & symbol = Data::get_symbol_string(id);
+        assert(tables.in_alphabet_id(id) ==
+               (by_ids.get_alphabet().count(symbol) == 1));
+        assert(tables.is_flag_id(id) ==
+               (symbol == "@P.F.X@" || symbol == "@R.F.X@" ||
+                symbol == "@D.F.X@"));
+      }
+    assert(not tables.in_alphabet_id(Data::get_max_number() + 1));
+    assert(not tables.is_flag_id(Data::get_max_number() + 1));
+
+    /* Looking up strings and ids gives the same paths, and a symbol
+       that has never been seen is matched by ?:? and ?:x without giving
+       it an id. */
+    const char * unseen = "symbol-never-seen-before";
+    const char * inputs[][4] = {
+      { NULL }, { "a", NULL }, { "b", NULL }, { "z", NULL },
+      { "a", "b", NULL }, { "z", "b", "b", NULL }, { unseen, NULL },
+      { "@P.F.X@", NULL } };
+    const size_t counts[][2] = { { 0, 0 }, { 2, 2 }, { 0, 0 }, { 2, 2 },
+                                 { 4, 2 }, { 8, 2 }, { 2, 2 }, { 0, 0 } };
+    SymbolId unseen_id = 0;
+    {
+      HfstTwoLevelPaths results;
+      by_strings.lookup(StringVector(1, unseen), results);
+      assert(results.size() == 2);
+      for (HfstTwoLevelPaths::const_iterator it = results.begin();
+           it != results.end(); it++)
+        assert(it->second[0].first == unseen);
+      assert(not Data::find_symbol_id(unseen, unseen_id));
+    }
+    for (unsigned int i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++)
+      for (unsigned int obey_flags = 0; obey_flags < 2; obey_flags++)
+        {
+          StringVector input;
+          for (unsigned int k = 0; inputs[i][k] != NULL; k++)
+            input.push_back(inputs[i][k]);
+          HfstTwoLevelPaths string_results;
+          by_strings.lookup(input, string_results, NULL, NULL,
+                            obey_flags == 1);
+          assert(string_results.size() == counts[i][obey_flags]);
+
+          SymbolIdVector id_input;
+          for (unsigned int k = 0; k < input.size(); k++)
+            id_input.push_back(Data::get_symbol_id(input[k]));
+          HfstTwoLevelIdPaths id_results;
+          by_ids.lookup(id_input, id_results, NULL, NULL, obey_flags == 1);
+          assert(id_paths_to_strings(id_results) == string_results);
+        }
+
+    /* Both overloads of is_possible_transition agree on every transition
+       at every position of the inputs. */
+    StringSet alphabet = by_strings.get_alphabet();
+    for (HfstState s = 0; s <= by_strings.get_max_state(); s++)
+      {
+        const implementations::HfstBasicTransitions & state_transitions
+          = by_strings[s];
+        for (implementations::HfstBasicTransitions::const_iterator it
+               = state_transitions.begin(); it != state_transitions.end();
+             it++)
+          for (unsigned int i = 0; i < sizeof(inputs) / sizeof(inputs[0]);
+               i++)
+            {
+              StringVector input;
+              SymbolIdVector id_input;
+              for (unsigned int k = 0; inputs[i][k] != NULL; k++)
+                {
+                  input.push_back(inputs[i][k]);
+                  id_input.push_back(Data::get_symbol_id(inputs[i][k]));
+                }
+              for (unsigned int k = 0; k <= input.size(); k++)
+                {
+                  StringVector fds(1, "@P.F.X@");
+                  bool string_consumed = false;
+                  bool id_consumed = false;
+                  assert(HfstBasicTransducer::is_possible_transition
+                         (*it, input, k, alphabet, string_consumed, &fds) ==
+                         by_ids.is_possible_transition
+                         (*it, id_input, k, tables, id_consumed, &fds));
+                  assert(string_consumed == id_consumed);
+                }
+            }
+      }
+
+    /* Substituting ids does what substituting their strings does. */
+    HfstBasicTransducer strings_substituted(by_strings);
+    HfstBasicTransducer ids_substituted(by_ids);
+    strings_substituted.substitute("a", "q");
+    ids_substituted.substitute(Data::get_symbol_id("a"),
+                               Data::get_symbol_id("q"));
+    assert(transition_lines(ids_substituted) ==
+           transition_lines(strings_substituted));
+    strings_substituted.substitute("b", "r", false, true);
+    ids_substituted.substitute(Data::get_symbol_id("b"),
+                               Data::get_symbol_id("r"), false, true);
+    assert(transition_lines(ids_substituted) ==
+           transition_lines(strings_substituted));
+    assert(ids_substituted.get_alphabet() ==
+           strings_substituted.get_alphabet());
+
+    HfstSymbolSubstitutions symbol_map;
+    SymbolIdSubstitutions id_map;
+    symbol_map["q"] = "a";
+    symbol_map["x"] = "y";
+    for (HfstSymbolSubstitutions::const_iterator it = symbol_map.begin();
+         it != symbol_map.end(); it++)
+      id_map[Data::get_symbol_id(it->first)] =
+        Data::get_symbol_id(it->second);
+    strings_substituted.substitute_symbols(symbol_map);
+    ids_substituted.substitute(id_map);
+    assert(transition_lines(ids_substituted) ==
+           transition_lines(strings_substituted));
+
+    HfstSymbolPairSubstitutions pair_map;
+    SymbolIdPairSubstitutions id_pair_map;
+    pair_map[StringPair("a", "b")] = StringPair("s", "t");
+    pair_map[StringPair("@_UNKNOWN_SYMBOL_@", "y")] =
+      StringPair("@_UNKNOWN_SYMBOL_@", "u");
+    for (HfstSymbolPairSubstitutions::const_iterator it = pair_map.begin();
+         it != pair_map.end(); it++)
+      id_pair_map[SymbolIdPair(Data::get_symbol_id(it->first.first),
+                               Data::get_symbol_id(it->first.second))] =
+        SymbolIdPair(Data::get_symbol_id(it->second.first),
+                     Data::get_symbol_id(it->second.second));
+    strings_substituted.substitute_symbol_pairs(pair_map);
+    ids_substituted.substitute(id_pair_map);
+    assert(transition_lines(ids_substituted) ==
+           transition_lines(strings_substituted));
+    assert(transition_lines(ids_substituted) != transition_lines(by_ids));
+  }
+
+
   verbose_print("HfstBasicTransducer: iterating through");
 
   {
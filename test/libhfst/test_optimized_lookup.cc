@@ -0,0 +1,848 @@
+/*
+   Test file for optimized-lookup transducers (hfst_ol::Transducer):
+   reading them, looking up strings in them and the tables they are
+   made of.
+*/
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include "HfstTransducer.h"
+#include "HfstInputStream.h"
+#include "HfstOutputStream.h"
+#include "implementations/ConvertTransducerFormat.h"
+#include "implementations/optimized-lookup/transducer.h"
+#include "implementations/optimized-lookup/convert.h"
+#include "auxiliary_functions.cc"
+
+using namespace hfst;
+
+using implementations::HfstState;
+using implementations::HfstBasicTransition;
+using implementations::HfstBasicTransducer;
+using implementations::ConversionFunctions;
+
+/* A transducer that maps each of \a words to itself followed by \a tag,
+   with weights that grow with the position of the word in the list */
+HfstBasicTransducer analyser(const char ** words, const std::string & tag)
+{
+  HfstBasicTransducer t;
+  for (unsigned int i = 0; words[i] != NULL; i++)
+    {
+      HfstState state = 0;
+      for (const char * c = words[i]; *c != '\0'; c++)
+        {
+          HfstState target = t.add_state();
+          std::string symbol(1, *c);
+          t.add_transition(state, HfstBasicTransition(target, symbol, symbol,
+                                                      0));
+          state = target;
+        }
+      HfstState last = t.add_state();
+      t.add_transition(state, HfstBasicTransition
+                       (last, "@_EPSILON_SYMBOL_@", tag, 0.5 * i));
+      t.set_final_weight(last, 0.25);
+    }
+  return t;
+}
+
+/* The results of looking up each of \a inputs in \a t */
+std::vector<HfstOneLevelPaths> lookup_all(hfst_ol::Transducer * t,
+                                          const char ** inputs)
+{
+  std::vector<HfstOneLevelPaths> results;
+  for (unsigned int i = 0; inputs[i] != NULL; i++)
+    {
+      HfstOneLevelPaths * paths = t->lookup_fd(std::string(inputs[i]));
+      results.push_back(*paths);
+      delete paths;
+    }
+  return results;
+}
+
+/* The output strings of \a paths, which it deletes */
+std::set<std::string> outputs(HfstOneLevelPaths * paths)
+{
+  std::set<std::string> strings;
+  for (HfstOneLevelPaths::const_iterator it = paths->begin();
+       it != paths->end(); it++)
+    {
+      std::string output;
+      for (StringVector::const_iterator sym = it->second.begin();
+           sym != it->second.end(); sym++)
+        output += *sym;
+      strings.insert(output);
+    }
+  delete paths;
+  return strings;
+}
+
+/* An optimized-lookup transducer that keeps its tables as arrays of
+   whole entries, the way they are stored on disk, instead of an array
+   for each field */
+class EntryTableTransducer : public hfst_ol::Transducer
+{
+ public:
+  template <class T1, class T2>
+    EntryTableTransducer(const hfst_ol::Transducer & t,
+                         const hfst_ol::TransducerTable<T1> & index_table,
+                         const hfst_ol::TransducerTable<T2> & transition_table):
+  hfst_ol::Transducer(t.get_header(), t.get_alphabet(),
+                      index_table, transition_table)
+  {
+    delete tables;
+    tables = new hfst_ol::TransducerTables<T1, T2>
+      (index_table, transition_table);
+  }
+};
+
+/* Check that SoaTransducerTables built from \a index_table and
+   \a transition_table give the same entries as TransducerTables, and
+   that they find the same runs of input symbols as a plain count. */
+template <class T1, class T2>
+void compare_tables(const hfst_ol::TransducerTable<T1> & index_table,
+                    const hfst_ol::TransducerTable<T2> & transition_table)
+{
+  hfst_ol::SoaTransducerTables<T1, T2> soa(index_table, transition_table);
+  hfst_ol::TransducerTables<T1, T2> aos(index_table, transition_table);
+  for (hfst_ol::TransitionTableIndex i = 0; i < index_table.size(); i++)
+    {
+      assert(soa.get_index_input(i) == aos.get_index_input(i));
+      assert(soa.get_index_target(i) == aos.get_index_target(i));
+      assert(soa.get_index_finality(i) == aos.get_index_finality(i));
+      if (aos.get_index_finality(i))
+        assert(soa.get_final_weight(i) == aos.get_final_weight(i));
+    }
+  hfst_ol::TransitionTableIndex size = transition_table.size();
+  for (hfst_ol::TransitionTableIndex i = 0; i < size; i++)
+    {
+      hfst_ol::TransitionTableIndex t =
+        i + hfst_ol::TRANSITION_TARGET_TABLE_START;
+      assert(soa.get_transition_input(t) == aos.get_transition_input(t));
+      assert(soa.get_transition_output(t) == aos.get_transition_output(t));
+      assert(soa.get_transition_target(t) == aos.get_transition_target(t));
+      assert(soa.get_transition_finality(t)
+             == aos.get_transition_finality(t));
+      assert(soa.get_weight(t) == aos.get_weight(t));
+      hfst_ol::SymbolNumber input = aos.get_transition_input(t);
+      if (input == hfst_ol::NO_SYMBOL_NUMBER)
+        continue;
+      hfst_ol::TransitionTableIndex run = 0;
+      while (i + run < size && aos.get_transition_input(t + run) == input)
+        run++;
+      assert(soa.get_transition_run_length(t, input) == run);
+      assert(soa.get_transition_run_length(t, input + 1) == 0);
+    }
+}
+
+/* The starting indices that the packer gave \a states before it kept a
+   bitmap of the used indices: it tried every index from the floor on in
+   turn, and moved the floor one index at a time. Returns the number of
+   indices used, including unused ones below the greatest. */
+unsigned int place_states_one_by_one
+(std::vector<hfst_ol::StatePlaceholder> const & states,
+ std::vector<unsigned int> const & order,
+ std::set<hfst_ol::SymbolNumber> const & flag_symbols,
+ hfst_ol::SymbolNumber input_symbols,
+ hfst_ol::PackingParameters const & packing,
+ std::vector<unsigned int> & starts)
+{
+  std::vector<bool> used;
+  starts.assign(states.size(), UINT_MAX);
+  unsigned int first_available_index = 0;
+  unsigned int previous_first_index = 0;
+  unsigned int previous_successful_index = 0;
+  int floor_stuck_counter = 0;
+  for (size_t k = 0; k < order.size(); k++)
+    {
+      const hfst_ol::StatePlaceholder & state = states[order[k]];
+      std::vector<unsigned int> offsets(1, 0);
+      for (size_t t = 0; t < state.transition_placeholders.size(); t++)
+        {
+          hfst_ol::SymbolNumber input =
+            state.transition_placeholders[t][0].input;
+          offsets.push_back(flag_symbols.count(input) != 0 ? 1 : input + 1);
+        }
+      unsigned int i = first_available_index;
+      while (true)
+        {
+          bool fits = true;
+          for (size_t o = 0; o < offsets.size(); o++)
+            if (i + offsets[o] < used.size() && used[i + offsets[o]])
+              fits = false;
+          if (fits)
+            break;
+          i++;
+        }
+      starts[order[k]] = i;
+      previous_successful_index = i;
+      for (size_t o = 0; o < offsets.size(); o++)
+        {
+          if (i + offsets[o] >= used.size())
+            used.resize(i + offsets[o] + 1, false);
+          used[i + offsets[o]] = true;
+        }
+
+      while (true)
+        {
+          unsigned int index = first_available_index;
+          bool unsuitable = index < used.size() && used[index];
+          unsigned int filled = 0;
+          for (unsigned int n = 0; !unsuitable && n < input_symbols; n++)
+            {
+              if (index + n + 1 < used.size() && used[index + n + 1])
+                filled++;
+              if (filled >= packing.packing_aggression * input_symbols)
+                unsuitable = true;
+            }
+          if (!unsuitable)
+            break;
+          first_available_index++;
+        }
+      if (first_available_index == previous_first_index)
+        {
+          if (floor_stuck_counter > packing.floor_jump_threshold)
+            {
+              first_available_index = previous_successful_index + 1;
+              floor_stuck_counter = 0;
+              previous_first_index = first_available_index;
+            }
+          else
+            floor_stuck_counter++;
+        }
+      else
+        {
+          previous_first_index = first_available_index;
+          floor_stuck_counter = 0;
+        }
+    }
+  return (unsigned int) used.size();
+}
+
+/* A transducer of \a states states with random transitions between
+   them that read one of the first \a inputs of the symbols a-h and write
+   any of them or nothing, and random final states and weights */
+HfstBasicTransducer random_transducer(unsigned int states,
+                                      unsigned int inputs = 8)
+{
+  const char * symbols[] = { "a", "b", "c", "d", "e", "f", "g", "h",
+                             "@_EPSILON_SYMBOL_@" };
+  HfstBasicTransducer t;
+  for (unsigned int state = 1; state < states; state++)
+    t.add_state();
+  for (unsigned int state = 0; state < states; state++)
+    {
+      if (rand() % 3 == 0)
+        t.set_final_weight(state, (float) (rand() % 5));
+      for (unsigned int n = rand() % 6; n > 0; n--)
+        t.add_transition
+          (state, HfstBasicTransition
+           (rand() % states, symbols[rand() % inputs], symbols[rand() % 9],
+            (float) (rand() % 3)));
+    }
+  return t;
+}
+
+/* \a count random strings of up to six of the first \a inputs of the
+   symbols a-h */
+std::vector<std::string> random_strings(unsigned int count,
+                                        unsigned int inputs = 8)
+{
+  std::vector<std::string> strings;
+  for (unsigned int n = 0; n < count; n++)
+    {
+      std::string input;
+      for (unsigned int length = rand() % 7; length > 0; length--)
+        input += (char) ('a' + rand() % inputs);
+      strings.push_back(input);
+    }
+  return strings;
+}
+
+/* Records the results a lookup passes to it, as lookup_fd_pairs would
+   collect them and as output strings with their weights. A visitor that
+   counts every result makes a limited lookup stop after as many results,
+   one that doesn't counts only those it hasn't seen before. */
+class RecordingVisitor : public hfst_ol::LookupVisitor
+{
+  const hfst_ol::Transducer & transducer;
+  const hfst_ol::LookupContext & context;
+  bool count_every_result;
+ public:
+  HfstTwoLevelPaths paths;
+  std::set<std::pair<float, std::string> > outputs;
+  size_t visits;
+
+  RecordingVisitor(const hfst_ol::Transducer & t,
+                   const hfst_ol::LookupContext & c, bool count_every):
+  transducer(t), context(c), count_every_result(count_every), visits(0) {}
+
+  bool visit(const hfst_ol::SymbolPair * path, size_t length,
+             hfst_ol::Weight weight)
+  {
+    visits++;
+    HfstTwoLevelPath result;
+    result.first = weight;
+    std::string output;
+    for (size_t i = 0; i < length; i++)
+      {
+        result.second.push_back
+          (StringPair(transducer.symbol_string(context, path[i].input),
+                      transducer.symbol_string(context, path[i].output)));
+        output += transducer.symbol_string(context, path[i].output);
+      }
+    outputs.insert(std::pair<float, std::string>(weight, output));
+    bool seen_before = !paths.insert(result).second;
+    return count_every_result || !seen_before;
+  }
+};
+
+/* The output strings of \a paths with their weights, epsilons left out */
+std::set<std::pair<float, std::string> > weighted_outputs
+(const HfstTwoLevelPaths & paths)
+{
+  std::set<std::pair<float, std::string> > strings;
+  for (HfstTwoLevelPaths::const_iterator it = paths.begin();
+       it != paths.end(); it++)
+    {
+      std::string output;
+      for (StringPairVector::const_iterator pair = it->second.begin();
+           pair != it->second.end(); pair++)
+        if (pair->second != "@_EPSILON_SYMBOL_@")
+          output += pair->second;
+      strings.insert(std::pair<float, std::string>(it->first, output));
+    }
+  return strings;
+}
+
+/* The letter trie of optimized-lookup before CompactLetterTrie, with a
+   table of 256 children on each node, to check CompactLetterTrie
+   against */
+class ReferenceLetterTrie
+{
+  std::vector<ReferenceLetterTrie *> letters;
+  std::vector<hfst_ol::SymbolNumber> symbols;
+ public:
+  ReferenceLetterTrie():
+  letters(UCHAR_MAX+1, static_cast<ReferenceLetterTrie *>(NULL)),
+    symbols(UCHAR_MAX+1, hfst_ol::NO_SYMBOL_NUMBER) {}
+  ~ReferenceLetterTrie()
+  {
+    for (size_t i = 0; i < letters.size(); i++)
+      delete letters[i];
+  }
+  void add_string(const char * p, hfst_ol::SymbolNumber symbol_key)
+  {
+    if (*(p+1) == 0)
+      {
+        symbols[(unsigned char)(*p)] = symbol_key;
+        return;
+      }
+    if (letters[(unsigned char)(*p)] == NULL)
+      letters[(unsigned char)(*p)] = new ReferenceLetterTrie();
+    letters[(unsigned char)(*p)]->add_string(p+1, symbol_key);
+  }
+  bool has_key_starting_with(const char c) const
+  {
+    return letters[(unsigned char) c] != NULL;
+  }
+  hfst_ol::SymbolNumber find_key(char ** p)
+  {
+    const char * old_p = *p;
+    ++(*p);
+    if (letters[(unsigned char)(*old_p)] == NULL)
+      return symbols[(unsigned char)(*old_p)];
+    hfst_ol::SymbolNumber s = letters[(unsigned char)(*old_p)]->find_key(p);
+    if (s == hfst_ol::NO_SYMBOL_NUMBER)
+      {
+        --(*p);
+        return symbols[(unsigned char)(*old_p)];
+      }
+    return s;
+  }
+};
+
+int main(int argc, char **argv)
+{
+
+  const char * nouns[] = { "cat", "dog", "category", "do", "cattle", NULL };
+  const char * verbs[] = { "do", "go", "dog", "catalog", NULL };
+  const char * inputs[] = { "cat", "dog", "do", "catalog", "cattle", "go",
+                            "", "ca", "dogs", "xyz", NULL };
+  HfstBasicTransducer noun_fst = analyser(nouns, "+N");
+  HfstBasicTransducer verb_fst = analyser(verbs, "+V");
+
+
+  verbose_print("Memory-mapped reading", HFST_OLW_TYPE);
+
+  /* All the transducers of an archive are mapped from one mapping of
+     the file, which stays until the last of them is deleted, and they
+     look up the same as transducers read into memory. */
+  {
+    HfstBasicTransducer * basics[] = { &noun_fst, &verb_fst, &noun_fst };
+    std::vector<std::vector<HfstOneLevelPaths> > expected;
+    HfstOutputStream out("test_optimized_lookup.hfst", HFST_OLW_TYPE);
+    for (unsigned int i = 0; i < 3; i++)
+      {
+        hfst_ol::Transducer * ol =
+          ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+          (basics[i], true, "");
+        expected.push_back(lookup_all(ol, inputs));
+        HfstTransducer * fst = ConversionFunctions::hfst_ol_to_hfst_transducer
+          (ol);
+        out << *fst;
+        delete fst;
+      }
+    out.close();
+
+    for (unsigned int mapped = 0; mapped < 2; mapped++)
+      {
+        std::vector<HfstTransducer *> read;
+        HfstInputStream * in = new HfstInputStream
+          ("test_optimized_lookup.hfst");
+        in->set_memory_mapping(mapped == 1);
+        while (not in->is_eof())
+          read.push_back(new HfstTransducer(*in));
+        in->close();
+        delete in;
+
+        assert(read.size() == 3);
+        const hfst_ol::MappedFile * file = NULL;
+        for (size_t i = 0; i < read.size(); i++)
+          {
+            hfst_ol::Transducer * ol =
+              ConversionFunctions::hfst_transducer_to_hfst_ol(read[i]);
+            assert(ol->is_memory_mapped() == (mapped == 1));
+            if (i == 0)
+              file = ol->get_mapped_file();
+            assert(ol->get_mapped_file() == file);
+          }
+        /* Delete them one by one, so that at the end only the last one
+           holds the mapping. */
+        for (size_t first = 0; first < read.size(); first++)
+          {
+            for (size_t i = first; i < read.size(); i++)
+              {
+                hfst_ol::Transducer * ol =
+                  ConversionFunctions::hfst_transducer_to_hfst_ol(read[i]);
+                assert(lookup_all(ol, inputs) == expected[i]);
+              }
+            delete read[first];
+          }
+      }
+    remove("test_optimized_lookup.hfst");
+  }
+
+
+  verbose_print("Symbols outside the alphabet", HFST_OLW_TYPE);
+
+  /* [ ?:? | a:b ]* | c ?:X, where ? matches any symbol the transducer
+     doesn't read, also b and X, which it only writes. Such symbols in the input are numbered for one lookup
+     at a time, without adding them to the alphabet, so they are written
+     out as they were and don't get mixed up between lookups or in the
+     cache. */
+  {
+    HfstBasicTransducer t;
+    t.set_final_weight(0, 0);
+    t.add_transition(0, HfstBasicTransition
+                     (0, "@_IDENTITY_SYMBOL_@", "@_IDENTITY_SYMBOL_@", 0));
+    t.add_transition(0, HfstBasicTransition(0, "a", "b", 0));
+    HfstState c = t.add_state();
+    HfstState end = t.add_state();
+    t.add_transition(0, HfstBasicTransition(c, "c", "c", 0));
+    t.add_transition(c, HfstBasicTransition
+                     (end, "@_UNKNOWN_SYMBOL_@", "X", 0));
+    t.set_final_weight(end, 0);
+    hfst_ol::Transducer * ol =
+      ConversionFunctions::hfst_basic_transducer_to_hfst_ol(&t, true, "");
+    size_t alphabet_size = ol->get_alphabet().get_symbol_table().size();
+
+    const char * inputs[] =
+      { "aza", "zy", "yz", "z\xc3\xa4z", "\xe2\x82\xac", "", "cz",
+        "c\xc3\xa4", "czz", "b", "ca", "X", NULL };
+    const char * results[] =
+      { "bzb", "zy", "yz", "z\xc3\xa4z", "\xe2\x82\xac", "", "cX",
+        "cX", NULL, "b", NULL, "X" };
+    hfst_ol::LookupContext cached(10);
+    for (unsigned int round = 0; round < 2; round++)
+      {
+        for (unsigned int i = 0; inputs[i] != NULL; i++)
+          {
+            std::set<std::string> expected;
+            if (results[i] != NULL)
+              expected.insert(results[i]);
+            assert(outputs(ol->lookup_fd(inputs[i])) == expected);
+            assert(outputs(ol->lookup_fd(inputs[i], cached)) == expected);
+          }
+        assert(ol->get_alphabet().get_symbol_table().size()
+               == alphabet_size);
+      }
+    delete ol;
+  }
+
+
+  verbose_print("Structure-of-arrays tables", HFST_OLW_TYPE);
+
+  /* symbol_run_length finds runs of every length, starting anywhere
+     relative to the blocks it compares at a time. */
+  {
+    const size_t length = 80;
+    std::vector<hfst_ol::SymbolNumber> symbols
+      (length + hfst_ol::SYMBOL_RUN_PADDING, hfst_ol::NO_SYMBOL_NUMBER);
+    for (size_t start = 0; start < 20; start++)
+      for (size_t run = 0; start + run < length; run++)
+        {
+          std::fill(symbols.begin(), symbols.begin() + length, 3);
+          std::fill(symbols.begin() + start, symbols.begin() + start + run,
+                    7);
+          assert(hfst_ol::symbol_run_length(&symbols[start], 7) == run);
+        }
+  }
+
+  /* A state with long runs of epsilons, flag diacritics among them, and
+     of other symbols, longer than the blocks that are compared at a time,
+     looks up the same with the tables kept either way. */
+  {
+    HfstBasicTransducer wide(noun_fst);
+    HfstState end = wide.add_state();
+    wide.set_final_weight(end, 1);
+    for (unsigned int i = 0; i < 40; i++)
+      {
+        std::ostringstream output;
+        output << "o" << i;
+        HfstState target = wide.add_state();
+        wide.add_transition(0, HfstBasicTransition
+                            (target, "@_EPSILON_SYMBOL_@", output.str(), i));
+        wide.add_transition(target, HfstBasicTransition
+                            (end, (i % 2 == 0) ? "x" : "y", "x", 0));
+        wide.add_transition(0, HfstBasicTransition(target, "x", output.str(),
+                                                   i));
+        if (i % 5 == 0)
+          {
+            HfstState flagged = wide.add_state();
+            wide.add_transition(0, HfstBasicTransition
+                                (flagged, "@P.F.A@", "@P.F.A@", 0));
+            wide.add_transition(flagged, HfstBasicTransition
+                                (target, "@R.F.A@", "@R.F.A@", 0));
+            wide.add_transition(flagged, HfstBasicTransition
+                                (target, "@R.F.B@", "@R.F.B@", 0));
+          }
+      }
+    const char * inputs[] = { "x", "y", "xx", "xy", "yx", "cat", "dog",
+                              "category", "", "z", NULL };
+
+    for (unsigned int weighted = 0; weighted < 2; weighted++)
+      {
+        /* Conversion keeps weighted tables even for unweighted
+           transducers, so read them back as they are written. */
+        hfst_ol::Transducer * converted =
+          ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+          (&wide, weighted == 1, "");
+        std::stringstream stream;
+        converted->write(stream);
+        delete converted;
+        hfst_ol::Transducer * soa = new hfst_ol::Transducer(stream);
+        hfst_ol::Transducer * aos;
+        if (weighted == 1)
+          {
+            hfst_ol::TransducerTable<hfst_ol::TransitionWIndex> index =
+              soa->copy_windex_table();
+            hfst_ol::TransducerTable<hfst_ol::TransitionW> transitions =
+              soa->copy_transitionw_table();
+            compare_tables(index, transitions);
+            aos = new EntryTableTransducer(*soa, index, transitions);
+          }
+        else
+          {
+            hfst_ol::TransducerTable<hfst_ol::TransitionIndex> index =
+              soa->copy_index_table();
+            hfst_ol::TransducerTable<hfst_ol::Transition> transitions =
+              soa->copy_transition_table();
+            compare_tables(index, transitions);
+            aos = new EntryTableTransducer(*soa, index, transitions);
+          }
+        std::vector<HfstOneLevelPaths> results = lookup_all(soa, inputs);
+        assert(results == lookup_all(aos, inputs));
+        assert(results[0].size() >= 20);
+        delete soa;
+        delete aos;
+      }
+  }
+
+
+  verbose_print("Packing the index table", HFST_OLW_TYPE);
+
+  /* States with few and with many input symbols, flag diacritics among
+     them, get the same starting indices from place_states as from trying
+     each index in turn, and so the index table is the same size. */
+  {
+    const hfst_ol::SymbolNumber input_symbols = 70;
+    std::set<hfst_ol::SymbolNumber> flag_symbols;
+    flag_symbols.insert(5);
+    flag_symbols.insert(6);
+    srand(1);
+    std::vector<hfst_ol::StatePlaceholder> states;
+    for (unsigned int state = 0; state < 3000; state++)
+      {
+        hfst_ol::StatePlaceholder placeholder(state, false, 0, 0);
+        unsigned int inputs = (rand() % 10 == 0) ?
+          input_symbols / 2 + rand() % (input_symbols / 2) :
+          1 + rand() % 4;
+        for (unsigned int n = 0; n < inputs; n++)
+          {
+            hfst_ol::SymbolNumber input = rand() % input_symbols;
+            placeholder.add_input(input, flag_symbols);
+            hfst_ol::TransitionPlaceholder transition(0, input, input, 0);
+            placeholder.add_transition(transition);
+          }
+        states.push_back(placeholder);
+      }
+    std::vector<unsigned int> order;
+    for (unsigned int state = 0; state < states.size(); state++)
+      order.push_back(state);
+    std::vector<unsigned int> shuffled(order);
+    for (size_t n = shuffled.size() - 1; n > 1; n--)
+      std::swap(shuffled[n], shuffled[1 + rand() % n]);
+
+    const char * options[] = { "", "quick", "packing-aggression=0.5",
+                               "packing-aggression=1",
+                               "floor-jump-threshold=0",
+                               "floor-jump-threshold=1000", NULL };
+    for (unsigned int o = 0; options[o] != NULL; o++)
+      for (unsigned int shuffle = 0; shuffle < 2; shuffle++)
+        {
+          hfst_ol::PackingParameters packing =
+            hfst_ol::PackingParameters::from_options(options[o]);
+          std::vector<unsigned int> & placing_order =
+            (shuffle == 1) ? shuffled : order;
+          std::vector<hfst_ol::StatePlaceholder> placed(states);
+          hfst_ol::IndexPlaceholders used_indices;
+          hfst_ol::place_states(placed, placing_order, flag_symbols,
+                                input_symbols, packing, used_indices);
+          std::vector<unsigned int> starts;
+          unsigned int size = place_states_one_by_one
+            (states, placing_order, flag_symbols, input_symbols, packing,
+             starts);
+          for (size_t state = 0; state < placed.size(); state++)
+            assert(placed[state].start_index == starts[state]);
+          assert(used_indices.indices.size() == size);
+        }
+  }
+
+  /* However it is packed, a transducer with many states that need an
+     index table entry looks up the same. */
+  {
+    HfstBasicTransducer random_fst = random_transducer(300);
+    std::vector<std::string> strings = random_strings(200);
+    std::vector<const char *> random_inputs;
+    for (unsigned int n = 0; n < strings.size(); n++)
+      random_inputs.push_back(strings[n].c_str());
+    random_inputs.push_back(NULL);
+
+    const char * options[] = { "", "quick", "packing-aggression=0.5",
+                               "floor-jump-threshold=1000", "density-sort",
+                               "threads=4", NULL };
+    std::vector<HfstOneLevelPaths> expected;
+    for (unsigned int o = 0; options[o] != NULL; o++)
+      {
+        hfst_ol::Transducer * ol =
+          ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+          (&random_fst, true, options[o]);
+        std::vector<HfstOneLevelPaths> results =
+          lookup_all(ol, &random_inputs[0]);
+        if (o == 0)
+          expected = results;
+        assert(results == expected);
+        delete ol;
+      }
+  }
+
+
+  verbose_print("Converting in threads", HFST_OLW_TYPE);
+
+  /* States are split between threads at least 4096 at a time, so with
+     more than 4 * 4096 states four threads each get a range, and the
+     tables are the same as when converting in one thread. */
+  {
+    HfstBasicTransducer tree;
+    for (unsigned int word = 0; word < 4000; word++)
+      {
+        HfstState state = 0;
+        for (unsigned int length = 1 + rand() % 8; length > 0; length--)
+          {
+            HfstState target = tree.add_state();
+            std::string symbol(1, (char) ('a' + rand() % 10));
+            tree.add_transition(state, HfstBasicTransition
+                                (target, symbol, symbol, length / 10.0));
+            state = target;
+          }
+        tree.set_final_weight(state, (float) (word % 3));
+      }
+    assert(tree.get_max_state() + 1 > 4 * 4096);
+    std::string written[2];
+    const char * options[] = { "threads=1", "threads=4" };
+    for (unsigned int o = 0; o < 2; o++)
+      {
+        hfst_ol::Transducer * ol =
+          ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+          (&tree, true, options[o]);
+        std::ostringstream stream;
+        ol->write(stream);
+        written[o] = stream.str();
+        delete ol;
+      }
+    assert(written[0] == written[1]);
+  }
+
+
+  verbose_print("Looking up through a visitor", HFST_OLW_TYPE);
+
+  /* A visitor gets the results that lookup_fd and lookup_fd_pairs
+     collect, which are those of looking up in the HfstBasicTransducer,
+     and a limited lookup stops after the results the visitor counted. */
+  {
+    HfstBasicTransducer random_fst = random_transducer(20, 3);
+    hfst_ol::Transducer * ol =
+      ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+      (&random_fst, true, "");
+    HfstTransducer * fst = ConversionFunctions::hfst_ol_to_hfst_transducer
+      (ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+       (&random_fst, true, ""));
+    std::vector<std::string> strings = random_strings(200, 3);
+    hfst_ol::LookupContext c;
+    size_t ambiguous = 0;
+    for (size_t n = 0; n < strings.size(); n++)
+      {
+        const std::string & input = strings[n];
+        RecordingVisitor all(*ol, c, true);
+        ol->lookup_fd(input, c, all);
+        HfstTwoLevelPaths * pairs = ol->lookup_fd_pairs(input.c_str(), c);
+        assert(all.paths == *pairs);
+        HfstOneLevelPaths * paths = ol->lookup_fd(input, c);
+        std::set<std::pair<float, std::string> > strings_found;
+        for (HfstOneLevelPaths::const_iterator it = paths->begin();
+             it != paths->end(); it++)
+          {
+            std::string output;
+            for (size_t i = 0; i < it->second.size(); i++)
+              output += it->second[i];
+            strings_found.insert
+              (std::pair<float, std::string>(it->first, output));
+          }
+        assert(all.outputs == strings_found);
+        StringVector symbols;
+        for (size_t i = 0; i < input.size(); i++)
+          symbols.push_back(input.substr(i, 1));
+        HfstTwoLevelPaths basic_paths;
+        random_fst.lookup(symbols, basic_paths);
+        assert(all.outputs == weighted_outputs(basic_paths));
+        if (all.paths.size() > 1)
+          ambiguous++;
+
+        RecordingVisitor through_fst(*ol, c, true);
+        fst->lookup_fd(input, c, through_fst);
+        assert(through_fst.paths == all.paths);
+
+        for (ssize_t limit = 1; limit < 4; limit++)
+          {
+            RecordingVisitor counting(*ol, c, true);
+            ol->lookup_fd(input, c, counting, limit);
+            assert(counting.visits == std::min((size_t) limit, all.visits));
+            RecordingVisitor deduplicating(*ol, c, false);
+            ol->lookup_fd(input, c, deduplicating, limit);
+            assert(deduplicating.paths.size() ==
+                   std::min((size_t) limit, all.paths.size()));
+            HfstTwoLevelPaths * limited =
+              ol->lookup_fd_pairs(input.c_str(), c, limit);
+            assert(*limited == deduplicating.paths);
+            delete limited;
+          }
+        delete pairs;
+        delete paths;
+      }
+    assert(ambiguous > 10);
+    delete fst;
+    delete ol;
+  }
+
+
+  verbose_print("Compact letter trie", HFST_OLW_TYPE);
+
+  /* CompactLetterTrie tokenizes like the trie it replaced, with symbols
+     that are prefixes of each other and multibyte symbols sharing their
+     first bytes, added in an order that makes nodes move */
+  {
+    const char * pieces[] = { "a", "b", "\xc3\xa4", "\xc3\xb6", "\xe2\x82\xac",
+                              "\xf0\x9f\x98\x80", "@", "\xff" };
+    std::vector<std::string> symbols;
+    symbols.push_back("a");
+    symbols.push_back("ab");
+    symbols.push_back("abc");
+    symbols.push_back("b");
+    symbols.push_back("\xc3\xa4");
+    symbols.push_back("\xc3\xa4\xc3\xb6");
+    symbols.push_back("\xe2\x82\xac");
+    symbols.push_back("@P.X.Y@");
+    symbols.push_back("@P.X.Z@");
+    symbols.push_back("\xff\xff");
+    for (unsigned int n = 0; n < 200; n++)
+      {
+        std::string symbol;
+        for (unsigned int length = 1 + rand() % 4; length > 0; length--)
+          symbol += pieces[rand() % 8];
+        symbols.push_back(symbol);
+      }
+
+    hfst_ol::CompactLetterTrie<hfst_ol::SymbolNumber>
+      compact(hfst_ol::NO_SYMBOL_NUMBER);
+    ReferenceLetterTrie reference;
+    std::map<std::string, hfst_ol::SymbolNumber> numbers;
+    for (hfst_ol::SymbolNumber k = 0; k < symbols.size(); k++)
+      {
+        compact.add_string(symbols[k].c_str(), k);
+        reference.add_string(symbols[k].c_str(), k);
+        numbers[symbols[k]] = k;
+      }
+
+    for (std::map<std::string, hfst_ol::SymbolNumber>::const_iterator it
+           = numbers.begin(); it != numbers.end(); it++)
+      {
+        assert(compact.find_symbol(it->first.c_str()) == it->second);
+        assert(compact.has_symbol(it->second));
+      }
+    assert(compact.find_symbol("abca") == hfst_ol::NO_SYMBOL_NUMBER);
+    assert(compact.find_symbol("") == hfst_ol::NO_SYMBOL_NUMBER);
+    for (unsigned int c = 0; c <= UCHAR_MAX; c++)
+      assert(compact.has_key_starting_with((char) c) ==
+             reference.has_key_starting_with((char) c));
+
+    /* Inputs of random pieces, cut at random bytes so that some end in
+       the middle of a multibyte character */
+    for (unsigned int n = 0; n < 1000; n++)
+      {
+        std::string input;
+        for (unsigned int length = rand() % 10; length > 0; length--)
+          input += pieces[rand() % 8];
+        if (input.size() > 0)
+          input.resize(rand() % input.size() + 1);
+        std::vector<char> compact_input(input.begin(), input.end());
+        compact_input.push_back('\0');
+        std::vector<char> reference_input(compact_input);
+        char * compact_p = &compact_input[0];
+        char * reference_p = &reference_input[0];
+        while (*reference_p != '\0')
+          {
+            hfst_ol::SymbolNumber expected = reference.find_key(&reference_p);
+            assert(compact.find_key(&compact_p) == expected);
+            assert(compact_p - &compact_input[0] ==
+                   reference_p - &reference_input[0]);
+          }
+      }
+  }
+
+}
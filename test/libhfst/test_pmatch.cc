@@ -0,0 +1,938 @@
+/*
+   Test file for pmatch matching with hfst_ol::PmatchContainer.
+   The rules are built as HfstBasicTransducers in the form that
+   hfst-pmatch2fst compiles them to. Also tests the word vector
+   searches of Like() and Unlike() and the binary output format of
+   hfst-tokenize.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <set>
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#include <thread>
+#endif
+
+#include "HfstTransducer.h"
+#include "HfstOutputStream.h"
+#include "implementations/ConvertTransducerFormat.h"
+#include "implementations/optimized-lookup/pmatch.h"
+#include "implementations/optimized-lookup/pmatch_tokenize.h"
+#include "parsers/pmatch_vectors.h"
+#include "auxiliary_functions.cc"
+
+using namespace hfst;
+
+using implementations::HfstState;
+using implementations::HfstBasicTransition;
+using implementations::HfstBasicTransducer;
+using implementations::ConversionFunctions;
+using pmatch::WordVectorIndex;
+using pmatch::WordVecFloat;
+using hfst_ol_tokenize::BinaryLocationReader;
+using hfst_ol_tokenize::BinaryLocationWriter;
+
+/* Add a path spelling \a word from \a state, return its last state. */
+HfstState add_word(HfstBasicTransducer & t, HfstState state,
+                   const std::string & word)
+{
+  for (std::string::const_iterator it = word.begin(); it != word.end(); it++)
+    {
+      HfstState target = t.add_state();
+      std::string symbol(1, *it);
+      t.add_transition(state, HfstBasicTransition(target, symbol, symbol, 0));
+      state = target;
+    }
+  return state;
+}
+
+/* Add a transition from \a state that outputs \a symbol without
+   consuming input, return its target. */
+HfstState add_marker(HfstBasicTransducer & t, HfstState state,
+                     const std::string & symbol)
+{
+  HfstState target = t.add_state();
+  t.add_transition(state, HfstBasicTransition
+                   (target, "@_EPSILON_SYMBOL_@", symbol, 0));
+  return target;
+}
+
+/* End a rule at \a state, tagging what it matched with \a tag, with
+   \a weight as the final weight. */
+void add_end_tag(HfstBasicTransducer & t, HfstState state,
+                 const std::string & tag, float weight = 0)
+{
+  state = add_marker(t, state, "@PMATCH_ENDTAG_" + tag + "@");
+  state = add_marker(t, state, "@PMATCH_EXIT@");
+  t.set_final_weight(state, weight);
+}
+
+/* Convert \a t to weighted optimized-lookup format, numbering its
+   symbols as in \a harmonizer if given. */
+hfst_ol::Transducer * to_ol(HfstBasicTransducer & t,
+                            HfstTransducer * harmonizer = NULL)
+{
+  return ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+    (&t, true, "", harmonizer);
+}
+
+/* The transducers of a pmatch archive number their symbols the same
+   way, which hfst-pmatch2fst ensures by converting them with a
+   harmonizer that has all the symbols as input symbols. This is one for
+   \a top and \a rtn. */
+HfstTransducer * archive_harmonizer(const HfstBasicTransducer & top,
+                                    const HfstBasicTransducer & rtn)
+{
+  StringSet symbols = top.get_alphabet();
+  StringSet rtn_symbols = rtn.get_alphabet();
+  symbols.insert(rtn_symbols.begin(), rtn_symbols.end());
+  HfstBasicTransducer all_symbols;
+  all_symbols.add_state(1);
+  all_symbols.set_final_weight(1, 0);
+  for (StringSet::const_iterator it = symbols.begin();
+       it != symbols.end(); it++)
+    all_symbols.add_transition(0, HfstBasicTransition(1, *it, *it, 0));
+  return ConversionFunctions::hfst_ol_to_hfst_transducer(to_ol(all_symbols));
+}
+
+std::string locations_to_string(const hfst_ol::LocationVectorVector & lvv)
+{
+  std::ostringstream os;
+  for (hfst_ol::LocationVectorVector::const_iterator it = lvv.begin();
+       it != lvv.end(); it++)
+    {
+      for (hfst_ol::LocationVector::const_iterator loc = it->begin();
+           loc != it->end(); loc++)
+        {
+          os << loc->start << "+" << loc->length << "\t" << loc->input
+             << "\t" << loc->output << "\t" << loc->tag << "\n";
+        }
+      os << "\n";
+    }
+  return os.str();
+}
+
+/* \a output without the tags that matching added to it */
+std::string strip_tags(const std::string & output)
+{
+  std::string stripped;
+  bool in_tag = false;
+  for (std::string::const_iterator it = output.begin();
+       it != output.end(); it++)
+    {
+      if (*it == '<')
+        in_tag = true;
+      else if (*it == '>')
+        in_tag = false;
+      else if (not in_tag)
+        stripped += *it;
+    }
+  return stripped;
+}
+
+/* The input that \a lvv covers, put together from its locations */
+std::string located_input(const hfst_ol::LocationVectorVector & lvv)
+{
+  std::string input;
+  for (hfst_ol::LocationVectorVector::const_iterator it = lvv.begin();
+       it != lvv.end(); it++)
+    input += it->at(0).input;
+  return input;
+}
+
+/* Check that what \a reader read is \a lvv, as written by
+   BinaryLocationWriter with \a s. */
+void check_binary_record(const BinaryLocationReader & reader,
+                         const hfst_ol::LocationVectorVector & lvv,
+                         const hfst_ol_tokenize::TokenizeSettings & s)
+{
+  assert(reader.get_kind() == BinaryLocationReader::UNIT);
+  const std::vector<BinaryLocationReader::Token> & tokens =
+    reader.get_tokens();
+  size_t token = 0;
+  for (hfst_ol::LocationVectorVector::const_iterator it = lvv.begin();
+       it != lvv.end(); it++)
+    {
+      bool nonmatching = it->at(0).output == "@_NONMATCHING_@";
+      if (nonmatching && not s.print_all)
+        continue;
+      assert(token < tokens.size());
+      const BinaryLocationReader::Token & t = tokens[token++];
+      assert(t.start == it->at(0).start && t.length == it->at(0).length);
+      assert(t.nonmatching == nonmatching);
+      assert(t.reading_count == it->size());
+      for (unsigned int i = 0; i < t.reading_count; i++)
+        {
+          const hfst_ol::Location & loc = it->at(i);
+          const BinaryLocationReader::Reading & r = t.readings[i];
+          assert(r.weight == loc.weight);
+          if (loc.tag.empty())
+            assert(r.tag == hfst_ol_tokenize::BINARY_NO_TAG);
+          else
+            assert(reader.symbol(r.tag) == loc.tag);
+          assert(r.input.size == loc.input_symbol_strings.size());
+          for (unsigned int k = 0; k < r.input.size; k++)
+            assert(reader.symbol(r.input[k]) == loc.input_symbol_strings[k]);
+          assert(reader.string_of(r.input) == loc.input);
+          assert(r.input_parts.size == loc.input_parts.size());
+          for (unsigned int k = 0; k < r.input_parts.size; k++)
+            assert(r.input_parts[k] == loc.input_parts[k]);
+          if (nonmatching)
+            {
+              assert(r.output.size == 0 && r.output_parts.size == 0);
+              continue;
+            }
+          assert(r.output.size == loc.output_symbol_strings.size());
+          for (unsigned int k = 0; k < r.output.size; k++)
+            assert(reader.symbol(r.output[k])
+                   == loc.output_symbol_strings[k]);
+          assert(r.output_parts.size == loc.output_parts.size());
+          for (unsigned int k = 0; k < r.output_parts.size; k++)
+            assert(r.output_parts[k] == loc.output_parts[k]);
+        }
+    }
+  assert(token == tokens.size());
+}
+
+/* Orders the readings of a token by weight, tag and output. */
+bool reading_less(const hfst_ol::Location & a, const hfst_ol::Location & b)
+{
+  if (a.weight != b.weight)
+    return a.weight < b.weight;
+  if (a.tag != b.tag)
+    return a.tag < b.tag;
+  return a.output < b.output;
+}
+
+bool same_reading(const hfst_ol::Location & a, const hfst_ol::Location & b)
+{
+  return not reading_less(a, b) && not reading_less(b, a);
+}
+
+/* The readings of \a lvv that hfst-tokenize keeps with the options of
+   \a s: without duplicates, sorted, if s.dedupe, then only those of the
+   first s.max_weight_classes weights. */
+hfst_ol::LocationVectorVector
+filtered_readings(const hfst_ol::LocationVectorVector & lvv,
+                  const hfst_ol_tokenize::TokenizeSettings & s)
+{
+  hfst_ol::LocationVectorVector filtered;
+  for (hfst_ol::LocationVectorVector::const_iterator it = lvv.begin();
+       it != lvv.end(); it++)
+    {
+      if (it->at(0).output == "@_NONMATCHING_@")
+        {
+          filtered.push_back(*it);
+          continue;
+        }
+      hfst_ol::LocationVector readings(*it);
+      if (s.dedupe)
+        {
+          std::sort(readings.begin(), readings.end(), reading_less);
+          readings.erase(std::unique(readings.begin(), readings.end(),
+                                     same_reading), readings.end());
+        }
+      hfst_ol::LocationVector kept;
+      int weight_classes = 0;
+      for (size_t i = 0; i < readings.size(); i++)
+        {
+          if (i == 0 || readings[i].weight != readings[i - 1].weight)
+            weight_classes++;
+          if (weight_classes > s.max_weight_classes)
+            break;
+          kept.push_back(readings[i]);
+        }
+      filtered.push_back(kept);
+    }
+  return filtered;
+}
+
+/* The cosine distance of \a v and \a point, or NaN if either has
+   length 0 */
+double cosine_distance(const std::vector<double> & v,
+                       const std::vector<double> & point)
+{
+  double dot = 0, v_square_sum = 0, point_square_sum = 0;
+  for (size_t i = 0; i < v.size(); i++)
+    {
+      dot += v[i] * point[i];
+      v_square_sum += v[i] * v[i];
+      point_square_sum += point[i] * point[i];
+    }
+  if (v_square_sum == 0 || point_square_sum == 0)
+    return std::numeric_limits<double>::quiet_NaN();
+  return 1.0 - dot / std::sqrt(v_square_sum * point_square_sum);
+}
+
+/* Check that \a found, from the most distant to the nearest, are the
+   \a n nearest of the vectors whose distances are \a distances, as
+   found by comparing each of them. Of vectors at (nearly) the same
+   distance, either may come first. */
+void check_nearest(const std::vector<WordVectorIndex::Neighbour> & found,
+                   const std::vector<double> & distances, size_t n)
+{
+  std::vector<std::pair<double, size_t> > expected;
+  for (size_t i = 0; i < distances.size(); i++)
+    {
+      if (distances[i] == distances[i])
+        expected.push_back(std::pair<double, size_t>(distances[i], i));
+    }
+  std::sort(expected.begin(), expected.end());
+  if (expected.size() > n)
+    expected.resize(n);
+  assert(found.size() == expected.size());
+  std::set<size_t> seen;
+  for (size_t rank = 0; rank < found.size(); rank++)
+    {
+      size_t i = found[rank].first;
+      assert(seen.insert(i).second);
+      assert(distances[i] == distances[i]);
+      assert(std::fabs(found[rank].second - distances[i]) < 1e-4);
+      assert(std::fabs(found[rank].second -
+                       expected[expected.size() - 1 - rank].first) < 1e-4);
+    }
+}
+
+int main(int argc, char **argv)
+{
+
+  /* cat, category and a b* c, the last one needing arbitrarily much
+     lookahead */
+  HfstBasicTransducer top;
+  HfstState entry = add_marker(top, 0, "@PMATCH_ENTRY@");
+  add_end_tag(top, add_word(top, entry, "cat"), "Animal");
+  add_end_tag(top, add_word(top, entry, "category"), "Cat");
+  HfstState a = add_word(top, entry, "a");
+  top.add_transition(a, HfstBasicTransition(a, "b", "b", 0));
+  add_end_tag(top, add_word(top, a, "c"), "ABC");
+  hfst_ol::PmatchContainer container(to_ol(top));
+
+  const std::string text =
+    "a cat in a category, abbbc and abbb: \xc3\xa4 \xe6\x97\xa5\xe6\x9c\xac cat";
+  std::string whole_output = container.match(text);
+  std::string whole_locations = locations_to_string(container.locate(text));
+  assert(whole_output.find("<Animal>cat</Animal>") != std::string::npos);
+  assert(whole_output.find("<Cat>category</Cat>") != std::string::npos);
+  assert(whole_output.find("<ABC>abbbc</ABC>") != std::string::npos);
+
+
+  verbose_print("PmatchStream in pieces of any size");
+
+  /* Pushing the text in pieces of any size, even ones that end in the
+     middle of a character, gives the same result as matching it at
+     once. */
+  for (size_t piece = 1; piece <= text.size(); piece++)
+    {
+      for (int locate = 0; locate < 2; locate++)
+        {
+          hfst_ol::PmatchStream stream(container, locate == 1);
+          std::string output;
+          std::string locations;
+          for (size_t i = 0; i < text.size(); i += piece)
+            {
+              stream.push(text.substr(i, piece));
+              output += stream.take_output();
+              locations += locations_to_string(stream.take_locations());
+            }
+          stream.finish();
+          output += stream.take_output();
+          locations += locations_to_string(stream.take_locations());
+          if (locate == 1)
+            assert(locations == whole_locations);
+          else
+            assert(output == whole_output);
+        }
+    }
+
+
+  verbose_print("PmatchStream memory use");
+
+  /* Only the input still being matched is kept, however long the
+     stream. */
+  {
+    hfst_ol::PmatchStream stream(container);
+    size_t matches = 0;
+    for (unsigned int i = 0; i < 20000; i++)
+      {
+        stream.push("the cat and abbbbc ");
+        assert(stream.get_buffered_size() < 1000);
+        std::string output = stream.take_output();
+        for (size_t pos = output.find("<Animal>"); pos != std::string::npos;
+             pos = output.find("<Animal>", pos + 1))
+          matches++;
+      }
+    stream.finish();
+    assert(matches + (stream.take_output().find("<Animal>")
+                      != std::string::npos) == 20000);
+  }
+
+
+  /* Num x | Num y | # Num, where Num is [0-9]+ and is called several
+     times at the same input positions */
+  HfstBasicTransducer rtn_top;
+  HfstState rtn_entry = add_marker(rtn_top, 0, "@PMATCH_ENTRY@");
+  const char * tags[] = { "X", "Y" };
+  const char * follows[] = { "x", "y" };
+  for (unsigned int i = 0; i < 2; i++)
+    {
+      HfstState num = rtn_top.add_state();
+      rtn_top.add_transition
+        (rtn_entry, HfstBasicTransition(num, "@I.Num@", "@I.Num@", 0));
+      add_end_tag(rtn_top, add_word(rtn_top, num, follows[i]), tags[i]);
+    }
+  HfstState hash = add_word(rtn_top, rtn_entry, "#");
+  HfstState hash_num = rtn_top.add_state();
+  rtn_top.add_transition
+    (hash, HfstBasicTransition(hash_num, "@I.Num@", "@I.Num@", 0));
+  add_end_tag(rtn_top, hash_num, "Hash");
+
+  HfstBasicTransducer num;
+  HfstState digits = num.add_state();
+  for (const char * d = "0123456789"; *d != '\0'; d++)
+    {
+      std::string digit(1, *d);
+      num.add_transition(0, HfstBasicTransition(digits, digit, digit, 0));
+      num.add_transition
+        (digits, HfstBasicTransition(digits, digit, digit, 0));
+    }
+  num.set_final_weight(digits, 0);
+
+  HfstTransducer * harmonizer = archive_harmonizer(rtn_top, num);
+
+  const std::string numbers = "12x 345y #67 8 #9x 1234567890y 00z";
+  std::string called;
+  std::string called_locations;
+
+
+  verbose_print("Memoised RTN calls");
+
+  {
+    hfst_ol::PmatchContainer rtn_container(to_ol(rtn_top, harmonizer));
+    rtn_container.add_rtn(to_ol(num, harmonizer), "Num");
+    rtn_container.finish_adding_rtns();
+
+    called = rtn_container.match(numbers);
+    assert(called.find("<X>12x</X>") != std::string::npos);
+    assert(called.find("<Y>345y</Y>") != std::string::npos);
+    assert(called.find("<Hash>#67</Hash>") != std::string::npos);
+    called_locations = locations_to_string(rtn_container.locate(numbers));
+    rtn_container.set_memoize_rtns(true);
+    assert(rtn_container.match(numbers) == called);
+    assert(locations_to_string(rtn_container.locate(numbers))
+           == called_locations);
+  }
+
+
+  verbose_print("Several contexts on one container");
+
+  /* Each PmatchContext keeps its own working state, including the
+     numbers it gives to symbols outside the alphabet and its memo of
+     RTN calls, so contexts used in turn, two streams fed in turn or
+     contexts used at once in threads match as if each had the container
+     to itself. */
+  {
+    hfst_ol::PmatchContainer rtn_container(to_ol(rtn_top, harmonizer));
+    rtn_container.add_rtn(to_ol(num, harmonizer), "Num");
+    rtn_container.finish_adding_rtns();
+    rtn_container.set_memoize_rtns(true);
+    const std::string texts[] =
+      { numbers, "\xe6\x97\xa5 #1 2x \xc3\xa4 3y", "\xc3\xa4 45x \xe6\x97\xa5 #6" };
+    const size_t text_count = sizeof(texts) / sizeof(texts[0]);
+    std::vector<std::string> outputs;
+    std::vector<std::string> locations;
+    for (size_t i = 0; i < text_count; i++)
+      {
+        hfst_ol::PmatchContext c;
+        outputs.push_back(rtn_container.match(texts[i], c));
+        hfst_ol::PmatchContext l;
+        locations.push_back
+          (locations_to_string(rtn_container.locate(texts[i], l)));
+      }
+    assert(outputs[0] == called);
+    assert(outputs[1].find("<X>2x</X>") != std::string::npos);
+
+    hfst_ol::PmatchContext contexts[text_count];
+    for (unsigned int round = 0; round < 3; round++)
+      for (size_t i = 0; i < text_count; i++)
+        {
+          assert(rtn_container.match(texts[i], contexts[i]) == outputs[i]);
+          size_t other = (i + round) % text_count;
+          assert(locations_to_string
+                 (rtn_container.locate(texts[other], contexts[i]))
+                 == locations[other]);
+        }
+
+    for (size_t piece = 1; piece < 6; piece++)
+      {
+        hfst_ol::PmatchStream first(rtn_container);
+        hfst_ol::PmatchStream second(rtn_container);
+        std::string first_output;
+        std::string second_output;
+        for (size_t i = 0; i < texts[1].size() || i < texts[2].size();
+             i += piece)
+          {
+            if (i < texts[1].size())
+              first.push(texts[1].substr(i, piece));
+            if (i < texts[2].size())
+              second.push(texts[2].substr(i, piece));
+            first_output += first.take_output();
+            second_output += second.take_output();
+          }
+        first.finish();
+        second.finish();
+        assert(first_output + first.take_output() == outputs[1]);
+        assert(second_output + second.take_output() == outputs[2]);
+      }
+
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+    std::vector<std::string> threaded(text_count * 4);
+    std::vector<std::thread> threads;
+    for (size_t n = 0; n < threaded.size(); n++)
+      threads.push_back(std::thread([&, n]() {
+            hfst_ol::PmatchContext c;
+            for (unsigned int round = 0; round < 20; round++)
+              threaded[n] = rtn_container.match(texts[n % text_count], c);
+          }));
+    for (size_t n = 0; n < threads.size(); n++)
+      threads[n].join();
+    for (size_t n = 0; n < threaded.size(); n++)
+      assert(threaded[n] == outputs[n % text_count]);
+#endif
+  }
+
+
+  verbose_print("Prefilter on and off");
+
+  /* Until finish_adding_rtns(), a container that has had RTNs added
+     tries matches everywhere. It must locate the same matches as it does
+     with the filters built, also for matches that begin with a list, an
+     RTN call, an optional symbol or epsilons, and for input that ends in
+     the middle of a symbol, with fewer steps taken when filtered. */
+  {
+    HfstBasicTransducer filtered_top;
+    HfstState start = add_marker(filtered_top, 0, "@PMATCH_ENTRY@");
+    // [x|y] z and [? - [x|y]] !
+    HfstState listed = filtered_top.add_state();
+    filtered_top.add_transition
+      (start, HfstBasicTransition(listed, "@L.x_y_@", "@L.x_y_@", 0));
+    add_end_tag(filtered_top, add_word(filtered_top, listed, "z"), "L");
+    HfstState excluded = filtered_top.add_state();
+    filtered_top.add_transition
+      (start, HfstBasicTransition(excluded, "@X.x_y_@", "@X.x_y_@", 0));
+    add_end_tag(filtered_top, add_word(filtered_top, excluded, "!"), "X");
+    // Num y
+    HfstState called_num = filtered_top.add_state();
+    filtered_top.add_transition
+      (start, HfstBasicTransition(called_num, "@I.Num@", "@I.Num@", 0));
+    add_end_tag(filtered_top, add_word(filtered_top, called_num, "y"), "N");
+    // (o) p, and q after two epsilons
+    HfstState optional = add_word(filtered_top, start, "o");
+    filtered_top.add_transition
+      (start, HfstBasicTransition(optional, "@_EPSILON_SYMBOL_@",
+                                  "@_EPSILON_SYMBOL_@", 0));
+    add_end_tag(filtered_top, add_word(filtered_top, optional, "p"), "P");
+    HfstState epsilons = add_marker
+      (filtered_top, add_marker(filtered_top, start, "@_EPSILON_SYMBOL_@"),
+       "@_EPSILON_SYMBOL_@");
+    add_end_tag(filtered_top, add_word(filtered_top, epsilons, "q"), "Q");
+    // the multicharacter symbols ch and \xc3\xa4 twice
+    HfstState ch = filtered_top.add_state();
+    filtered_top.add_transition(start, HfstBasicTransition(ch, "ch", "ch", 0));
+    add_end_tag(filtered_top, add_word(filtered_top, ch, "e"), "C");
+    HfstState umlaut = filtered_top.add_state();
+    HfstState umlauts = filtered_top.add_state();
+    filtered_top.add_transition
+      (start, HfstBasicTransition(umlaut, "\xc3\xa4", "\xc3\xa4", 0));
+    filtered_top.add_transition
+      (umlaut, HfstBasicTransition(umlauts, "\xc3\xa4", "\xc3\xa4", 0));
+    add_end_tag(filtered_top, umlauts, "A");
+    HfstTransducer * filtered_harmonizer =
+      archive_harmonizer(filtered_top, num);
+
+    const std::string body =
+      "xz yz az a! x! z! 12y 3x 4 p op oop q che ch c \xc3\xa4\xc3\xa4 \xc3\xa4 ";
+    std::string long_body;
+    for (unsigned int i = 0; i < 50; i++)
+      long_body += body + "and some text that nothing matches ";
+    const std::string endings[] =
+      { "", "ch", "c", "\xc3\xa4", "\xc3", "o", "12", "x" };
+    unsigned long unfiltered_steps = 0;
+    unsigned long filtered_steps = 0;
+    for (unsigned int i = 0; i < sizeof(endings) / sizeof(endings[0]); i++)
+      {
+        const std::string filtered_text = long_body + endings[i];
+        hfst_ol::PmatchContainer filters(to_ol(filtered_top,
+                                               filtered_harmonizer));
+        filters.add_rtn(to_ol(num, filtered_harmonizer), "Num");
+        hfst_ol::PmatchContext unfiltered;
+        std::string unfiltered_locations = locations_to_string
+          (filters.locate(filtered_text, unfiltered));
+        unfiltered_steps += unfiltered.spent.steps;
+        std::string unfiltered_output = filters.match(filtered_text, unfiltered);
+
+        filters.finish_adding_rtns();
+        hfst_ol::PmatchContext filtered;
+        assert(locations_to_string(filters.locate(filtered_text, filtered))
+               == unfiltered_locations);
+        filtered_steps += filtered.spent.steps;
+        assert(filters.match(filtered_text, filtered) == unfiltered_output);
+        assert(unfiltered_output.find("<L>xz</L>") != std::string::npos);
+        assert(unfiltered_output.find("<X>a!</X>") != std::string::npos);
+        assert(unfiltered_output.find("<N>12y</N>") != std::string::npos);
+        assert(unfiltered_output.find("<P>op</P>") != std::string::npos);
+        assert(unfiltered_output.find("<Q>q</Q>") != std::string::npos);
+        assert(unfiltered_output.find("<C>che</C>") != std::string::npos);
+        assert(unfiltered_output.find("<A>\xc3\xa4\xc3\xa4</A>")
+               != std::string::npos);
+
+        /* Matching with the container's own context rebuilds the
+           filters by itself. */
+        hfst_ol::PmatchContainer rebuilt(to_ol(filtered_top,
+                                               filtered_harmonizer));
+        rebuilt.add_rtn(to_ol(num, filtered_harmonizer), "Num");
+        assert(locations_to_string(rebuilt.locate(filtered_text))
+               == unfiltered_locations);
+        hfst_ol::PmatchContext after_rebuilding;
+        rebuilt.locate(filtered_text, after_rebuilding);
+        assert(after_rebuilding.spent.steps == filtered.spent.steps);
+      }
+    assert(filtered_steps < unfiltered_steps);
+    delete filtered_harmonizer;
+  }
+
+
+  verbose_print("Loading RTNs lazily");
+
+  /* An archive as hfst-pmatch2fst writes it, TOP followed by the RTNs,
+     with and without the index of them in TOP's header */
+  for (int indexed = 0; indexed < 2; indexed++)
+    {
+      hfst_ol::Transducer * num_ol = to_ol(num, harmonizer);
+      std::ostringstream serialized;
+      num_ol->write(serialized);
+      std::ostringstream rtn_index;
+      rtn_index << "Num\t" << serialized.str().size() << "\n";
+
+      HfstTransducer * top_fst = ConversionFunctions::hfst_ol_to_hfst_transducer
+        (to_ol(rtn_top, harmonizer));
+      top_fst->set_name("TOP");
+      if (indexed == 1)
+        top_fst->set_property
+          (hfst_ol::PmatchContainer::rtn_index_property(), rtn_index.str());
+      HfstTransducer * num_fst =
+        ConversionFunctions::hfst_ol_to_hfst_transducer(num_ol);
+      num_fst->set_name("Num");
+      HfstOutputStream out("test_pmatch.hfst", HFST_OLW_TYPE);
+      out << *top_fst << *num_fst;
+      out.close();
+      delete top_fst;
+      delete num_fst;
+
+      /* Read from a stream, everything is loaded up front. */
+      std::ifstream instream("test_pmatch.hfst", std::ios::binary);
+      hfst_ol::PmatchContainer eager(instream);
+      instream.close();
+      assert(eager.get_lazy_rtns() == NULL);
+      assert(eager.match(numbers) == called);
+
+      /* Mapped, an indexed archive's RTNs are loaded when first called
+         and match as if loaded up front. */
+      hfst_ol::PmatchContainer mapped
+        (new hfst_ol::MappedFile("test_pmatch.hfst"));
+      const hfst_ol::PmatchLazyRtns * lazy_rtns = mapped.get_lazy_rtns();
+      if (indexed == 0)
+        assert(lazy_rtns == NULL);
+      else
+        {
+          assert(lazy_rtns != NULL && lazy_rtns->size() == 1);
+          assert(lazy_rtns->get_loaded_count() == 0);
+        }
+      assert(mapped.match(numbers) == called);
+      assert(lazy_rtns == NULL || lazy_rtns->get_loaded_count() == 1);
+      assert(locations_to_string(mapped.locate(numbers)) == called_locations);
+      remove("test_pmatch.hfst");
+    }
+
+  delete harmonizer;
+
+
+  verbose_print("Word vector searches");
+
+  /* A model with a dimension that isn't a multiple of the SIMD width,
+     and some vectors of length 0, which are never anyone's neighbours */
+  {
+    const size_t model_size = 200;
+    const size_t dimension = 13;
+    srand(1);
+    std::vector<std::vector<double> > vectors;
+    FILE * model = fopen("test_pmatch.vec", "wb");
+    fprintf(model, "%u %u\n", (unsigned int) model_size,
+            (unsigned int) dimension);
+    for (size_t i = 0; i < model_size; i++)
+      {
+        std::vector<double> v;
+        fprintf(model, "w%u", (unsigned int) i);
+        for (size_t k = 0; k < dimension; k++)
+          {
+            v.push_back(i % 17 == 0 ? 0.0 : (rand() % 7 - 3) / 2.0);
+            fprintf(model, " %g", v.back());
+          }
+        fprintf(model, "\n");
+        vectors.push_back(v);
+      }
+    fclose(model);
+
+    WordVectorIndex index;
+    assert(index.read("test_pmatch.vec"));
+    remove("test_pmatch.vec");
+    assert(index.size() == model_size && index.dimension() == dimension);
+    assert(index.find("w42") == 42 && index.word(42) == "w42");
+    assert(index.find("w200") == index.size());
+
+    const size_t ns[] = { 1, 5, 50, 300 };
+    for (unsigned int query = 0; query < 20; query++)
+      {
+        std::vector<double> point;
+        std::vector<WordVecFloat> float_point;
+        for (size_t k = 0; k < dimension; k++)
+          {
+            point.push_back((rand() % 9 - 4) / 4.0);
+            float_point.push_back(point.back());
+          }
+        std::vector<double> distances;
+        for (size_t i = 0; i < model_size; i++)
+          distances.push_back(cosine_distance(vectors[i], point));
+
+        for (unsigned int j = 0; j < 4; j++)
+          {
+            std::vector<WordVectorIndex::Neighbour> exact =
+              index.nearest(&float_point[0], ns[j]);
+            check_nearest(exact, distances, ns[j]);
+
+            /* With as many candidates as vectors, the approximate search
+               is exact, and with fewer it finds real distances. */
+            index.set_approximate_candidates(model_size);
+            assert(index.nearest(&float_point[0], ns[j]) == exact);
+            index.set_approximate_candidates(20);
+            std::vector<WordVectorIndex::Neighbour> approximate =
+              index.nearest(&float_point[0], ns[j]);
+            assert(approximate.size() <= ns[j]);
+            for (size_t rank = 0; rank < approximate.size(); rank++)
+              {
+                double distance = distances[approximate[rank].first];
+                assert(distance == distance);
+                assert(std::fabs(approximate[rank].second - distance)
+                       < 1e-4);
+              }
+            index.set_approximate_candidates(0);
+          }
+
+        /* Each vector moved halfway towards (or as far away from) a
+           plane through the origin */
+        std::vector<double> plane(dimension, 0.0);
+        plane[query % dimension] = 1.0;
+        plane[(query + 5) % dimension] = -0.5;
+        std::vector<WordVecFloat> float_plane(plane.begin(), plane.end());
+        for (int negative = 0; negative < 2; negative++)
+          {
+            std::vector<double> moved_distances;
+            for (size_t i = 0; i < model_size; i++)
+              {
+                double v_dot_plane = 0, plane_square_sum = 0;
+                for (size_t k = 0; k < dimension; k++)
+                  {
+                    v_dot_plane += vectors[i][k] * plane[k];
+                    plane_square_sum += plane[k] * plane[k];
+                  }
+                double s = (negative ? -0.5 : 0.5) * -v_dot_plane
+                  / plane_square_sum;
+                std::vector<double> moved(vectors[i]);
+                for (size_t k = 0; k < dimension; k++)
+                  moved[k] += s * plane[k];
+                moved_distances.push_back(cosine_distance(moved, point));
+              }
+            for (unsigned int j = 0; j < 4; j++)
+              check_nearest(index.nearest_transformed
+                            (&float_point[0], &float_plane[0], 0.0, 0.5,
+                             negative == 1, ns[j]),
+                            moved_distances, ns[j]);
+          }
+      }
+
+    /* Nothing is at a distance from a point of length 0. */
+    std::vector<WordVecFloat> origin(dimension, 0.0);
+    assert(index.nearest(&origin[0], 5).empty());
+  }
+
+
+
+  verbose_print("Work budgets");
+
+  /* However soon the budget runs out, the output covers the whole input:
+     the matches found until then and the rest unmatched. */
+  {
+    std::string long_text = text + " a";
+    for (unsigned int i = 0; i < 500; i++)
+      long_text += "b";
+    long_text += "c cat category";
+    std::string unlimited_output = container.match(long_text);
+    std::string unlimited_locations =
+      locations_to_string(container.locate(long_text));
+    assert(unlimited_output.find("<ABC>abbbbb") != std::string::npos);
+    assert(located_input(container.locate(long_text)) == long_text);
+
+    hfst_ol::PmatchContext context;
+    const unsigned long steps[] = { 1, 2, 5, 20, 100, 500, 0 };
+    for (unsigned int i = 0; steps[i] != 0; i++)
+      {
+        hfst_ol::PmatchBudget budget;
+        budget.max_steps = steps[i];
+        std::string output = container.match(long_text, context, budget);
+        assert(strip_tags(output) == long_text);
+        assert(context.budget_exhausted());
+        assert(context.spent.exhausted
+               == hfst_ol::PmatchBudgetUsage::STEP_LIMIT);
+        assert(located_input(container.locate(long_text, context, budget))
+               == long_text);
+      }
+    const size_t bytes[] = { 1, 100, 1000, 0 };
+    for (unsigned int i = 0; bytes[i] != 0; i++)
+      {
+        hfst_ol::PmatchBudget budget;
+        budget.max_bytes = bytes[i];
+        assert(strip_tags(container.match(long_text, context, budget))
+               == long_text);
+        assert(located_input(container.locate(long_text, context, budget))
+               == long_text);
+      }
+
+    /* A budget that is never reached changes nothing. */
+    hfst_ol::PmatchBudget ample;
+    ample.max_steps = 100000000;
+    ample.max_bytes = 100000000;
+    ample.max_time = 1000.0;
+    assert(container.match(long_text, context, ample) == unlimited_output);
+    assert(not context.budget_exhausted());
+    assert(locations_to_string(container.locate(long_text, context, ample))
+           == unlimited_locations);
+
+    /* A stream counts as one input for its budget. */
+    hfst_ol::PmatchBudget budget;
+    budget.max_steps = 100;
+    hfst_ol::PmatchStream stream(container);
+    stream.set_budget(budget);
+    std::string output;
+    for (size_t i = 0; i < long_text.size(); i += 7)
+      {
+        stream.push(long_text.substr(i, 7));
+        output += stream.take_output();
+      }
+    stream.finish();
+    output += stream.take_output();
+    assert(strip_tags(output) == long_text);
+  }
+
+
+
+  verbose_print("Binary tokenize output");
+
+  /* What BinaryLocationWriter writes, BinaryLocationReader reads back
+     as it was located, with the container's symbols in the stream header
+     or with all symbols local to their records. */
+  {
+    hfst_ol::LocationVectorVector lvv = container.locate(text);
+    hfst_ol::LocationVectorVector numbers_lvv = container.locate("12 cat");
+    for (int with_header = 0; with_header < 2; with_header++)
+      {
+        for (int print_all = 0; print_all < 2; print_all++)
+          {
+            BinaryLocationWriter writer = with_header ?
+              BinaryLocationWriter(container) : BinaryLocationWriter();
+            hfst_ol_tokenize::TokenizeSettings settings;
+            settings.output_format = hfst_ol_tokenize::binary;
+            settings.print_all = (print_all == 1);
+            std::ostringstream out;
+            writer.write_header(out);
+            writer.write(lvv, out, settings);
+            writer.write_verbatim("[<superblank>]", out);
+            writer.write(numbers_lvv, out, settings);
+
+            std::istringstream in(out.str());
+            BinaryLocationReader reader(in);
+            assert(reader.good());
+            assert(reader.header_symbol_count() == (with_header ?
+                   container.get_symbol_table().size() : 0));
+            assert(reader.next());
+            check_binary_record(reader, lvv, settings);
+            assert(reader.next());
+            assert(reader.get_kind() == BinaryLocationReader::VERBATIM);
+            assert(reader.get_text() == "[<superblank>]");
+            assert(reader.next());
+            check_binary_record(reader, numbers_lvv, settings);
+            assert(not reader.next() && reader.good());
+
+            /* A stream cut short is noticed. */
+            std::istringstream cut(out.str().substr(0, out.str().size() - 3));
+            BinaryLocationReader cut_reader(cut);
+            while (cut_reader.next())
+              ;
+            assert(not cut_reader.good());
+          }
+      }
+    std::istringstream not_binary("<Animal>cat</Animal>\n");
+    assert(not BinaryLocationReader(not_binary).good());
+  }
+
+  /* Duplicate readings are dropped with dedupe and readings past the
+     best weight classes with max_weight_classes, as in the other output
+     formats. */
+  {
+    HfstBasicTransducer ambiguous_top;
+    HfstState ambiguous_entry =
+      add_marker(ambiguous_top, 0, "@PMATCH_ENTRY@");
+    for (unsigned int i = 0; i < 3; i++)
+      add_end_tag(ambiguous_top, add_word(ambiguous_top, ambiguous_entry,
+                                          "dog"), "Animal");
+    add_end_tag(ambiguous_top, add_word(ambiguous_top, ambiguous_entry,
+                                        "dog"), "Verb", 1);
+    add_end_tag(ambiguous_top, add_word(ambiguous_top, ambiguous_entry,
+                                        "dog"), "Animal", 2);
+    hfst_ol::PmatchContainer ambiguous(to_ol(ambiguous_top));
+    hfst_ol::LocationVectorVector lvv = ambiguous.locate("a dog and dogs");
+    assert(lvv.size() == 5 && lvv[1].size() == 5);
+
+    const bool dedupes[] = { false, true, true, false, true };
+    const int classes[] = { std::numeric_limits<int>::max(),
+                            std::numeric_limits<int>::max(), 1, 1, 2 };
+    const unsigned int readings[] = { 5, 3, 1, 3, 2 };
+    for (unsigned int i = 0; i < 5; i++)
+      {
+        BinaryLocationWriter writer(ambiguous);
+        hfst_ol_tokenize::TokenizeSettings settings;
+        settings.output_format = hfst_ol_tokenize::binary;
+        settings.print_all = true;
+        settings.dedupe = dedupes[i];
+        settings.max_weight_classes = classes[i];
+        std::ostringstream out;
+        writer.write_header(out);
+        writer.write(lvv, out, settings);
+
+        std::istringstream in(out.str());
+        BinaryLocationReader reader(in);
+        assert(reader.next());
+        check_binary_record(reader, filtered_readings(lvv, settings),
+                            settings);
+        const std::vector<BinaryLocationReader::Token> & tokens =
+          reader.get_tokens();
+        assert(tokens.size() == 5);
+        assert(tokens[1].reading_count == readings[i]);
+        assert(tokens[3].reading_count == readings[i]);
+        assert(reader.symbol(tokens[1].readings[0].tag) == "<Animal>");
+        assert(tokens[1].readings[0].weight == 0);
+        assert(not reader.next() && reader.good());
+      }
+  }
+
+}
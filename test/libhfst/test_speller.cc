@@ -0,0 +1,541 @@
+/*
+   Test file for spell-checking with hfst_ol::Speller and
+   hfst_ol::BatchSpeller.
+   The lexicon is a list of random words and the error model allows at
+   most two weighted edits, so that the corrections can be checked
+   against an exhaustive search of the lexicon.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <map>
+
+#include "HfstTransducer.h"
+#include "implementations/ConvertTransducerFormat.h"
+#include "implementations/optimized-lookup/transducer.h"
+#include "implementations/optimized-lookup/ospell_batch.h"
+#include "auxiliary_functions.cc"
+
+using namespace hfst;
+
+using implementations::HfstState;
+using implementations::HfstBasicTransition;
+using implementations::HfstBasicTransducer;
+using implementations::ConversionFunctions;
+using hfst_ol::StringWeightPair;
+
+const char * letters = "abcdefghijklmnopqrst";
+const unsigned int max_edits = 2;
+const float deletion_weight = 1.5;
+const float insertion_weight = 1.5;
+
+float substitution_weight(char from, char to)
+{
+  return 1.0 + ((from + to) % 5) / 10.0f;
+}
+
+/* The lightest way to edit \a from into \a to with at most max_edits
+   edits, or infinity */
+float edit_weight(const std::string & from, const std::string & to)
+{
+  const float inf = std::numeric_limits<float>::infinity();
+  /* weights[i][j][e]: from[0,i) edited into to[0,j) with e edits */
+  std::vector<std::vector<std::vector<float> > > weights
+    (from.size() + 1, std::vector<std::vector<float> >
+     (to.size() + 1, std::vector<float>(max_edits + 1, inf)));
+  weights[0][0][0] = 0;
+  for (size_t i = 0; i <= from.size(); i++)
+    for (size_t j = 0; j <= to.size(); j++)
+      for (unsigned int e = 0; e <= max_edits; e++)
+        {
+          float w = weights[i][j][e];
+          if (w == inf)
+            continue;
+          if (i < from.size() && j < to.size() && from[i] == to[j])
+            weights[i+1][j+1][e] = std::min(weights[i+1][j+1][e], w);
+          if (e == max_edits)
+            continue;
+          if (i < from.size())
+            weights[i+1][j][e+1] =
+              std::min(weights[i+1][j][e+1], w + deletion_weight);
+          if (j < to.size())
+            weights[i][j+1][e+1] =
+              std::min(weights[i][j+1][e+1], w + insertion_weight);
+          if (i < from.size() && j < to.size() && from[i] != to[j])
+            weights[i+1][j+1][e+1] =
+              std::min(weights[i+1][j+1][e+1],
+                       w + substitution_weight(from[i], to[j]));
+        }
+  float best = inf;
+  for (unsigned int e = 0; e <= max_edits; e++)
+    best = std::min(best, weights[from.size()][to.size()][e]);
+  return best;
+}
+
+bool lighter(const StringWeightPair & a, const StringWeightPair & b)
+{
+  return a.second < b.second;
+}
+
+/* The corrections of \a input in \a lexicon, the lightest first, found
+   by trying every word */
+std::vector<StringWeightPair> all_corrections
+(const std::string & input, const std::map<std::string, float> & lexicon,
+ float max_weight)
+{
+  std::vector<StringWeightPair> corrections;
+  for (std::map<std::string, float>::const_iterator it = lexicon.begin();
+       it != lexicon.end(); it++)
+    {
+      float weight = edit_weight(input, it->first) + it->second;
+      if (weight != std::numeric_limits<float>::infinity() &&
+          weight <= max_weight)
+        corrections.push_back(StringWeightPair(it->first, weight));
+    }
+  std::stable_sort(corrections.begin(), corrections.end(), lighter);
+  return corrections;
+}
+
+std::vector<StringWeightPair> correct
+(hfst_ol::Speller & speller, const std::string & input, unsigned int nbest,
+ float max_weight)
+{
+  std::vector<char> line(input.begin(), input.end());
+  line.push_back('\0');
+  hfst_ol::CorrectionQueue queue =
+    speller.correct(&line[0], nbest, max_weight);
+  std::vector<StringWeightPair> corrections;
+  for (; not queue.empty(); queue.pop())
+    corrections.push_back(queue.top());
+  return corrections;
+}
+
+bool check(hfst_ol::Speller & speller, const std::string & input)
+{
+  std::vector<char> line(input.begin(), input.end());
+  line.push_back('\0');
+  return speller.check(&line[0]);
+}
+
+/* Check that \a found are the \a nbest (or all, if 0) lightest of
+   \a expected. Of corrections of (nearly) the same weight, any may be
+   left out. */
+void check_corrections(const std::vector<StringWeightPair> & found,
+                       const std::vector<StringWeightPair> & expected,
+                       unsigned int nbest)
+{
+  std::map<std::string, float> expected_weights;
+  for (std::vector<StringWeightPair>::const_iterator it = expected.begin();
+       it != expected.end(); it++)
+    expected_weights[it->first] = it->second;
+  size_t count = expected.size();
+  if (nbest != 0 && count > nbest)
+    count = nbest;
+  assert(found.size() == count);
+  for (size_t i = 0; i < found.size(); i++)
+    {
+      assert(expected_weights.count(found[i].first) == 1);
+      assert(std::fabs(found[i].second - expected_weights[found[i].first])
+             < 1e-4);
+      assert(std::fabs(found[i].second - expected[i].second) < 1e-4);
+    }
+}
+
+int main(int argc, char **argv)
+{
+
+  /* A lexicon of random words, some of them more than once with
+     different weights */
+  srand(5);
+  HfstBasicTransducer lexicon;
+  std::map<std::string, float> words;
+  std::vector<std::string> word_list;
+  for (unsigned int i = 0; i < 300; i++)
+    {
+      std::string word;
+      unsigned int length = 3 + rand() % 6;
+      for (unsigned int k = 0; k < length; k++)
+        word += letters[rand() % 20];
+      if (i % 50 == 49)
+        word = word_list[rand() % word_list.size()];
+      word_list.push_back(word);
+      float first_weight = (rand() % 30) / 10.0f;
+      float final_weight = (rand() % 5) / 10.0f;
+      HfstState state = 0;
+      for (size_t k = 0; k < word.size(); k++)
+        {
+          HfstState target = lexicon.add_state();
+          std::string symbol(1, word[k]);
+          lexicon.add_transition
+            (state, HfstBasicTransition(target, symbol, symbol,
+                                        k == 0 ? first_weight : 0));
+          state = target;
+        }
+      lexicon.set_final_weight(state, final_weight);
+      if (words.count(word) == 0 ||
+          words[word] > first_weight + final_weight)
+        words[word] = first_weight + final_weight;
+    }
+
+  /* At most max_edits deletions, insertions and substitutions */
+  HfstBasicTransducer errors;
+  for (unsigned int e = 0; e < max_edits; e++)
+    errors.add_state();
+  for (unsigned int e = 0; e <= max_edits; e++)
+    {
+      errors.set_final_weight(e, 0);
+      for (const char * a = letters; *a != '\0'; a++)
+        {
+          std::string A(1, *a);
+          errors.add_transition(e, HfstBasicTransition(e, A, A, 0));
+          if (e == max_edits)
+            continue;
+          errors.add_transition
+            (e, HfstBasicTransition(e + 1, A, "@_EPSILON_SYMBOL_@",
+                                    deletion_weight));
+          errors.add_transition
+            (e, HfstBasicTransition(e + 1, "@_EPSILON_SYMBOL_@", A,
+                                    insertion_weight));
+          for (const char * b = letters; *b != '\0'; b++)
+            {
+              if (*a != *b)
+                errors.add_transition
+                  (e, HfstBasicTransition(e + 1, A, std::string(1, *b),
+                                          substitution_weight(*a, *b)));
+            }
+        }
+    }
+
+  hfst_ol::Transducer * lexicon_ol =
+    ConversionFunctions::hfst_basic_transducer_to_hfst_ol(&lexicon, true, "");
+  hfst_ol::Transducer * errors_ol =
+    ConversionFunctions::hfst_basic_transducer_to_hfst_ol(&errors, true, "");
+
+  /* Spellers only use the lookaheads of the transducers they share, they
+     don't build them */
+  {
+    hfst_ol::Speller speller(errors_ol, lexicon_ol);
+    assert(errors_ol->get_input_lookahead() == NULL);
+    assert(lexicon_ol->get_input_lookahead() == NULL);
+  }
+  errors_ol->build_input_lookahead();
+  lexicon_ol->build_input_lookahead();
+
+  /* Words of the lexicon, with up to three random edits, and random
+     strings */
+  std::vector<std::string> inputs;
+  for (unsigned int i = 0; i < 60; i++)
+    {
+      std::string input = word_list[rand() % word_list.size()];
+      for (unsigned int edits = i % 4; edits > 0 && input.size() > 1; edits--)
+        {
+          size_t pos = rand() % input.size();
+          if (rand() % 3 == 0)
+            input.erase(pos, 1);
+          else if (rand() % 2 == 0)
+            input.insert(pos, 1, letters[rand() % 20]);
+          else
+            input[pos] = letters[rand() % 20];
+        }
+      inputs.push_back(input);
+    }
+  inputs.push_back("qqqqqqqq");
+  inputs.push_back("a");
+
+  const unsigned int nbests[] = { 0, 1, 3, 10 };
+  /* The weights are sums of tenths, so these limits aren't on the edge
+     of rounding error */
+  const float max_weights[] = { std::numeric_limits<float>::infinity(),
+                                2.05, 3.45 };
+
+
+  verbose_print("Speller: checking");
+
+  {
+    hfst_ol::Speller speller(errors_ol, lexicon_ol);
+    for (std::vector<std::string>::const_iterator it = inputs.begin();
+         it != inputs.end(); it++)
+      assert(check(speller, *it) == (words.count(*it) == 1));
+  }
+
+
+  verbose_print("Speller: corrections against an exhaustive search");
+
+  /* The best-first search with a limit on the number or the weight of
+     the corrections finds the same ones as trying every word. */
+  {
+    hfst_ol::Speller speller(errors_ol, lexicon_ol);
+    for (std::vector<std::string>::const_iterator it = inputs.begin();
+         it != inputs.end(); it++)
+      {
+        for (unsigned int w = 0; w < 3; w++)
+          {
+            std::vector<StringWeightPair> expected =
+              all_corrections(*it, words, max_weights[w]);
+            for (unsigned int n = 0; n < 4; n++)
+              check_corrections(correct(speller, *it, nbests[n],
+                                        max_weights[w]),
+                                expected, nbests[n]);
+          }
+      }
+  }
+
+
+  verbose_print("Speller: searches reusing the nodes");
+
+  /* A Speller reuses the space of its search nodes, so searching the
+     same inputs again, in another order, takes no more space and finds
+     the same as a new Speller. */
+  {
+    hfst_ol::Speller speller(errors_ol, lexicon_ol);
+    std::vector<std::vector<StringWeightPair> > first;
+    for (std::vector<std::string>::const_iterator it = inputs.begin();
+         it != inputs.end(); it++)
+      first.push_back(correct(speller, *it, 0, max_weights[2]));
+    size_t capacity = speller.nodes.capacity();
+    for (size_t i = inputs.size(); i > 0; i--)
+      {
+        assert(correct(speller, inputs[i - 1], 0, max_weights[2])
+               == first[i - 1]);
+        assert(check(speller, inputs[i - 1])
+               == (words.count(inputs[i - 1]) == 1));
+      }
+    assert(speller.nodes.capacity() == capacity);
+    hfst_ol::Speller fresh(errors_ol, lexicon_ol);
+    for (size_t i = 0; i < inputs.size(); i++)
+      assert(correct(fresh, inputs[i], 0, max_weights[2]) == first[i]);
+  }
+
+
+  verbose_print("Speller: flag diacritics");
+
+  /* pa qq | pb rr, where the ending is chosen by a flag set at the
+     start, so "parr" and "pbqq" aren't words. The flag states of the
+     nodes of a search must be kept apart. */
+  {
+    HfstBasicTransducer flagged;
+    const char * starts[] = { "a", "b" };
+    const char * ends[] = { "qq", "rr" };
+    HfstState middle = flagged.add_state();
+    HfstState last = flagged.add_state();
+    flagged.set_final_weight(last, 0);
+    for (unsigned int i = 0; i < 2; i++)
+      {
+        std::string value = std::string("@P.END.") + starts[i] + "@";
+        HfstState state = flagged.add_state();
+        flagged.add_transition(0, HfstBasicTransition(state, value, value, 0));
+        HfstState p = flagged.add_state();
+        flagged.add_transition(state, HfstBasicTransition(p, "p", "p", 0));
+        std::string start(starts[i]);
+        flagged.add_transition
+          (p, HfstBasicTransition(middle, start, start, 0));
+        std::string require = std::string("@R.END.") + starts[i] + "@";
+        state = flagged.add_state();
+        flagged.add_transition
+          (middle, HfstBasicTransition(state, require, require, 0));
+        for (const char * c = ends[i]; *c != '\0'; c++)
+          {
+            HfstState target = c[1] == '\0' ? last : flagged.add_state();
+            std::string symbol(1, *c);
+            flagged.add_transition
+              (state, HfstBasicTransition(target, symbol, symbol, 0));
+            state = target;
+          }
+      }
+    /* The speller needs the lexicon to know all the symbols that the
+       error model can write, so they lead to a dead end. */
+    HfstState dead_end = flagged.add_state();
+    for (const char * c = letters; *c != '\0'; c++)
+      flagged.add_transition
+        (0, HfstBasicTransition(dead_end, std::string(1, *c),
+                                std::string(1, *c), 0));
+    std::map<std::string, float> flagged_words;
+    flagged_words["paqq"] = 0;
+    flagged_words["pbrr"] = 0;
+
+    hfst_ol::Transducer * flagged_ol =
+      ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+      (&flagged, true, "");
+    flagged_ol->build_input_lookahead();
+    hfst_ol::Speller speller(errors_ol, flagged_ol);
+    const char * flagged_inputs[] =
+      { "paqq", "pbrr", "parr", "pbqq", "paq", "pbr", "aqq", "pqq", NULL };
+    for (unsigned int i = 0; flagged_inputs[i] != NULL; i++)
+      {
+        std::string input(flagged_inputs[i]);
+        assert(check(speller, input) == (flagged_words.count(input) == 1));
+        for (unsigned int n = 0; n < 4; n++)
+          check_corrections(correct(speller, input, nbests[n],
+                                    max_weights[0]),
+                            all_corrections(input, flagged_words,
+                                            max_weights[0]),
+                            nbests[n]);
+      }
+    delete flagged_ol;
+  }
+
+
+  verbose_print("BatchSpeller");
+
+  /* In any number of threads, with or without a cache, a batch gets the
+     same results as a Speller spelling its tokens one at a time. */
+  {
+    StringVector batch;
+    for (unsigned int i = 0; i < 200; i++)
+      batch.push_back(inputs[(i * 7) % inputs.size()]);
+    for (unsigned int w = 0; w < 3; w += 2)
+      {
+        hfst_ol::Speller speller(errors_ol, lexicon_ol);
+        hfst_ol::SpellResultVector expected(batch.size());
+        for (size_t i = 0; i < batch.size(); i++)
+          {
+            expected[i].in_lexicon = check(speller, batch[i]);
+            if (not expected[i].in_lexicon)
+              expected[i].corrections =
+                correct(speller, batch[i], 5, max_weights[w]);
+          }
+
+        const unsigned int threads[] = { 1, 4 };
+        const size_t cache_sizes[] = { 0, 10, 1000 };
+        for (unsigned int t = 0; t < 2; t++)
+          {
+            for (unsigned int c = 0; c < 3; c++)
+              {
+                hfst_ol::BatchSpeller batch_speller
+                  (errors_ol, lexicon_ol, threads[t]);
+                assert(batch_speller.get_thread_count() == threads[t]);
+                batch_speller.set_nbest(5);
+                batch_speller.set_max_weight(max_weights[w]);
+                batch_speller.set_cache_size(cache_sizes[c]);
+                /* The second time, corrections come from the cache. */
+                for (unsigned int round = 0; round < 2; round++)
+                  {
+                    hfst_ol::SpellResultVector results;
+                    batch_speller.spell(batch, results);
+                    assert(results.size() == expected.size());
+                    for (size_t i = 0; i < results.size(); i++)
+                      {
+                        assert(results[i].in_lexicon
+                               == expected[i].in_lexicon);
+                        assert(results[i].corrections
+                               == expected[i].corrections);
+                      }
+                  }
+                if (cache_sizes[c] == 0)
+                  assert(batch_speller.get_cache_hits() == 0);
+                else if (cache_sizes[c] > inputs.size())
+                  assert(batch_speller.get_cache_hits() > 0);
+                hfst_ol::SpellResult single = batch_speller.spell(batch[1]);
+                assert(single.in_lexicon == expected[1].in_lexicon);
+                assert(single.corrections == expected[1].corrections);
+              }
+          }
+      }
+  }
+
+
+  verbose_print("Speller: input lookahead");
+
+  /* The lookahead only prunes nodes that can't read the rest of the
+     input, so without it the same is found, with more nodes expanded.
+     Transducers whose lookahead wasn't built search like it was off. */
+  {
+    hfst_ol::Transducer * unbuilt_lexicon =
+      ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+      (&lexicon, true, "");
+    hfst_ol::Transducer * unbuilt_errors =
+      ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+      (&errors, true, "");
+    hfst_ol::Speller speller(errors_ol, lexicon_ol);
+    hfst_ol::Speller plain(errors_ol, lexicon_ol);
+    hfst_ol::Speller unbuilt(unbuilt_errors, unbuilt_lexicon);
+    plain.use_lookahead = false;
+    for (std::vector<std::string>::const_iterator it = inputs.begin();
+         it != inputs.end(); it++)
+      {
+        bool in_lexicon = check(plain, *it);
+        assert(check(speller, *it) == in_lexicon);
+        assert(check(unbuilt, *it) == in_lexicon);
+        for (unsigned int w = 0; w < 3; w++)
+          {
+            std::vector<StringWeightPair> all =
+              correct(plain, *it, 0, max_weights[w]);
+            assert(correct(speller, *it, 0, max_weights[w]) == all);
+            assert(correct(unbuilt, *it, 0, max_weights[w]) == all);
+            std::vector<StringWeightPair> expected =
+              all_corrections(*it, words, max_weights[w]);
+            for (unsigned int n = 1; n < 4; n++)
+              {
+                check_corrections(correct(plain, *it, nbests[n],
+                                          max_weights[w]),
+                                  expected, nbests[n]);
+                check_corrections(correct(unbuilt, *it, nbests[n],
+                                          max_weights[w]),
+                                  expected, nbests[n]);
+              }
+          }
+      }
+    assert(speller.nodes_expanded <= plain.nodes_expanded);
+    assert(unbuilt.nodes_expanded == plain.nodes_expanded);
+    assert(unbuilt_errors->get_input_lookahead() == NULL);
+    assert(unbuilt_lexicon->get_input_lookahead() == NULL);
+    delete unbuilt_lexicon;
+    delete unbuilt_errors;
+
+    StringVector batch(inputs.begin(), inputs.end());
+    hfst_ol::BatchSpeller batch_speller(errors_ol, lexicon_ol, 2);
+    hfst_ol::BatchSpeller plain_batch(errors_ol, lexicon_ol, 2);
+    plain_batch.set_lookahead(false);
+    batch_speller.set_nbest(3);
+    plain_batch.set_nbest(3);
+    hfst_ol::SpellResultVector results;
+    hfst_ol::SpellResultVector plain_results;
+    batch_speller.spell(batch, results);
+    plain_batch.spell(batch, plain_results);
+    assert(results.size() == plain_results.size());
+    for (size_t i = 0; i < results.size(); i++)
+      {
+        assert(results[i].in_lexicon == plain_results[i].in_lexicon);
+        if (not plain_results[i].in_lexicon)
+          check_corrections(plain_results[i].corrections,
+                            all_corrections(batch[i], words,
+                                            max_weights[0]),
+                            3);
+      }
+    assert(batch_speller.get_nodes_expanded()
+           <= plain_batch.get_nodes_expanded());
+  }
+
+  /* Lookup finds the same analyses once the lookahead is built. */
+  {
+    hfst_ol::Transducer * fresh =
+      ConversionFunctions::hfst_basic_transducer_to_hfst_ol
+      (&lexicon, true, "");
+    assert(fresh->get_input_lookahead() == NULL);
+    std::vector<HfstOneLevelPaths> before;
+    for (std::vector<std::string>::const_iterator it = inputs.begin();
+         it != inputs.end(); it++)
+      {
+        HfstOneLevelPaths * paths = fresh->lookup_fd(*it);
+        before.push_back(*paths);
+        delete paths;
+      }
+    fresh->build_input_lookahead();
+    assert(fresh->get_input_lookahead() != NULL);
+    for (size_t i = 0; i < inputs.size(); i++)
+      {
+        HfstOneLevelPaths * paths = fresh->lookup_fd(inputs[i]);
+        assert(*paths == before[i]);
+        assert(paths->empty() == (words.count(inputs[i]) == 0));
+        delete paths;
+      }
+    delete fresh;
+  }
+
+
+  delete lexicon_ol;
+  delete errors_ol;
+
+}
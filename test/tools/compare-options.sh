@@ -0,0 +1,46 @@
+# Helpers for checking that a tool prints the same when run in different
+# ways, eg. in several threads, with a cache or with the transducer
+# memory-mapped. Source this from a test script.
+
+# repeat_lines COUNT FILE...
+# Print the lines of FILEs (- for standard input) COUNT times over.
+repeat_lines ()
+{
+    repeat_count=$1
+    shift
+    awk -v count=$repeat_count '{ lines[NR] = $0 }
+        END { for (i = 0; i < count; i++)
+                  for (k = 1; k <= NR; k++) print lines[k] }' "$@"
+}
+
+# compare_options INPUT TOOL ARGS OPTIONS...
+# Run TOOL ARGS with INPUT as standard input, then again with each of
+# OPTIONS before ARGS, and fail if a run fails or prints anything, on
+# standard output or standard error, that the first one didn't. The
+# output of the first run is left in compared.out.
+compare_options ()
+{
+    compare_input=$1
+    compare_tool=$2
+    compare_args=$3
+    shift 3
+    if ! $compare_tool $compare_args < $compare_input \
+        > compared.out 2> compared.err ; then
+        echo "FAIL: $compare_tool $compare_args"
+        return 1
+    fi
+    for compare_option in "$@"; do
+        if ! $compare_tool $compare_option $compare_args < $compare_input \
+            > compared.other 2> compared.other.err ; then
+            echo "FAIL: $compare_tool $compare_option $compare_args"
+            return 1
+        fi
+        if ! cmp -s compared.out compared.other \
+            || ! cmp -s compared.err compared.other.err ; then
+            echo "FAIL: $compare_tool $compare_args prints differently with $compare_option"
+            return 1
+        fi
+    done
+    rm compared.err compared.other compared.other.err
+    return 0
+}
@@ -16,6 +16,8 @@ else
     done
 fi
 
+. $srcdir/compare-options.sh
+
 if ! $TOOL -s cat.hfst < $srcdir/cat.strings > test.lookups ; then
     exit 1
 fi
@@ -113,6 +115,32 @@ if ((test -z "$i") || $FORMAT_TOOL --list-formats | grep $i > /dev/null); then
 fi
 done
 
+# threaded lookup, or lookup with the input lookahead, prints the same as
+# unthreaded, in input order
+if [ "$1" != '--python' ] && test -f cat2dog.hfstol ; then
+    printf 'cat\ndog\n\n' | repeat_lines 334 - > many.strings
+    if ! compare_options many.strings $TOOL "-s cat2dog.hfstol" \
+        "-j 2" "-j 4" "-a" "-j 4 -a" ; then
+        exit 1
+    fi
+    rm many.strings compared.out
+fi
+
+# lookup in a memory-mapped archive of several transducers prints the same
+# as lookup in one read into memory
+if [ "$1" != '--python' ] && test -f cat2dog.hfstol \
+    && test -f cat_weight_ambig.hfstol ; then
+    cat cat2dog.hfstol cat_weight_ambig.hfstol cat2dog.hfstol > several.hfstol
+    printf 'cat\ndog\n\ncats\n' > several.strings
+    for cascade in union priority-union composition; do
+        if ! compare_options several.strings $TOOL \
+            "-C $cascade several.hfstol" -m ; then
+            exit 1
+        fi
+    done
+    rm several.hfstol several.strings compared.out
+fi
+
 rm TMP
 rm test.lookups
 rm warnings
@@ -11,6 +11,8 @@ else
     fi
 fi
 
+. $srcdir/compare-options.sh
+
 if ! $TOOL cat2dog.hfstol < $srcdir/cat.strings > test.lookups ; then
     exit 1
 fi
@@ -21,4 +23,59 @@ if ! $TOOL cat2dog.hfstol < empty > test.lookups ; then
     exit 1
 fi
 
+if [ "$1" != '--python' ]; then
+    # Threaded lookup, and lookup with a cache, small or large, prints the
+    # same as plain lookup, in input order, also for lines too long to look
+    # up
+    printf 'cat\ndog\n\n' | repeat_lines 334 - > many.strings
+    awk 'BEGIN { for (i = 0; i < 1200; i++) printf "c"; print "" }' \
+        >> many.strings
+    if ! compare_options many.strings $TOOL cat2dog.hfstol \
+        "-j 2" "-j 4" "-c 1" "-c 100" ; then
+        exit 1
+    fi
+    if ! grep -q "^cccccccccc" compared.out ; then
+        echo "FAIL: a line too long to look up should still be answered"
+        exit 1
+    fi
+    rm many.strings compared.out
+fi
+
+if [ "$1" != '--python' ] && test -x $TOOLDIR/hfst-txt2fst \
+    && test -x $TOOLDIR/hfst-fst2fst ; then
+    # Conversion in several threads writes the same transducer as in one.
+    # States are split between threads at least 4096 at a time, so the
+    # transducer needs more than 4 * 4096 of them for four threads to run.
+    awk 'BEGIN { srand(1); s = 0;
+                 for (i = 0; i < 5000; i++) {
+                     len = 1 + int(rand() * 8); prev = 0; word = "";
+                     for (k = 0; k < len; k++) {
+                         c = substr("abcdefghij", 1 + int(rand() * 10), 1);
+                         s++; print prev "\t" s "\t" c "\t" c "\t" k / 10;
+                         prev = s; word = word c }
+                     print prev "\t" i % 3;
+                     print word > "many.strings" } }' > many.txt
+    if ! $TOOLDIR/hfst-txt2fst -e '@0@' -i many.txt -o many.hfst ; then
+        exit 1
+    fi
+    for threads in 1 4; do
+        if ! $TOOLDIR/hfst-fst2fst -w -j $threads -i many.hfst \
+            -o many$threads.hfstol ; then
+            exit 1
+        fi
+    done
+    if ! cmp -s many1.hfstol many4.hfstol ; then
+        echo "FAIL: conversion in 4 threads differs from conversion in one"
+        exit 1
+    fi
+    if ! $TOOL many4.hfstol < many.strings > test.lookups ; then
+        exit 1
+    fi
+    if grep -q "+?" test.lookups ; then
+        echo "FAIL: every word should be found in the converted transducer"
+        exit 1
+    fi
+    rm many.txt many.hfst many1.hfstol many4.hfstol many.strings
+fi
+
 rm test.lookups empty
@@ -14,6 +14,8 @@ fi
 if [ "$srcdir" = "" ] ; then
     srcdir=. ;
 fi
+. $srcdir/compare-options.sh
+
 if ! $TOOL pmatch_endtag.pmatch < $srcdir/cat.strings > test.lookups ; then
     exit 1
 fi
@@ -28,6 +30,33 @@ if ! echo "cat" | $TOOL pmatch_endtag.pmatch > test.pmatch;
         exit 1
     fi
     
+# --threads, with input long enough to be split between the threads,
+# prints the same as one thread
+if [ "$1" != '--python' ]; then
+    echo "a cat and a dog and a cat" | repeat_lines 6000 - > many.strings
+    if ! compare_options many.strings $TOOL pmatch_endtag.pmatch "-j 4" ; then
+        exit 1
+    fi
+    if ! test `grep -c "<animal>cat</animal>" compared.out` -eq 6000 ; then
+        echo "FAIL: every line should be matched"
+        exit 1
+    fi
+    # however little work each line may take, its output still covers all
+    # of the line
+    for budget in "--max-steps 1" "--max-steps 10" "--max-bytes 1" \
+        "--max-bytes 100" "--max-wall-time 0.000001"; do
+        if ! $TOOL $budget pmatch_endtag.pmatch < many.strings \
+            > test.threaded ; then
+            exit 1
+        fi
+        if ! sed -e 's/<[^>]*>//g' test.threaded | cmp -s - many.strings ; then
+            echo "FAIL: matching with $budget should pass the rest of the input through"
+            exit 1
+        fi
+    done
+    rm many.strings compared.out test.threaded
+fi
+
 rm test.pmatch test.lookups
 
 # Jyrki's suite
@@ -963,3 +963,23 @@ test_begin "Exc()"
 check_compile_run \
     --code 'Match runs of characters not in {a, b, c}' 'set need-separators off regex Exc({abc})+ EndTag(A);' \
     --inout '' 'aa bb aabqbcc xyaz' 'aa<A> </A>bb<A> </A>aab<A>q</A>bcc<A> xy</A>a<A>z</A>'
+
+# Memoised RTN calls must match the same as calling the RTNs each time
+
+test_begin "Ins with --memoize-rtns"
+
+set_runner_opts -n --memoize-rtns
+
+check_compile_run \
+    --code 'Ins followed by a character contained in Ins expression' \
+    'Define A [Alpha+]; Define TOP [Ins(A) {a} EndTag(A)];' \
+    --inout '' 'aa' '<A>aa</A>'
+
+check_compile_run \
+    --code 'Disjunction of two Ins expressions' \
+    'Define S { }; Define NS [? - S]; Define A [NS* {a} NS*]; Define B [NS* {b} NS*]; Define C {c}; Define TOP [[[Ins(A) | Ins(B)] S C]+ EndTag(AB)];' \
+    --inout 'Multiple matches' \
+    'k c a c b c ka c ak c kak c aa c bb c ab c ba c aba c bab c kakb c' \
+    'k c <AB>a c</AB> <AB>b c</AB> <AB>ka c</AB> <AB>ak c</AB> <AB>kak c</AB> <AB>aa c</AB> <AB>bb c</AB> <AB>ab c</AB> <AB>ba c</AB> <AB>aba c</AB> <AB>bab c</AB> <AB>kakb c</AB>'
+
+set_runner_opts -n
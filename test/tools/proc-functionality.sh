@@ -14,6 +14,7 @@ fi
 if [ "$srcdir" = "" ]; then
     srcdir="./";
 fi
+. $srcdir/compare-options.sh
 
 # basic lookup
 if ! echo "cat" | $TOOL cat2dog.hfstol | tr -d '\r' > test.strings ; then
@@ -67,6 +68,20 @@ if ! diff test.strings $srcdir/proc-caps-out2.strings  ; then
     echo uppercase roundtrip diffs
     exit 1
 fi
+# generation with a cache, small enough to evict and large enough not to
+if [ "$1" != '--python' ]; then
+    for cache in 1 100; do
+        if ! $TOOL -g --cache $cache proc-caps.genhfstol < $srcdir/proc-caps-gen.strings | tr -d '\r' > test.strings ; then
+            echo cached roundtrip fail:
+            cat test.strings
+            exit 1
+        fi
+        if ! diff test.strings $srcdir/proc-caps-out2.strings  ; then
+            echo cached roundtrip diffs with cache $cache
+            exit 1
+        fi
+    done
+fi
 if ! $TOOL -c proc-caps.hfstol < $srcdir/proc-caps-in.strings | tr -d '\r' > test.strings ; then
     echo uppercase 2 fail:
     cat test.strings
@@ -166,6 +181,60 @@ if ! diff test.strings $srcdir/proc-compounds-out.strings ; then
     echo compound diffs
     exit 1
 fi
+
+# --threads, with input long enough to be split into many segments,
+# prints the same as one thread, without falling back to one thread
+if [ "$1" != '--python' ]; then
+    repeat_lines 2000 $srcdir/proc-caps-in.strings \
+        $srcdir/proc-compounds.strings > many.strings
+    for options in "proc-caps.hfstol" "-c proc-caps.hfstol" \
+        "--cg proc-caps.hfstol" "-z proc-caps.hfstol" \
+        "-W cat_weight_ambig.hfstol" "compounds.hfstol"; do
+        if ! compare_options many.strings $TOOL "$options" \
+            "--threads 2" "--threads 4" ; then
+            exit 1
+        fi
+        if ! $TOOL --threads 2 $options < many.strings > /dev/null \
+            2> threads.err ; then
+            echo "FAIL: $TOOL --threads 2 $options"
+            exit 1
+        fi
+        if grep -q "processing in one thread" threads.err ; then
+            echo "FAIL: $TOOL --threads 2 $options fell back to one thread"
+            exit 1
+        fi
+    done
+    # a transducer that can consume every blank can't be split between
+    # threads, so it is run in one thread, with a warning
+    if test -x $TOOLDIR/hfst-regexp2fst && test -x $TOOLDIR/hfst-fst2fst ; then
+        printf '%s\n' 'a [a | " " | "\t" | "\n" | "\r" | "\v" | "\f"]*' \
+            | $TOOLDIR/hfst-regexp2fst | $TOOLDIR/hfst-fst2fst -w -o blanks.hfstol
+        if ! $TOOL blanks.hfstol < many.strings > test.strings ; then
+            echo blanks fail
+            exit 1
+        fi
+        if ! $TOOL --threads 2 blanks.hfstol < many.strings > threads.out \
+            2> threads.err ; then
+            echo threaded blanks fail
+            exit 1
+        fi
+        if ! cmp -s test.strings threads.out ; then
+            echo threaded blanks diffs
+            exit 1
+        fi
+        if ! grep -q "processing in one thread" threads.err ; then
+            echo "threaded blanks didn't warn about processing in one thread"
+            exit 1
+        fi
+        rm blanks.hfstol threads.out
+    fi
+    repeat_lines 1000 $srcdir/proc-caps-gen.strings > many.strings
+    if ! compare_options many.strings $TOOL "-g proc-caps.genhfstol" \
+        "--threads 2" "--threads 4" ; then
+        exit 1
+    fi
+    rm many.strings compared.out threads.err
+fi
 rm test.strings
 
 ## skip new test introduced in version 3014...
@@ -0,0 +1,72 @@
+#!/bin/sh
+TOOLDIR=../../tools/src
+TOOL=$TOOLDIR/hfst-spell
+
+for tool in $TOOL $TOOLDIR/hfst-txt2fst; do
+    if ! test -x $tool; then
+	exit 0;
+    fi
+done
+
+if [ "$srcdir" = "" ]; then
+    srcdir=. ;
+fi
+. $srcdir/compare-options.sh
+
+# A lexicon of random words, an error model of one weighted deletion,
+# insertion or substitution, and the words with such errors in them
+awk 'BEGIN { srand(1); s = 0; letters = "abcdefghij";
+             for (i = 0; i < 300; i++) {
+                 len = 2 + int(rand() * 6); prev = 0; word = "";
+                 for (k = 0; k < len; k++) {
+                     c = substr(letters, 1 + int(rand() * 10), 1);
+                     s++; print prev "\t" s "\t" c "\t" c "\t" (k == 0 ? i % 7 / 10 : 0);
+                     prev = s; word = word c }
+                 print prev "\t" i % 3 / 10;
+                 words[i] = word }
+             for (i = 0; i < 3000; i++) {
+                 word = words[int(rand() * 300)];
+                 pos = 1 + int(rand() * length(word));
+                 c = substr(letters, 1 + int(rand() * 10), 1);
+                 if (i % 4 == 1)
+                     word = substr(word, 1, pos - 1) substr(word, pos + 1);
+                 else if (i % 4 == 2)
+                     word = substr(word, 1, pos - 1) c substr(word, pos);
+                 else if (i % 4 == 3)
+                     word = substr(word, 1, pos - 1) c substr(word, pos + 1);
+                 print word > "spell.strings" } }' > spell-lexicon.txt
+awk 'BEGIN { letters = "abcdefghij";
+             for (i = 1; i <= 10; i++) {
+                 a = substr(letters, i, 1);
+                 print 0 "\t" 0 "\t" a "\t" a "\t" 0;
+                 print 1 "\t" 1 "\t" a "\t" a "\t" 0;
+                 print 0 "\t" 1 "\t" a "\t@0@\t" 1.5;
+                 print 0 "\t" 1 "\t@0@\t" a "\t" 1.5;
+                 for (j = 1; j <= 10; j++)
+                     if (i != j)
+                         print 0 "\t" 1 "\t" a "\t" substr(letters, j, 1) "\t" 1 + (i + j) % 5 / 10 }
+             print 0; print 1 }' > spell-errmodel.txt
+for name in lexicon errmodel; do
+    if ! $TOOLDIR/hfst-txt2fst -e '@0@' -i spell-$name.txt -o spell-$name.hfst ; then
+        exit 1
+    fi
+done
+
+# spell-checking in several threads, with a cache, or without the input
+# lookahead prints the same as in one thread with the defaults
+if ! compare_options spell.strings $TOOL \
+    "-n 5 spell-errmodel.hfst spell-lexicon.hfst" "-j 2" "-j 4" "-c 10" \
+    "-c 1000" "-j 4 -c 100" "-L" "-j 4 -L" ; then
+    exit 1
+fi
+if ! test `grep -c '" is in the lexicon' compared.out` -ge 750 ; then
+    echo "FAIL: the words of the lexicon should be found in it"
+    exit 1
+fi
+if grep -q "^Unable to correct" compared.out ; then
+    echo "FAIL: every token is one error away from a word"
+    exit 1
+fi
+
+rm spell.strings spell-lexicon.txt spell-errmodel.txt spell-lexicon.hfst \
+    spell-errmodel.hfst compared.out
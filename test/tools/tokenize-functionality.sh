@@ -5,6 +5,7 @@ TOOLDIR=../../tools/src
 if [ "$srcdir" = "" ]; then
     srcdir="./";
 fi
+. $srcdir/compare-options.sh
 
 # Prerequisites
 if ! $TOOLDIR/hfst-lexc -q < $srcdir/tokenize-dog-in.lexc > $srcdir/tokenize-dog-gen.hfst; then
@@ -76,5 +77,20 @@ if ! diff test.strings $srcdir/tokenize-dog-out-giella-cg-superblank.strings ; t
     exit 1
 fi
 
+# --threads, with input long enough to be split between the threads,
+# prints the same as one thread
+echo "test dog be dog catdog собака" | repeat_lines 6000 - > many.strings
+for format in "" --cg --giella-cg --xerox --binary; do
+    if ! compare_options many.strings $TOOLDIR/hfst-tokenize \
+        "$format $srcdir/tokenize-dog.pmhfst" "-j 4" ; then
+        exit 1
+    fi
+done
+if ! test "`head -c 8 compared.out`" = HFSTTOK1 ; then
+    echo tokenize --binary should start with its stream header
+    exit 1
+fi
+rm many.strings compared.out
+
 rm test.strings tokenize-dog.pmhfst tokenize-dog.hfst tokenize-dog-gen.hfst
 exit 0
@@ -54,6 +54,8 @@ using hfst::ImplementationType;
 ImplementationType output_type = hfst::UNSPECIFIED_TYPE;
 bool hfst_format = true;
 std::string options = "";
+bool quick = false;
+std::string threads = "";
 
 void set_output_type(ImplementationType type)
 {
@@ -85,7 +87,9 @@ print_usage()
     "  -l, --openfst-log                 Write output in (HFST's) log weight (OpenFST) implementation\n"
     "  -O, --optimized-lookup-unweighted Write output in the HFST optimized-lookup implementation\n"
     "  -w, --optimized-lookup-weighted   Write output in optimized-lookup (weighted) implementation\n"
-    "  -Q  --quick                       When converting to optimized-lookup, don't try hard to compress\n");
+    "  -Q  --quick                       When converting to optimized-lookup, don't try hard to compress\n"
+    "  -j, --threads=N                   Use N threads when converting to optimized-lookup,\n"
+    "                                    0 meaning one per core (the result is the same)\n");
     fprintf(message_out, "\n");
     print_common_unary_program_parameter_instructions(message_out);
         fprintf(message_out,
@@ -121,12 +125,13 @@ parse_options(int argc, char** argv)
           {"optimized-lookup-unweighted",   no_argument, 0, 'O'},
           {"optimized-lookup-weighted",no_argument, 0, 'w'},
       {"quick",              no_argument, 0, 'Q'},
+          {"threads",      required_argument, 0, 'j'},
           {0,0,0,0}
         };
         int option_index = 0;
         // add tool-specific options here
         int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT
-                             HFST_GETOPT_UNARY_SHORT "SFtlOwQf:bx",
+                             HFST_GETOPT_UNARY_SHORT "SFtlOwQf:bxj:",
                              long_options, &option_index);
         if (-1 == c)
         {
@@ -177,8 +182,19 @@ parse_options(int argc, char** argv)
           set_output_type(hfst::HFST_OLW_TYPE);
           break;
     case 'Q':
-        options = "quick";
+        quick = true;
         break;
+        case 'j':
+          {
+            int n = atoi(optarg);
+            if (n < 0)
+              {
+                error(EXIT_FAILURE, 0, "--threads argument %s must be a "
+                      "non-negative integer", optarg);
+              }
+            threads = optarg;
+            break;
+          }
 #include "inc/getopt-cases-error.h"
         }
     }
@@ -190,6 +206,15 @@ parse_options(int argc, char** argv)
               "(one of -S, -F, -t, -x, -l, -O, or -w)");
     }
 
+    if (quick)
+      {
+        options = "quick";
+      }
+    if (threads != "")
+      {
+        options += (options == "" ? "threads=" : ",threads=") + threads;
+      }
+
 #include "inc/check-params-common.h"
 #include "inc/check-params-unary.h"
     return EXIT_CONTINUE;
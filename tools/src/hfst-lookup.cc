@@ -47,6 +47,14 @@ using hfst::hfst_fprintf_console;
 #include <limits>
 #include <math.h>
 
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  define HFST_LOOKUP_THREADS 1
+#  include <thread>
+#  include <mutex>
+#  include <condition_variable>
+#  include <deque>
+#endif
+
 #include "hfst-commandline.h"
 #include "hfst-program-options.h"
 #include "HfstLookupFlagDiacritics.h"
@@ -164,6 +172,15 @@ static bool print_statistics = false;
 
 static bool show_progress_bar = false;
 
+// number of worker threads used for optimized lookup in batch mode
+static unsigned int threads = 1;
+
+// whether to map optimized-lookup transducer files instead of reading them
+static bool memory_mapping = false;
+
+// whether to build the input lookahead of optimized-lookup transducers
+static bool input_lookahead = false;
+
 // predefined formats
 // Xerox:
 // word     word N SG
@@ -265,7 +282,18 @@ print_usage()
             "  -t, --time-cutoff=S              Limit search after having used S seconds per input\n"
             "                                   (only for lookup-optimized transducers)\n"
             "  -C, --cascade=CASCADE            How multiple transducers in input are handled\n"
-            "  -P, --progress                   Show neat progress bar if possible\n");
+            "  -P, --progress                   Show neat progress bar if possible\n"
+            "  -j, --threads=N                  Use N threads for lookup\n"
+            "                                   (only for lookup-optimized transducers)\n"
+            "  -m, --mmap                       Map the transducer file into memory instead\n"
+            "                                   of reading it, so that processes using the\n"
+            "                                   same file share it (only for lookup-optimized\n"
+            "                                   transducers read from a file)\n"
+            "  -a, --lookahead                  Find which symbols each state can read\n"
+            "                                   next when loading, and stop following\n"
+            "                                   paths that can't match the rest of the\n"
+            "                                   input; the results are the same (only for\n"
+            "                                   lookup-optimized transducers)\n");
     fprintf(message_out, "\n");
     print_common_unary_program_parameter_instructions(message_out);
     fprintf(message_out,
@@ -341,12 +369,15 @@ parse_options(int argc, char** argv)
             {"pipe-mode", optional_argument, 0, 'p'},
             {"progress", no_argument, 0, 'P'},
             {"cascade", required_argument, 0, 'C'},
+            {"threads", required_argument, 0, 'j'},
+            {"mmap", no_argument, 0, 'm'},
+            {"lookahead", no_argument, 0, 'a'},
             {0,0,0,0}
         };
         int option_index = 0;
         // add tool-specific options here
         int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT
-                             HFST_GETOPT_UNARY_SHORT "I:O:F:xc:n:X:e:E:b:t:p::PC:",
+                             HFST_GETOPT_UNARY_SHORT "I:O:F:xc:n:X:e:E:b:t:p::PC:j:ma",
                              long_options, &option_index);
         if (-1 == c)
         {
@@ -483,6 +514,34 @@ parse_options(int argc, char** argv)
             show_progress_bar = true;
             break;
 
+        case 'j':
+          {
+            int n = atoi(optarg);
+            if (n < 1)
+              {
+                error(EXIT_FAILURE, 0, "--threads argument %s must be a "
+                      "positive integer", optarg);
+              }
+            threads = (unsigned int)n;
+#ifndef HFST_LOOKUP_THREADS
+            if (threads > 1)
+              {
+                warning(0, 0, "threads not supported on this platform, "
+                        "ignoring --threads");
+                threads = 1;
+              }
+#endif
+            break;
+          }
+
+        case 'm':
+            memory_mapping = true;
+            break;
+
+        case 'a':
+            input_lookahead = true;
+            break;
+
         case 'C':
             if (strcmp(optarg, "union") == 0)
               { cascade_ = CASCADE_UNION; }
@@ -1129,6 +1188,22 @@ void lookup_fd_and_print(HfstBasicTransducer * tr, HfstTransducer * TR, HfstOneL
                          bool print_fail = false, const HfstOneLevelPath * input_to_print = NULL,
                          bool no_newline = false);
 
+/* Warn that the results of an infinitely ambiguous lookup were limited. */
+static void
+warn_infinite_results()
+{
+  if (silent)
+    return;
+  size_t maxnum = (max_number == -1)? MAX_NUMBER : max_number;
+  if (max_number == -1)
+    warning(0, 0, "Got infinite results, number of results limited to " SIZE_T_SPECIFIER "\n"
+            "(can be controlled with --max-number=N)",
+            maxnum);
+  else
+    warning(0, 0, "Got infinite results, number of results limited to " SIZE_T_SPECIFIER "",
+            maxnum);
+}
+
 HfstOneLevelPaths*
 lookup_simple(const HfstOneLevelPath& s, HfstTransducer& t, bool* infinity, bool print_pairs_at_this_point=false, bool print_fail=false, const HfstOneLevelPath * input_to_print = NULL, bool no_newline=false)
 {
@@ -1136,15 +1211,7 @@ lookup_simple(const HfstOneLevelPath& s, HfstTransducer& t, bool* infinity, bool
   if (time_cutoff == 0.0 && t.is_lookup_infinitely_ambiguous(s.second))
     {
       size_t maxnum = (max_number == -1)? MAX_NUMBER : max_number;
-      if (!silent) {
-        if (max_number == -1)
-          warning(0, 0, "Got infinite results, number of results limited to " SIZE_T_SPECIFIER "\n"
-                  "(can be controlled with --max-number=N)",
-                  maxnum);
-        else
-          warning(0, 0, "Got infinite results, number of results limited to " SIZE_T_SPECIFIER "",
-                  maxnum);
-      }
+      warn_infinite_results();
       if (print_pairs)
         lookup_fd_and_print(NULL, &t, *results, s, &maxnum, print_pairs_at_this_point, print_fail, input_to_print, no_newline);
       else
@@ -1168,6 +1235,23 @@ lookup_simple(const HfstOneLevelPath& s, HfstTransducer& t, bool* infinity, bool
 }
 
 
+#ifdef HFST_LOOKUP_THREADS
+/* Same as lookup_simple without pair printing, but reentrant: \a c holds
+   the lookup state, so several threads can share \a t. The warning about
+   infinite results is left to the caller. */
+HfstOneLevelPaths*
+lookup_simple(const HfstOneLevelPath& s, const HfstTransducer& t,
+              hfst_ol::LookupContext & c, bool* infinity)
+{
+  if (time_cutoff == 0.0 && t.is_lookup_infinitely_ambiguous(s.second, c))
+    {
+      size_t maxnum = (max_number == -1)? MAX_NUMBER : max_number;
+      *infinity = true;
+      return t.lookup_fd(s.second, c, maxnum, time_cutoff);
+    }
+  return t.lookup_fd(s.second, c, max_number, time_cutoff);
+}
+#endif
 
 /* Replace all strings \a str1 in \a symbol with \a str2. */
 static std::string replace_all(std::string symbol,
@@ -1734,6 +1818,252 @@ perform_lookups(HfstOneLevelPath& origin, std::vector<HfstBasicTransducer>& casc
     return kvs;
 }
 
+static void
+print_lookup_statistics(FILE* outstream)
+{
+  fprintf(outstream, "Strings\tFound\tMissing\tResults\n"
+          "%lu\t%lu\t%lu\t%lu\n",
+          inputs, analysed, no_analyses, analyses);
+  fprintf(outstream, "Coverage\tAmbiguity\n"
+          "%f\t%f\n",
+          (float)analysed/(float)inputs,
+          (float)analyses/(float)inputs);
+}
+
+/* Read the next line of lookup_file into *line, from the console on
+   Windows if it's the standard input and input isn't piped. */
+static bool
+read_lookup_line(char** line, size_t* llen)
+{
+#ifdef WINDOWS
+  if (lookup_file == stdin && !pipe_input)
+    {
+      std::string str("");
+      size_t bufsize = 1000;
+      if (! hfst::get_line_from_console(str, bufsize))
+        {
+          return false;
+        }
+      free(*line);
+      *line = strdup(str.c_str());
+      *llen = str.size() + 1;
+      return true;
+    }
+#endif
+  return hfst_getline(line, llen, lookup_file) != -1;
+}
+
+#ifdef HFST_LOOKUP_THREADS
+// How many lines a worker thread looks up at a time
+static const size_t LINES_PER_JOB = 100;
+// How many jobs per thread may be read ahead of the output
+static const size_t JOBS_PER_THREAD = 4;
+
+// One input line, tokenized by the main thread and looked up by one of
+// the workers.
+struct BatchLine
+{
+  HfstOneLevelPath* kv;
+  HfstOneLevelPaths* kvs;
+  char* markup;
+  bool unknown;
+  bool infinite;
+};
+
+// The lines a worker looks up at a time
+struct LookupJob
+{
+  std::vector<BatchLine> lines;
+  bool done;
+  LookupJob() : done(false) {}
+};
+
+/* A fixed set of worker threads that look up the jobs submitted to them
+   in one transducer, each with a lookup context of its own. */
+class LookupPool
+{
+ public:
+  LookupPool(const HfstTransducer& t, unsigned int threads) :
+    transducer(t), closed(false)
+  {
+    for (unsigned int i = 0; i < threads; i++)
+      {
+        workers.push_back(std::thread(&LookupPool::work, this));
+      }
+  }
+
+  ~LookupPool()
+  {
+    finish();
+  }
+
+  void submit(LookupJob* job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(job);
+    }
+    job_queued.notify_one();
+  }
+
+  /* Wait until \a job has been looked up. */
+  void wait(const LookupJob* job)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [job] { return job->done; });
+  }
+
+  /* Let the workers finish once the queue is empty, and wait for them. */
+  void finish()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    job_queued.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+      {
+        workers[i].join();
+      }
+    workers.clear();
+  }
+
+ private:
+  const HfstTransducer& transducer;
+  std::vector<std::thread> workers;
+  std::deque<LookupJob*> queue;
+  std::mutex mutex;
+  std::condition_variable job_queued;
+  std::condition_variable job_done;
+  bool closed;
+
+  void work()
+  {
+    hfst_ol::LookupContext c;
+    while (true)
+      {
+        LookupJob* job;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          job_queued.wait(lock, [this] { return closed || !queue.empty(); });
+          if (queue.empty())
+            {
+              break;
+            }
+          job = queue.front();
+          queue.pop_front();
+        }
+        for (std::vector<BatchLine>::iterator it = job->lines.begin();
+             it != job->lines.end(); ++it)
+          {
+            if (it->unknown)
+              {
+                it->kvs = new HfstOneLevelPaths;
+              }
+            else
+              {
+                it->kvs = lookup_simple(*it->kv, transducer, c,
+                                        &it->infinite);
+              }
+          }
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          job->done = true;
+        }
+        job_done.notify_all();
+      }
+  }
+};
+
+/* Print the results of \a job and free them. */
+static void
+print_job(LookupJob* job, FILE* outstream)
+{
+  for (std::vector<BatchLine>::iterator it = job->lines.begin();
+       it != job->lines.end(); ++it)
+    {
+      if (it->infinite)
+        warn_infinite_results();
+      print_lookups(*(it->kvs), *(it->kv), it->markup, it->unknown,
+                    it->infinite, outstream);
+      delete it->kv;
+      delete it->kvs;
+      free(it->markup);
+    }
+  fflush(outstream);
+}
+
+/* Look up the lines of lookup_file in \a t with a pool of worker threads.
+   Lines are read and tokenized in jobs by the calling thread, looked up
+   in parallel and printed in input order, so the output is the same as
+   when looking up one line at a time. */
+static void
+process_lines_threaded(const HfstTransducer& t,
+                       hfst::HfstStrings2FstTokenizer& input_tokenizer,
+                       FILE* outstream)
+{
+  LookupPool pool(t, threads);
+  const size_t max_pending = JOBS_PER_THREAD * threads;
+  std::deque<LookupJob*> pending;
+  char* line = 0;
+  size_t llen = 0;
+  bool eof = false;
+  while (!eof || !pending.empty())
+    {
+      if (!eof)
+        {
+          LookupJob* job = new LookupJob;
+          while (job->lines.size() < LINES_PER_JOB)
+            {
+              if (!read_lookup_line(&line, &llen))
+                {
+                  eof = true;
+                  break;
+                }
+              linen++;
+              char* p = line;
+              while (*p != '\0')
+                {
+                  if (*p == '\n' || *p == '\r')
+                    {
+                      *p = '\0';
+                      break;
+                    }
+                  p++;
+                }
+              BatchLine bl;
+              bl.kvs = NULL;
+              bl.markup = 0;
+              bl.unknown = false;
+              bl.infinite = false;
+              bl.kv = line_to_lookup_path(&line, input_tokenizer, &bl.markup,
+                                          &bl.unknown, true);
+              job->lines.push_back(bl);
+            }
+          if (job->lines.empty())
+            {
+              delete job;
+            }
+          else
+            {
+              pool.submit(job);
+              pending.push_back(job);
+            }
+        }
+      // Print the oldest job once it's done, waiting for it only when
+      // enough has been read ahead
+      while (!pending.empty() && (eof || pending.size() >= max_pending))
+        {
+          pool.wait(pending.front());
+          print_job(pending.front(), outstream);
+          delete pending.front();
+          pending.pop_front();
+        }
+    }
+  free(line);
+}
+#endif
+
 int
 process_stream(HfstInputStream& inputstream, FILE* outstream)
 {
@@ -1809,6 +2139,20 @@ process_stream(HfstInputStream& inputstream, FILE* outstream)
 
     inputstream.close();
 
+    // The transducers are copied while the cascade grows, and copies don't
+    // keep the lookahead, so it's built only now, before any threads start
+    if (input_lookahead)
+      {
+        for (size_t i = 0; i < cascade.size(); i++)
+          {
+            if (cascade[i].get_type() == HFST_OL_TYPE ||
+                cascade[i].get_type() == HFST_OLW_TYPE)
+              {
+                cascade[i].build_input_lookahead();
+              }
+          }
+      }
+
     /*
     if ((cascade_ == CASCADE_COMPOSITION || cascade_ == CASCADE_PRIORITY_UNION) &&
         (inputstream.get_type() == HFST_OL_TYPE ||
@@ -1855,6 +2199,27 @@ process_stream(HfstInputStream& inputstream, FILE* outstream)
         }
         free(format_string);
       }
+#ifdef HFST_LOOKUP_THREADS
+    if (threads > 1)
+      {
+        if (only_optimized_lookup && cascade.size() == 1 && !print_pairs)
+          {
+            verbose_printf("Looking up with %u threads\n", threads);
+            process_lines_threaded(cascade[0], input_tokenizer, outstream);
+            if (print_statistics)
+              {
+                print_lookup_statistics(outstream);
+              }
+            return EXIT_SUCCESS;
+          }
+        if (!silent)
+          {
+            warning(0, 0, "--threads is only supported for a single "
+                    "lookup-optimized transducer without pair printing, "
+                    "looking up with one thread");
+          }
+      }
+#endif
     long filesize = -1;
     if (show_progress_bar)
       {
@@ -1868,25 +2233,10 @@ process_stream(HfstInputStream& inputstream, FILE* outstream)
     long filepos = ftell(lookup_file);
     while (true)
       {
-#ifdef WINDOWS
-        if (lookup_file == stdin && !pipe_input)
-          {
-            std::string str("");
-            size_t bufsize = 1000;
-            if (! hfst::get_line_from_console(str, bufsize))
-              {
-                break;
-              }
-            line = strdup(str.c_str());
-          }
-        else
+        if (!read_lookup_line(&line, &llen))
           {
-#endif
-            if (hfst_getline(&line, &llen, lookup_file) == -1)
-              break;
-#ifdef WINDOWS
+            break;
           }
-#endif
 
         char * p = line;
         linen++;
@@ -1962,13 +2312,7 @@ process_stream(HfstInputStream& inputstream, FILE* outstream)
     free(line);
     if (print_statistics)
       {
-        fprintf(outstream, "Strings\tFound\tMissing\tResults\n"
-                "%lu\t%lu\t%lu\t%lu\n",
-                inputs, analysed, no_analyses, analyses);
-        fprintf(outstream, "Coverage\tAmbiguity\n"
-                "%f\t%f\n",
-                (float)analysed/(float)inputs,
-                (float)analyses/(float)inputs);
+        print_lookup_statistics(outstream);
       }
     return EXIT_SUCCESS;
 }
@@ -2032,6 +2376,15 @@ int main( int argc, char **argv ) {
               inputfilename);
         return EXIT_FAILURE;
       }
+    if (memory_mapping)
+      {
+        if (inputfile == stdin)
+          {
+            warning(0, 0, "--mmap needs a transducer file, reading "
+                    "standard input instead");
+          }
+        instream->set_memory_mapping(true);
+      }
     process_stream(*instream, outfile);
     if (outfile != stdout)
     {
@@ -37,6 +37,14 @@ using hfst::hfst_fprintf_console;
 
 #include <cstdarg>
 #include <iostream> // DEBUG
+#include <sstream>
+
+#if OL_THREADS
+#  include <thread>
+#  include <mutex>
+#  include <condition_variable>
+#  include <deque>
+#endif
 
 static float beam=-1;
 static bool pipe_input = false;
@@ -71,6 +79,10 @@ bool print_usage(void)
     "                              (with this option enabled -u and -n don't work and\n" <<
     "                              output won't be ordered by weight).\n" <<
     "  -p, --pipe-mode[=STREAM]    Control input and output streams.\n" <<
+    "  -j, --threads=N             Look up inputs in N threads (default 1),\n" <<
+    "                              output is printed in input order\n" <<
+    "  -c, --cache=N               Remember the output for the N most recently\n" <<
+    "                              looked up inputs (default 0, no cache)\n" <<
     "\n" <<
     "N must be a positive integer. B must be a non-negative float.\n" <<
     "S must be a non-negative float. The default, 0.0, indicates no cutoff.\n"
@@ -133,11 +145,13 @@ int main(int argc, char **argv)
           {"fast",         no_argument,       0, 'f'},
           {"pipe-mode",    optional_argument,       0, 'p'},
           {"analyses",     required_argument, 0, 'n'},
+          {"threads",      required_argument, 0, 'j'},
+          {"cache",        required_argument, 0, 'c'},
           {0,              0,                 0,  0 }
         };
       
       int option_index = 0;
-      c = getopt_long(argc, argv, "hVvqsewb:t:uxfn:p::", long_options, &option_index);
+      c = getopt_long(argc, argv, "hVvqsewb:t:uxfn:p::j:c:", long_options, &option_index);
 
       if (c == -1) // no more options to look at
         break;
@@ -216,6 +230,32 @@ int main(int argc, char **argv)
             }
           break;
 
+        case 'j':
+          threads = atoi(optarg);
+          if (threads < 1)
+            {
+              std::cerr << "Invalid or no argument for thread count\n";
+              return EXIT_FAILURE;
+            }
+#if !OL_THREADS
+          std::cerr << "Warning: threads are not supported on this platform, "
+                    << "looking up serially\n";
+          threads = 1;
+#endif
+          break;
+
+        case 'c':
+          {
+            int n = atoi(optarg);
+            if (n < 0)
+              {
+                std::cerr << "Invalid argument for cache size\n";
+                return EXIT_FAILURE;
+              }
+            cache_size = n;
+            break;
+          }
+
         case 'x':
           outputType = xerox;
           break;
@@ -386,42 +426,6 @@ void TransducerAlphabet::get_next_symbol(FILE * f, SymbolNumber k)
   kt->operator[](k) = strdup(line);
 }
 
-void LetterTrie::add_string(const char * p, SymbolNumber symbol_key)
-{
-  if (*(p+1) == 0)
-    {
-      symbols[(unsigned char)(*p)] = symbol_key;
-      return;
-    }
-  if (letters[(unsigned char)(*p)] == NULL)
-    {
-      letters[(unsigned char)(*p)] = new LetterTrie();
-    }
-  letters[(unsigned char)(*p)]->add_string(p+1,symbol_key);
-}
-
-bool LetterTrie::has_key_starting_with(const char c) const
-{
-    return letters[(unsigned char) c] != NULL;
-}
-
-SymbolNumber LetterTrie::find_key(char ** p)
-{
-  const char * old_p = *p;
-  ++(*p);
-  if (letters[(unsigned char)(*old_p)] == NULL)
-    {
-      return symbols[(unsigned char)(*old_p)];
-    }
-  SymbolNumber s = letters[(unsigned char)(*old_p)]->find_key(p);
-  if (s == NO_SYMBOL_NUMBER)
-    {
-      --(*p);
-      return symbols[(unsigned char)(*old_p)];
-    }
-  return s;
-}
-
 void Encoder::read_input_symbols(KeyTable * kt)
 {
   for (SymbolNumber k = 0; k < number_of_input_symbols; ++k)
@@ -457,101 +461,363 @@ SymbolNumber Encoder::find_key(char ** p)
   return s;
 }
 
+/* Read the next line of input into line, from the console on Windows
+   unless input is piped. */
+bool readInputLine (std::string & line)
+{
+#ifdef WINDOWS
+  if (!pipe_input)
+    return hfst::get_line_from_console(line, MAX_IO_STRING*sizeof(char));
+#endif
+  return static_cast<bool>(std::getline(std::cin, line));
+}
+
 template <class genericTransducer>
-void runTransducer (genericTransducer T)
+void lookupLine (genericTransducer & T, const std::string & line,
+                 SymbolNumber * input_string)
 {
-  SymbolNumber * input_string = (SymbolNumber*)(malloc(2000));
-  for (int i = 0; i < 1000; ++i)
+  // find_next_key() only moves the pointer along
+  char * str = const_cast<char *>(line.c_str());
+  if (echoInputsFlag)
     {
-      input_string[i] = NO_SYMBOL_NUMBER;
+#ifdef WINDOWS
+      if (!pipe_output)
+        hfst_fprintf_console(stdout, "%s\n", str); // fix: add \r?
+      else
+#endif
+        *output_stream << str << std::endl;
     }
-
-  char * str = (char*)(malloc(MAX_IO_STRING*sizeof(char)));
-  *str = 0;
+  int i = 0;
+  SymbolNumber k = NO_SYMBOL_NUMBER;
+  bool failed = false;
   char * old_str = str;
-
-  while(true)
+  for ( char ** Str = &str; **Str != 0; )
     {
-#ifdef WINDOWS
-      if (!pipe_input)
+      if (i == MAX_INPUT_SYMBOLS)
         {
-          free(str);
-          std::string linestr("");
-          if (! hfst::get_line_from_console(linestr, MAX_IO_STRING*sizeof(char)))
-            break;
-          str = strdup(linestr.c_str());
-          old_str = str;
+          std::cerr << "Warning: input longer than " << MAX_INPUT_SYMBOLS
+                    << " symbols is not looked up\n";
+          failed = true;
+          break;
         }
-      else
+      k = T.find_next_key(Str);
+#if OL_FULL_DEBUG
+      std::cout << "INPUT STRING ENTRY " << i << " IS " << k << std::endl;
 #endif
+      if (k == NO_SYMBOL_NUMBER)
         {
-          if (! std::cin.getline(str,MAX_IO_STRING))
-            break;
+          failed = true;
+          break;
         }
-                        
+      input_string[i] = k;
+      ++i;
+    }
+  str = old_str;
+  if (failed)
+    { // tokenization failed
       if (echoInputsFlag)
         {
+          *output_stream << std::endl;
+        }
+      if (outputType == xerox)
+        {
 #ifdef WINDOWS
           if (!pipe_output)
-            hfst_fprintf_console(stdout, "%s\n", str); // fix: add \r?
+            hfst_fprintf_console(stdout, "%s\t%s\t+?\n\n", str, str);
           else
 #endif
-            std::cout << str << std::endl;
+            *output_stream << str << "\t" << str << "\t+?" << std::endl << std::endl;
+
+#ifdef WINDOWS
+          if (!pipe_output)
+            hfst_fprintf_console(stdout, "\n\n");
+          else
+#endif
+            *output_stream << std::endl << std::endl;
         }
-      int i = 0;
-      SymbolNumber k = NO_SYMBOL_NUMBER;
-      bool failed = false;
-      for ( char ** Str = &str; **Str != 0; )
+      return;
+    }
+
+  input_string[i] = NO_SYMBOL_NUMBER;
+
+  std::string key;
+  if (line_cache != NULL)
+    {
+      for (int j = 0; j < i; ++j)
         {
-          k = T.find_next_key(Str);
-#if OL_FULL_DEBUG
-          std::cout << "INPUT STRING ENTRY " << i << " IS " << k << std::endl;
-#endif
-          if (k == NO_SYMBOL_NUMBER)
+          hfst_ol::append_to_cache_key(key, input_string[j]);
+        }
+      const std::string * cached = line_cache->find(key);
+      if (cached != NULL)
+        {
+          *output_stream << *cached;
+          return;
+        }
+    }
+
+  if (time_cutoff > 0.0) {
+      start_clock = clock();
+      call_counter = 0;
+      limit_reached = false;
+  }
+
+  if (line_cache == NULL)
+    {
+      T.analyze(input_string);
+      T.printAnalyses(std::string(str));
+      return;
+    }
+
+  std::ostream * out = output_stream;
+  std::ostringstream analyses;
+  output_stream = &analyses;
+  T.analyze(input_string);
+  T.printAnalyses(std::string(str));
+  output_stream = out;
+  *output_stream << analyses.str();
+  // Output that was cut short by the time limit is not remembered
+  if (!limit_reached)
+    {
+      line_cache->insert(key, analyses.str());
+    }
+}
+
+/* Print the hit rate of the lookup caches if we are verbose. */
+void printCacheStatistics (size_t hits, size_t misses)
+{
+  if (!verboseFlag || cache_size == 0)
+    return;
+  std::cerr << "Lookup cache: " << hits << " hits, "
+            << misses << " misses" << std::endl;
+}
+
+#if OL_THREADS
+// How many lines a lookup thread takes at a time
+static const size_t LINES_PER_JOB = 100;
+// How many jobs per thread may be read ahead of the output
+static const size_t JOBS_PER_THREAD = 4;
+
+/* Lines of input for a lookup thread, and what is to be printed for them */
+struct LookupJob
+{
+  std::vector<std::string> lines;
+  std::string output;
+  bool done;
+  LookupJob (): done(false) {}
+};
+
+/* A fixed set of threads, each with its own copy of the transducer and
+   its own cache, that look up the jobs submitted to them. */
+template <class genericTransducer>
+class LookupPool
+{
+ public:
+  LookupPool (genericTransducer & T, int threads):
+    transducers(threads, T),
+    caches(threads, hfst_ol::LookupCache<std::string>(cache_size)),
+    closed(false)
+  {
+    for (int t = 0; t < threads; ++t)
+      {
+        pool.push_back(std::thread(&LookupPool::work, this, t));
+      }
+  }
+
+  ~LookupPool ()
+  {
+    finish();
+  }
+
+  void submit (LookupJob * job)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(job);
+    }
+    job_queued.notify_one();
+  }
+
+  /* Wait until job has been looked up. */
+  void wait (const LookupJob * job)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    job_done.wait(lock, [job] { return job->done; });
+  }
+
+  /* Let the threads finish once the queue is empty, and wait for them. */
+  void finish ()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+    }
+    job_queued.notify_all();
+    for (size_t t = 0; t < pool.size(); ++t)
+      {
+        pool[t].join();
+      }
+    pool.clear();
+  }
+
+  /* The cache statistics of all the threads, once they have finished. */
+  void get_cache_statistics (size_t & hits, size_t & misses) const
+  {
+    hits = 0;
+    misses = 0;
+    for (size_t t = 0; t < caches.size(); ++t)
+      {
+        hits += caches[t].get_hits();
+        misses += caches[t].get_misses();
+      }
+  }
+
+ private:
+  std::vector<genericTransducer> transducers;
+  std::vector<hfst_ol::LookupCache<std::string> > caches;
+  std::vector<std::thread> pool;
+  std::deque<LookupJob *> queue;
+  std::mutex mutex;
+  std::condition_variable job_queued;
+  std::condition_variable job_done;
+  bool closed;
+
+  void work (int t)
+  {
+    SymbolNumber * input_string = (SymbolNumber*)(malloc(2000));
+    for (int i = 0; i < 1000; ++i)
+      {
+        input_string[i] = NO_SYMBOL_NUMBER;
+      }
+    std::ostringstream out;
+    output_stream = &out;
+    if (caches[t].is_enabled())
+      line_cache = &caches[t];
+
+    while (true)
+      {
+        LookupJob * job;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          job_queued.wait(lock, [this] { return closed || !queue.empty(); });
+          if (queue.empty())
+            break;
+          job = queue.front();
+          queue.pop_front();
+        }
+        out.str("");
+        for (size_t n = 0; n < job->lines.size(); ++n)
+          {
+            lookupLine(transducers[t], job->lines[n], input_string);
+          }
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          job->output = out.str();
+          job->done = true;
+        }
+        job_done.notify_all();
+      }
+
+    line_cache = NULL;
+    output_stream = &std::cout;
+    free(input_string);
+  }
+};
+
+/* Read the input in jobs of several lines, look them up in a pool of
+   threads and print the results in input order. */
+template <class genericTransducer>
+void runTransducerThreaded (genericTransducer & T)
+{
+  LookupPool<genericTransducer> pool(T, threads);
+  const size_t max_pending = JOBS_PER_THREAD * threads;
+  std::deque<LookupJob *> pending;
+  std::string line;
+  bool input_left = true;
+
+  while (input_left || !pending.empty())
+    {
+      if (input_left)
+        {
+          LookupJob * job = new LookupJob;
+          while (job->lines.size() < LINES_PER_JOB)
             {
-              if (echoInputsFlag)
+              if (! readInputLine(line))
                 {
-                  std::cout << std::endl;
+                  input_left = false;
+                  break;
                 }
-              failed = true;
-              break;
+              job->lines.push_back(line);
             }
-          input_string[i] = k;
-          ++i;
-        }
-      str = old_str;
-      if (failed)
-        { // tokenization failed
-          if (outputType == xerox)
+          if (job->lines.empty())
             {
-#ifdef WINDOWS
-          if (!pipe_output)
-              hfst_fprintf_console(stdout, "%s\t%s\t+?\n\n", str, str);
+              delete job;
+            }
           else
+            {
+              pool.submit(job);
+              pending.push_back(job);
+            }
+        }
+      // Print the oldest job once it's done, waiting for it only when
+      // enough has been read ahead
+      while (!pending.empty() &&
+             (!input_left || pending.size() >= max_pending))
+        {
+          pool.wait(pending.front());
+          std::cout << pending.front()->output;
+          std::cout.flush();
+          delete pending.front();
+          pending.pop_front();
+        }
+    }
+
+  pool.finish();
+  size_t hits = 0;
+  size_t misses = 0;
+  pool.get_cache_statistics(hits, misses);
+  printCacheStatistics(hits, misses);
+}
 #endif
-              std::cout << str << "\t" << str << "\t+?" << std::endl << std::endl;
 
+template <class genericTransducer>
+void runTransducer (genericTransducer T)
+{
+#if OL_THREADS
+  // Output to the Windows console doesn't go through output_stream, so
+  // it can't be put back in order
+  bool ordered_output = true;
 #ifdef WINDOWS
-          if (!pipe_output)
-            hfst_fprintf_console(stdout, "\n\n");
-          else
+  ordered_output = pipe_output;
+#endif
+  if (threads > 1 && ordered_output)
+    {
+      runTransducerThreaded(T);
+      return;
+    }
 #endif
-              std::cout << std::endl << std::endl;
-            }
-          continue;
-        }
 
+  SymbolNumber * input_string = (SymbolNumber*)(malloc(2000));
+  for (int i = 0; i < 1000; ++i)
+    {
       input_string[i] = NO_SYMBOL_NUMBER;
+    }
 
-      if (time_cutoff > 0.0) {
-          start_clock = clock();
-          call_counter = 0;
-          limit_reached = false;
-      }
-      
-      T.analyze(input_string);
-      T.printAnalyses(std::string(str));
+  hfst_ol::LookupCache<std::string> cache(cache_size);
+#ifdef WINDOWS
+  // Output to the console doesn't go through output_stream
+  if (!pipe_output)
+    cache.set_capacity(0);
+#endif
+  if (cache.is_enabled())
+    line_cache = &cache;
+
+  std::string line;
+  while (readInputLine(line))
+    {
+      lookupLine(T, line, input_string);
     }
+  line_cache = NULL;
+  printCacheStatistics(cache.get_hits(), cache.get_misses());
 }
 
 int setup(FILE * f)
@@ -956,7 +1222,7 @@ void Transducer::note_analysis(SymbolNumber * whole_output_string)
             hfst_fprintf_console(stdout, "%s", symbol_table[*num]);
           else
 #endif
-            std::cout << symbol_table[*num];
+            *output_stream << symbol_table[*num];
         }
 
 #ifdef WINDOWS
@@ -964,7 +1230,7 @@ void Transducer::note_analysis(SymbolNumber * whole_output_string)
         hfst_fprintf_console(stdout, "\n");
       else
 #endif
-        std::cout << std::endl;
+        *output_stream << std::endl;
     } else
     {
       std::string str = "";
@@ -1093,14 +1359,14 @@ void Transducer::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "%s\t%s\t+?\n\n", prepend.c_str(), prepend.c_str());
           else
 #endif
-          std::cout << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
+          *output_stream << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
 
 #ifdef WINDOWS
           if (!pipe_output)
             hfst_fprintf_console(stdout, "\n\n");
           else
 #endif
-          std::cout << std::endl << std::endl;
+          *output_stream << std::endl << std::endl;
           return;
         }
       int i = 0;
@@ -1114,7 +1380,7 @@ void Transducer::printAnalyses(std::string prepend)
                 hfst_fprintf_console(stdout, "%s\t", prepend.c_str());
               else
 #endif
-                std::cout << prepend << "\t";
+                *output_stream << prepend << "\t";
             }
 
 #ifdef WINDOWS
@@ -1122,7 +1388,7 @@ void Transducer::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "%s\n", it->c_str());
           else
 #endif
-            std::cout << *it << std::endl;
+            *output_stream << *it << std::endl;
 
           ++it;
           ++i;
@@ -1134,7 +1400,7 @@ void Transducer::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "\n");
       else
 #endif
-        std::cout << std::endl;
+        *output_stream << std::endl;
 
     }
 }
@@ -1149,14 +1415,14 @@ void TransducerUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\t%s\t+?\n\n", prepend.c_str(), prepend.c_str());
       else
 #endif
-        std::cout << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
+        *output_stream << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
 
 #ifdef WINDOWS
       if (!pipe_output)
         hfst_fprintf_console(stdout, "\n\n");
       else
 #endif
-        std::cout << std::endl << std::endl;
+        *output_stream << std::endl << std::endl;
 
       return;
     }
@@ -1171,7 +1437,7 @@ void TransducerUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\t", prepend.c_str());
       else
 #endif
-        std::cout << prepend << "\t";
+        *output_stream << prepend << "\t";
         }
 
 #ifdef WINDOWS
@@ -1179,7 +1445,7 @@ void TransducerUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\n", it->c_str());
       else
 #endif
-        std::cout << *it << std::endl;
+        *output_stream << *it << std::endl;
 
       ++it;
       ++i;
@@ -1190,7 +1456,7 @@ void TransducerUniq::printAnalyses(std::string prepend)
     hfst_fprintf_console(stdout, "\n");
   else
 #endif
-    std::cout << std::endl;
+    *output_stream << std::endl;
 }
 
 void TransducerFdUniq::printAnalyses(std::string prepend)
@@ -1202,14 +1468,14 @@ void TransducerFdUniq::printAnalyses(std::string prepend)
     hfst_fprintf_console(stdout, "%s\t%s\t+?\n\n", prepend.c_str(), prepend.c_str());
   else
 #endif
-      std::cout << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
+      *output_stream << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
 
 #ifdef WINDOWS
   if (!pipe_output)
     hfst_fprintf_console(stdout, "\n\n");
   else
 #endif
-      std::cout << std::endl << std::endl;
+      *output_stream << std::endl << std::endl;
   return;
     }
   int i = 0;
@@ -1223,7 +1489,7 @@ void TransducerFdUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "%s\t", prepend.c_str());
           else
 #endif
-            std::cout << prepend << "\t";
+            *output_stream << prepend << "\t";
         }
 
 #ifdef WINDOWS
@@ -1231,7 +1497,7 @@ void TransducerFdUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\n", it->c_str());
       else
 #endif
-        std::cout << *it << std::endl;
+        *output_stream << *it << std::endl;
 
       ++it;
       ++i;
@@ -1243,7 +1509,7 @@ void TransducerFdUniq::printAnalyses(std::string prepend)
     hfst_fprintf_console(stdout, "\n");
   else
 #endif
-    std::cout << std::endl;
+    *output_stream << std::endl;
 }
 
 /**
@@ -1639,13 +1905,13 @@ void TransducerW::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\t%s\t+?\n\n", prepend.c_str(), prepend.c_str());
       else
 #endif
-          std::cout << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
+          *output_stream << prepend << "\t" << prepend << "\t+?" << std::endl << std::endl;
 
 #ifdef WINDOWS
       if (!pipe_output)
         hfst_fprintf_console(stdout, "\n\n");
       else
-          std::cout << std::endl << std::endl;
+          *output_stream << std::endl << std::endl;
 #endif
 
       return;
@@ -1668,7 +1934,7 @@ void TransducerW::printAnalyses(std::string prepend)
               hfst_fprintf_console(stdout, "%s\t", prepend.c_str());
             else
 #endif
-              std::cout << prepend << "\t";
+              *output_stream << prepend << "\t";
           }
 
 #ifdef WINDOWS
@@ -1676,7 +1942,7 @@ void TransducerW::printAnalyses(std::string prepend)
           hfst_fprintf_console(stdout, "%s", (*it).second.c_str());
         else
 #endif
-          std::cout << (*it).second;
+          *output_stream << (*it).second;
         
         if (displayWeightsFlag)
           {
@@ -1685,7 +1951,7 @@ void TransducerW::printAnalyses(std::string prepend)
               hfst_fprintf_console(stdout, "\t%f", (*it).first);
             else
 #endif
-              std::cout << '\t' << (*it).first;
+              *output_stream << '\t' << (*it).first;
           }
 
 #ifdef WINDOWS
@@ -1693,7 +1959,7 @@ void TransducerW::printAnalyses(std::string prepend)
           hfst_fprintf_console(stdout, "\n");
         else
 #endif
-          std::cout << std::endl;
+          *output_stream << std::endl;
  
       }
       ++it;
@@ -1706,7 +1972,7 @@ void TransducerW::printAnalyses(std::string prepend)
     hfst_fprintf_console(stdout, "\n");
   else
 #endif
-    std::cout << std::endl;
+    *output_stream << std::endl;
 }
 
 void TransducerWUniq::printAnalyses(std::string prepend)
@@ -1718,14 +1984,14 @@ void TransducerWUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\t%s\t+?\n", prepend.c_str(), prepend.c_str());
       else
 #endif
-        std::cout << prepend << "\t" << prepend << "\t+?" << std::endl;
+        *output_stream << prepend << "\t" << prepend << "\t+?" << std::endl;
 
 #ifdef WINDOWS
       if (!pipe_output)
         hfst_fprintf_console(stdout, "\n");
       else
 #endif
-        std::cout << std::endl;
+        *output_stream << std::endl;
 
       return;
     }
@@ -1751,7 +2017,7 @@ void TransducerWUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "%s\t", prepend.c_str());
           else
 #endif
-            std::cout << prepend << "\t";
+            *output_stream << prepend << "\t";
         }
 
 #ifdef WINDOWS
@@ -1759,7 +2025,7 @@ void TransducerWUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "%s", (*display_it).second.c_str());
           else
 #endif
-            std::cout << (*display_it).second;
+            *output_stream << (*display_it).second;
 
       if (displayWeightsFlag)
         {
@@ -1768,7 +2034,7 @@ void TransducerWUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "\t%f", (*display_it).first);
           else
 #endif
-            std::cout << '\t' << (*display_it).first;
+            *output_stream << '\t' << (*display_it).first;
         }
 
 #ifdef WINDOWS
@@ -1776,7 +2042,7 @@ void TransducerWUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "\n");
       else
 #endif
-        std::cout << std::endl;
+        *output_stream << std::endl;
 
       ++display_it;
       ++i;
@@ -1788,7 +2054,7 @@ void TransducerWUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "\n");
       else
 #endif
-        std::cout << std::endl;
+        *output_stream << std::endl;
 }
 
 void TransducerWFdUniq::printAnalyses(std::string prepend)
@@ -1800,14 +2066,14 @@ void TransducerWFdUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s\t%s\t+?", prepend, prepend);
       else
 #endif
-        std::cout << prepend << "\t" << prepend << "\t+?" << std::endl;
+        *output_stream << prepend << "\t" << prepend << "\t+?" << std::endl;
 
 #ifdef WINDOWS
       if (!pipe_output)
         hfst_fprintf_console(stdout, "\n");
       else
 #endif
-        std::cout << std::endl;
+        *output_stream << std::endl;
 
       return;
     }
@@ -1834,7 +2100,7 @@ void TransducerWFdUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "%s\t", prepend);
           else
 #endif
-            std::cout << prepend << "\t";
+            *output_stream << prepend << "\t";
         }
 
 #ifdef WINDOWS
@@ -1842,7 +2108,7 @@ void TransducerWFdUniq::printAnalyses(std::string prepend)
         hfst_fprintf_console(stdout, "%s", (*display_it).second);
       else
 #endif
-        std::cout << (*display_it).second;
+        *output_stream << (*display_it).second;
 
       if (displayWeightsFlag)
         {
@@ -1851,7 +2117,7 @@ void TransducerWFdUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "\t%f", (*display_it).first);
           else
 #endif
-            std::cout << '\t' << (*display_it).first;
+            *output_stream << '\t' << (*display_it).first;
         }
 
 #ifdef WINDOWS
@@ -1859,7 +2125,7 @@ void TransducerWFdUniq::printAnalyses(std::string prepend)
             hfst_fprintf_console(stdout, "\n");
           else
 #endif
-            std::cout << std::endl;
+            *output_stream << std::endl;
     }
   display_map.clear();
 
@@ -1868,7 +2134,7 @@ void TransducerWFdUniq::printAnalyses(std::string prepend)
     hfst_fprintf_console(stdout, "\n");
   else
 #endif
-    std::cout << std::endl;
+    *output_stream << std::endl;
 }
 
 void TransducerW::get_analyses(SymbolNumber * input_symbol,
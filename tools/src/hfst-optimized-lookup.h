@@ -20,6 +20,14 @@
   config.h-defined constants
 */
 
+#if HAVE_CONFIG_H
+// For NO_CPLUSPLUS_11; this tool has a name and version of its own
+#  include <config.h>
+#  undef PACKAGE_NAME
+#  undef PACKAGE_BUGREPORT
+#  undef PACKAGE_STRING
+#endif
+
 const char * PACKAGE_NAME = "hfst-optimized-lookup";
 const char * PACKAGE_BUGREPORT = "hfst-bugs@helsinki.fi";
 const char * PACKAGE_STRING = "hfst-optimized-lookup 1.2";
@@ -49,6 +57,17 @@ const char * PACKAGE_STRING = "hfst-optimized-lookup 1.2";
 #include <string>
 #include <time.h>
 
+#include "implementations/optimized-lookup/lookup_cache.h"
+#include "implementations/optimized-lookup/letter_trie.h"
+
+// --threads needs std::thread; elsewhere lookups are always done serially
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  define OL_THREADS 1
+#  define OL_THREAD_LOCAL thread_local
+#else
+#  define OL_THREAD_LOCAL
+#endif
+
 enum OutputType {HFST, xerox};
 OutputType outputType = xerox;
 
@@ -60,12 +79,23 @@ bool echoInputsFlag = false;
 bool beFast = false;
 int maxAnalyses = INT_MAX;
 bool preserveDiacriticRepresentationsFlag = false;
-bool limit_reached = false;
-unsigned long call_counter = 0;
 double time_cutoff = 0.0;
-clock_t start_clock;
+int threads = 1;
+// The time cutoff is tracked and the output written separately in each
+// lookup thread
+OL_THREAD_LOCAL bool limit_reached = false;
+OL_THREAD_LOCAL unsigned long call_counter = 0;
+OL_THREAD_LOCAL clock_t start_clock;
+OL_THREAD_LOCAL std::ostream * output_stream = &std::cout;
+// The output for the cache_size most recently looked up inputs, keyed on
+// their symbol numbers, each lookup thread having a cache of its own
+size_t cache_size = 0;
+OL_THREAD_LOCAL hfst_ol::LookupCache<std::string> * line_cache = NULL;
 
 #define MAX_IO_STRING 5000
+// How many symbols an input may have: the input string has room for them
+// and the NO_SYMBOL_NUMBER at the end
+#define MAX_INPUT_SYMBOLS 999
 
 // the following flags are only meaningful with certain debugging #defines
 bool timingFlag = false;
@@ -289,27 +319,7 @@ public:
   
 };
 
-class LetterTrie;
-typedef std::vector<LetterTrie*> LetterTrieVector;
-
-class LetterTrie
-{
-private:
-    LetterTrieVector letters;
-    SymbolNumberVector symbols;
-
-public:
-    LetterTrie(void):
-        letters(UCHAR_MAX, (LetterTrie*) NULL),
-        symbols(UCHAR_MAX,NO_SYMBOL_NUMBER)
-        {}
-
-    void add_string(const char * p,SymbolNumber symbol_key);
-    bool has_key_starting_with(const char c) const;
-
-    SymbolNumber find_key(char ** p);
-
-};
+typedef hfst_ol::CompactLetterTrie<SymbolNumber> LetterTrie;
 
 class Encoder {
 
@@ -323,6 +333,7 @@ private:
 public:
     Encoder(KeyTable * kt, SymbolNumber input_symbol_count):
         number_of_input_symbols(input_symbol_count),
+        letters(NO_SYMBOL_NUMBER),
         ascii_symbols(UCHAR_MAX,NO_SYMBOL_NUMBER)
         {
             read_input_symbols(kt);
@@ -613,6 +624,31 @@ public:
             set_symbol_table();
         }
 
+    // Copies share the tables but have their own output buffer, so each
+    // lookup thread can work on a copy of its own
+    Transducer(const Transducer & t):
+        header(t.header),
+        alphabet(t.alphabet),
+        keys(t.keys),
+        index_reader(t.index_reader),
+        transition_reader(t.transition_reader),
+        encoder(t.encoder),
+        display_vector(t.display_vector),
+        output_string((SymbolNumber*)(malloc(2000))),
+        symbol_table(t.symbol_table),
+        indices(t.indices),
+        transitions(t.transitions)
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                output_string[i] = NO_SYMBOL_NUMBER;
+            }
+        }
+
+    virtual ~Transducer()
+        {
+            free(output_string);
+        }
     
     KeyTable * get_key_table(void)
         {
@@ -1005,6 +1041,33 @@ public:
             set_symbol_table();
         }
 
+    // Copies share the tables but have their own output buffer, so each
+    // lookup thread can work on a copy of its own
+    TransducerW(const TransducerW & t):
+        header(t.header),
+        alphabet(t.alphabet),
+        keys(t.keys),
+        index_reader(t.index_reader),
+        transition_reader(t.transition_reader),
+        encoder(t.encoder),
+        display_map(t.display_map),
+        output_string((SymbolNumber*)(malloc(2000))),
+        symbol_table(t.symbol_table),
+        indices(t.indices),
+        transitions(t.transitions),
+        current_weight(0.0)
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                output_string[i] = NO_SYMBOL_NUMBER;
+            }
+        }
+
+    virtual ~TransducerW()
+        {
+            free(output_string);
+        }
+
     KeyTable * get_key_table(void)
         {
             return keys;
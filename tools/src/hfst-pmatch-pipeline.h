@@ -0,0 +1,283 @@
+//! @file hfst-pmatch-pipeline.h
+//!
+//! @brief Running pmatch over a text stream in several threads
+//!
+//! @author HFST Team
+
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, version 3 of the License.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef GUARD_hfst_pmatch_pipeline_h
+#define GUARD_hfst_pmatch_pipeline_h
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "implementations/optimized-lookup/pmatch.h"
+
+// --threads needs std::thread; elsewhere the input is processed serially
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  define PMATCH_THREADS 1
+#  include <thread>
+#  include <mutex>
+#  include <condition_variable>
+#  include <functional>
+#  include <exception>
+#endif
+
+#ifdef PMATCH_THREADS
+
+/** \brief A reader - workers - writer pipeline for pmatch.
+
+    The calling thread reads the input and pushes it in chunks that
+    pmatch can process independently of each other, ie. the units that
+    would otherwise be passed to the container one at a time (lines,
+    blank-line separated paragraphs or NUL-delimited blocks). Consecutive
+    chunks are collected into batches, the batches are processed by a
+    pool of worker threads, each with a PmatchContext of its own, and a
+    writer thread prints the results in input order. The output is
+    therefore the same as when processing one chunk at a time.
+
+    At most a few batches per worker are in flight at any time, so memory
+    use doesn't grow with the size of the input.
+*/
+class PmatchPipeline
+{
+public:
+    /** Process one chunk with a context, writing the result to a stream. */
+    typedef std::function<void(hfst_ol::PmatchContext &, std::ostream &,
+                               const std::string &)> ChunkFunction;
+
+private:
+    struct Chunk
+    {
+        std::string text;
+        bool verbatim;
+    };
+
+    struct Batch
+    {
+        std::vector<Chunk> chunks;
+        size_t bytes;
+        // Whether to flush the output stream after writing this batch
+        bool flush;
+        std::string output;
+        Batch(void): bytes(0), flush(false) {}
+    };
+
+    ChunkFunction process_chunk;
+    std::ostream & outstream;
+    // The formatting flags of outstream, for the workers' buffers
+    std::ios format;
+    std::vector<hfst_ol::PmatchContext> contexts;
+    // Batches are sent on when they have this many bytes of input
+    size_t batch_bytes;
+    size_t max_in_flight;
+
+    Batch * current;
+    size_t next_number;
+    size_t next_to_write;
+    size_t in_flight;
+    bool closing;
+    bool write_failed;
+    std::exception_ptr worker_error;
+    std::deque<std::pair<size_t, Batch *> > todo;
+    std::map<size_t, Batch *> done;
+
+    std::mutex lock;
+    std::condition_variable work_available;
+    std::condition_variable batch_done;
+    std::condition_variable batch_written;
+    std::vector<std::thread> workers;
+    std::thread writer;
+
+    void work(size_t worker)
+    {
+        std::ostringstream out;
+        out.copyfmt(format);
+        while (true) {
+            std::pair<size_t, Batch *> job;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                work_available.wait(l, [this] { return closing || !todo.empty(); });
+                if (todo.empty()) {
+                    return;
+                }
+                job = todo.front();
+                todo.pop_front();
+            }
+            try {
+                for (std::vector<Chunk>::const_iterator it = job.second->chunks.begin();
+                     it != job.second->chunks.end(); ++it) {
+                    if (it->verbatim) {
+                        out << it->text;
+                    } else {
+                        process_chunk(contexts[worker], out, it->text);
+                    }
+                }
+                job.second->output = out.str();
+            } catch (...) {
+                std::unique_lock<std::mutex> l(lock);
+                if (!worker_error) {
+                    worker_error = std::current_exception();
+                }
+            }
+            out.str(std::string());
+            out.clear();
+            job.second->chunks.clear();
+            {
+                std::unique_lock<std::mutex> l(lock);
+                done[job.first] = job.second;
+            }
+            batch_done.notify_all();
+        }
+    }
+
+    void write(void)
+    {
+        while (true) {
+            Batch * batch;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                batch_done.wait(l, [this] {
+                        return done.count(next_to_write) != 0 ||
+                            (closing && in_flight == 0); });
+                if (done.count(next_to_write) == 0) {
+                    return;
+                }
+                batch = done[next_to_write];
+                done.erase(next_to_write);
+            }
+            outstream << batch->output;
+            if (batch->flush) {
+                outstream.flush();
+            }
+            {
+                std::unique_lock<std::mutex> l(lock);
+                if (outstream.bad()) {
+                    write_failed = true;
+                }
+                ++next_to_write;
+                --in_flight;
+            }
+            delete batch;
+            batch_written.notify_all();
+        }
+    }
+
+    void send(void)
+    {
+        if (current->chunks.empty() && !current->flush) {
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> l(lock);
+            batch_written.wait(l, [this] { return in_flight < max_in_flight; });
+            todo.push_back(std::pair<size_t, Batch *>(next_number++, current));
+            ++in_flight;
+        }
+        current = new Batch();
+        work_available.notify_one();
+    }
+
+    void add(const std::string & text, bool verbatim)
+    {
+        Chunk chunk;
+        chunk.text = text;
+        chunk.verbatim = verbatim;
+        current->chunks.push_back(chunk);
+        current->bytes += text.size();
+        if (current->bytes >= batch_bytes) {
+            send();
+        }
+    }
+
+public:
+    /** Process chunks with \a f in \a threads worker threads, writing the
+        results to \a out. */
+    PmatchPipeline(unsigned int threads, ChunkFunction f, std::ostream & out):
+        process_chunk(f), outstream(out), format(NULL), contexts(threads),
+        batch_bytes(1 << 16), max_in_flight(4 * threads),
+        current(new Batch()), next_number(0), next_to_write(0), in_flight(0),
+        closing(false), write_failed(false)
+    {
+        format.copyfmt(out);
+        for (unsigned int i = 0; i < threads; ++i) {
+            workers.push_back(std::thread(&PmatchPipeline::work, this, i));
+        }
+        writer = std::thread(&PmatchPipeline::write, this);
+    }
+
+    ~PmatchPipeline(void)
+    {
+        if (writer.joinable()) {
+            try {
+                finish();
+            } catch (...) {
+            }
+        }
+        delete current;
+    }
+
+    /** Queue \a text to be processed. */
+    void push(const std::string & text) { add(text, false); }
+    /** Queue \a text to be written as it is. */
+    void push_verbatim(const std::string & text) { add(text, true); }
+    /** Send on what has been queued so far and flush the output stream
+        once it has been written, eg. when the input has asked for a
+        flush and may not continue before seeing the output. */
+    void flush(void)
+    {
+        current->flush = true;
+        send();
+    }
+
+    /** Process and write everything that has been queued and stop the
+        threads. An exception thrown while processing is rethrown here.
+        Returns false if writing failed. */
+    bool finish(void)
+    {
+        send();
+        {
+            std::unique_lock<std::mutex> l(lock);
+            closing = true;
+        }
+        work_available.notify_all();
+        batch_done.notify_all();
+        for (size_t i = 0; i < workers.size(); ++i) {
+            workers[i].join();
+        }
+        // Workers may have finished the last batches after the writer
+        // last looked
+        batch_done.notify_all();
+        writer.join();
+        if (worker_error) {
+            std::rethrow_exception(worker_error);
+        }
+        return !write_failed;
+    }
+
+    /** The contexts of the workers, eg. for summing up pattern counts
+        once finish() has returned. */
+    const std::vector<hfst_ol::PmatchContext> & get_contexts(void) const
+    {
+        return contexts;
+    }
+};
+
+#endif // PMATCH_THREADS
+
+#endif // GUARD_hfst_pmatch_pipeline_h
@@ -78,7 +78,11 @@ void libreadline_getline(char ** buffer)
 #include "hfst-commandline.h"
 #include "hfst-program-options.h"
 #include "hfst-tool-metadata.h"
+#include "hfst-pmatch-pipeline.h"
 #include "implementations/optimized-lookup/pmatch.h"
+#ifdef PMATCH_THREADS
+#  include <unistd.h> // isatty
+#endif
 
 #include "inc/globals-common.h"
 #include "inc/globals-unary.h"
@@ -93,9 +97,17 @@ static var_val locate_mode = not_defined;
 static var_val mark_patterns = not_defined;
 static int max_recursion = -1;
 static int max_context = -1;
+static bool memoize_rtns = false;
 
 static double time_cutoff = 0.0;
+static hfst_ol::PmatchBudget budget;
 static bool profile = false;
+static unsigned int threads = 1;
+#ifdef PMATCH_THREADS
+// With --threads, input goes through this instead of being matched and
+// printed right away
+static PmatchPipeline * pipeline = NULL;
+#endif
 
 void
 print_usage()
@@ -115,8 +127,17 @@ print_usage()
             "      --no-mark-patterns  Don't tag matched patterns\n"
             "      --max-context       Upper limit to context length allowed\n"
             "      --max-recursion     Upper limit for recursion\n"
+            "      --memoize-rtns      Remember the results of RTN calls at each\n"
+            "                          input position instead of repeating them\n"
             "  -t, --time-cutoff=S     Limit search after having used S seconds per input\n"
-            "  -p  --profile           Produce profiling data\n");
+            "      --max-wall-time=S   Stop matching an input after S seconds\n"
+            "      --max-steps=N       Stop matching an input after N steps\n"
+            "      --max-bytes=N       Stop matching an input when its working state\n"
+            "                          grows past N bytes\n"
+            "  -p  --profile           Produce profiling data\n"
+            "  -j, --threads=N         Match in N threads (default 1) when not reading\n"
+            "                          from a terminal; the output is the same as with\n"
+            "                          one thread\n");
     fprintf(message_out,
             "Use standard streams for input and output.\n"
             "\n"
@@ -128,9 +149,10 @@ print_usage()
     fprintf(message_out, "\n");
 }
 
-void match_and_print(hfst_ol::PmatchContainer & container,
-                std::ostream & outstream,
-                std::string & input_text)
+void match_and_print(const hfst_ol::PmatchContainer & container,
+                     hfst_ol::PmatchContext & c,
+                     std::ostream & outstream,
+                     std::string input_text)
 {
     if (input_text.size() > 0 && input_text.at(input_text.size() - 1) == '\n') {
         // Remove final newline
@@ -138,16 +160,22 @@ void match_and_print(hfst_ol::PmatchContainer & container,
     }
     if (!container.is_in_locate_mode()) {
 #ifndef _MSC_VER
-        outstream << container.match(input_text, time_cutoff);
+        outstream << container.match(input_text, c, time_cutoff);
 #else
-        hfst::hfst_fprintf_console(stdout, "%s", container.match(input_text, time_cutoff).c_str());
+        hfst::hfst_fprintf_console(stdout, "%s", container.match(input_text, c, time_cutoff).c_str());
 #endif
+        if (verbose && c.budget_exhausted()) {
+            std::cerr << container.get_budget_info(c);
+        }
         outstream << std::endl;
         if (blankline_separated) {
             outstream << std::endl;
         }
     } else {
-        hfst_ol::LocationVectorVector locations = container.locate(input_text, time_cutoff);
+        hfst_ol::LocationVectorVector locations = container.locate(input_text, c, time_cutoff);
+        if (verbose && c.budget_exhausted()) {
+            std::cerr << container.get_budget_info(c);
+        }
         bool printed_something = false;
         for(hfst_ol::LocationVectorVector::const_iterator it = locations.begin();
             it != locations.end(); ++it) {
@@ -167,9 +195,22 @@ void match_and_print(hfst_ol::PmatchContainer & container,
     }
 }
 
+void match_and_print(hfst_ol::PmatchContainer & container,
+                std::ostream & outstream,
+                std::string & input_text)
+{
+#ifdef PMATCH_THREADS
+    if (pipeline != NULL) {
+        pipeline->push(input_text);
+        return;
+    }
+#endif
+    match_and_print(container, container.get_context(), outstream, input_text);
+}
+
 
-int process_input(hfst_ol::PmatchContainer & container,
-                  std::ostream & outstream)
+int read_input(hfst_ol::PmatchContainer & container,
+               std::ostream & outstream)
 {
     std::string input_text;
     char * line = NULL;
@@ -240,13 +281,45 @@ int process_input(hfst_ol::PmatchContainer & container,
     if (blankline_separated && !input_text.empty()) {
         match_and_print(container, outstream, input_text);
     }
+    return EXIT_SUCCESS;
+}
+
+int process_input(hfst_ol::PmatchContainer & container,
+                  std::ostream & outstream)
+{
+    int retval = EXIT_SUCCESS;
+#ifdef PMATCH_THREADS
+    if (threads > 1 && !isatty(STDIN_FILENO)) {
+        const hfst_ol::PmatchContainer & shared = container;
+        PmatchPipeline p(threads,
+                         [&shared](hfst_ol::PmatchContext & c, std::ostream & out,
+                                   const std::string & input_text) {
+                             match_and_print(shared, c, out, input_text);
+                         },
+                         outstream);
+        pipeline = &p;
+        retval = read_input(container, outstream);
+        pipeline = NULL;
+        if (!p.finish()) {
+            std::cerr << "hfst-pmatch: Could not flush file" << std::endl;
+        }
+        for (std::vector<hfst_ol::PmatchContext>::const_iterator it =
+                 p.get_contexts().begin(); it != p.get_contexts().end(); ++it) {
+            container.get_context().add_counts(*it);
+        }
+    } else {
+        retval = read_input(container, outstream);
+    }
+#else
+    retval = read_input(container, outstream);
+#endif
     if (count_patterns == on) {
         outstream << "\n" << container.get_pattern_count_info() << "\n";
     }
     if (profile) {
         outstream << "\n" << container.get_profiling_info() << "\n";
     }
-    return EXIT_SUCCESS;
+    return retval;
 }
 
 
@@ -268,12 +341,17 @@ int parse_options(int argc, char** argv)
                 {"no-mark-patterns", no_argument, 0, 'm'},
                 {"max-context", required_argument, 0, 'b'},
                 {"max-recursion", required_argument, 0, 'r'},
+                {"memoize-rtns", no_argument, 0, 'M'},
                 {"time-cutoff", required_argument, 0, 't'},
+                {"max-wall-time", required_argument, 0, 'W'},
+                {"max-steps", required_argument, 0, 'S'},
+                {"max-bytes", required_argument, 0, 'B'},
                 {"profile", no_argument, 0, 'p'},
+                {"threads", required_argument, 0, 'j'},
                 {0,0,0,0}
             };
         int option_index = 0;
-        int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT HFST_GETOPT_UNARY_SHORT "nxlcdmq:r:t:p",
+        int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT HFST_GETOPT_UNARY_SHORT "nxlcdmq:r:t:pj:",
                             long_options, &option_index);
         if (-1 == c)
         {
@@ -319,6 +397,9 @@ int parse_options(int argc, char** argv)
                 return EXIT_FAILURE;
             }
             break;
+        case 'M':
+            memoize_rtns = true;
+            break;
         case 't':
             time_cutoff = atof(optarg);
             if (time_cutoff < 0.0)
@@ -327,9 +408,49 @@ int parse_options(int argc, char** argv)
                 return EXIT_FAILURE;
             }
             break;
+        case 'W':
+            budget.max_time = atof(optarg);
+            if (budget.max_time < 0.0)
+            {
+                std::cerr << "Invalid argument for --max-wall-time\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            if (atol(optarg) < 0)
+            {
+                std::cerr << "Invalid argument for --max-steps\n";
+                return EXIT_FAILURE;
+            }
+            budget.max_steps = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            if (atol(optarg) < 0)
+            {
+                std::cerr << "Invalid argument for --max-bytes\n";
+                return EXIT_FAILURE;
+            }
+            budget.max_bytes = strtoul(optarg, NULL, 10);
+            break;
         case 'p':
             profile = true;
             break;
+        case 'j':
+            if (atoi(optarg) < 1)
+            {
+                std::cerr << "Invalid argument for --threads\n";
+                return EXIT_FAILURE;
+            }
+            threads = atoi(optarg);
+#ifndef PMATCH_THREADS
+            if (threads > 1)
+            {
+                std::cerr << "Warning: threads are not supported on this platform, "
+                    "matching in one thread\n";
+                threads = 1;
+            }
+#endif
+            break;
 #include "inc/getopt-cases-error.h"
         }
         
@@ -394,8 +515,16 @@ int main(int argc, char ** argv)
         std::cerr << "Could not open file " << inputfilename << std::endl;
         return EXIT_FAILURE;
     }
+    // A regular file is mapped, so that RTNs are read only once called
+    instream.seekg(0, std::ios::end);
+    bool mappable = instream.tellg() > 0;
+    instream.clear();
+    instream.seekg(0);
     try {
-        hfst_ol::PmatchContainer container(instream);
+        hfst_ol::PmatchContainer * loaded = mappable ?
+            new hfst_ol::PmatchContainer(new hfst_ol::MappedFile(inputfilename)) :
+            new hfst_ol::PmatchContainer(instream);
+        hfst_ol::PmatchContainer & container = *loaded;
         container.set_verbose(verbose);
         if (extract_patterns != not_defined)
             container.set_extract_patterns(extract_patterns == on);
@@ -411,11 +540,15 @@ int main(int argc, char ** argv)
             container.set_max_context(max_context);
         if (max_recursion >= 0)
             container.set_max_recursion(max_recursion);
+        container.set_memoize_rtns(memoize_rtns);
+        container.set_budget(budget);
         container.set_profile(profile);
 #ifdef _MSC_VER
         //hfst::print_output_to_console(true);
 #endif
-    return process_input(container, std::cout);
+        int retval = process_input(container, std::cout);
+        delete loaded;
+        return retval;
     } catch(HfstException & e) {
         std::cerr << "The archive in " << inputfilename << " doesn't look right."
             "\nDid you make it with hfst-pmatch2fst or make sure it's in weighted optimized-lookup format?\n";
@@ -31,6 +31,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 #include <vector>
 #include <map>
@@ -60,6 +61,7 @@ using std::pair;
 #include "HfstOutputStream.h"
 #include "HfstExceptionDefs.h"
 #include "implementations/ConvertTransducerFormat.h"
+#include "implementations/optimized-lookup/pmatch.h"
 #include "parsers/PmatchCompiler.h"
 #include "hfst-commandline.h"
 #include "hfst-program-options.h"
@@ -79,6 +81,9 @@ static bool line_separated = false;
 static bool flatten = false;
 static bool include_cosine_distances = false;
 static clock_t timer;
+// TOP's header must have room for its other properties as well, and all
+// of them together are limited to 64 kB
+static const size_t MAX_RTN_INDEX_LENGTH = 60000;
 
 #if HAVE_OPENFST
 static hfst::ImplementationType compilation_format = hfst::TROPICAL_OPENFST_TYPE;
@@ -306,18 +311,16 @@ process_stream(HfstOutputStream& outstream)
                                              true, // weighted
                                              "", // no special options
                                              &harmonizer); // harmonize with this
-        output_tmp = hfst::implementations::ConversionFunctions::
+        hfst::HfstTransducer * toplevel = hfst::implementations::ConversionFunctions::
             hfst_ol_to_hfst_transducer(harmonized_tmp);
-        output_tmp->set_name("TOP");
+        toplevel->set_name("TOP");
         for(std::map<std::string, std::string>::iterator it = properties.begin();
             it != properties.end(); ++it) {
-            output_tmp->set_property(it->first, it->second);
+            toplevel->set_property(it->first, it->second);
         }
-        outstream << *output_tmp;
         delete definitions["TOP"];
         definitions.erase("TOP");
         delete intermediate_tmp;
-        delete output_tmp;
 
         if (verbose) {
             double duration = (clock() - timer) /
@@ -325,7 +328,11 @@ process_stream(HfstOutputStream& outstream)
             timer = clock();
             std::cerr << "converted in " << duration << " seconds\n";
         }
-    
+
+        // The RTNs are converted before writing TOP, so that TOP's header
+        // can list their sizes for loading them lazily
+        std::vector<hfst::HfstTransducer *> rtns;
+        std::ostringstream rtn_index;
         for (std::map<std::string, HfstTransducer *>::iterator it =
                  definitions.begin(); it != definitions.end(); ++it) {
             if (verbose) {
@@ -339,19 +346,34 @@ process_stream(HfstOutputStream& outstream)
                                                  true, // weighted
                                                  "", // no special options
                                                  &harmonizer); // harmonize with this
+            std::ostringstream serialized;
+            harmonized_tmp->write(serialized);
+            rtn_index << it->first << "\t" << serialized.str().size() << "\n";
             output_tmp = hfst::implementations::ConversionFunctions::
                 hfst_ol_to_hfst_transducer(harmonized_tmp);
             output_tmp->set_name(it->first);
-            outstream << *output_tmp;;
+            rtns.push_back(output_tmp);
             delete it->second;
             delete intermediate_tmp;
-            delete output_tmp;
             if (verbose) {
                 double duration = (clock() - timer) /
                     (double) CLOCKS_PER_SEC;
                 std::cerr << "converted in " << duration << " seconds\n";
             }
         }
+        // Without the index the archive is just loaded the old way
+        if (!rtns.empty() && rtn_index.str().size() < MAX_RTN_INDEX_LENGTH) {
+            toplevel->set_property(
+                hfst_ol::PmatchContainer::rtn_index_property(),
+                rtn_index.str());
+        }
+        outstream << *toplevel;
+        delete toplevel;
+        for (std::vector<hfst::HfstTransducer *>::iterator it = rtns.begin();
+             it != rtns.end(); ++it) {
+            outstream << **it;
+            delete *it;
+        }
     } else {
         std::cerr << program_name << ": Empty ruleset, nothing to write\n";
         return EXIT_FAILURE;
@@ -26,75 +26,6 @@
 
 
 
-//////////Function definitions for LetterTrie
-
-bool
-LetterTrie::has_symbol_0() const
-{
-  for(size_t i=0;i<symbols.size();i++)
-  {
-    if(symbols[i] == 0)
-      return true;
-  }
-  for(size_t i=0;i<letters.size();i++)
-  {
-    if(letters[i] != NULL && letters[i]->has_symbol_0())
-      return true;
-  }
-  return false;
-}
-
-void
-LetterTrie::add_string(const char * p, SymbolNumber symbol_key)
-{
-  if (*(p+1) == 0)
-  {
-    symbols[(unsigned char)(*p)] = symbol_key;
-    return;
-  }
-
-  if (letters[(unsigned char)(*p)] == NULL)
-    letters[(unsigned char)(*p)] = new LetterTrie();
-  letters[(unsigned char)(*p)]->add_string(p+1,symbol_key);
-}
-
-SymbolNumber
-LetterTrie::find_symbol(const char* c) const
-{
-  if(strlen(c) == 1)
-    return symbols[(unsigned char)(c[0])];
-  
-  if(letters[(unsigned char)(c[0])] == NULL)
-    return NO_SYMBOL_NUMBER;
-  else
-    return letters[(unsigned char)(c[0])]->find_symbol(c+1);
-}
-
-SymbolNumber
-LetterTrie::extract_symbol(std::istream& is) const
-{
-  int c = is.get();
-  if(c == EOF)
-    return 0;
-    
-  if(letters[c] == NULL)
-  {
-    if(symbols[c] == NO_SYMBOL_NUMBER)
-      is.putback(c);
-    return symbols[c];
-  }
-  
-  SymbolNumber s = letters[c]->extract_symbol(is);
-  if(s == NO_SYMBOL_NUMBER)
-  {
-    if(symbols[c] == NO_SYMBOL_NUMBER)
-      is.putback(c);
-    return symbols[c];
-  }
-  return s;
-}
-
-
 //////////Function definitions for Symbolizer
 
 void
@@ -144,11 +75,43 @@ Symbolizer::extract_symbol(std::istream& is) const
     return NO_SYMBOL_NUMBER;
   if(ascii_symbols[c] == NO_SYMBOL_NUMBER ||
      ascii_symbols[c] == 0)
-    return letters.extract_symbol(is);
+    return extract_longest_symbol(is);
   
   return ascii_symbols[is.get()];
 }
 
+SymbolNumber
+Symbolizer::extract_longest_symbol(std::istream& is) const
+{
+  int c = is.get();
+  if(c == EOF)
+    return 0;
+  
+  // Follow the trie as far as the input allows, remembering the longest
+  // symbol seen, and put back whatever was read past it
+  std::string consumed;
+  SymbolNumber longest = NO_SYMBOL_NUMBER;
+  size_t longest_length = 0;
+  OlLetterTrie::Node node = letters.root();
+  while(c != EOF)
+  {
+    consumed.push_back((char)c);
+    if(!letters.next(node, (unsigned char)c, node))
+      break;
+    if(letters.symbol(node) != NO_SYMBOL_NUMBER)
+    {
+      longest = letters.symbol(node);
+      longest_length = consumed.size();
+    }
+    c = is.get();
+  }
+  if(c == EOF)
+    is.clear();
+  for(size_t i=consumed.size(); i>longest_length; i--)
+    is.putback(consumed[i-1]);
+  return longest;
+}
+
 
 //////////Function definitions for ProcTransducerAlphabet
 
@@ -18,63 +18,22 @@
 
 #include "hfst-proc.h"
 
-class LetterTrie;
-typedef std::vector<LetterTrie*> LetterTrieVector;
-class Symbolizer;
-
 extern bool processCompounds ;
 
-class LetterTrie
+class Symbolizer
 {
  private:
-  LetterTrieVector letters;
-  SymbolNumberVector symbols;
-  
-  /**
-   * Whether our symbols vector or that of any of our children contains
-   * symbol number 0
-   */
-  bool has_symbol_0() const;
- public:
-  LetterTrie(void):
-    letters(std::numeric_limits<unsigned char>::max(), (LetterTrie*) NULL),
-    symbols(std::numeric_limits<unsigned char>::max(),NO_SYMBOL_NUMBER)
-  {}
-  
-  LetterTrie(const LetterTrie& o): letters(), symbols(o.symbols)
-  {
-    for(LetterTrieVector::const_iterator it=o.letters.begin(); it!=o.letters.end(); it++)
-      letters.push_back(((*it)==NULL) ? NULL : new LetterTrie(*(*it)));
-  }
+  OlLetterTrie letters;
+  SymbolNumberVector ascii_symbols;
   
-  ~LetterTrie()
-  {
-    for(LetterTrieVector::iterator it=letters.begin(); it!=letters.end(); it++)
-      delete *it;
-  }
-
-  void add_string(const char * p,SymbolNumber symbol_key);
+  SymbolNumber symbol_count;
 
-  SymbolNumber find_symbol(const char* c) const;
-  
   /**
-   * Read the next symbol from the stream. If the next character(s) do not form
-   * a symbol, this version will put the characters back, so the stream is in
-   * the same condition it was when this function was called
+   * Read the longest symbol in the trie from the stream. Characters read
+   * past it are put back.
    * @return the number of the symbol, 0 for EOF, or NO_SYMBOL_NUMBER
    */
-  SymbolNumber extract_symbol(std::istream& is) const;
-  
-  friend class Symbolizer;
-};
-
-class Symbolizer
-{
- private:
-  LetterTrie letters;
-  SymbolNumberVector ascii_symbols;
-  
-  SymbolNumber symbol_count;
+  SymbolNumber extract_longest_symbol(std::istream& is) const;
 
  public:
   Symbolizer(): letters(),
@@ -85,7 +44,7 @@ class Symbolizer
   {
     add_symbols(st);
     
-    if(letters.has_symbol_0())
+    if(letters.has_symbol(0))
     {
       std::cerr << "!! Warning: the letter trie contains references to symbol  !!\n"
                 << "!! number 0. This is almost certainly a bug and could      !!\n"
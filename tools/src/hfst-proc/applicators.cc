@@ -290,6 +290,10 @@ GenerationApplicator::apply()
     else
       token_stream << next_token;
   }
+
+  if(verboseFlag && cache.is_enabled())
+    std::cerr << "Lookup cache: " << cache.get_hits() << " hits, "
+              << cache.get_misses() << " misses" << std::endl;
 }
 
 std::vector<TokenVector>
@@ -360,21 +364,21 @@ GenerationApplicator::preprocess_finals(const LookupPathSet& finals) const
 }
 
 
-bool
-GenerationApplicator::lookup(const TokenVector& tokens, bool generate_on_fail)
+GenerationApplicator::Generation
+GenerationApplicator::generate(const TokenVector& tokens) const
 {
+  Generation generation;
   LookupState state(transducer);
   state.lookup(token_stream.to_symbols(tokens), caps_mode);
   if(state.is_final()) // generation succeeded
   {
     LookupPathSet finals = state.get_finals_set();
-    CapitalizationState caps_change = Unknown;
     if(caps_mode!=DictionaryCase) {
         CapitalizationState lm_caps_state = token_stream.get_capitalization_state((*finals.begin())->get_output_symbols());
         CapitalizationState sf_caps_state = token_stream.get_capitalization_state(TokenVector(tokens.begin(),tokens.size()>1?tokens.begin()+2:tokens.end()));
         if(sf_caps_state != lm_caps_state) {
             // We *only* change capitalization if lm and sf caps state differs
-            caps_change = sf_caps_state;
+            generation.caps_change = sf_caps_state;
         }
     }
 
@@ -382,17 +386,45 @@ GenerationApplicator::lookup(const TokenVector& tokens, bool generate_on_fail)
             std::cout << "Generated " << finals.size() << " forms" << std::endl;
 
     LookupPathSet new_finals = preprocess_finals(finals);
+    for(LookupPathSet::const_iterator it=new_finals.begin(); it!=new_finals.end(); it++)
+      generation.forms.push_back((*it)->get_output_symbols());
+    generation.found = true;
+  }
+  return generation;
+}
+
+bool
+GenerationApplicator::lookup(const TokenVector& tokens, bool generate_on_fail)
+{
+  // Only token strings made of symbols are cached, other tokens don't have
+  // a symbol number of their own
+  std::string key;
+  bool cacheable = cache.is_enabled();
+  for(TokenVector::const_iterator it=tokens.begin(); cacheable && it!=tokens.end(); it++)
+  {
+    if(it->type == Symbol)
+      append_to_cache_key(key, it->symbol);
+    else
+      cacheable = false;
+  }
 
-    token_stream.put_symbols((*new_finals.begin())->get_output_symbols(),caps_change);
-    if(new_finals.size() > 1)
+  Generation fresh;
+  const Generation* generation = cacheable ? cache.find(key) : NULL;
+  if(generation == NULL)
+  {
+    fresh = generate(tokens);
+    if(cacheable)
+      cache.insert(key, fresh);
+    generation = &fresh;
+  }
+
+  if(generation->found)
+  {
+    token_stream.put_symbols(generation->forms[0],generation->caps_change);
+    for(size_t i=1; i<generation->forms.size(); i++)
     {
-      LookupPathSet::const_iterator it=new_finals.begin();
-      it++; // start from begin+1
-      for(;it!=new_finals.end();it++)
-      {
-        token_stream.ostream() << '/';
-        token_stream.put_symbols((*it)->get_output_symbols(),caps_change);
-      }
+      token_stream.ostream() << '/';
+      token_stream.put_symbols(generation->forms[i],generation->caps_change);
     }
     return true;
   }
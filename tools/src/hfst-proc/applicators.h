@@ -59,8 +59,21 @@ class AnalysisApplicator: public Applicator
 class GenerationApplicator: public Applicator
 {
  private:
+  /**
+   * The forms generated from a token string, in output order
+   */
+  struct Generation
+  {
+    bool found;
+    std::vector<SymbolNumberVector> forms;
+    CapitalizationState caps_change;
+    Generation(): found(false), forms(), caps_change(Unknown) {}
+  };
+
   GenerationMode mode;
   CapitalizationMode caps_mode;
+  // Generations of recently seen token strings, keyed on their symbols
+  LookupCache<Generation> cache;
 
   /**
    * Split the given token string into a set of token strings to generate with,
@@ -68,6 +81,8 @@ class GenerationApplicator: public Applicator
    */
   std::vector<TokenVector> split(const TokenVector& tokens) const;
 
+  Generation generate(const TokenVector& tokens) const;
+
   bool lookup(const TokenVector& tokens, bool generate_on_fail);
 
   LookupPathSet preprocess_finals(const LookupPathSet& finals) const ;
@@ -75,9 +90,28 @@ class GenerationApplicator: public Applicator
 
  public:
   GenerationApplicator(const ProcTransducer& t, TokenIOStream& ts,
-                       GenerationMode m, CapitalizationMode c):
-    Applicator(t,ts), mode(m), caps_mode(c) {}
+                       GenerationMode m, CapitalizationMode c,
+                       size_t cache_size=0):
+    Applicator(t,ts), mode(m), caps_mode(c), cache(cache_size) {}
   void apply();
 };
 
+/**
+ * Makes applicators of one kind for any number of token streams
+ */
+class ApplicatorFactory
+{
+ public:
+  virtual ~ApplicatorFactory() {}
+
+  /**
+   * Create an applicator working on the given token stream
+   * @param formatter set to a new output formatter that the applicator uses,
+   *                  or NULL if it doesn't use one. It must outlive the
+   *                  applicator
+   */
+  virtual Applicator* create(TokenIOStream& ts,
+                             OutputFormatter*& formatter) const = 0;
+};
+
 #endif
@@ -26,6 +26,12 @@
 #include "transducer.h"
 #include "formatter.h"
 #include "applicators.h"
+#include "parallel.h"
+
+#ifdef HFST_PROC_THREADS
+#  include <thread>
+#  include <algorithm>
+#endif
 
 bool verboseFlag = false;
 bool silentFlag = false;
@@ -99,6 +105,63 @@ void stream_error(const char* e)
 void stream_error(std::string e) {stream_error(e.c_str());}
 
 
+/**
+ * Makes the applicator that the command line asks for
+ */
+class CommandLineApplicatorFactory : public ApplicatorFactory
+{
+ private:
+  const ProcTransducer& transducer;
+  int cmd;
+  int output_type;
+  bool filter_compound_analyses;
+  CapitalizationMode capitalization_mode;
+  size_t cache_size;
+ public:
+  CommandLineApplicatorFactory(const ProcTransducer& t, int c, int o, bool f,
+                               CapitalizationMode m, size_t cache):
+    transducer(t), cmd(c), output_type(o), filter_compound_analyses(f),
+    capitalization_mode(m), cache_size(cache) {}
+
+  Applicator* create(TokenIOStream& token_stream,
+                     OutputFormatter*& output_formatter) const
+  {
+    output_formatter = NULL;
+    switch(cmd)
+    {
+      case 't':
+        return new TokenizationApplicator(transducer, token_stream);
+      case 'g':
+        return new GenerationApplicator(transducer, token_stream, gm_unknown,
+                                        capitalization_mode, cache_size);
+      case 'n':
+        return new GenerationApplicator(transducer, token_stream, gm_clean,
+                                        capitalization_mode, cache_size);
+      case 'd':
+        return new GenerationApplicator(transducer, token_stream, gm_all,
+                                        capitalization_mode, cache_size);
+      case 'a':
+      default:
+        switch(output_type)
+        {
+          case 'C':
+            output_formatter = (OutputFormatter*)new CGOutputFormatter(token_stream, filter_compound_analyses);
+            break;
+          case 'x':
+            output_formatter = (OutputFormatter*)new XeroxOutputFormatter(token_stream, filter_compound_analyses);
+            break;
+          case 'j':
+            output_formatter = (OutputFormatter*)new TransliterateOutputFormatter(token_stream, filter_compound_analyses);
+            break;
+          default:
+            output_formatter = (OutputFormatter*)new ApertiumOutputFormatter(token_stream, filter_compound_analyses);
+        }
+        return new AnalysisApplicator(transducer, token_stream, *output_formatter,
+                                      capitalization_mode);
+    }
+  }
+};
+
 bool print_usage(void)
 {
   std::cout <<
@@ -126,6 +189,13 @@ bool print_usage(void)
     "                          (if the transducer is weighted, the N best analyses)\n" <<
     "  --weight-classes N      Output no more than N best weight classes\n" <<
     "                          (where analyses with equal weight constitute a class\n"
+    "  --cache N               Remember the generations of the N most recently\n" <<
+    "                          generated word forms (default 0, no cache)\n" <<
+    "  --threads N             Process in N threads, 0 meaning one per core\n" <<
+    "                          (default 1). The input is split at blanks that\n" <<
+    "                          no word can contain, and the output is the same\n" <<
+    "                          as with one thread. Each thread has a cache of\n" <<
+    "                          its own\n" <<
     "  -c, --case-sensitive    Perform lookup using the literal case of the input\n" <<
     "                          characters\n" <<
     "  -w  --dictionary-case   Output results using dictionary case instead of\n" <<
@@ -172,6 +242,8 @@ int main(int argc, char **argv)
   int capitalization = 0;
   bool filter_compound_analyses = true;
   bool null_flush = false;
+  size_t cache_size = 0;
+  unsigned int threads = 1;
   
   while (true)
   {
@@ -204,6 +276,8 @@ int main(int argc, char **argv)
       {"dictionary-case",no_argument,       0, 'w'},
       {"null-flush",     no_argument,       0, 'z'},
       {"raw",            no_argument,       0, 'X'},
+      {"cache",          required_argument, 0, '1'},
+      {"threads",        required_argument, 0, '2'},
       {0,                0,                 0,  0 }
     };
     
@@ -305,6 +379,35 @@ int main(int argc, char **argv)
         }
       break;
     
+    case '1':
+      if (atoi(optarg) < 0)
+        {
+          std::cerr << "Invalid or no argument for cache size\n";
+          return EXIT_FAILURE;
+        }
+      cache_size = atoi(optarg);
+      break;
+
+    case '2':
+      if (atoi(optarg) < 0)
+        {
+          std::cerr << "Invalid or no argument for thread count\n";
+          return EXIT_FAILURE;
+        }
+      threads = atoi(optarg);
+#ifdef HFST_PROC_THREADS
+      if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+#else
+      if (threads != 1)
+        {
+          std::cerr << "hfst-proc: warning: threads are not supported on this "
+                    << "platform, processing in one thread" << std::endl;
+          threads = 1;
+        }
+#endif
+      break;
+
     case 'e':
       processCompounds = true;
       break;
@@ -428,49 +531,44 @@ int main(int argc, char **argv)
     if(verboseFlag)
       std::cout << "Transducer successfully loaded" << std::endl;
     in.close();
-    TokenIOStream token_stream(*input, *output, t.get_alphabet(), null_flush,
-                               rawMode);
-    Applicator* applicator = NULL;
-    OutputFormatter* output_formatter = NULL;
-    switch(cmd)
+    CommandLineApplicatorFactory factory(t, cmd, output_type,
+                                         filter_compound_analyses,
+                                         capitalization_mode, cache_size);
+    bool generation = (cmd == 'g' || cmd == 'n' || cmd == 'd');
+
+    // Tokenization and the verbose and debugging output, which goes to
+    // standard output as it happens, are only done in one thread
+    bool parallel = false;
+    if(threads > 1 && cmd != 't' && !verboseFlag &&
+       !printDebuggingInformationFlag)
     {
-      case 't':
-        applicator = new TokenizationApplicator(t, token_stream);
-        break;
-      case 'g':
-        applicator = new GenerationApplicator(t, token_stream, gm_unknown, capitalization_mode);
-        break;
-      case 'n':
-        applicator = new GenerationApplicator(t, token_stream, gm_clean, capitalization_mode);
-        break;
-      case 'd':
-        applicator = new GenerationApplicator(t, token_stream, gm_all, capitalization_mode);
-        break;
-      case 'a':
-      default:
-        switch(output_type)
-        {
-          case 'C':
-            output_formatter = (OutputFormatter*)new CGOutputFormatter(token_stream, filter_compound_analyses);
-            break;
-          case 'x':
-            output_formatter = (OutputFormatter*)new XeroxOutputFormatter(token_stream, filter_compound_analyses);
-            break;
-          case 'j':
-            output_formatter = (OutputFormatter*)new TransliterateOutputFormatter(token_stream, filter_compound_analyses);
-            break;
-          default:
-            output_formatter = (OutputFormatter*)new ApertiumOutputFormatter(token_stream, filter_compound_analyses);
-        }
-        applicator = new AnalysisApplicator(t, token_stream, *output_formatter, capitalization_mode);
-        break;
+      if(!generation)
+        t.build_input_lookahead();
+      SegmentReader reader(*input, t, generation, null_flush, rawMode);
+      if(reader.can_split())
+      {
+        ParallelProcessor processor(t, factory, threads, null_flush, rawMode);
+        processor.process(reader, *output);
+        parallel = true;
+      }
+      else if(!silentFlag)
+        std::cerr << "hfst-proc: warning: the transducer can consume every "
+                  << "blank, processing in one thread" << std::endl;
+    }
+
+    if(!parallel)
+    {
+      TokenIOStream token_stream(*input, *output, t.get_alphabet(), null_flush,
+                                 rawMode);
+      OutputFormatter* output_formatter = NULL;
+      Applicator* applicator = factory.create(token_stream, output_formatter);
+
+      applicator->apply();
+
+      delete applicator;
+      if(output_formatter != NULL)
+        delete output_formatter;
     }
-    
-    applicator->apply();
-    
-    delete applicator;
-    if(output_formatter != NULL)
-      delete output_formatter;
   }
   catch (std::exception& e)
   {
@@ -0,0 +1,305 @@
+//       This program is free software: you can redistribute it and/or modify
+//       it under the terms of the GNU General Public License as published by
+//       the Free Software Foundation, version 3 of the License.
+//
+//       This program is distributed in the hope that it will be useful,
+//       but WITHOUT ANY WARRANTY; without even the implied warranty of
+//       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//       GNU General Public License for more details.
+//
+//       You should have received a copy of the GNU General Public License
+//       along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "parallel.h"
+#include "formatter.h"
+#include "transducer.h"
+
+#ifdef HFST_PROC_THREADS
+#  include <thread>
+#  include <atomic>
+#  include <exception>
+#endif
+
+// The smallest segment worth handing to a thread, in bytes
+static const size_t MIN_SEGMENT_SIZE = 4096;
+// How many segments each thread gets per batch. The whole batch is read
+// before any of it is processed, so this bounds how far the output lags
+// behind the input
+static const size_t SEGMENTS_PER_THREAD = 16;
+
+//////////Function definitions for SegmentReader
+
+SegmentReader::SegmentReader(std::istream& i, const ProcTransducer& t,
+                             bool gen, bool flush, bool raw_mode):
+  is(i), null_flush(flush), raw(raw_mode), generation(gen),
+  boundary_chars(256, false), superblank_is_boundary(false),
+  in_superblank(false), in_word(false), at_end(false)
+{
+  const char* blanks = " \t\n\r\v\f";
+  for(const char* c=blanks; *c!='\0'; c++)
+    boundary_chars[(unsigned char)*c] = is_boundary(*c, t);
+
+  if(generation)
+    superblank_is_boundary = true;
+  else
+  {
+    const InputLookahead* lookahead = t.get_input_lookahead();
+    SymbolNumber blank = t.get_alphabet().get_blank_symbol();
+    superblank_is_boundary = lookahead != NULL &&
+      !t.get_alphabet().is_alphabetic(blank) &&
+      !lookahead->can_ever_consume(blank);
+  }
+}
+
+bool
+SegmentReader::is_boundary(char c, const ProcTransducer& t) const
+{
+  // outside ^...$ words generation just copies the input
+  if(generation)
+    return true;
+
+  const ProcTransducerAlphabet& alphabet = t.get_alphabet();
+  const InputLookahead* lookahead = t.get_input_lookahead();
+  if(lookahead == NULL)
+    return false;
+
+  // a character in a multicharacter symbol could be read as part of it
+  const SymbolTable& symbols = alphabet.get_symbol_table();
+  for(size_t i=0; i<symbols.size(); i++)
+  {
+    if(symbols[i].size() > 1 && symbols[i].find(c) != std::string::npos)
+      return false;
+  }
+
+  std::string str(1, c);
+  SymbolNumber symbol = alphabet.get_symbolizer().find_symbol(str.c_str());
+  if(symbol == NO_SYMBOL_NUMBER || symbol == 0)
+    return !alphabet.is_alphabetic(str.c_str()); // stepping with it fails
+
+  // the lookup steps with the symbol, or its lowercase form too
+  return !alphabet.is_alphabetic(symbol) &&
+    !lookahead->can_ever_consume(symbol) &&
+    !lookahead->can_ever_consume(alphabet.to_lower(symbol));
+}
+
+bool
+SegmentReader::can_split() const
+{
+  if(superblank_is_boundary && !raw)
+    return true;
+  for(size_t i=0; i<boundary_chars.size(); i++)
+  {
+    if(boundary_chars[i])
+      return true;
+  }
+  return false;
+}
+
+bool
+SegmentReader::read(std::string& segment, size_t min_size, bool& flush)
+{
+  segment.clear();
+  flush = false;
+  if(at_end)
+    return false;
+
+  int c;
+  while((c = is.get()) != EOF)
+  {
+    segment += (char)c;
+
+    if(!raw && c == '\\')
+    {
+      if((c = is.get()) == EOF)
+        break;
+      segment += (char)c;
+      continue;
+    }
+
+    if(in_superblank)
+    {
+      // a null character in a superblank is just part of it
+      if(c == ']')
+      {
+        in_superblank = false;
+        if(superblank_is_boundary && !in_word && segment.size() >= min_size)
+          return true;
+      }
+      continue;
+    }
+
+    if(c == '\0')
+    {
+      if(!null_flush)
+      {
+        // the token stream stops reading at a literal NUL, so we do too
+        at_end = true;
+        return true;
+      }
+      if(!in_word)
+      {
+        flush = true;
+        return true;
+      }
+      continue;
+    }
+
+    if(!raw)
+    {
+      if(c == '[')
+      {
+        in_superblank = true;
+        continue;
+      }
+      if(generation && c == '^')
+        in_word = true;
+      else if(generation && c == '$')
+        in_word = false;
+    }
+
+    if(!in_word && boundary_chars[(unsigned char)c] &&
+       segment.size() >= min_size)
+      return true;
+  }
+
+  at_end = true;
+  return !segment.empty();
+}
+
+//////////Function definitions for ParallelProcessor
+
+ParallelProcessor::Worker::Worker(const ProcTransducer& t,
+                                  const ApplicatorFactory& factory,
+                                  bool flush, bool raw):
+  in(), out(), token_stream(in, out, t.get_alphabet(), flush, raw),
+  formatter(NULL), applicator(NULL)
+{
+  applicator = factory.create(token_stream, formatter);
+}
+
+ParallelProcessor::Worker::~Worker()
+{
+  delete applicator;
+  if(formatter != NULL)
+    delete formatter;
+}
+
+std::string
+ParallelProcessor::Worker::process(const std::string& segment)
+{
+  in.clear();
+  in.str(segment);
+  out.clear();
+  out.str("");
+  applicator->apply();
+  return out.str();
+}
+
+ParallelProcessor::ParallelProcessor(const ProcTransducer& t,
+                                     const ApplicatorFactory& factory,
+                                     unsigned int threads, bool flush,
+                                     bool raw)
+{
+  // the token streams share static state that the first one sets up, so
+  // they are all made here rather than in their threads
+  for(unsigned int i=0; i<(threads > 0 ? threads : 1); i++)
+    workers.push_back(new Worker(t, factory, flush, raw));
+}
+
+ParallelProcessor::~ParallelProcessor()
+{
+  for(std::vector<Worker*>::iterator it=workers.begin(); it!=workers.end(); it++)
+    delete *it;
+}
+
+void
+ParallelProcessor::process_batch(const std::vector<std::string>& segments,
+                                 std::ostream& os)
+{
+#ifdef HFST_PROC_THREADS
+  if(workers.size() > 1 && segments.size() > 1)
+  {
+    std::vector<std::string> outputs(segments.size());
+    std::vector<std::exception_ptr> errors(segments.size());
+    std::atomic<size_t> next_segment(0);
+    std::vector<std::thread> threads;
+    for(size_t w=0; w<workers.size(); w++)
+    {
+      threads.push_back(std::thread([&, w]()
+        {
+          Worker& worker = *workers[w];
+          size_t i;
+          while((i = next_segment++) < segments.size())
+          {
+            try
+            {
+              outputs[i] = worker.process(segments[i]);
+            }
+            catch(...)
+            {
+              // the worker's stream is in an unknown state now, so it
+              // stops; the segments it would have taken go to the others
+              outputs[i] = worker.out.str();
+              errors[i] = std::current_exception();
+              return;
+            }
+          }
+        }));
+    }
+    for(size_t w=0; w<threads.size(); w++)
+      threads[w].join();
+
+    for(size_t i=0; i<segments.size(); i++)
+    {
+      os << outputs[i];
+      if(errors[i])
+      {
+        os.flush();
+        std::rethrow_exception(errors[i]);
+      }
+    }
+    return;
+  }
+#endif
+  for(size_t i=0; i<segments.size(); i++)
+  {
+    try
+    {
+      os << workers[0]->process(segments[i]);
+    }
+    catch(...)
+    {
+      os << workers[0]->out.str();
+      os.flush();
+      throw;
+    }
+  }
+}
+
+void
+ParallelProcessor::process(SegmentReader& reader, std::ostream& os)
+{
+  const size_t batch_size = SEGMENTS_PER_THREAD*workers.size();
+  std::vector<std::string> segments;
+  std::string segment;
+  bool input_left = true;
+  while(input_left)
+  {
+    segments.clear();
+    bool flush = false;
+    while(segments.size() < batch_size && !flush)
+    {
+      if(!reader.read(segment, MIN_SEGMENT_SIZE, flush))
+      {
+        input_left = false;
+        break;
+      }
+      segments.push_back(segment);
+    }
+
+    process_batch(segments, os);
+    // the null character at the end of the batch asks for the output so far
+    if(flush)
+      os.flush();
+  }
+}
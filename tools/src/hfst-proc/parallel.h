@@ -0,0 +1,139 @@
+//       This program is free software: you can redistribute it and/or modify
+//       it under the terms of the GNU General Public License as published by
+//       the Free Software Foundation, version 3 of the License.
+//
+//       This program is distributed in the hope that it will be useful,
+//       but WITHOUT ANY WARRANTY; without even the implied warranty of
+//       MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//       GNU General Public License for more details.
+//
+//       You should have received a copy of the GNU General Public License
+//       along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _HFST_PROC_PARALLEL_H_
+#define _HFST_PROC_PARALLEL_H_
+
+#include <sstream>
+#include "hfst-proc.h"
+#include "tokenizer.h"
+#include "applicators.h"
+
+#if !defined(_MSC_VER) && !defined(NO_CPLUSPLUS_11)
+#  define HFST_PROC_THREADS 1
+#endif
+
+/**
+ * Reads a text stream in segments that can each be processed on its own
+ * with the same output as in the whole stream.
+ *
+ * In analysis, a segment ends just after a blank or a superblank that no
+ * lookup can go on past: it isn't alphabetic and no state of the
+ * transducer consumes it, so whatever word is being looked up ends there
+ * and the next one starts from scratch. In generation, where each ^...$
+ * word is looked up on its own, any blank or superblank outside a word
+ * will do.
+ */
+class SegmentReader
+{
+ private:
+  std::istream& is;
+  bool null_flush;
+  bool raw;
+  bool generation;
+
+  /**
+   * Which single-byte characters a segment can end after
+   */
+  std::vector<bool> boundary_chars;
+  bool superblank_is_boundary;
+
+  bool in_superblank;
+  bool in_word;
+  bool at_end;
+
+  /**
+   * Whether the character c can't be part of a word the transducer
+   * analyses
+   */
+  bool is_boundary(char c, const ProcTransducer& t) const;
+ public:
+  /**
+   * @param t the transducer the segments are processed with. In analysis,
+   *          its input lookahead must have been built; without it there
+   *          are no boundaries
+   * @param gen whether the segments are for generation
+   */
+  SegmentReader(std::istream& i, const ProcTransducer& t, bool gen,
+                bool flush, bool raw_mode);
+
+  /**
+   * Whether the stream can be split at all
+   */
+  bool can_split() const;
+
+  /**
+   * Read the next segment. It is at least min_size bytes long unless the
+   * stream ends or a null character is found first
+   * @param segment set to the text of the segment
+   * @param flush set to whether the segment ends with a null character that
+   *              the output should be flushed on
+   * @return false if there was nothing left to read
+   */
+  bool read(std::string& segment, size_t min_size, bool& flush);
+};
+
+/**
+ * Processes the segments of a stream in several threads, which share one
+ * transducer but have applicators of their own, and writes the output in
+ * input order
+ */
+class ParallelProcessor
+{
+ private:
+  /**
+   * What one thread works with: a token stream reading the segment at hand
+   * and writing its output, and an applicator working on it
+   */
+  struct Worker
+  {
+    std::istringstream in;
+    std::ostringstream out;
+    TokenIOStream token_stream;
+    OutputFormatter* formatter;
+    Applicator* applicator;
+
+    Worker(const ProcTransducer& t, const ApplicatorFactory& factory,
+           bool flush, bool raw);
+    ~Worker();
+
+    /**
+     * Apply the applicator to segment, returning the output
+     */
+    std::string process(const std::string& segment);
+  };
+
+  std::vector<Worker*> workers;
+
+  /**
+   * Process the segments and write their output to os in order. If
+   * processing a segment fails, the output before the failure is written
+   * and the error is thrown on
+   */
+  void process_batch(const std::vector<std::string>& segments,
+                     std::ostream& os);
+ public:
+  /**
+   * @param threads the number of threads, at least 1
+   */
+  ParallelProcessor(const ProcTransducer& t, const ApplicatorFactory& factory,
+                    unsigned int threads, bool flush, bool raw);
+  ~ParallelProcessor();
+
+  /**
+   * Process everything the reader reads, writing the output to os. The
+   * first error found is thrown on, after the output before it is written
+   */
+  void process(SegmentReader& reader, std::ostream& os);
+};
+
+#endif
@@ -0,0 +1,339 @@
+//! @file hfst-spell.cc
+//!
+//! @brief Spell-checking of a stream of tokens with an error model and a
+//! lexicon
+//!
+//! @author HFST Team
+
+
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, version 3 of the License.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <limits>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#ifdef _MSC_VER
+#  include "hfst-getopt.h"
+#  include "hfst-string-conversions.h"
+#else
+#  include <getopt.h>
+#endif
+
+#include "HfstExceptionDefs.h"
+#include "HfstTransducer.h"
+#include "HfstInputStream.h"
+#include "implementations/ConvertTransducerFormat.h"
+#include "implementations/optimized-lookup/ospell_batch.h"
+#include "hfst-commandline.h"
+#include "hfst-program-options.h"
+#include "hfst-tool-metadata.h"
+#ifndef _MSC_VER
+#  include <unistd.h> // isatty
+#endif
+
+#include "inc/globals-common.h"
+
+using hfst::HfstTransducer;
+using hfst::HfstInputStream;
+using hfst::implementations::ConversionFunctions;
+
+static char * errmodel_filename = NULL;
+static char * lexicon_filename = NULL;
+static unsigned int nbest = 0;
+static float max_weight = std::numeric_limits<float>::infinity();
+static unsigned int threads = 1;
+static size_t cache_size = 0;
+static bool use_lookahead = true;
+static bool profile = false;
+
+void
+print_usage()
+{
+    // c.f. http://www.gnu.org/prep/standards/standards.html#g_t_002d_002dhelp
+    fprintf(message_out, "Usage: %s [OPTIONS...] ERRMODEL LEXICON\n"
+            "check the spelling of tokens and correct the misspelled ones\n"
+            "\n", program_name);
+    print_common_program_options(message_out);
+    fprintf(message_out,
+            "Spelling options:\n"
+            "  -n, --limit=N           Print at most N corrections per token\n"
+            "  -w, --max-weight=W      Print no corrections heavier than W\n"
+            "  -c, --cache=N           Remember the corrections of the N most\n"
+            "                          recently seen misspellings\n"
+            "  -j, --threads=N         Spell-check in N threads, 0 meaning one per\n"
+            "                          core (default 1); the output is the same as\n"
+            "                          with one thread\n"
+            "  -L, --no-lookahead      Follow paths that can't match the rest of\n"
+            "                          the token too; the results are the same\n"
+            "  -p, --profile           Print the search nodes expanded per token\n"
+            "                          and the CPU time taken to standard error\n");
+    fprintf(message_out, "\n");
+    fprintf(message_out,
+            "ERRMODEL and LEXICON are transducers; they are converted to\n"
+            "weighted optimized-lookup format if they aren't in it already.\n"
+            "The tokens are read from standard input, one per line, and the\n"
+            "results are printed to standard output in input order.\n"
+            "\n"
+        );
+
+    print_report_bugs();
+    fprintf(message_out, "\n");
+    print_more_info();
+    fprintf(message_out, "\n");
+}
+
+int parse_options(int argc, char** argv)
+{
+    extend_options_getenv(&argc, &argv);
+    // use of this function requires options are settable on global scope
+    while (true)
+    {
+        static const struct option long_options[] =
+            {
+                HFST_GETOPT_COMMON_LONG,
+                {"limit", required_argument, 0, 'n'},
+                {"max-weight", required_argument, 0, 'w'},
+                {"cache", required_argument, 0, 'c'},
+                {"threads", required_argument, 0, 'j'},
+                {"no-lookahead", no_argument, 0, 'L'},
+                {"profile", no_argument, 0, 'p'},
+                {0,0,0,0}
+            };
+        int option_index = 0;
+        int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT "n:w:c:j:Lp",
+                            long_options, &option_index);
+        if (-1 == c)
+        {
+            break;
+        }
+
+        switch (c)
+        {
+#include "inc/getopt-cases-common.h"
+        case 'n':
+            if (atoi(optarg) < 1)
+            {
+                std::cerr << "Invalid argument for --limit\n";
+                return EXIT_FAILURE;
+            }
+            nbest = atoi(optarg);
+            break;
+        case 'w':
+            max_weight = (float) atof(optarg);
+            break;
+        case 'c':
+            if (atol(optarg) < 0)
+            {
+                std::cerr << "Invalid argument for --cache\n";
+                return EXIT_FAILURE;
+            }
+            cache_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            if (atoi(optarg) < 0)
+            {
+                std::cerr << "Invalid argument for --threads\n";
+                return EXIT_FAILURE;
+            }
+            threads = atoi(optarg);
+#if defined(_MSC_VER) || defined(NO_CPLUSPLUS_11)
+            if (threads != 1)
+            {
+                std::cerr << "Warning: threads are not supported on this platform, "
+                    "spell-checking in one thread\n";
+                threads = 1;
+            }
+#endif
+            break;
+        case 'L':
+            use_lookahead = false;
+            break;
+        case 'p':
+            profile = true;
+            break;
+#include "inc/getopt-cases-error.h"
+        }
+    }
+
+    if ( (optind + 2) != argc)
+    {
+        std::cerr << "Give the error model and the lexicon, in that order\n";
+        return EXIT_FAILURE;
+    }
+    errmodel_filename = hfst_strdup(argv[optind]);
+    lexicon_filename = hfst_strdup(argv[optind + 1]);
+    return EXIT_CONTINUE;
+}
+
+/* Read the first transducer in \a filename and return it in optimized-lookup
+   format. */
+HfstTransducer * read_transducer(const char * filename)
+{
+    HfstInputStream is(filename);
+    HfstTransducer * t = new HfstTransducer(is);
+    is.close();
+    if (t->get_type() != hfst::HFST_OL_TYPE &&
+        t->get_type() != hfst::HFST_OLW_TYPE)
+    {
+        verbose_printf("Converting %s to optimized-lookup format\n", filename);
+    }
+    ConversionFunctions::hfst_transducer_to_hfst_ol(t);
+    return t;
+}
+
+void print_results(const hfst::StringVector & tokens,
+                   const hfst_ol::SpellResultVector & results,
+                   std::ostream & out)
+{
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        if (results[i].in_lexicon)
+        {
+            out << "\"" << tokens[i] << "\" is in the lexicon.\n\n";
+        }
+        else if (results[i].corrections.empty())
+        {
+            out << "Unable to correct \"" << tokens[i] << "\"!\n\n";
+        }
+        else
+        {
+            out << "Corrections for \"" << tokens[i] << "\":\n";
+            for (std::vector<hfst_ol::StringWeightPair>::const_iterator it =
+                     results[i].corrections.begin();
+                 it != results[i].corrections.end(); ++it)
+            {
+                out << it->first << "    " << it->second << "\n";
+            }
+            out << "\n";
+        }
+    }
+    out.flush();
+}
+
+int process_input(hfst_ol::BatchSpeller & speller, std::ostream & out,
+                  size_t & token_count)
+{
+    // Enough tokens at a time to keep every thread busy, few enough that
+    // output doesn't lag far behind input. With one thread, or someone
+    // typing the input, each token is answered as soon as it's read.
+    size_t batch_size = 1000 * speller.get_thread_count();
+    if (speller.get_thread_count() == 1)
+    {
+        batch_size = 1;
+    }
+#ifndef _MSC_VER
+    if (isatty(STDIN_FILENO))
+    {
+        batch_size = 1;
+    }
+#endif
+    hfst::StringVector tokens;
+    hfst_ol::SpellResultVector results;
+    std::string line;
+    bool input_left = true;
+    while (input_left)
+    {
+        tokens.clear();
+        while (tokens.size() < batch_size)
+        {
+            if (!std::getline(std::cin, line))
+            {
+                input_left = false;
+                break;
+            }
+            if (!line.empty() && line[line.size() - 1] == '\r')
+            {
+                line.erase(line.size() - 1);
+            }
+            if (!line.empty())
+            {
+                tokens.push_back(line);
+            }
+        }
+        speller.spell(tokens, results);
+        print_results(tokens, results, out);
+        token_count += tokens.size();
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char ** argv)
+{
+    hfst_set_program_name(argv[0], "0.1", "HfstSpell");
+    hfst_setlocale();
+    int retval = parse_options(argc, argv);
+    if (retval != EXIT_CONTINUE) {
+        return retval;
+    }
+    message_out = stderr;
+
+    HfstTransducer * errmodel = NULL;
+    HfstTransducer * lexicon = NULL;
+    try {
+        errmodel = read_transducer(errmodel_filename);
+        lexicon = read_transducer(lexicon_filename);
+        hfst_ol::Transducer * errmodel_ol =
+            ConversionFunctions::hfst_transducer_to_hfst_ol(errmodel);
+        hfst_ol::Transducer * lexicon_ol =
+            ConversionFunctions::hfst_transducer_to_hfst_ol(lexicon);
+        if (use_lookahead) {
+            // before the spellers that share them are made
+            errmodel_ol->build_input_lookahead();
+            lexicon_ol->build_input_lookahead();
+        }
+        hfst_ol::BatchSpeller speller(errmodel_ol, lexicon_ol, threads);
+        speller.set_nbest(nbest);
+        speller.set_max_weight(max_weight);
+        speller.set_cache_size(cache_size);
+        size_t token_count = 0;
+        clock_t start = clock();
+        retval = process_input(speller, std::cout, token_count);
+        if (profile) {
+            size_t nodes = speller.get_nodes_expanded();
+            fprintf(stderr, "Tokens: %lu\n"
+                    "Search nodes expanded: %lu (%.1f per token)\n"
+                    "CPU time: %.2f s\n",
+                    (unsigned long) token_count, (unsigned long) nodes,
+                    token_count > 0 ? (double) nodes / token_count : 0.0,
+                    ((double) clock() - start) / CLOCKS_PER_SEC);
+        }
+        if (verbose && cache_size > 0) {
+            fprintf(stderr, "Cache hits: %lu, misses: %lu\n",
+                    (unsigned long) speller.get_cache_hits(),
+                    (unsigned long) speller.get_cache_misses());
+        }
+    } catch (const hfst_ol::AlphabetTranslationException & e) {
+        std::cerr << "The error model has the symbol " << e.what()
+                  << ", which the lexicon doesn't have\n";
+        retval = EXIT_FAILURE;
+    } catch (HfstException & e) {
+        std::cerr << "Exception thrown:\n" << e.what() << std::endl;
+        retval = EXIT_FAILURE;
+    }
+    delete errmodel;
+    delete lexicon;
+    free(errmodel_filename);
+    free(lexicon_filename);
+    return retval;
+}
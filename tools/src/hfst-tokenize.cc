@@ -20,6 +20,10 @@
 #  include <config.h>
 #endif
 
+#ifdef WINDOWS
+#include <io.h>
+#endif
+
 
 #include <iterator>
 #include <iostream>
@@ -44,6 +48,7 @@ using std::pair;
 #include "hfst-commandline.h"
 #include "hfst-program-options.h"
 #include "hfst-tool-metadata.h"
+#include "hfst-pmatch-pipeline.h"
 #include "implementations/optimized-lookup/pmatch.h"
 #include "implementations/optimized-lookup/pmatch_tokenize.h"
 #include "parsers/pmatch_utils.h"
@@ -51,6 +56,9 @@ using std::pair;
 #include "HfstDataTypes.h"
 #include "HfstInputStream.h"
 #include "implementations/ConvertTransducerFormat.h"
+#ifdef PMATCH_THREADS
+#  include <unistd.h> // isatty
+#endif
 
 using hfst::HfstTransducer;
 
@@ -66,6 +74,12 @@ static bool superblanks = false; // Input is apertium-style superblanks (overrid
 static bool blankline_separated = true; // Input is separated by blank lines (as opposed to single newlines)
 static bool keep_newlines = false;
 static int token_number = 1;
+static unsigned int threads = 1;
+#ifdef PMATCH_THREADS
+// With --threads, input goes through this instead of being tokenized and
+// printed right away
+static PmatchPipeline * pipeline = NULL;
+#endif
 std::string tokenizer_filename;
 static hfst::ImplementationType default_format = hfst::TROPICAL_OPENFST_TYPE;
 TokenizeSettings settings;
@@ -100,7 +114,12 @@ print_usage()
             "                           treats @PMATCH_INPUT_MARK@ as subreading separator,\n"
             "                           expects tags to be Multichar_symbols, flush on NUL)\n"
             "  -C  --conllu             CoNLL-U format\n"
-            "  -f, --finnpos            FinnPos output\n");
+            "  -f, --finnpos            FinnPos output\n"
+            "  -B, --binary             Binary output, with symbols as numbers (see\n"
+            "                           pmatch_tokenize_binary.h in the HFST sources)\n"
+            "  -j, --threads=N          Tokenize in N threads (default 1) when not\n"
+            "                           reading from a terminal; the output is the same\n"
+            "                           as with one thread\n");
     fprintf(message_out,
             "Use standard streams for input and output (for now).\n"
             "\n"
@@ -187,10 +206,60 @@ hfst_ol::PmatchContainer make_naive_tokenizer(HfstTransducer * dictionary)
     hfst_ol::Transducer * dict_backend = hfst::implementations::ConversionFunctions::
         hfst_transducer_to_hfst_ol(dictionary);
     retval.add_rtn(dict_backend, dict_name);
+    retval.finish_adding_rtns();
     delete tokenizer_ol;
     return retval;
 }
 
+void tokenize_chunk(hfst_ol::PmatchContainer & container,
+                    std::ostream & outstream,
+                    const string & input_text)
+{
+#ifdef PMATCH_THREADS
+    if (pipeline != NULL) {
+        pipeline->push(input_text);
+        return;
+    }
+#endif
+    match_and_print(container, outstream, input_text, settings);
+}
+
+void print_blank(std::ostream & outstream, const string & blank)
+{
+#ifdef PMATCH_THREADS
+    if (pipeline != NULL) {
+        std::ostringstream printed;
+        print_nonmatching_sequence(blank, printed, settings);
+        pipeline->push_verbatim(printed.str());
+        return;
+    }
+#endif
+    print_nonmatching_sequence(blank, outstream, settings);
+}
+
+void flush_output(std::ostream & outstream)
+{
+    // The binary format has no flush marker, the records are complete as
+    // they are
+    bool marker = settings.output_format != binary;
+#ifdef PMATCH_THREADS
+    if (pipeline != NULL) {
+        if (marker) {
+            pipeline->push_verbatim("<STREAMCMD:FLUSH>\n");
+        }
+        pipeline->flush();
+        return;
+    }
+#endif
+    if (marker) {
+        outstream << "<STREAMCMD:FLUSH>" << std::endl; // CG format uses this instead of \0
+    }
+    outstream.flush();
+    if(outstream.bad()) {
+        std::cerr << "hfst-tokenize: Could not flush file" << std::endl;
+    }
+}
+
 // TODO: lambda this when C++11 available everywhere
 inline void process_input_0delim_print(hfst_ol::PmatchContainer & container,
                                        std::ostream & outstream,
@@ -198,7 +267,7 @@ inline void process_input_0delim_print(hfst_ol::PmatchContainer & container,
 {
     string input_text(cur.str());
     if(!input_text.empty()) {
-        match_and_print(container, outstream, input_text, settings);
+        tokenize_chunk(container, outstream, input_text);
     }
     cur.clear();
     cur.str(string());
@@ -235,7 +304,7 @@ int process_input_0delim(hfst_ol::PmatchContainer & container,
                 }
                 else {
                     in_blank = false;
-                    print_nonmatching_sequence(cur.str(), outstream, settings);
+                    print_blank(outstream, cur.str());
                     cur.clear();
                     cur.str(string());
                 }
@@ -246,11 +315,7 @@ int process_input_0delim(hfst_ol::PmatchContainer & container,
             }
             else if(line[i] == '\0') {
                 process_input_0delim_print(container, outstream, cur);
-                outstream << "<STREAMCMD:FLUSH>" << std::endl; // CG format uses this instead of \0
-                outstream.flush();
-                if(outstream.bad()) {
-                    std::cerr << "hfst-tokenize: Could not flush file" << std::endl;
-                }
+                flush_output(outstream);
             }
             else {
                 cur << line[i];
@@ -264,7 +329,7 @@ int process_input_0delim(hfst_ol::PmatchContainer & container,
         }
     }
     if(in_blank) {
-        print_nonmatching_sequence(cur.str(), outstream, settings);
+        print_blank(outstream, cur.str());
     }
     else {
         process_input_0delim_print(container, outstream, cur);
@@ -280,12 +345,9 @@ inline void maybe_erase_newline(string& input_text)
     }
 }
 
-int process_input(hfst_ol::PmatchContainer & container,
-                  std::ostream & outstream)
+int read_input(hfst_ol::PmatchContainer & container,
+               std::ostream & outstream)
 {
-    if(settings.output_format == cg || settings.output_format == giellacg) {
-        outstream << std::fixed << std::setprecision(10);
-    }
     if(settings.output_format == giellacg || superblanks) {
         if(superblanks) {
             return process_input_0delim<true>(container, outstream);
@@ -301,7 +363,7 @@ int process_input(hfst_ol::PmatchContainer & container,
         while (hfst_getline(&line, &bufsize, inputfile) > 0) {
             if (line[0] == '\n') {
                 maybe_erase_newline(input_text);
-                match_and_print(container, outstream, input_text, settings);
+                tokenize_chunk(container, outstream, input_text);
                 input_text.clear();
             } else {
                 input_text.append(line);
@@ -311,7 +373,7 @@ int process_input(hfst_ol::PmatchContainer & container,
         }
         if (!input_text.empty()) {
             maybe_erase_newline(input_text);
-            match_and_print(container, outstream, input_text, settings);
+            tokenize_chunk(container, outstream, input_text);
         }
     }
     else {
@@ -319,7 +381,7 @@ int process_input(hfst_ol::PmatchContainer & container,
         while (hfst_getline(&line, &bufsize, inputfile) > 0) {
             input_text = line;
             maybe_erase_newline(input_text);
-            match_and_print(container, outstream, input_text, settings);
+            tokenize_chunk(container, outstream, input_text);
             free(line);
             line = NULL;
         }
@@ -328,6 +390,40 @@ int process_input(hfst_ol::PmatchContainer & container,
     return EXIT_SUCCESS;
 }
 
+int process_input(hfst_ol::PmatchContainer & container,
+                  std::ostream & outstream)
+{
+    if(settings.output_format == cg || settings.output_format == giellacg) {
+        outstream << std::fixed << std::setprecision(10);
+    }
+    // Used by the pipeline too, so it lives until the end of this function
+    BinaryLocationWriter binary_writer;
+    if (settings.output_format == binary) {
+        binary_writer = BinaryLocationWriter(container);
+        binary_writer.write_header(outstream);
+        settings.binary_writer = &binary_writer;
+    }
+#ifdef PMATCH_THREADS
+    if (threads > 1 && !isatty(STDIN_FILENO)) {
+        const hfst_ol::PmatchContainer & shared = container;
+        PmatchPipeline p(threads,
+                         [&shared](hfst_ol::PmatchContext & c, std::ostream & out,
+                                   const string & input_text) {
+                             match_and_print(shared, c, out, input_text, settings);
+                         },
+                         outstream);
+        pipeline = &p;
+        int retval = read_input(container, outstream);
+        pipeline = NULL;
+        if (!p.finish()) {
+            std::cerr << "hfst-tokenize: Could not flush file" << std::endl;
+        }
+        return retval;
+    }
+#endif
+    return read_input(container, outstream);
+}
+
 int parse_options(int argc, char** argv)
 {
     extend_options_getenv(&argc, &argv);
@@ -356,10 +452,12 @@ int parse_options(int argc, char** argv)
                 {"gtd", no_argument, 0, 'g'},
                 {"conllu", no_argument, 0, 'C'},
                 {"finnpos", no_argument, 0, 'f'},
+                {"binary", no_argument, 0, 'B'},
+                {"threads", required_argument, 0, 'j'},
                 {0,0,0,0}
             };
         int option_index = 0;
-        int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT "nkawWmub:t:l:zixcSgCf",
+        int c = getopt_long(argc, argv, HFST_GETOPT_COMMON_SHORT "nkawWmub:t:l:zixcSgCfBj:",
                              long_options, &option_index);
         if (-1 == c)
         {
@@ -447,6 +545,25 @@ int parse_options(int argc, char** argv)
         case 'f':
             settings.output_format = finnpos;
             break;
+        case 'B':
+            settings.output_format = binary;
+            break;
+        case 'j':
+            if (atoi(optarg) < 1)
+            {
+                std::cerr << "Invalid argument for --threads\n";
+                return EXIT_FAILURE;
+            }
+            threads = atoi(optarg);
+#ifndef PMATCH_THREADS
+            if (threads > 1)
+            {
+                std::cerr << "Warning: threads are not supported on this platform, "
+                    "tokenizing in one thread\n";
+                threads = 1;
+            }
+#endif
+            break;
 #include "inc/getopt-cases-error.h"
         }
 
@@ -498,6 +615,11 @@ int main(int argc, char ** argv)
     if (retval != EXIT_CONTINUE) {
         return retval;
     }
+#ifdef WINDOWS
+    if (settings.output_format == binary) {
+        _setmode(1, _O_BINARY);
+    }
+#endif
     std::ifstream instream(tokenizer_filename.c_str(),
                            std::ifstream::binary);
     if (!instream.good()) {
@@ -534,10 +656,22 @@ int main(int argc, char ** argv)
             container.set_single_codepoint_tokenization(!settings.tokenize_multichar);
             return process_input(container, std::cout);
         } else {
-            hfst_ol::PmatchContainer container(instream);
+            // A regular file is mapped, so that RTNs are read only once
+            // called
+            instream.seekg(0, std::ios::end);
+            bool mappable = instream.tellg() > 0;
+            instream.clear();
+            instream.seekg(0);
+            hfst_ol::PmatchContainer * loaded = mappable ?
+                new hfst_ol::PmatchContainer(
+                    new hfst_ol::MappedFile(tokenizer_filename)) :
+                new hfst_ol::PmatchContainer(instream);
+            hfst_ol::PmatchContainer & container = *loaded;
             container.set_verbose(verbose);
             container.set_single_codepoint_tokenization(!settings.tokenize_multichar);
-            return process_input(container, std::cout);
+            int retval = process_input(container, std::cout);
+            delete loaded;
+            return retval;
         }
     } catch(HfstException & e) {
         std::cerr << "Exception thrown:\n" << e.what() << std::endl;